@@ -95,6 +95,13 @@ public:
         */
     virtual QString tagKey(int i) const = 0;
 
+    /** return the interned ids of the key and value of the tag at the
+         * position "i" (see g_getTagKey and g_getTagValue).
+         * Be carefull: no verification is made on i.
+        */
+    virtual quint32 tagKeyId(int i) const = 0;
+    virtual quint32 tagValueId(int i) const = 0;
+
 
     /** check if the feature has been uploaded
      * @return true if uploaded
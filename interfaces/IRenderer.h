@@ -3,6 +3,8 @@
 
 #include <QFlags>
 
+#include <functional>
+
 class RendererOptions
 {
 public:
@@ -27,7 +29,8 @@ public:
         Interacting = 0x8000,
         LockZoom = 0x10000,
         ForPrinting = 0x20000,
-        PrintAllLabels = 0x40000
+        PrintAllLabels = 0x40000,
+        RenderStatisticsVisible = 0x80000
     };
     Q_DECLARE_FLAGS(RenderOptions, RenderOption)
 
@@ -45,4 +48,7 @@ public:
 Q_DECLARE_OPERATORS_FOR_FLAGS(RendererOptions::RenderOptions)
 Q_DECLARE_OPERATORS_FOR_FLAGS(RendererOptions::DirectionalArrowsShowOptions)
 
+/* Called while waiting for a synchronous render: tiles done so far / total */
+typedef std::function<void(int done, int total)> RenderProgressCallback;
+
 #endif // IRENDERER_H
@@ -1,6 +1,7 @@
 #include "MemoryBackend.h"
 #include "RTree.h"
 
+#include <QElapsedTimer>
 #include <QReadWriteLock>
 
 RenderPriority NodePri(RenderPriority::IsSingular,0., 0);
@@ -19,6 +20,11 @@ public:
     QMutex toBeDeletedLock;
     QList<Feature*> toBeDeleted;
 
+    /* While indexing is delayed, the features to index again, with the
+     * layer holding their current entry */
+    int indexingDelayed;
+    QHash<Feature*, ILayer*> delayedIndex;
+
     QHash<Feature*, CoordBox> AllocFeatures;
     QHash<ILayer*, CoordTree*> theRTree;
     QList<Feature*> findResult;
@@ -30,6 +36,18 @@ bool indexFindCallbackList(Feature* F, void* ctxt)
     return true;
 }
 
+static inline void buildPath(Feature* F, IndexFindContext* pCtxt)
+{
+    if (!pCtxt->buildPathNsecs) {
+        F->buildPath(*(pCtxt->theProjection));
+        return;
+    }
+    QElapsedTimer timer;
+    timer.start();
+    F->buildPath(*(pCtxt->theProjection));
+    *(pCtxt->buildPathNsecs) += timer.nsecsElapsed();
+}
+
 bool indexFindCallback(Feature* F, void* ctxt)
 {
     IndexFindContext* pCtxt = (IndexFindContext*)ctxt;
@@ -41,7 +59,7 @@ bool indexFindCallback(Feature* F, void* ctxt)
         Way * R = STATIC_CAST_WAY(F);
         if (pCtxt->theFeatures->value(R->renderPriority()).contains(F))
             return true;
-        R->buildPath(*(pCtxt->theProjection));
+        buildPath(R, pCtxt);
         if (M_PREFS->getTrackPointsVisible()) {
             for (int i=0; i<R->size(); ++i) {
                 if (pCtxt->bbox.contains(R->getNode(i)->boundingBox()))
@@ -55,7 +73,7 @@ bool indexFindCallback(Feature* F, void* ctxt)
         Relation * RR = STATIC_CAST_RELATION(F);
         if (pCtxt->theFeatures->value(RR->renderPriority()).contains(F))
             return true;
-        RR->buildPath(*(pCtxt->theProjection));
+        buildPath(RR, pCtxt);
         (*(pCtxt->theFeatures))[RR->renderPriority()].insert(F);
     } else
     if (CHECK_NODE(F)) {
@@ -63,7 +81,7 @@ bool indexFindCallback(Feature* F, void* ctxt)
             return true;
         if (!(F->isVirtual() && !M_PREFS->getVirtualNodesVisible())) {
             Node * N = STATIC_CAST_NODE(F);
-            N->buildPath(*(pCtxt->theProjection));
+            buildPath(N, pCtxt);
             (*(pCtxt->theFeatures))[NodePri].insert(F);
         }
     } else {
@@ -137,6 +155,7 @@ void MemoryBackend::getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*
     IndexFindContext ctxt;
     ctxt.theFeatures = &theFeatures;
     ctxt.theProjection = &theProjection;
+    ctxt.buildPathNsecs = 0;
 
     for (int i=0; i < invalidRects.size(); ++i) {
         ctxt.bbox = invalidRects[i];
@@ -145,11 +164,12 @@ void MemoryBackend::getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*
 }
 
 void MemoryBackend::getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*> >& theFeatures,
-                                  const CoordBox& invalidRect, Projection& theProjection)
+                                  const CoordBox& invalidRect, Projection& theProjection, qint64* buildPathNsecs)
 {
     IndexFindContext ctxt;
     ctxt.theFeatures = &theFeatures;
     ctxt.theProjection = &theProjection;
+    ctxt.buildPathNsecs = buildPathNsecs;
 
     ctxt.bbox = invalidRect;
     indexFind(l, invalidRect, ctxt);
@@ -161,6 +181,7 @@ void MemoryBackend::getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*
 MemoryBackend::MemoryBackend()
 {
     p = new MemoryBackendPrivate;
+    p->indexingDelayed = 0;
 }
 
 MemoryBackend::~MemoryBackend()
@@ -330,6 +351,8 @@ void MemoryBackend::deallocFeature(ILayer* l, Feature *f)
     p->delayedDeletesLock.lockForRead();
     p->toBeDeletedLock.lock();
     if (p->AllocFeatures.contains(f)) {
+        if (p->delayedIndex.contains(f))
+            l = p->delayedIndex.take(f);
         indexRemove(l, p->AllocFeatures[f], f);
         if (!p->AllocFeatures.remove(f)) {
             qWarning() << "Feature, that is not in a list is being removed.";
@@ -373,10 +396,40 @@ void MemoryBackend::deallocVirtualNode(Feature *f)
     p->delayedDeletesLock.unlock();
 }
 
+void MemoryBackend::delayIndexing()
+{
+    ++p->indexingDelayed;
+}
+
+void MemoryBackend::resumeIndexing()
+{
+    Q_ASSERT(p->indexingDelayed > 0);
+    if (p->indexingDelayed <= 0)
+        return;
+    if (--p->indexingDelayed)
+        return;
+
+    QHash<Feature*, ILayer*> delayed = p->delayedIndex;
+    p->delayedIndex.clear();
+    QHash<Feature*, ILayer*>::const_iterator it = delayed.constBegin();
+    for (; it != delayed.constEnd(); ++it)
+        sync(it.key(), it.value());
+}
+
 void MemoryBackend::sync(Feature *f)
+{
+    if (p->indexingDelayed) {
+        if (!p->delayedIndex.contains(f))
+            p->delayedIndex.insert(f, f->layer());
+        return;
+    }
+    sync(f, f->layer());
+}
+
+void MemoryBackend::sync(Feature *f, ILayer* indexedIn)
 {
     if (p->AllocFeatures.contains(f) && !p->AllocFeatures[f].isNull())
-        indexRemove(f->layer(), p->AllocFeatures[f], f);
+        indexRemove(indexedIn, p->AllocFeatures[f], f);
     if (CHECK_NODE(f)) {
         Node* N = STATIC_CAST_NODE(f);
         if (!N->tagSize())
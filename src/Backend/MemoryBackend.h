@@ -9,6 +9,7 @@ struct IndexFindContext {
     Projection* theProjection;
     QTransform* theTransform;
     CoordBox bbox;
+    qint64* buildPathNsecs; /* If set, time spent in buildPath is added to it */
 };
 
 class MemoryBackendPrivate;
@@ -21,6 +22,8 @@ public:
 private:
     MemoryBackendPrivate* p;
 
+    void sync(Feature* f, ILayer* indexedIn);
+
 public:
     virtual Node* allocNode(ILayer* l, const Node& other);
     virtual Node* allocNode(ILayer* l, const QPointF& aCoord);
@@ -45,6 +48,10 @@ public:
     virtual void purge();
     virtual void delayDeletes();
     virtual void resumeDeletes();
+    /* Until resumed, sync() only records the features changed; each is then
+     * indexed again once. Calls may be nested. */
+    virtual void delayIndexing();
+    virtual void resumeIndexing();
 
     virtual const QList<Feature*>& indexFind(ILayer* l, const QRectF& vp);
     virtual void indexFind(ILayer* l, const QRectF& bb, const IndexFindContext& findResult);
@@ -52,7 +59,7 @@ public:
     virtual void getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*> >& theFeatures,
                                const QList<CoordBox>& invalidRects, Projection& theProjection);
     virtual void getFeatureSet(ILayer* l, QMap<RenderPriority, QSet <Feature*> >& theFeatures,
-                               const CoordBox& invalidRect, Projection& theProjection);
+                               const CoordBox& invalidRect, Projection& theProjection, qint64* buildPathNsecs = 0);
     virtual void indexAdd(ILayer* l, const QRectF& bb, Feature* aFeat);
     virtual void indexRemove(ILayer* l, const QRectF& bb, Feature* aFeat);
 
@@ -108,7 +108,7 @@ void LayerDock::dropEvent(QDropEvent *event)
     }
 
     p->Main->document()->moveLayer(p->theDropWidget->getLayer(), p->Layout->indexOf(p->theDropWidget));
-    emit(layersChanged(false));
+    emit(layersAppearanceChanged(p->theDropWidget->getLayer()));
     update();
 }
 
@@ -128,6 +128,7 @@ void LayerDock::addLayer(Layer* aLayer)
         p->Layout->addWidget(w);
 
         connect(w, SIGNAL(layerChanged(LayerWidget*,bool)), this, SLOT(layerChanged(LayerWidget*,bool)));
+        connect(w, SIGNAL(layerAppearanceChanged(LayerWidget*)), this, SLOT(layerAppearanceChanged(LayerWidget*)));
         connect(w, SIGNAL(layerClosed(Layer*)), this, SLOT(layerClosed(Layer*)));
         connect(w, SIGNAL(layerCleared(Layer*)), this, SLOT(layerCleared(Layer*)));
         connect(w, SIGNAL(layerZoom(Layer*)), this, SLOT(layerZoom(Layer*)));
@@ -280,6 +281,11 @@ void LayerDock::layerChanged(LayerWidget* l, bool adjustViewport)
     emit(layersChanged(adjustViewport));
 }
 
+void LayerDock::layerAppearanceChanged(LayerWidget* l)
+{
+    emit(layersAppearanceChanged(l->getLayer()));
+}
+
 void LayerDock::layerClosed(Layer* l)
 {
 //	Main->document()->getUploadedLayer()->clear();
@@ -38,6 +38,7 @@ class LayerDock : public MDockAncestor
         void layerCleared(Layer*);
         void layerZoom(Layer*);
         void layerProjection(const QString&);
+        void layerAppearanceChanged(LayerWidget*);
 
         void tabChanged(int idx);
         void tabContextMenuRequested(const QPoint& pos);
@@ -53,6 +54,8 @@ class LayerDock : public MDockAncestor
 
     signals:
         void layersChanged(bool adjustViewport);
+        /* Only the visibility, order, alpha or read-only state of aLayer changed */
+        void layersAppearanceChanged(Layer* aLayer);
         void layersClosed();
         void layersCleared();
         void layersProjection(const QString&);
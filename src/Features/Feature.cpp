@@ -11,13 +11,17 @@
 #include "Document.h"
 #include "Layer.h"
 #include "MasPaintStyle.h"
+#include "PainterIndex.h"
+#include "MapCSSStyleSheet.h"
 #include "TagSelector.h"
+#include "StyleProfiler.h"
 #include "MapView.h"
 #include "PropertiesDock.h"
 
 #include "Utils.h"
 
 #include <QApplication>
+#include <QThread>
 #include <QUuid>
 #include <QProgressDialog>
 #include <QPainter>
@@ -91,6 +95,7 @@ public:
         :  LastActor(Feature::User)
         , PossiblePaintersUpToDate(false)
         , PixelPerMForPainter(-1), CurrentPainter(0), HasPainter(false)
+        , PaintersGeneration(0), PainterRevision(0)
         , theFeature(aFeature), LastPartNotification(0)
         , Deleted(false), Visible(true), Uploaded(false), FilterRevision(-1)
         , Virtual(false), Special(false), DirtyLevel(0)
@@ -108,6 +113,7 @@ public:
         : Tags(other.Tags), LastActor(other.LastActor)
         , PossiblePaintersUpToDate(false)
         , PixelPerMForPainter(-1), CurrentPainter(0), HasPainter(false)
+        , PaintersGeneration(0), PainterRevision(0)
         , theFeature(NULL), LastPartNotification(0)
         , Deleted(false), Visible(true), Uploaded(false), FilterRevision(-1)
         , Virtual(other.Virtual), Special(other.Special), DirtyLevel(0)
@@ -121,9 +127,10 @@ public:
 #endif
     }
 
+    void findPainters(const PainterTable* aTable, QList<const FeaturePainter*>& thePainters);
     void updatePossiblePainters();
-    void blankPainters();
     void updatePainters(qreal PixelPerM);
+    bool paintersCurrent() const;
 #ifndef FRISIUS_BUILD
     void initVersionNumber()
     {
@@ -141,6 +148,8 @@ public:
     qreal PixelPerMForPainter; // 8
     const FeaturePainter* CurrentPainter; // 4
     bool HasPainter; // 1
+    int PaintersGeneration; // 4
+    int PainterRevision; // 4
     Feature* theFeature; // 4
     QList<Feature*> Parents; // 4
     int LastPartNotification; // 4
@@ -460,7 +469,12 @@ void Feature::setTag(const QString& key, const QString& value)
     if (key.toLower() == "created_by")
         return;
 
-    QPair<quint32, quint32> pi = g_addToTagList(key, value);
+    setTagIds(g_addTagKey(key), g_addTagValue(value));
+}
+
+void Feature::setTagIds(quint32 keyId, quint32 valueId)
+{
+    QPair<quint32, quint32> pi = g_addToTagList(keyId, valueId);
 
     int i = 0;
     for (; i<p->Tags.size(); ++i)
@@ -527,6 +541,16 @@ QString Feature::tagKey(int i) const
     return g_getTagKey(p->Tags[i].first);
 }
 
+quint32 Feature::tagKeyId(int i) const
+{
+    return p->Tags[i].first;
+}
+
+quint32 Feature::tagValueId(int i) const
+{
+    return p->Tags[i].second;
+}
+
 int Feature::findKey(const QString &k) const
 {
     for (int i=0; i<p->Tags.size(); ++i)
@@ -552,6 +576,28 @@ void Feature::invalidatePainter()
 {
     p->PossiblePaintersUpToDate = false;
     p->PixelPerMForPainter = -1;
+    p->PainterRevision++;
+}
+
+int Feature::painterRevision() const
+{
+    return p->PainterRevision;
+}
+
+void Feature::findPainters(const PainterTable* aTable, QList<const FeaturePainter*>& thePainters) const
+{
+    p->findPainters(aTable, thePainters);
+}
+
+void Feature::setPainters(const PainterTable* aTable, const QList<const FeaturePainter*>& thePainters)
+{
+    QMutexLocker mutlock(&featMutex);
+    p->PossiblePainters = thePainters;
+    p->PaintersGeneration = aTable->Generation;
+    p->CurrentPainter = NULL;
+    p->PixelPerMForPainter = -1;
+    p->PossiblePaintersUpToDate = true;
+    p->HasPainter = !thePainters.isEmpty();
 }
 
 static QPainterPath painterPath;
@@ -561,26 +607,32 @@ const QPainterPath& Feature::getPath() const
     return painterPath;
 }
 
-void FeaturePrivate::updatePossiblePainters()
+void FeaturePrivate::findPainters(const PainterTable* aTable, QList<const FeaturePainter*>& thePainters)
 {
-    QMutexLocker mutlock(&theFeature->featMutex);
+    thePainters.clear();
 
     //still match features with no tags and no parent, i.e. "lost" trackpoints
-    if ( (theFeature->layer()->isTrack()) && M_PREFS->getDisableStyleForTracks() ) return blankPainters();
+    if ( (theFeature->layer()->isTrack()) && M_PREFS->getDisableStyleForTracks() ) return;
 
     if ( (theFeature->layer()->isTrack()) || theFeature->sizeParents() ) {
-        if (CHECK_NODE(theFeature) && !STATIC_CAST_NODE(theFeature)->isPOI()) return blankPainters();
-        if (!theFeature->tagSize()) return blankPainters();
+        if (CHECK_NODE(theFeature) && !STATIC_CAST_NODE(theFeature)->isPOI()) return;
+        if (!theFeature->tagSize()) return;
+    }
+
+    if (aTable->Cascade) {
+        aTable->Cascade->painters(theFeature, thePainters);
+        return;
     }
 
-    PossiblePainters.clear();
     QList<const FeaturePainter*> DefaultPainters;
-    for (int i=0; i<theFeature->layer()->getDocument()->getPaintersSize(); ++i)
+    QVector<int> Candidates;
+    aTable->Index.candidates(theFeature, Candidates);
+    for (int i=0; i<Candidates.size(); ++i)
     {
-        const FeaturePainter* Current = dynamic_cast<const FeaturePainter*>(theFeature->layer()->getDocument()->getPainter(i));
+        const FeaturePainter* Current = &aTable->Painters.at(Candidates[i]);
         switch (Current->matchesTag(theFeature,NULL)) {
         case TagSelect_Match:
-            PossiblePainters.push_back(Current);
+            thePainters.push_back(Current);
             break;
         case TagSelect_DefaultMatch:
             DefaultPainters.push_back(Current);
@@ -589,15 +641,36 @@ void FeaturePrivate::updatePossiblePainters()
             break;
         }
     }
-    if (!PossiblePainters.size())
-        PossiblePainters = DefaultPainters;
+    if (!thePainters.size())
+        thePainters = DefaultPainters;
+    M_STYLEPROFILER->flush();
+}
+
+void FeaturePrivate::updatePossiblePainters()
+{
+    QMutexLocker mutlock(&theFeature->featMutex);
+
+    const PainterTable* theTable = theFeature->layer()->getDocument()->getPainterTable();
+    findPainters(theTable, PossiblePainters);
+    PaintersGeneration = theTable->Generation;
+    CurrentPainter = NULL;
+    PixelPerMForPainter = -1;
     PossiblePaintersUpToDate = true;
     HasPainter = (PossiblePainters.size() > 0);
 }
 
+/* False once the document switched to other painters than those matched */
+bool FeaturePrivate::paintersCurrent() const
+{
+    Layer* L = theFeature->layer();
+    if (!L || !L->getDocument())
+        return true;
+    return L->getDocument()->getPainterTable()->Generation == PaintersGeneration;
+}
+
 void FeaturePrivate::updatePainters(qreal PixelPerM)
 {
-    if (!PossiblePaintersUpToDate)
+    if (!PossiblePaintersUpToDate || !paintersCurrent())
         updatePossiblePainters();
 
     QMutexLocker mutlock(&theFeature->featMutex);
@@ -611,23 +684,17 @@ void FeaturePrivate::updatePainters(qreal PixelPerM)
         }
 }
 
-void FeaturePrivate::blankPainters()
-{
-    CurrentPainter = NULL;
-    PossiblePainters.clear();
-    PossiblePaintersUpToDate = true;
-    HasPainter = false;
-}
-
 const FeaturePainter* Feature::getPainter(qreal PixelPerM) const
 {
-    if (p->PixelPerMForPainter != PixelPerM)
+    if (p->PixelPerMForPainter != PixelPerM || !p->paintersCurrent())
         p->updatePainters(PixelPerM);
     return p->CurrentPainter;
 }
 
 const FeaturePainter* Feature::getCurrentPainter() const
 {
+    if (!p->PossiblePaintersUpToDate || !p->paintersCurrent())
+        p->updatePossiblePainters();
     if (p->CurrentPainter)
         return p->CurrentPainter;
     else {
@@ -639,7 +706,7 @@ const FeaturePainter* Feature::getCurrentPainter() const
 
 bool Feature::hasPainter() const
 {
-    if (!p->PossiblePaintersUpToDate)
+    if (!p->PossiblePaintersUpToDate || !p->paintersCurrent())
         p->updatePossiblePainters();
 
     return p->HasPainter;
@@ -649,7 +716,7 @@ bool Feature::hasPainter(qreal PixelPerM) const
 {
     if (!layer())
         return false;
-    if (p->PixelPerMForPainter != PixelPerM)
+    if (p->PixelPerMForPainter != PixelPerM || !p->paintersCurrent())
         p->updatePainters(PixelPerM);
     return (p->CurrentPainter != NULL);
 }
@@ -869,7 +936,7 @@ void Feature::fromXML(QXmlStreamReader& stream, Feature* F)
 //        g_Merk_MainWindow->properties()->addSelection(F);
 }
 
-void Feature::toXML(QXmlStreamWriter& stream, bool strict, QString changetsetid)
+void Feature::toXML(QXmlStreamWriter& stream, bool strict, QString changetsetid, const QSet<Feature*>* selection)
 {
     stream.writeAttribute("id", xmlId());
 #ifndef FRISIUS_BUILD
@@ -891,7 +958,12 @@ void Feature::toXML(QXmlStreamWriter& stream, bool strict, QString changetsetid)
             stream.writeAttribute("special","true");
         // TODO Manage selection at document level
 #ifndef _MOBILE
-        if (g_Merk_MainWindow && g_Merk_MainWindow->properties()->isSelected(this))
+        bool Selected = false;
+        if (selection)
+            Selected = selection->contains(this);
+        else if (g_Merk_MainWindow && QThread::currentThread() == qApp->thread())
+            Selected = g_Merk_MainWindow->properties()->isSelected(this);
+        if (Selected)
             stream.writeAttribute("selected","true");
 #endif
     }
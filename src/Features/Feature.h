@@ -10,6 +10,7 @@ class Feature;
 
 #include <QtCore/QString>
 #include <QList>
+#include <QSet>
 
 #define CAST_FEATURE(x) (dynamic_cast<Feature*>(x))
 #define CAST_NODE(x) (dynamic_cast<Node*>(x))
@@ -34,6 +35,7 @@ class CommandList;
 class Document;
 class Layer;
 class Projection;
+struct PainterTable;
 class TrackNode;
 
 class QPointF;
@@ -163,6 +165,11 @@ public:
          */
     virtual void setTag(const QString& key, const QString& value);
 
+    /** Same as setTag, with a key of g_addTagKey and a value of g_addTagValue.
+         * created_by is not filtered out here.
+         */
+    void setTagIds(quint32 keyId, quint32 valueId);
+
     /** Set the tag "key=value" at the position index
          * If a tag with the same key exist, it is replaced
          * Otherwise the tag is added at the index position
@@ -210,6 +217,8 @@ public:
          * @return the value
         */
     virtual QString tagKey(int i) const;
+    virtual quint32 tagKeyId(int i) const;
+    virtual quint32 tagValueId(int i) const;
 
     /** remove the tag at the position "i".
          * position start at 0.
@@ -287,6 +296,11 @@ public:
     bool hasPainter() const;
     bool hasPainter(qreal PixelPerM) const;
     void invalidatePainter();
+    /* Changes at each invalidatePainter(), to tell painters found in the
+     * background for an older state of the feature */
+    int painterRevision() const;
+    void findPainters(const PainterTable* aTable, QList<const FeaturePainter*>& thePainters) const;
+    void setPainters(const PainterTable* aTable, const QList<const FeaturePainter*>& thePainters);
     QVector<qreal> getParentDashes() const;
 
     virtual qreal getAlpha();
@@ -310,10 +324,12 @@ public:
     void notifyParents(int Id);
 
     static void fromXML(QXmlStreamReader& stream, Feature* F);
-    virtual void toXML(QXmlStreamWriter& stream, bool strict, QString changetsetid = QString());
+    /* selection: the features marked as selected when not strict; without
+     * it, the selection of the main window is used on the GUI thread */
+    virtual void toXML(QXmlStreamWriter& stream, bool strict, QString changetsetid = QString(), const QSet<Feature*>* selection = 0);
 
     virtual QString toXML(int lvl=0, QProgressDialog * progress=NULL);
-    virtual bool toXML(QXmlStreamWriter& stream, QProgressDialog * progress=NULL, bool strict=false, QString changetsetid = QString()) = 0;
+    virtual bool toXML(QXmlStreamWriter& stream, QProgressDialog * progress=NULL, bool strict=false, QString changetsetid = QString(), const QSet<Feature*>* selection = 0) = 0;
 
     QString toMainHtml(QString type, QString systemtype);
     virtual QString toHtml() { return QString(); }
@@ -308,7 +308,7 @@ void Node::updateMeta()
     MetaUpToDate = true;
 }
 
-bool Node::toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict, QString changesetid)
+bool Node::toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict, QString changesetid, const QSet<Feature*>* selection)
 {
     bool OK = true;
 
@@ -317,7 +317,7 @@ bool Node::toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool stri
 
     stream.writeStartElement("node");
 
-    Feature::toXML(stream, strict, changesetid);
+    Feature::toXML(stream, strict, changesetid, selection);
     stream.writeAttribute("lon",COORD2STRING(BBox.topRight().x()));
     stream.writeAttribute("lat", COORD2STRING(BBox.topRight().y()));
 
@@ -682,7 +682,7 @@ PhotoNode::~PhotoNode(void)
 QPixmap PhotoNode::photo() const
 {
     if (Photo)
-        return *(Photo);
+        return QPixmap::fromImage(*Photo);
     else
         return QPixmap();
 }
@@ -690,7 +690,7 @@ QPixmap PhotoNode::photo() const
 void PhotoNode::setPhoto(QPixmap thePhoto)
 {
     delete Photo;
-    Photo = new QPixmap(thePhoto.scaled(M_PREFS->getMaxGeoPicWidth(), M_PREFS->getMaxGeoPicWidth(), Qt::KeepAspectRatio));
+    Photo = new QImage(thePhoto.scaled(M_PREFS->getMaxGeoPicWidth(), M_PREFS->getMaxGeoPicWidth(), Qt::KeepAspectRatio).toImage());
 }
 
 void PhotoNode::drawTouchup(QPainter& thePainter , MapView* theView)
@@ -711,7 +711,7 @@ void PhotoNode::drawTouchup(QPainter& thePainter , MapView* theView)
             qreal phRt = 1. * Photo->width() / Photo->height();
             phPt = me - QPoint(10*rt, 10*rt) - QPoint(M_PREFS->getMaxGeoPicWidth()*rt, M_PREFS->getMaxGeoPicWidth()*rt/phRt);
         }
-        thePainter.drawPixmap(phPt, Photo->scaledToWidth(M_PREFS->getMaxGeoPicWidth()*rt));
+        thePainter.drawImage(phPt, Photo->scaledToWidth(M_PREFS->getMaxGeoPicWidth()*rt, Qt::SmoothTransformation));
     }
 #endif
     Node::drawTouchup(thePainter, theView);
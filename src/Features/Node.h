@@ -10,6 +10,7 @@
 
 #include <QtCore/QDateTime>
 #include <QtXml>
+#include <QImage>
 
 class QProgressDialog;
 
@@ -76,7 +77,7 @@ public:
     Coord position() const;
     void setPosition(const Coord& aCoord);
 
-    bool toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict=false, QString changetsetid = QString());
+    bool toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict=false, QString changetsetid = QString(), const QSet<Feature*>* selection = 0);
     static Node* fromXML(Document* d, Layer* L, QXmlStreamReader& stream);
 
     bool toGPX(QXmlStreamWriter& stream, QProgressDialog * progress, QString element, bool forExport=false);
@@ -140,7 +141,8 @@ public:
     void setPhoto(QPixmap thePhoto);
 
 protected:
-    QPixmap* Photo;
+    /* An image, not a pixmap: it is drawn by the tile workers */
+    QImage* Photo;
     mutable bool photoLocationBR;
 };
 
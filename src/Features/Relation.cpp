@@ -16,6 +16,9 @@
 #include <algorithm>
 #include <utility>
 #include <QList>
+#include <QMultiHash>
+#include <QSet>
+#include <QVector>
 
 #define TEST_RFLAGS(x) theView->renderOptions().options.testFlag(x)
 
@@ -34,6 +37,13 @@ class RelationMemberModel : public QAbstractTableModel
         MainWindow* Main;
 };
 
+/* A closed ring of a multipolygon, joined from one or more member ways */
+struct MultipolygonRing
+{
+    QList<Node*> Nodes;
+    int Depth;  /* Nesting level: even for outer rings, odd for holes */
+};
+
 class RelationPrivate
 {
     public:
@@ -41,6 +51,7 @@ class RelationPrivate
             : theRelation(R), theModel(0), ModelReferences(0)
             , PathUpToDate(false)
             , ProjectionRevision(0)
+            , RingsUpToDate(false)
             , BBoxUpToDate(false)
             , Width(0)
         {
@@ -50,6 +61,13 @@ class RelationPrivate
             delete theModel;
         }
         void CalculateWidth();
+        void assembleRings(const Projection& theProjection);
+        void invalidate()
+        {
+            PathUpToDate = false;
+            RingsUpToDate = false;
+            BBoxUpToDate = false;
+        }
 
         Relation* theRelation;
         QList<QPair<QString, MapFeaturePtr> > Members;
@@ -60,6 +78,10 @@ class RelationPrivate
         bool PathUpToDate;
         int ProjectionRevision;
 
+        /* Ring topology of a multipolygon; only depends on the members */
+        QList<MultipolygonRing> Rings;
+        bool RingsUpToDate;
+
         bool BBoxUpToDate;
 
         RenderPriority theRenderPriority;
@@ -99,6 +121,132 @@ void RelationPrivate::CalculateWidth()
 }
 
 
+/* The placeholders of nodes not downloaded are left out, as in Way::buildPath */
+static QPolygonF projectRing(const QList<Node*>& Nodes, const Projection& theProjection)
+{
+    QPolygonF poly;
+    poly.reserve(Nodes.size());
+    for (int i=0; i<Nodes.size(); ++i)
+        if (!Nodes[i]->notEverythingDownloaded())
+            poly << Nodes[i]->projected(theProjection);
+    return poly;
+}
+
+/**
+ * Joins the member ways into closed rings at their shared end nodes, then
+ * finds the nesting of the rings: each ring's parent is the smallest larger
+ * ring that contains it. The roles are not used: ways with another role
+ * than outer or inner are drawn as outer ones, unless nested.
+ */
+void RelationPrivate::assembleRings(const Projection& theProjection)
+{
+    Rings.clear();
+
+    QList<QList<Node*> > chains;
+    for (int i=0; i<Members.size(); ++i) {
+        if (!Members[i].second || !CHECK_WAY(Members[i].second))
+            continue;
+        Way* W = STATIC_CAST_WAY(Members[i].second);
+        if (W->size() < 2)
+            continue;
+        QList<Node*> chain;
+        for (int j=0; j<W->size(); ++j)
+            chain << W->getNode(j);
+        chains << chain;
+    }
+
+    QMultiHash<Node*, int> ends;
+    for (int i=0; i<chains.size(); ++i) {
+        if (chains[i].first() != chains[i].last()) {
+            ends.insert(chains[i].first(), i);
+            ends.insert(chains[i].last(), i);
+        }
+    }
+
+    QVector<bool> used(chains.size(), false);
+    for (int i=0; i<chains.size(); ++i) {
+        if (used[i])
+            continue;
+        used[i] = true;
+        QList<Node*> ring = chains[i];
+        while (ring.first() != ring.last()) {
+            Node* end = ring.last();
+            int next = -1;
+            QMultiHash<Node*, int>::const_iterator it = ends.constFind(end);
+            for (; it != ends.constEnd() && it.key() == end; ++it)
+                if (!used[it.value()]) {
+                    next = it.value();
+                    break;
+                }
+            if (next < 0)
+                break;  /* Unclosed: drawn as if closed */
+            used[next] = true;
+            const QList<Node*>& c = chains[next];
+            if (c.first() == end)
+                for (int j=1; j<c.size(); ++j)
+                    ring << c[j];
+            else
+                for (int j=c.size()-2; j>=0; --j)
+                    ring << c[j];
+        }
+        int downloaded = 0;
+        for (int j=0; j<ring.size(); ++j)
+            if (!ring[j]->notEverythingDownloaded())
+                ++downloaded;
+        if (downloaded >= 3) {
+            MultipolygonRing R;
+            R.Nodes = ring;
+            R.Depth = 0;
+            Rings << R;
+        }
+    }
+
+    /* Sort by decreasing area: a ring can only be inside a larger one */
+    int n = Rings.size();
+    QVector<QPolygonF> polys(n);
+    QVector<QRectF> bboxes(n);
+    QVector<QPair<qreal, int> > byArea(n);
+    for (int i=0; i<n; ++i) {
+        /* Chained with the placeholders, which share the ends of the ways */
+        polys[i] = projectRing(Rings[i].Nodes, theProjection);
+        bboxes[i] = polys[i].boundingRect();
+        qreal area = 0;
+        for (int j=0, k=polys[i].size()-1; j<polys[i].size(); k=j++)
+            area += polys[i][k].x()*polys[i][j].y() - polys[i][j].x()*polys[i][k].y();
+        byArea[i] = qMakePair(-qAbs(area), i);
+    }
+    std::sort(byArea.begin(), byArea.end());
+
+    QList<MultipolygonRing> sorted;
+    for (int k=0; k<n; ++k) {
+        int i = byArea[k].second;
+        MultipolygonRing R = Rings[i];
+        for (int m=k-1; m>=0; --m) {
+            int j = byArea[m].second;
+            if (!bboxes[j].contains(bboxes[i]))
+                continue;
+            /* Test a vertex that is not shared with the candidate parent */
+#if QT_VERSION >= QT_VERSION_CHECK(5,14,0)
+            QSet<Node*> parentNodes(Rings[j].Nodes.constBegin(), Rings[j].Nodes.constEnd());
+#else
+            QSet<Node*> parentNodes = QSet<Node*>::fromList(Rings[j].Nodes);
+#endif
+            int v = 0;
+            while (v < R.Nodes.size() && (parentNodes.contains(R.Nodes[v]) || R.Nodes[v]->notEverythingDownloaded()))
+                ++v;
+            if (v == R.Nodes.size())
+                continue;
+            if (polys[j].containsPoint(R.Nodes[v]->projected(theProjection), Qt::OddEvenFill)) {
+                R.Depth = sorted[m].Depth + 1;
+                break;
+            }
+        }
+        sorted << R;
+    }
+    Rings = sorted;
+    RingsUpToDate = true;
+}
+
 Relation::Relation()
     : Feature()
 {
@@ -140,8 +288,7 @@ void Relation::partChanged(Feature*, int ChangeId)
     if (isDeleted())
         return;
 
-    p->PathUpToDate = false;
-    p->BBoxUpToDate = false;
+    p->invalidate();
     MetaUpToDate = false;
     g_backend.sync(this);
 
@@ -325,8 +472,7 @@ void Relation::add(const QString& Role, Feature* F)
 {
     p->Members.push_back(qMakePair(Role,F));
     F->setParentFeature(this);
-    p->PathUpToDate = false;
-    p->BBoxUpToDate = false;
+    p->invalidate();
     MetaUpToDate = false;
     g_backend.sync(this);
 
@@ -338,8 +484,7 @@ void Relation::add(const QString& Role, Feature* F, int Idx)
     p->Members.push_back(qMakePair(Role,F));
     std::rotate(p->Members.begin()+Idx,p->Members.end()-1,p->Members.end());
     F->setParentFeature(this);
-    p->PathUpToDate = false;
-    p->BBoxUpToDate = false;
+    p->invalidate();
     MetaUpToDate = false;
     g_backend.sync(this);
 
@@ -353,8 +498,7 @@ void Relation::remove(int Idx)
     p->Members.erase(p->Members.begin()+Idx);
     if (F && find(F) == p->Members.size())
         F->unsetParentFeature(this);
-    p->PathUpToDate = false;
-    p->BBoxUpToDate = false;
+    p->invalidate();
     MetaUpToDate = false;
     g_backend.sync(this);
 
@@ -460,8 +604,9 @@ void Relation::buildPath(Projection const &theProjection)
                 Way* M = STATIC_CAST_WAY(p->Members[i].second);
                 M->buildPath(theProjection);
                 if (M->getPath().elementCount() > 1) {
-                    memberPaths << qMakePair(p->Members[i].first, M->getPath());
-                    if (isMultipolygon && (p->Members[i].first == "outer" || p->Members[i].first.isEmpty())) {
+                    if (!isMultipolygon)
+                        memberPaths << qMakePair(p->Members[i].first, M->getPath());
+                    else if (p->Members[i].first == "outer" || p->Members[i].first.isEmpty()) {
                         if (!numOuter)
                             outerWay = M;
                         else
@@ -472,8 +617,28 @@ void Relation::buildPath(Projection const &theProjection)
             }
         }
 
-        QList<QPainterPath> innerPaths;
-        QList<QPainterPath> outerPaths;
+        if (isMultipolygon) {
+            // Holes are added as subpaths and left to the odd-even fill rule
+            if (!p->RingsUpToDate)
+                p->assembleRings(theProjection);
+
+            if (outerWay && tagSize() == 1) {
+                outerWay->rebuildPath(theProjection);
+                for (int i=0; i<p->Rings.size(); ++i) {
+                    if (p->Rings[i].Depth % 2) {
+                        QPainterPath hole;
+                        hole.addPolygon(projectRing(p->Rings[i].Nodes, theProjection));
+                        hole.closeSubpath();
+                        outerWay->addPathHole(hole);
+                    }
+                }
+            } else {
+                for (int i=0; i<p->Rings.size(); ++i) {
+                    p->thePath.addPolygon(projectRing(p->Rings[i].Nodes, theProjection));
+                    p->thePath.closeSubpath();
+                }
+            }
+        }
 
         while (memberPaths.size()) {
             // handle the start...
@@ -507,24 +672,7 @@ void Relation::buildPath(Projection const &theProjection)
                     k=0;
                 }
             }
-            if (curRole == "inner" and isMultipolygon)
-                innerPaths << curPath;
-            else
-                outerPaths << curPath;
-        }
-
-        if (outerWay && tagSize() == 1) {
-            outerWay->rebuildPath(theProjection);
-            for (int i=0; i<innerPaths.size(); ++i) {
-                outerWay->addPathHole(innerPaths[i]);
-            }
-        } else {
-            for (int i=0; i<outerPaths.size(); ++i) {
-                p->thePath.addPath(outerPaths[i]);
-            }
-            for (int i=0; i<innerPaths.size(); ++i) {
-                p->thePath = p->thePath.subtracted(innerPaths[i]);
-            }
+            p->thePath.addPath(curPath);
         }
 
         p->ProjectionRevision = theProjection.projectionRevision();
@@ -553,6 +701,7 @@ void Relation::updateMeta()
     Feature::updateMeta();
 
     p->PathUpToDate = false;
+    p->RingsUpToDate = false;
     p->CalculateWidth();
 
     MetaUpToDate = true;
@@ -569,12 +718,12 @@ void Relation::updateMeta()
     }
 }
 
-bool Relation::toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict, QString changetsetid)
+bool Relation::toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict, QString changetsetid, const QSet<Feature*>* selection)
 {
     bool OK = true;
 
     stream.writeStartElement("relation");
-    Feature::toXML(stream, strict, changetsetid);
+    Feature::toXML(stream, strict, changetsetid, selection);
 
     // Has to be first to be picked up when reading back
     if (!strict)
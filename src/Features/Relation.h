@@ -56,7 +56,7 @@ public:
     const QPainterPath& getPath() const;
     void buildPath(Projection const &theProjection);
 
-    virtual bool toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict=false, QString changetsetid = QString());
+    virtual bool toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict=false, QString changetsetid = QString(), const QSet<Feature*>* selection = 0);
     static Relation* fromXML(Document* d, Layer* L, QXmlStreamReader& stream);
 
     virtual QString toHtml();
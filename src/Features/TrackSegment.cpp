@@ -13,22 +13,123 @@
 
 #include <algorithm>
 #include <QList>
+#include <QHash>
+#include <QMutex>
+#include <QVector>
+
+#include <math.h>
 
 #define TEST_RFLAGS(x) theView->renderOptions().options.testFlag(x)
 
+/* Points closer than this to the previous kept point are skipped */
+#define DECIMATION_PIXELS 2.0
+/* Kept points per run, whose box lets the drawing skip the runs off a tile */
+#define DECIMATION_RUN 64
+
 class TrackSegmentPrivate
 {
     public:
         TrackSegmentPrivate()
         : Distance(0)
+        , DecimatedRevision(-1)
         {
         }
 
         QList<TrackNode*> Nodes;
         qreal Distance;
         CoordBox BBox;
+
+        /* Indexes of the nodes kept at a given zoom level, and the boxes of
+         * their runs: run r spans the kept points r*DECIMATION_RUN up to the
+         * first of the next run. Filled lazily by the render threads; reset
+         * when the nodes change. */
+        struct Decimation
+        {
+            QVector<int> kept;
+            QVector<CoordBox> runs;
+        };
+        QMutex DecimatedMutex;
+        QHash<int, Decimation> Decimated;
+        int DecimatedRevision;
+
+        void invalidateDecimated();
+        Decimation decimated(MapView* theView);
+        void addRuns(Decimation& d) const;
 };
 
+/* Unlike CoordBox::intersects, also true for the flat box of a straight run */
+static inline bool overlaps(const CoordBox& a, const CoordBox& b)
+{
+    return a.left() <= b.right() && b.left() <= a.right()
+            && a.bottom() <= b.top() && b.bottom() <= a.top();
+}
+
+void TrackSegmentPrivate::invalidateDecimated()
+{
+    QMutexLocker lock(&DecimatedMutex);
+    Decimated.clear();
+}
+
+void TrackSegmentPrivate::addRuns(Decimation& d) const
+{
+    for (int r=0; r*DECIMATION_RUN < d.kept.size(); ++r) {
+        int first = r*DECIMATION_RUN;
+        int last = qMin(first + DECIMATION_RUN, d.kept.size() - 1);
+        CoordBox box(Nodes[d.kept[first]]->position(), Nodes[d.kept[first]]->position());
+        for (int k=first+1; k<=last; ++k)
+            box.merge(Nodes[d.kept[k]]->position());
+        d.runs << box;
+    }
+}
+
+TrackSegmentPrivate::Decimation TrackSegmentPrivate::decimated(MapView* theView)
+{
+    const QTransform& T = theView->transform();
+    qreal scale = sqrt(T.m11()*T.m11() + T.m12()*T.m12());
+    if (scale <= 0.0 || Nodes.size() < 3) {
+        Decimation all;
+        all.kept.resize(Nodes.size());
+        for (int i=0; i<all.kept.size(); ++i)
+            all.kept[i] = i;
+        addRuns(all);
+        return all;
+    }
+
+    /* Half-octave zoom buckets, so that zooming does not recompute on every step */
+    int level = qRound(log(scale) / log(2.0) * 2.0);
+    const Projection& theProjection = theView->projection();
+
+    QMutexLocker lock(&DecimatedMutex);
+    if (DecimatedRevision != theProjection.projectionRevision()) {
+        Decimated.clear();
+        DecimatedRevision = theProjection.projectionRevision();
+    }
+    QHash<int, Decimation>::const_iterator it = Decimated.constFind(level);
+    if (it != Decimated.constEnd())
+        return it.value();
+
+    qreal tolerance = DECIMATION_PIXELS / pow(2.0, level / 2.0);
+    tolerance *= tolerance;
+
+    Decimation result;
+    QVector<int>& kept = result.kept;
+    kept.append(0);
+    QPointF last = Nodes[0]->projected(theProjection);
+    for (int i=1; i<Nodes.size()-1; ++i) {
+        QPointF pt = Nodes[i]->projected(theProjection);
+        QPointF d = pt - last;
+        if (d.x()*d.x() + d.y()*d.y() < tolerance)
+            continue;
+        kept.append(i);
+        last = pt;
+    }
+    kept.append(Nodes.size()-1);
+    addRuns(result);
+
+    Decimated.insert(level, result);
+    return result;
+}
+
 TrackSegment::TrackSegment(void)
     : Feature()
 {
@@ -75,6 +176,7 @@ void TrackSegment::add(TrackNode* aPoint)
 {
     p->Nodes.push_back(aPoint);
     aPoint->setParentFeature(this);
+    p->invalidateDecimated();
     g_backend.sync(this);
 }
 
@@ -82,6 +184,7 @@ void TrackSegment::add(TrackNode* Pt, int Idx)
 {
     p->Nodes.push_back(Pt);
     std::rotate(p->Nodes.begin()+Idx,p->Nodes.end()-1,p->Nodes.end());
+    p->invalidateDecimated();
     g_backend.sync(this);
 }
 
@@ -98,6 +201,7 @@ void TrackSegment::remove(int idx)
     Node* Pt = p->Nodes[idx];
     p->Nodes.erase(p->Nodes.begin()+idx);
     Pt->unsetParentFeature(this);
+    p->invalidateDecimated();
     g_backend.sync(this);
 }
 
@@ -162,25 +266,45 @@ void TrackSegment::drawSimple(QPainter &P, MapView *theView)
 }
 
 void TrackSegment::drawTouchup(QPainter &P, MapView* theView)
+{
+    drawTrack(P, theView, theView->viewport());
+}
+
+void TrackSegment::drawTrack(QPainter &P, MapView* theView, const CoordBox& clip)
 {
     QPen pen;
 
     if (!TEST_RFLAGS(RendererOptions::TrackSegmentVisible))
         return;
+    // Drawn by the render layer through drawDensity()
+    if (M_PREFS->getGpxTrackDensity())
+        return;
+    if (!overlaps(boundingBox(), clip))
+        return;
 
-    for (int i=1; i<p->Nodes.size(); ++i)
+    TrackSegmentPrivate::Decimation d = p->decimated(theView);
+    const QVector<int>& kept = d.kept;
+    for (int k=1; k<kept.size(); ++k)
     {
-        if (!theView->viewport().contains(p->Nodes[i-1]->position()) && !theView->viewport().contains(p->Nodes[i]->position()))
+        /* Skip to the end of the runs off the clip */
+        int r = (k-1) / DECIMATION_RUN;
+        if ((k-1) % DECIMATION_RUN == 0 && !overlaps(d.runs[r], clip)) {
+            k = qMin((r+1) * DECIMATION_RUN, kept.size() - 1);
+            continue;
+        }
+        TrackNode* From = p->Nodes[kept[k-1]];
+        TrackNode* To = p->Nodes[kept[k]];
+        if (!overlaps(CoordBox(From->position(), To->position()), clip))
             continue;
 
-        QPointF FromF = theView->toView(p->Nodes[i-1]);
-        QPointF ToF = theView->toView(p->Nodes[i]);
+        QPointF FromF = theView->toView(From);
+        QPointF ToF = theView->toView(To);
 
         if (!M_PREFS->getSimpleGpxTrack())
         {
-            qreal distance = p->Nodes[i-1]->position().distanceFrom(p->Nodes[i]->position());
-            qreal slope = (p->Nodes[i]->elevation() - p->Nodes[i-1]->elevation()) / (distance * 10.0);
-            qreal speed = p->Nodes[i]->speed();
+            qreal distance = From->position().distanceFrom(To->position());
+            qreal slope = (To->elevation() - From->elevation()) / (distance * 10.0);
+            qreal speed = To->speed();
 
             int width = M_PREFS->getGpxTrackWidth();
             // Dynamic track line width adaption to zoom level
@@ -234,6 +358,32 @@ void TrackSegment::drawTouchup(QPainter &P, MapView* theView)
     }
 }
 
+void TrackSegment::drawDensity(QPainter &P, MapView* theView, const CoordBox& clip)
+{
+    if (!TEST_RFLAGS(RendererOptions::TrackSegmentVisible))
+        return;
+    if (!overlaps(boundingBox(), clip))
+        return;
+
+    /* One polyline for each sequence of runs crossing the clip */
+    TrackSegmentPrivate::Decimation d = p->decimated(theView);
+    QPolygonF poly;
+    for (int r=0; r<d.runs.size(); ++r) {
+        if (!overlaps(d.runs[r], clip)) {
+            if (poly.size() > 1)
+                P.drawPolyline(poly);
+            poly.clear();
+            continue;
+        }
+        int first = r*DECIMATION_RUN;
+        int last = qMin(first + DECIMATION_RUN, d.kept.size() - 1);
+        for (int k=(poly.isEmpty() ? first : first+1); k<=last; ++k)
+            poly << theView->toView(p->Nodes[d.kept[k]]);
+    }
+    if (poly.size() > 1)
+        P.drawPolyline(poly);
+}
+
 bool TrackSegment::notEverythingDownloaded()
 {
     return false;
@@ -311,6 +461,7 @@ void TrackSegment::cascadedRemoveIfUsing(Document* theDocument, Feature* aFeatur
 
 void TrackSegment::partChanged(Feature*, int)
 {
+    p->invalidateDecimated();
 }
 
 void TrackSegment::updateMeta()
@@ -377,7 +528,7 @@ bool TrackSegment::toGPX(QXmlStreamWriter& stream, QProgressDialog * progress, b
     return OK;
 }
 
-bool TrackSegment::toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool, QString)
+bool TrackSegment::toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool, QString, const QSet<Feature*>*)
 {
     return toGPX(stream, progress, false);
 }
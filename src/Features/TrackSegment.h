@@ -28,6 +28,10 @@ public:
     virtual const CoordBox& boundingBox(bool update=true) const;
     virtual void drawSimple(QPainter& P, MapView* theView);
     virtual void drawTouchup(QPainter& P, MapView* theView);
+    /* Like drawTouchup, for the part of the track crossing clip */
+    void drawTrack(QPainter& P, MapView* theView, const CoordBox& clip);
+    /* Draws the (decimated) track crossing clip as polylines with the current pen */
+    void drawDensity(QPainter& P, MapView* theView, const CoordBox& clip);
     virtual void drawSpecial(QPainter& P, QPen& Pen, MapView* theView);
     virtual void drawParentsSpecial(QPainter& P, QPen& Pen, MapView* theView);
     virtual void drawChildrenSpecial(QPainter& P, QPen& Pen, MapView* theView, int depth);
@@ -56,7 +60,7 @@ public:
 
     virtual bool toGPX(QXmlStreamWriter& stream, QProgressDialog * progress, bool forExport=false);
     static TrackSegment* fromGPX(Document* d, Layer* L, QXmlStreamReader& stream, QProgressDialog * progress);
-    virtual bool toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict=false,QString changetsetid = QString());
+    virtual bool toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict=false,QString changetsetid = QString(), const QSet<Feature*>* selection = 0);
     static TrackSegment* fromXML(Document* d, Layer* L, QXmlStreamReader& stream, QProgressDialog * progress);
 
     virtual QString toHtml() {return QString();}
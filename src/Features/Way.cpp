@@ -48,6 +48,7 @@ class WayPrivate
         bool PathUpToDate;
         bool VirtualsUptodate;
         QPainterPath thePath;
+        QVector<double> theVertices; // projected x,y pairs of thePath; empty if it has holes
         int ProjectionRevision;
         int BestSegment;
         qreal SimpleWidth;
@@ -490,13 +491,18 @@ void Way::drawTouchup(QPainter& P, MapView* theView)
     if (!Draw || !theView->renderOptions().options.testFlag(RendererOptions::VirtualNodesVisible) || !theView->renderOptions().options.testFlag(RendererOptions::NodesVisible) || isReadonly())
         return;
 
+    /* The virtual nodes are at the middle of the segments. They are not read
+     * from p->virtualNodes, which the GUI thread rebuilds while editing. */
+    if (!canAddVirtualNodes())
+        return;
     theWidth /= 2;
     P.setPen(QColor(0,0,0));
-    foreach (NodePtr N, p->virtualNodes) {
-        if (theView->viewport().contains(N->position())) {
-            QPoint p =  theView->toView(N);
-            P.drawLine(p+QPoint(-theWidth, -theWidth), p+QPoint(theWidth, theWidth));
-            P.drawLine(p+QPoint(theWidth, -theWidth), p+QPoint(-theWidth, theWidth));
+    for (int i=1; i<p->Nodes.size(); ++i) {
+        Coord mid = (p->Nodes[i-1]->position() + p->Nodes[i]->position()) / 2.0;
+        if (theView->viewport().contains(mid)) {
+            QPoint pt = theView->toView(mid);
+            P.drawLine(pt+QPoint(-theWidth, -theWidth), pt+QPoint(theWidth, theWidth));
+            P.drawLine(pt+QPoint(theWidth, -theWidth), pt+QPoint(-theWidth, theWidth));
         }
     }
 }
@@ -648,12 +654,20 @@ const QPainterPath& Way::getPath() const
     return p->thePath;
 }
 
+const QVector<double>& Way::getProjectedVertices() const
+{
+    return p->theVertices;
+}
+
 void Way::addPathHole(const QPainterPath& pth)
 {
     if (!p->PathUpToDate)
         return;
 
-    p->thePath = p->thePath.subtracted(pth);
+    /* The hole is known to be inside the way (see Relation::buildPath):
+     * with the odd-even fill rule, adding it is enough. */
+    p->thePath.addPath(pth);
+    p->theVertices.clear();
 }
 
 void Way::rebuildPath(const Projection &theProjection)
@@ -669,20 +683,24 @@ void Way::buildPath(const Projection &theProjection)
         return;
     else {
         p->thePath = QPainterPath();
+        p->theVertices.clear();
         if (p->Nodes.size() < 2) {
             p->PathUpToDate = true;
             return;
         }
 
+        p->theVertices.reserve(p->Nodes.size()*2);
         bool hasMoved = 0;
         for (int i=0; i<p->Nodes.size(); ++i) {
             if (!p->Nodes.at(i)->notEverythingDownloaded()) {
+                QPointF pt = p->Nodes.at(i)->projected(theProjection);
                 if (hasMoved) {
-                    p->thePath.lineTo(p->Nodes.at(i)->projected(theProjection));
+                    p->thePath.lineTo(pt);
                 } else {
-                    p->thePath.moveTo(p->Nodes.at(i)->projected(theProjection));
+                    p->thePath.moveTo(pt);
                     hasMoved = 1;
                 }
+                p->theVertices << pt.x() << pt.y();
             }
         }
         for (int i=0; i<p->virtualNodes.size(); ++i) {
@@ -753,12 +771,12 @@ bool Way::toGPX(QXmlStreamWriter& stream, QProgressDialog * progress, bool forEx
     return OK;
 }
 
-bool Way::toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict, QString changetsetid)
+bool Way::toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict, QString changetsetid, const QSet<Feature*>* selection)
 {
     bool OK = true;
 
     stream.writeStartElement("way");
-    Feature::toXML(stream, strict, changetsetid);
+    Feature::toXML(stream, strict, changetsetid, selection);
 
     // Has to be first to be picked up when reading back
     if (!strict)
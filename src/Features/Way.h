@@ -2,6 +2,7 @@
 #define MERKAARTOR_ROAD_H_
 
 #include <QList>
+#include <QVector>
 
 #include "Document.h"
 #include "Feature.h"
@@ -77,12 +78,13 @@ public:
     virtual bool deleteChildren(Document* theDocument, CommandList* theList);
 
     const QPainterPath& getPath() const;
+    const QVector<double>& getProjectedVertices() const;
     void addPathHole(const QPainterPath &pth);
     void rebuildPath(const Projection &theProjection);
     void buildPath(Projection const &theProjection);
 
     virtual bool toGPX(QXmlStreamWriter& stream, QProgressDialog * progress, bool forExport=false);
-    virtual bool toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict=false, QString changetsetid = QString());
+    virtual bool toXML(QXmlStreamWriter& stream, QProgressDialog * progress, bool strict=false, QString changetsetid = QString(), const QSet<Feature*>* selection = 0);
     static Way* fromXML(Document* d, Layer* L, QXmlStreamReader& stream);
 
     virtual QString toHtml();
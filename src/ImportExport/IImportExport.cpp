@@ -15,7 +15,7 @@
 #include "../ImportExport/IImportExport.h"
 
 IImportExport::IImportExport(Document* doc)
-        : theDoc(doc), Device(0), ownDevice(false)
+        : theDoc(doc), Device(0), ownDevice(false), theFilter(0)
 {
 }
 
@@ -52,6 +52,11 @@ bool IImportExport::saveFile(QString filename)
     return Device->open(QIODevice::WriteOnly | QIODevice::Truncate);
 }
 
+void IImportExport::setFilter(ImportFilter* aFilter)
+{
+    theFilter = aFilter;
+}
+
 bool IImportExport::export_(const QList<Feature *>& featList)
 {
     theFeatures = featList;
@@ -14,6 +14,7 @@
 
 class QString;
 class QIODevice;
+class ImportFilter;
 
 #include "Features.h"
 #include "Layer.h"
@@ -37,6 +38,8 @@ public:
     virtual bool loadFile(QString filename);
     // Specify the output as a QFile
     virtual bool saveFile(QString filename);
+    // Only import what aFilter accepts, if the format supports it
+    void setFilter(ImportFilter* aFilter);
     // import the  input
     virtual bool import(Layer* /* aLayer */) { return false; }
     // export
@@ -54,6 +57,7 @@ protected:
     QList<Feature*> theFeatures;
     QString FileName;
     bool ownDevice;
+    ImportFilter* theFilter;
 };
 
 #endif
@@ -7,6 +7,8 @@ HEADERS += \
     ImportGPX.h \
     ImportNGT.h \
     ImportOSM.h \
+    ImportFilter.h \
+    OsmXmlReader.h \
     ImportNGT.h \
     IImportExport.h \
     ImportNMEA.h \
@@ -20,6 +22,8 @@ SOURCES += \
     ExportOSM.cpp \
     ImportGPX.cpp \
     ImportOSM.cpp \
+    ImportFilter.cpp \
+    OsmXmlReader.cpp \
     ImportNGT.cpp \
     IImportExport.cpp \
     ImportNMEA.cpp \
@@ -12,14 +12,20 @@
 
 #include <QtGui>
 
+#include "Global.h"
+
 #include "../ImportExport/ImportExportOSC.h"
+#include "ImportFilter.h"
+#include "OsmXmlReader.h"
 
 #include "DirtyListExecutorOSC.h"
 
 #include "DownloadOSM.h"
 
+#include <algorithm>
+
 ImportExportOSC::ImportExportOSC(Document* doc)
- : IImportExport(doc)
+ : IImportExport(doc), Applied(0)
 {
 }
 
@@ -45,6 +51,53 @@ bool ImportExportOSC::export_(const QList<Feature *>&)
 // IMPORT
 
 
+/* Detaches F from its members and adds it to Dropped, with the placeholders
+ * only it refers to */
+static void dropFeature(Feature* F, const QSet<Feature*>& Keep, QSet<Feature*>& Dropped)
+{
+    QSet<Feature*> Children;
+    while (F->size()) {
+        Children << F->get(F->size()-1);
+        F->remove(F->size()-1);
+    }
+    Dropped.insert(F);
+
+    foreach (Feature* C, Children)
+        if (!Keep.contains(C) && !Dropped.contains(C) && !C->sizeParents() && C->lastUpdated() == Feature::NotYetDownloaded)
+            dropFeature(C, Keep, Dropped);
+}
+
+/* Deletes the features from their layers, one pass per layer */
+static void deleteFeatures(const QSet<Feature*>& Features)
+{
+    QHash<Layer*, QSet<Feature*> > byLayer;
+    foreach (Feature* F, Features)
+        if (F->layer())
+            byLayer[F->layer()].insert(F);
+    QHash<Layer*, QSet<Feature*> >::const_iterator it = byLayer.constBegin();
+    for (; it != byLayer.constEnd(); ++it)
+        it.key()->deleteFeatures(it.value());
+}
+
+/* The features of a <create> are only known once read: those aFilter rejects
+ * are removed afterwards, unless a feature kept uses them. The file order
+ * (nodes, ways, relations) is walked backwards, so that the parents are
+ * decided before their members. */
+static void filterCreated(ImportFilter* aFilter, QList<Feature*>& Created)
+{
+    QSet<Feature*> Keep = Created.toSet();
+    QSet<Feature*> Dropped;
+    for (int i=Created.size()-1; i>=0; --i) {
+        Feature* F = Created[i];
+        if (F->sizeParents() || aFilter->accept(F))
+            continue;
+        Keep.remove(F);
+        Created.removeAt(i);
+        dropFeature(F, Keep, Dropped);
+    }
+    deleteFeatures(Dropped);
+}
+
 // import the  input
 bool ImportExportOSC::import(Layer* aLayer)
 {
@@ -70,30 +123,35 @@ bool ImportExportOSC::import(Layer* aLayer)
     stream.readNext();
     while(!stream.atEnd() && !stream.isEndElement()) {
         if (stream.name() == "create") {
+            QList<Feature*> created;
             stream.readNext();
             while(!stream.atEnd() && !stream.isEndElement()) {
+                F = NULL;
                 if (stream.name() == "node") {
                     F = Node::fromXML(theDoc, aLayer, stream);
-                    theList->add(new AddFeatureCommand(aLayer, F, true));
                 } else if (stream.name() == "way") {
                     F = Way::fromXML(theDoc, aLayer, stream);
-                    theList->add(new AddFeatureCommand(aLayer, F, true));
                 } else if (stream.name() == "relation") {
                     F = Relation::fromXML(theDoc, aLayer, stream);
-                    theList->add(new AddFeatureCommand(aLayer, F, true));
                 } else if (!stream.isWhitespace()) {
                     qDebug() << "OSC: logic error: " << stream.name() << " : " << stream.tokenType() << " (" << stream.lineNumber() << ")";
                     stream.skipCurrentElement();
                 }
-                if (F) {
-                    for (int i=0; i<F->size(); ++i) {
-                        if (F->get(i)->notEverythingDownloaded() && F->get(i)->hasOSMId())
-                            featIdList << F->get(i)->id();
-                    }
-                }
+                if (F)
+                    created << F;
 
                 stream.readNext();
             }
+            if (theFilter)
+                filterCreated(theFilter, created);
+            foreach (F, created) {
+                theList->add(new AddFeatureCommand(aLayer, F, true));
+                for (int i=0; i<F->size(); ++i) {
+                    if (F->get(i)->notEverythingDownloaded() && F->get(i)->hasOSMId())
+                        featIdList << F->get(i)->id();
+                }
+            }
+            F = NULL;
         } else if (stream.name() == "modify") {
             stream.readNext();
             while(!stream.atEnd() && !stream.isEndElement()) {
@@ -168,3 +226,301 @@ bool ImportExportOSC::import(Layer* aLayer)
     return true;
 }
 
+
+// APPLY
+
+QString ImportExportOSC::Conflict::toString() const
+{
+    QString type = "node";
+    if (id.type == IFeature::LineString)
+        type = "way";
+    else if (id.type == IFeature::OsmRelation)
+        type = "relation";
+
+    QString why;
+    switch (reason) {
+    case LocallyModified:
+        why = "modified locally";
+        break;
+    case Outdated:
+        why = "the document has a later version";
+        break;
+    case StillUsed:
+        why = "still used";
+        break;
+    }
+    return QString("%1 %2 v%3: %4").arg(type).arg(id.numId).arg(version).arg(why);
+}
+
+void ImportExportOSC::addConflict(Conflict::Reason aReason, const Change& C)
+{
+    Conflict c;
+    c.reason = aReason;
+    c.id = C.id;
+    c.version = C.Version;
+    theConflicts << c;
+}
+
+bool ImportExportOSC::readChanges(QList<Change>& Changes)
+{
+    OsmXmlReader xml(Device);
+    OsmXmlReader::Token t = xml.readNext();
+    if (t != OsmXmlReader::StartElement || (xml.name() != "osmChange" && xml.name() != "osmchange")) {
+        theError = t == OsmXmlReader::Invalid ? xml.errorString() : QString("Not an osmChange file");
+        return false;
+    }
+
+    int action = -1;
+    Change* C = 0;
+    int order = 0;
+    for (;;) {
+        t = xml.readNext();
+        if (t == OsmXmlReader::Invalid) {
+            theError = xml.errorString();
+            return false;
+        }
+        if (t == OsmXmlReader::EndDocument)
+            return true;
+
+        OsmXmlReader::Span name = xml.name();
+        if (t == OsmXmlReader::EndElement) {
+            if (name == "node" || name == "way" || name == "relation")
+                C = 0;
+            else if (name == "create" || name == "modify" || name == "delete")
+                action = -1;
+            continue;
+        }
+
+        if (name == "create")
+            action = Create;
+        else if (name == "modify")
+            action = Modify;
+        else if (name == "delete")
+            action = Delete;
+        else if (action >= 0 && (name == "node" || name == "way" || name == "relation")) {
+            char type = IFeature::Point;
+            if (name == "way")
+                type = IFeature::LineString;
+            else if (name == "relation")
+                type = IFeature::OsmRelation;
+
+            Changes.append(Change());
+            C = &Changes.last();
+            C->action = (Action)action;
+            C->id = IFeature::FId(type, xml.attribute("id").toLongLong());
+            OsmXmlReader::Span version = xml.attribute("version");
+            C->Version = version.size ? version.toInt() : -1;
+            C->Order = order++;
+            if (type == IFeature::Point)
+                C->Position = Coord(xml.attribute("lon").toDouble(), xml.attribute("lat").toDouble());
+            C->Time = QDateTime::fromString(xml.attribute("timestamp").toString().left(19), Qt::ISODate);
+            if (!C->Time.isValid())
+                C->Time = QDateTime::currentDateTime();
+            C->User = xml.attribute("user").toString();
+        } else if (!C)
+            continue;
+        else if (name == "tag") {
+            QString k = xml.attribute("k").toString();
+            if (k.toLower() != "created_by")
+                C->Tags << qMakePair(g_addTagKey(k), g_addTagValue(xml.attribute("v").toString()));
+        } else if (name == "nd")
+            C->Refs << xml.attribute("ref").toLongLong();
+        else if (name == "member") {
+            OsmXmlReader::Span Type = xml.attribute("type");
+            char type;
+            if (Type == "node")
+                type = IFeature::Point;
+            else if (Type == "way")
+                type = IFeature::LineString;
+            else if (Type == "relation")
+                type = IFeature::OsmRelation;
+            else
+                continue;
+            C->Members << IFeature::FId(type, xml.attribute("ref").toLongLong());
+            C->Roles << xml.attribute("role").toString();
+        }
+    }
+}
+
+static void clearMembers(Feature* F)
+{
+    while (F->size())
+        F->remove(F->size()-1);
+}
+
+/* Creates or updates the feature of C, unless it conflicts */
+void ImportExportOSC::update(const Change& C, Layer* aLayer, QList<Feature*>& Created)
+{
+    Feature* F = theDoc->getFeature(C.id);
+    if (F && F->lastUpdated() != Feature::NotYetDownloaded) {
+        if (F->isDirty() || F->lastUpdated() == Feature::User) {
+            addConflict(Conflict::LocallyModified, C);
+            return;
+        }
+        if (C.Version >= 0 && F->versionNumber() >= C.Version) {
+            addConflict(Conflict::Outdated, C);
+            return;
+        }
+    } else if (F)
+        Created << F;
+
+    /* Updated features stay in their layer */
+    Layer* L = F ? F->layer() : aLayer;
+    if (C.id.type == IFeature::Point) {
+        Node* N = CAST_NODE(F);
+        if (!N) {
+            N = g_backend.allocNode(aLayer, C.Position);
+            N->setId(C.id);
+            aLayer->add(N);
+            Created << N;
+        } else
+            N->setPosition(C.Position);
+        F = N;
+    } else if (C.id.type == IFeature::LineString) {
+        Way* W = CAST_WAY(F);
+        if (!W) {
+            W = g_backend.allocWay(aLayer);
+            W->setId(C.id);
+            aLayer->add(W);
+            Created << W;
+        } else
+            clearMembers(W);
+        for (int i=0; i<C.Refs.size(); ++i)
+            W->add(Feature::getNodeOrCreatePlaceHolder(theDoc, L, IFeature::FId(IFeature::Point, C.Refs[i])));
+        F = W;
+    } else {
+        Relation* R = CAST_RELATION(F);
+        if (!R) {
+            R = g_backend.allocRelation(aLayer);
+            R->setId(C.id);
+            aLayer->add(R);
+            Created << R;
+        } else
+            clearMembers(R);
+        for (int i=0; i<C.Members.size(); ++i) {
+            const IFeature::FId& M = C.Members[i];
+            Feature* P;
+            if (M.type == IFeature::Point)
+                P = Feature::getNodeOrCreatePlaceHolder(theDoc, L, M);
+            else if (M.type == IFeature::LineString)
+                P = Feature::getWayOrCreatePlaceHolder(theDoc, L, M);
+            else
+                P = Feature::getRelationOrCreatePlaceHolder(theDoc, L, M);
+            if (P && P != R)
+                R->add(C.Roles[i], P);
+        }
+        F = R;
+    }
+
+    F->clearTags();
+    for (int i=0; i<C.Tags.size(); ++i)
+        F->setTagIds(C.Tags[i].first, C.Tags[i].second);
+    F->setTime(C.Time);
+    F->setUser(C.User);
+    if (C.Version >= 0)
+        F->setVersionNumber(C.Version);
+    F->setLastUpdated(Feature::OSMServer);
+    ++Applied;
+}
+
+/* The features are deleted together, once it is known that none of them
+ * is still used by a feature kept */
+void ImportExportOSC::remove(const QList<Change>& Deleted)
+{
+    QHash<Feature*, int> toDelete;
+    for (int i=0; i<Deleted.size(); ++i) {
+        const Change& C = Deleted[i];
+        Feature* F = theDoc->getFeature(C.id);
+        if (!F)
+            continue;
+        if (F->lastUpdated() != Feature::NotYetDownloaded) {
+            if (F->isDirty() || F->lastUpdated() == Feature::User) {
+                addConflict(Conflict::LocallyModified, C);
+                continue;
+            }
+            if (C.Version >= 0 && F->versionNumber() >= C.Version) {
+                addConflict(Conflict::Outdated, C);
+                continue;
+            }
+        }
+        toDelete.insert(F, i);
+    }
+
+    /* Leaving one out may keep its members used in turn */
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        QHash<Feature*, int>::iterator it = toDelete.begin();
+        while (it != toDelete.end()) {
+            Feature* F = it.key();
+            bool used = false;
+            for (int j=0; j<F->sizeParents() && !used; ++j)
+                used = !toDelete.contains(CAST_FEATURE(F->getParent(j)));
+            if (used) {
+                addConflict(Conflict::StillUsed, Deleted[it.value()]);
+                it = toDelete.erase(it);
+                changed = true;
+            } else
+                ++it;
+        }
+    }
+
+    QSet<Feature*> Features;
+    QHash<Feature*, int>::const_iterator it = toDelete.constBegin();
+    for (; it != toDelete.constEnd(); ++it) {
+        clearMembers(it.key());
+        Features.insert(it.key());
+    }
+    deleteFeatures(Features);
+    Applied += Features.size();
+}
+
+bool ImportExportOSC::byTypeAndId(const Change* a, const Change* b)
+{
+    if (a->id.type != b->id.type)
+        return a->id.type < b->id.type;
+    if (a->id.numId != b->id.numId)
+        return a->id.numId < b->id.numId;
+    if (a->Version != b->Version)
+        return a->Version < b->Version;
+    return a->Order < b->Order;
+}
+
+bool ImportExportOSC::apply(Layer* aLayer)
+{
+    theConflicts.clear();
+    Applied = 0;
+
+    QList<Change> Changes;
+    if (!readChanges(Changes))
+        return false;
+
+    /* Only the last change of a feature is applied: by version, then in
+     * the file order */
+    QVector<const Change*> sorted;
+    sorted.reserve(Changes.size());
+    for (int i=0; i<Changes.size(); ++i)
+        sorted << &Changes[i];
+    std::sort(sorted.begin(), sorted.end(), byTypeAndId);
+
+    /* Nodes, ways then relations are created or updated, so that the
+     * members are there for their parents; the deletes come last */
+    QList<Change> Deleted;
+    QList<Feature*> Created;
+    g_backend.delayIndexing();
+    for (int i=0; i<sorted.size(); ++i) {
+        const Change& C = *sorted[i];
+        if (i+1 < sorted.size() && sorted[i+1]->id == C.id)
+            continue;
+        if (C.action == Delete)
+            Deleted << C;
+        else
+            update(C, aLayer, Created);
+    }
+    if (theFilter)
+        filterCreated(theFilter, Created);
+    remove(Deleted);
+    g_backend.resumeIndexing();
+
+    return true;
+}
@@ -14,6 +14,8 @@
 
 #include "IImportExport.h"
 
+#include <QDateTime>
+
 class QDomDocument;
 /**
     @author cbro <cbro@semperpax.com>
@@ -21,6 +23,21 @@ class QDomDocument;
 class ImportExportOSC : public IImportExport
 {
 public:
+    /* A change of apply() that was not made */
+    struct Conflict
+    {
+        enum Reason {
+            LocallyModified,    /* the feature has edits not uploaded */
+            Outdated,           /* the document has this version or a later one */
+            StillUsed           /* deleted, but a feature kept refers to it */
+        };
+        Reason reason;
+        IFeature::FId id;
+        int version;            /* of the change */
+
+        QString toString() const;
+    };
+
     ImportExportOSC(Document* doc);
 
     ~ImportExportOSC();
@@ -28,8 +45,46 @@ public:
     // import the  input
     virtual bool import(Layer* aLayer);
 
+    /* Applies the osmChange to the document as data from the server, e.g. a
+     * replication diff: the features are updated where they are, those
+     * created go to aLayer. The whole file is read first; the changes are
+     * applied by type and id, the index being updated once at the end. */
+    bool apply(Layer* aLayer);
+    const QList<Conflict>& conflicts() const { return theConflicts; }
+    /* Changes applied by the last apply() */
+    int applied() const { return Applied; }
+    QString errorString() const { return theError; }
+
     //export
     virtual bool export_(const QList<Feature *>& featList = QList<Feature *>());
+
+private:
+    enum Action { Create, Modify, Delete };
+
+    struct Change
+    {
+        Action action;
+        IFeature::FId id;
+        int Version;    /* -1 if not given */
+        int Order;      /* in the file */
+        Coord Position;
+        QDateTime Time;
+        QString User;
+        QList<QPair<quint32, quint32> > Tags;
+        QVector<qint64> Refs;
+        QVector<IFeature::FId> Members;
+        QVector<QString> Roles;
+    };
+
+    static bool byTypeAndId(const Change* a, const Change* b);
+    bool readChanges(QList<Change>& Changes);
+    void update(const Change& C, Layer* aLayer, QList<Feature*>& Created);
+    void remove(const QList<Change>& Deleted);
+    void addConflict(Conflict::Reason aReason, const Change& C);
+
+    QList<Conflict> theConflicts;
+    int Applied;
+    QString theError;
 };
 
 #endif
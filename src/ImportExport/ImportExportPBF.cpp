@@ -14,20 +14,55 @@
 
 #include <QApplication>
 #include <QMessageBox>
+#include <QDataStream>
 #include <QDateTime>
+#include <QFileInfo>
+#include <QFuture>
+#include <QSharedPointer>
+#include <QThreadPool>
+#include <QVector>
+#include <QtEndian>
+#include <QtConcurrentRun>
 
 #include "ImportExportPBF.h"
 #include "Global.h"
+#include "MerkaartorPreferences.h"
 
 #include "zlib.h"
 //#include "bzlib.h"
 
+#include <algorithm>
+#include <limits>
+
 #define NANO ( 1000.0 * 1000.0 * 1000.0 )
 #define MAX_BLOCK_HEADER_SIZE ( 64 * 1024 )
 #define MAX_BLOB_SIZE ( 32 * 1024 * 1024 )
+/* Written blocks: the usual entity count and coordinate unit of the format */
+#define EXPORT_BLOCK_ENTITIES 8000
+#define EXPORT_GRANULARITY 100
+/* The sidecar index, filename.idx */
+#define INDEX_MAGIC 0x4d4b5049      /* "MKPI" */
+#define INDEX_VERSION 2
+/* The grid of the index, in degrees, and the most cells kept for a block */
+#define INDEX_CELL_SIZE 0.1
+#define INDEX_GRID_WIDTH 3600
+#define INDEX_GRID_HEIGHT 1800
+#define INDEX_MAX_CELLS 512
+
+/* A PrimitiveBlock inflated and parsed on the thread pool */
+struct PBFBlock
+{
+    PBFBlock() : ok(false) {}
+
+    bool ok;
+    OSMPBF::PrimitiveBlock primitive;
+    /* The string table, decoded from UTF-8 once per block */
+    QVector<QString> strings;
+};
+typedef QSharedPointer<PBFBlock> PBFBlockPtr;
 
 ImportExportPBF::ImportExportPBF(Document* doc)
-    : IImportExport(doc)
+    : IImportExport(doc), m_dataStart(0)
 {
     GOOGLE_PROTOBUF_VERIFY_VERSION;
 }
@@ -36,12 +71,6 @@ ImportExportPBF::~ImportExportPBF()
 {
 }
 
-// export
-bool ImportExportPBF::export_(const QList<Feature *>& /*featList*/)
-{
-    return false;
-}
-
 /***************************************************/
 /*
 Copyright 2010  Christian Vetter veaac.fdirct@gmail.com
@@ -66,73 +95,137 @@ static void SzFree( void *p, void *address)
     free( address );
 }
 
-void ImportExportPBF::loadGroup()
-{
-    const OSMPBF::PrimitiveGroup& group = m_primitiveBlock.primitivegroup( m_currentGroup );
-    if ( group.nodes_size() != 0 ) {
-        m_mode = ModeNode;
-    } else if ( group.ways_size() != 0 ) {
-        m_mode = ModeWay;
-    } else if ( group.relations_size() != 0 ) {
-        m_mode = ModeRelation;
-    } else if ( group.has_dense() )  {
-        m_mode = ModeDense;
-        m_lastDenseID = 0;
-        m_lastDenseTag = 0;
-        m_lastDenseLatitude = 0;
-        m_lastDenseLongitude = 0;
-        m_lastDenseTimestamp = 0;
-        m_lastDenseChangeset = 0;
-        m_lastDenseUId = 0;
-        m_lastDenseUserSid = 0;
-        assert( group.dense().id_size() != 0 );
-    } else
-        assert( false );
-}
-
-void ImportExportPBF::loadBlock()
-{
-    m_loadBlock = false;
-    m_currentGroup = 0;
-    m_currentEntity = 0;
-    int stringCount = m_primitiveBlock.stringtable().s_size();
-    // precompute all strings that match a necessary tag
-    m_nodeTagIDs.resize( m_primitiveBlock.stringtable().s_size() );
-    for ( int i = 1; i < stringCount; i++ )
-        m_nodeTagIDs[i] = m_nodeTags.value( m_primitiveBlock.stringtable().s( i ).data(), -1 );
-    m_wayTagIDs.resize( m_primitiveBlock.stringtable().s_size() );
-    for ( int i = 1; i < stringCount; i++ )
-        m_wayTagIDs[i] = m_wayTags.value( m_primitiveBlock.stringtable().s( i ).data(), -1 );
-    m_relationTagIDs.resize( m_primitiveBlock.stringtable().s_size() );
-    for ( int i = 1; i < stringCount; i++ )
-        m_relationTagIDs[i] = m_relationTags.value( m_primitiveBlock.stringtable().s( i ).data(), -1 );
-}
-
-bool ImportExportPBF::readNextBlock()
+static bool unpackZlib( const OSMPBF::Blob& blob, QByteArray& out )
 {
-    if ( !readBlockHeader() )
+    out.resize( blob.raw_size() );
+    z_stream compressedStream;
+    compressedStream.next_in = ( unsigned char* ) blob.zlib_data().data();
+    compressedStream.avail_in = blob.zlib_data().size();
+    compressedStream.next_out = ( unsigned char* ) out.data();
+    compressedStream.avail_out = blob.raw_size();
+    compressedStream.zalloc = Z_NULL;
+    compressedStream.zfree = Z_NULL;
+    compressedStream.opaque = Z_NULL;
+    int ret = inflateInit( &compressedStream );
+    if ( ret != Z_OK ) {
+        qCritical() << "failed to init zlib stream";
         return false;
-
-    if ( m_blockHeader.type() != "OSMData" ) {
-        qCritical() << "invalid block type, found" << m_blockHeader.type().data() << "instead of OSMData";
+    }
+    ret = inflate( &compressedStream, Z_FINISH );
+    if ( ret != Z_STREAM_END ) {
+        qCritical() << "failed to inflate zlib stream";
+        inflateEnd( &compressedStream );
         return false;
     }
+    ret = inflateEnd( &compressedStream );
+    if ( ret != Z_OK ) {
+        qCritical() << "failed to deinit zlib stream";
+        return false;
+    }
+    return true;
+}
 
-    if ( !readBlob() )
+static bool unpackLzma( const OSMPBF::Blob& /*blob*/, QByteArray& /*out*/ )
+{
+//    ISzAlloc alloc = { SzAlloc, SzFree };
+//    ELzmaStatus status;
+//    SizeT destinationLength = blob.raw_size();
+//    SizeT sourceLength = blob.lzma_data().size() - LZMA_PROPS_SIZE + 8;
+//    int ret = LzmaDecode(
+//            ( unsigned char* ) out.data(),
+//            &destinationLength,
+//            ( const unsigned char* ) blob.lzma_data().data() + LZMA_PROPS_SIZE + 8,
+//            &sourceLength,
+//            ( const unsigned char* ) blob.lzma_data().data(),
+//            LZMA_PROPS_SIZE + 8,
+//            LZMA_FINISH_END,
+//            &status,
+//            &alloc );
+
+//    if ( ret != SZ_OK )
+//        return false;
+
+    qCritical() << "lzma compressed blobs are not supported";
+    return false;
+}
+
+/* Turns the bytes of a Blob into those of the block it holds */
+static bool unpackBlob( const QByteArray& raw, QByteArray& out )
+{
+    OSMPBF::Blob blob;
+    if ( !blob.ParseFromArray( raw.constData(), raw.size() ) ) {
+        qCritical() << "failed to parse blob";
         return false;
+    }
 
-    if ( !m_primitiveBlock.ParseFromArray( m_buffer.data(), m_buffer.size() ) ) {
-        qCritical() << "failed to parse PrimitiveBlock";
+    if ( blob.has_raw() ) {
+        const std::string& data = blob.raw();
+        out = QByteArray( data.data(), data.size() );
+    } else if ( blob.has_zlib_data() ) {
+        return unpackZlib( blob, out );
+//    } else if ( blob.has_bzip2_data() ) {
+//        return unpackBzip2( blob, out );
+    } else if ( blob.has_lzma_data() ) {
+        return unpackLzma( blob, out );
+    } else {
+        qCritical() << "Blob contains no data";
         return false;
     }
     return true;
 }
 
-bool ImportExportPBF::readBlockHeader()
+/* Runs on the thread pool: everything about a block but the features. The
+ * index does not need the strings. */
+static PBFBlockPtr decodeBlock( const QByteArray& raw, bool withStrings )
+{
+    PBFBlockPtr block( new PBFBlock );
+    QByteArray data;
+    if ( !unpackBlob( raw, data ) )
+        return block;
+    if ( !block->primitive.ParseFromArray( data.constData(), data.size() ) ) {
+        qCritical() << "failed to parse PrimitiveBlock";
+        return block;
+    }
+
+    block->ok = true;
+    if ( !withStrings )
+        return block;
+
+    const OSMPBF::StringTable& table = block->primitive.stringtable();
+    block->strings.resize( table.s_size() );
+    for ( int i = 0; i < table.s_size(); i++ )
+        block->strings[i] = QString::fromUtf8( table.s( i ).data(), table.s( i ).size() );
+    return block;
+}
+
+static Coord blockCoord( const OSMPBF::PrimitiveBlock& b, long long lon, long long lat )
+{
+    return Coord(
+            ( ( qreal ) lon * b.granularity() + b.lon_offset() ) / NANO,
+            ( ( qreal ) lat * b.granularity() + b.lat_offset() ) / NANO
+            );
+}
+
+/* The tags of an element, interned for the import filter */
+template <class T>
+static void filterTags( const PBFBlock& block, const T& in, ImportFilter::Tags& out )
+{
+    for ( int tag = 0; tag < in.keys_size(); tag++ )
+        out << qMakePair( g_addTagKey( block.strings.at( in.keys( tag ) ) ),
+                          g_addTagValue( block.strings.at( in.vals( tag ) ) ) );
+}
+
+bool ImportExportPBF::readBlockHeader( bool* eof )
 {
     char sizeData[4];
-    if ( m_file.read( sizeData, 4 * sizeof( char ) ) != 4 * sizeof( char ) )
-        return false; // end of stream?
+    qint64 readSize = m_file.read( sizeData, 4 * sizeof( char ) );
+    if ( eof )
+        *eof = ( readSize == 0 );
+    if ( readSize != 4 * sizeof( char ) ) {
+        if ( readSize != 0 )
+            qCritical() << "truncated BlockHeader size";
+        return false;
+    }
 
     int size = convertNetworkByteOrder( sizeData );
     if ( size > MAX_BLOCK_HEADER_SIZE || size < 0 ) {
@@ -152,165 +245,92 @@ bool ImportExportPBF::readBlockHeader()
     return true;
 }
 
-bool ImportExportPBF::readBlob()
+/* Reads the Blob following the header, still packed */
+bool ImportExportPBF::readBlobData( QByteArray& data )
 {
     int size = m_blockHeader.datasize();
     if ( size < 0 || size > MAX_BLOB_SIZE ) {
         qCritical() << "invalid Blob size:" << size;
         return false;
     }
-    m_buffer.resize( size );
-    int readBytes = m_file.read( m_buffer.data(), size );
+    data.resize( size );
+    int readBytes = m_file.read( data.data(), size );
     if ( readBytes != size ) {
         qCritical() << "failed to read Blob";
         return false;
     }
-    if ( !m_blob.ParseFromArray( m_buffer.constData(), size ) ) {
-        qCritical() << "failed to parse blob";
-        return false;
-    }
-
-    if ( m_blob.has_raw() ) {
-        const std::string& data = m_blob.raw();
-        m_buffer.resize( data.size() );
-        for ( unsigned i = 0; i < data.size(); i++ )
-            m_buffer[i] = data[i];
-    } else if ( m_blob.has_zlib_data() ) {
-        if ( !unpackZlib() )
-            return false;
-//    } else if ( m_blob.has_bzip2_data() ) {
-//        if ( !unpackBzip2() )
-//            return false;
-    } else if ( m_blob.has_lzma_data() ) {
-        if ( !unpackLzma() )
-            return false;
-    } else {
-        qCritical() << "Blob contains no data";
-        return false;
-    }
-
     return true;
 }
 
-bool ImportExportPBF::unpackZlib()
+void ImportExportPBF::parseBlock( const PBFBlock& block, Layer* aLayer )
 {
-    m_buffer.resize( m_blob.raw_size() );
-    z_stream compressedStream;
-    compressedStream.next_in = ( unsigned char* ) m_blob.zlib_data().data();
-    compressedStream.avail_in = m_blob.zlib_data().size();
-    compressedStream.next_out = ( unsigned char* ) m_buffer.data();
-    compressedStream.avail_out = m_blob.raw_size();
-    compressedStream.zalloc = Z_NULL;
-    compressedStream.zfree = Z_NULL;
-    compressedStream.opaque = Z_NULL;
-    int ret = inflateInit( &compressedStream );
-    if ( ret != Z_OK ) {
-        qCritical() << "failed to init zlib stream";
-        return false;
-    }
-    ret = inflate( &compressedStream, Z_FINISH );
-    if ( ret != Z_STREAM_END ) {
-        qCritical() << "failed to inflate zlib stream";
-        return false;
-    }
-    ret = inflateEnd( &compressedStream );
-    if ( ret != Z_OK ) {
-        qCritical() << "failed to deinit zlib stream";
-        return false;
+    const OSMPBF::PrimitiveBlock& primitive = block.primitive;
+    for ( int g = 0; g < primitive.primitivegroup_size(); g++ ) {
+        const OSMPBF::PrimitiveGroup& group = primitive.primitivegroup( g );
+        for ( int i = 0; i < group.nodes_size(); i++ )
+            parseNode( block, group.nodes( i ), aLayer );
+        for ( int i = 0; i < group.ways_size(); i++ )
+            parseWay( block, group.ways( i ), aLayer );
+        for ( int i = 0; i < group.relations_size(); i++ )
+            parseRelation( block, group.relations( i ), aLayer );
+        if ( group.has_dense() )
+            parseDense( block, group.dense(), aLayer );
     }
-    return true;
-}
-
-bool ImportExportPBF::unpackBzip2()
-{
-//    unsigned size = m_blob.raw_size();
-//    m_buffer.resize( size );
-//    m_bzip2Buffer.resize( m_blob.bzip2_data().size() );
-//    for ( unsigned i = 0; i < m_blob.bzip2_data().size(); i++ )
-//        m_bzip2Buffer[i] = m_blob.bzip2_data()[i];
-//    int ret = BZ2_bzBuffToBuffDecompress( m_buffer.data(), &size, m_bzip2Buffer.data(), m_bzip2Buffer.size(), 0, 0 );
-//    if ( ret != BZ_OK ) {
-//        qCritical() << "failed to unpack bzip2 stream";
-//        return false;
-//    }
-    return true;
 }
 
-bool ImportExportPBF::unpackLzma()
+void ImportExportPBF::parseNode( const PBFBlock& block, const OSMPBF::Node& inputNode, Layer* aLayer )
 {
-//    ISzAlloc alloc = { SzAlloc, SzFree };
-//    ELzmaStatus status;
-//    SizeT destinationLength = m_blob.raw_size();
-//    SizeT sourceLength = m_blob.lzma_data().size() - LZMA_PROPS_SIZE + 8;
-//    int ret = LzmaDecode(
-//            ( unsigned char* ) m_buffer.data(),
-//            &destinationLength,
-//            ( const unsigned char* ) m_blob.lzma_data().data() + LZMA_PROPS_SIZE + 8,
-//            &sourceLength,
-//            ( const unsigned char* ) m_blob.lzma_data().data(),
-//            LZMA_PROPS_SIZE + 8,
-//            LZMA_FINISH_END,
-//            &status,
-//            &alloc );
-
-//    if ( ret != SZ_OK )
-//        return false;
-
-    return true;
-}
-
-void ImportExportPBF::parseNode( Layer* aLayer )
-{
-    const OSMPBF::Node& inputNode = m_primitiveBlock.primitivegroup( m_currentGroup ).nodes( m_currentEntity );
+    Coord pos = blockCoord( block.primitive, inputNode.lon(), inputNode.lat() );
+
+    if ( theFilter ) {
+        m_tags.clear();
+        if ( theFilter->hasSelector() )
+            filterTags( block, inputNode, m_tags );
+        if ( !theFilter->acceptNode( inputNode.id(), pos, m_tags ) )
+            return;
+    }
 
     Node* N = STATIC_CAST_NODE(theDoc->getFeature(IFeature::FId(IFeature::Point, inputNode.id())));
     if (!N) {
-        N = g_backend.allocNode(aLayer, Coord(
-                ( ( qreal ) inputNode.lon() * m_primitiveBlock.granularity() + m_primitiveBlock.lon_offset() ) / NANO,
-                ( ( qreal ) inputNode.lat() * m_primitiveBlock.granularity() + m_primitiveBlock.lat_offset() ) / NANO
-                ));
+        N = g_backend.allocNode(aLayer, pos);
         N->setId(IFeature::FId(IFeature::Point, inputNode.id()));
         aLayer->add(N);
     } else {
-        N->setPosition(Coord(
-                ( ( qreal ) inputNode.lon() * m_primitiveBlock.granularity() + m_primitiveBlock.lon_offset() ) / NANO,
-                ( ( qreal ) inputNode.lat() * m_primitiveBlock.granularity() + m_primitiveBlock.lat_offset() ) / NANO
-                ));
+        N->setPosition(pos);
         N->setLastUpdated(Feature::OSMServer);
     }
 
 #ifndef FRISIUS_BUILD
     if (inputNode.has_info()) {
-        OSMPBF::Info info = inputNode.info();
+        const OSMPBF::Info& info = inputNode.info();
         if (info.has_version())
             N->setVersionNumber(info.version());
         if (info.has_timestamp())
             N->setTime(QDateTime::fromTime_t(info.timestamp()));
         if (info.has_user_sid())
-            N->setUser(m_primitiveBlock.stringtable().s(info.user_sid()).data());
+            N->setUser(block.strings.at(info.user_sid()));
     }
 #endif
 
-    for ( int tag = 0; tag < inputNode.keys_size(); tag++ ) {
-        QString key = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputNode.keys( tag ) ).data() );
-        QString value = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputNode.vals( tag ) ).data() );
-        N->setTag(key, value);
-    }
-
-    m_currentEntity++;
-    if ( m_currentEntity >= m_primitiveBlock.primitivegroup( m_currentGroup ).nodes_size() ) {
-        m_currentEntity = 0;
-        m_currentGroup++;
-        if ( m_currentGroup >= m_primitiveBlock.primitivegroup_size() )
-            m_loadBlock = true;
-        else
-            loadGroup();
-    }
+    for ( int tag = 0; tag < inputNode.keys_size(); tag++ )
+        N->setTag( block.strings.at( inputNode.keys( tag ) ), block.strings.at( inputNode.vals( tag ) ) );
 }
 
-void ImportExportPBF::parseWay( Layer* aLayer )
+void ImportExportPBF::parseWay( const PBFBlock& block, const OSMPBF::Way& inputWay, Layer* aLayer )
 {
-    const OSMPBF::Way& inputWay = m_primitiveBlock.primitivegroup( m_currentGroup ).ways( m_currentEntity );
+    if ( theFilter ) {
+        m_tags.clear();
+        if ( theFilter->hasSelector() )
+            filterTags( block, inputWay, m_tags );
+        m_refs.clear();
+        long long ref = 0;
+        for ( int i = 0; i < inputWay.refs_size(); i++ ) {
+            ref += inputWay.refs( i );
+            m_refs << ref;
+        }
+        if ( !theFilter->acceptWay( inputWay.id(), m_refs, m_tags ) )
+            return;
+    }
 
     Way* W = STATIC_CAST_WAY(theDoc->getFeature(IFeature::FId(IFeature::LineString, inputWay.id())));
     if (!W) {
@@ -323,21 +343,18 @@ void ImportExportPBF::parseWay( Layer* aLayer )
 
 #ifndef FRISIUS_BUILD
     if (inputWay.has_info()) {
-        OSMPBF::Info info = inputWay.info();
+        const OSMPBF::Info& info = inputWay.info();
         if (info.has_version())
             W->setVersionNumber(info.version());
         if (info.has_timestamp())
             W->setTime(QDateTime::fromTime_t(info.timestamp()));
         if (info.has_user_sid())
-            W->setUser(m_primitiveBlock.stringtable().s(info.user_sid()).data());
+            W->setUser(block.strings.at(info.user_sid()));
     }
 #endif
 
-    for ( int tag = 0; tag < inputWay.keys_size(); tag++ ) {
-        QString key = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputWay.keys( tag ) ).data() );
-        QString value = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputWay.vals( tag ) ).data() );
-        W->setTag(key, value);
-    }
+    for ( int tag = 0; tag < inputWay.keys_size(); tag++ )
+        W->setTag( block.strings.at( inputWay.keys( tag ) ), block.strings.at( inputWay.vals( tag ) ) );
 
     long long lastRef = 0;
     for ( int i = 0; i < inputWay.refs_size(); i++ ) {
@@ -352,21 +369,28 @@ void ImportExportPBF::parseWay( Layer* aLayer )
         }
         W->add(N);
     }
-
-    m_currentEntity++;
-    if ( m_currentEntity >= m_primitiveBlock.primitivegroup( m_currentGroup ).ways_size() ) {
-        m_currentEntity = 0;
-        m_currentGroup++;
-        if ( m_currentGroup >= m_primitiveBlock.primitivegroup_size() )
-            m_loadBlock = true;
-        else
-            loadGroup();
-    }
 }
 
-void ImportExportPBF::parseRelation( Layer* aLayer )
+void ImportExportPBF::parseRelation( const PBFBlock& block, const OSMPBF::Relation& inputRelation, Layer* aLayer )
 {
-    const OSMPBF::Relation& inputRelation = m_primitiveBlock.primitivegroup( m_currentGroup ).relations( m_currentEntity );
+    if ( theFilter ) {
+        m_tags.clear();
+        if ( theFilter->hasSelector() )
+            filterTags( block, inputRelation, m_tags );
+        m_members.clear();
+        long long ref = 0;
+        for ( int i = 0; i < inputRelation.types_size(); i++ ) {
+            ref += inputRelation.memids( i );
+            char type = IFeature::OsmRelation;
+            if ( inputRelation.types( i ) == OSMPBF::Relation::NODE )
+                type = IFeature::Point;
+            else if ( inputRelation.types( i ) == OSMPBF::Relation::WAY )
+                type = IFeature::LineString;
+            m_members << IFeature::FId( type, ref );
+        }
+        if ( !theFilter->acceptRelation( inputRelation.id(), m_members, m_tags ) )
+            return;
+    }
 
     Relation* R = STATIC_CAST_RELATION(theDoc->getFeature(IFeature::FId(IFeature::OsmRelation, inputRelation.id())));
     if (!R) {
@@ -379,26 +403,23 @@ void ImportExportPBF::parseRelation( Layer* aLayer )
 
 #ifndef FRISIUS_BUILD
     if (inputRelation.has_info()) {
-        OSMPBF::Info info = inputRelation.info();
+        const OSMPBF::Info& info = inputRelation.info();
         if (info.has_version())
             R->setVersionNumber(info.version());
         if (info.has_timestamp())
             R->setTime(QDateTime::fromTime_t(info.timestamp()));
         if (info.has_user_sid())
-            R->setUser(m_primitiveBlock.stringtable().s(info.user_sid()).data());
+            R->setUser(block.strings.at(info.user_sid()));
     }
 #endif
 
-    for ( int tag = 0; tag < inputRelation.keys_size(); tag++ ) {
-        QString key = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputRelation.keys( tag ) ).data() );
-        QString value = QString::fromUtf8( m_primitiveBlock.stringtable().s( inputRelation.vals( tag ) ).data() );
-        R->setTag(key, value);
-    }
+    for ( int tag = 0; tag < inputRelation.keys_size(); tag++ )
+        R->setTag( block.strings.at( inputRelation.keys( tag ) ), block.strings.at( inputRelation.vals( tag ) ) );
 
     long long lastRef = 0;
     for ( int i = 0; i < inputRelation.types_size(); i++ ) {
         lastRef += inputRelation.memids( i );
-        QString role = QString::fromUtf8(m_primitiveBlock.stringtable().s( inputRelation.roles_sid( i ) ).data());
+        const QString& role = block.strings.at( inputRelation.roles_sid( i ) );
 
         switch (inputRelation.types( i )) {
         case OSMPBF::Relation::NODE: {
@@ -436,80 +457,71 @@ void ImportExportPBF::parseRelation( Layer* aLayer )
         }
         }
     }
-
-    m_currentEntity++;
-    if ( m_currentEntity >= m_primitiveBlock.primitivegroup( m_currentGroup ).relations_size() ) {
-        m_currentEntity = 0;
-        m_currentGroup++;
-        if ( m_currentGroup >= m_primitiveBlock.primitivegroup_size() )
-            m_loadBlock = true;
-        else
-            loadGroup();
-    }
 }
 
-void ImportExportPBF::parseDense( Layer* aLayer )
+void ImportExportPBF::parseDense( const PBFBlock& block, const OSMPBF::DenseNodes& dense, Layer* aLayer )
 {
-    const OSMPBF::DenseNodes& dense = m_primitiveBlock.primitivegroup( m_currentGroup ).dense();
-
-    m_lastDenseID += dense.id( m_currentEntity );
-    m_lastDenseLatitude += dense.lat( m_currentEntity );
-    m_lastDenseLongitude += dense.lon( m_currentEntity );
+    /* Everything but the tags is delta coded along the group */
+    long long lastID = 0;
+    long long lastLatitude = 0;
+    long long lastLongitude = 0;
+    long long lastTimestamp = 0;
+    long long lastChangeset = 0;
+    long long lastUId = 0;
+    long long lastUserSid = 0;
+    int lastTag = 0;
+
+    for ( int entity = 0; entity < dense.id_size(); entity++ ) {
+        lastID += dense.id( entity );
+        lastLatitude += dense.lat( entity );
+        lastLongitude += dense.lon( entity );
+        Coord pos = blockCoord( block.primitive, lastLongitude, lastLatitude );
+
+        if ( dense.has_denseinfo() ) {
+            lastTimestamp += dense.denseinfo().timestamp( entity );
+            lastChangeset += dense.denseinfo().changeset( entity );
+            lastUId += dense.denseinfo().uid( entity );
+            lastUserSid += dense.denseinfo().user_sid( entity );
+        }
 
-    Node* N = STATIC_CAST_NODE(theDoc->getFeature(IFeature::FId(IFeature::Point, m_lastDenseID)));
-    if (!N) {
-        N = g_backend.allocNode(aLayer, Coord(
-                ( ( qreal ) m_lastDenseLongitude * m_primitiveBlock.granularity() + m_primitiveBlock.lon_offset() ) / NANO,
-                ( ( qreal ) m_lastDenseLatitude * m_primitiveBlock.granularity() + m_primitiveBlock.lat_offset() ) / NANO
-                ));
-        N->setId(IFeature::FId(IFeature::Point, m_lastDenseID));
-        aLayer->add(N);
-    } else {
-        N->setPosition(Coord(
-                ( ( qreal ) m_lastDenseLongitude * m_primitiveBlock.granularity() + m_primitiveBlock.lon_offset() ) / NANO,
-                ( ( qreal ) m_lastDenseLatitude * m_primitiveBlock.granularity() + m_primitiveBlock.lat_offset() ) / NANO
-                ));
-        N->setLastUpdated(Feature::OSMServer);
-    }
+        /* The tags of the node are the pairs up to the next 0 */
+        int firstTag = lastTag;
+        while ( lastTag < dense.keys_vals_size() && dense.keys_vals( lastTag ) != 0 )
+            lastTag += 2;
+        int endTag = lastTag;
+        if ( lastTag < dense.keys_vals_size() )
+            lastTag++;
+
+        if ( theFilter ) {
+            m_tags.clear();
+            if ( theFilter->hasSelector() )
+                for ( int tag = firstTag; tag < endTag; tag += 2 )
+                    m_tags << qMakePair( g_addTagKey( block.strings.at( dense.keys_vals( tag ) ) ),
+                                         g_addTagValue( block.strings.at( dense.keys_vals( tag + 1 ) ) ) );
+            if ( !theFilter->acceptNode( lastID, pos, m_tags ) )
+                continue;
+        }
 
-    if (dense.has_denseinfo()) {
-        m_lastDenseTimestamp += dense.denseinfo().timestamp(m_currentEntity);
-        m_lastDenseChangeset += dense.denseinfo().changeset(m_currentEntity);
-        m_lastDenseUId += dense.denseinfo().uid(m_currentEntity);
-        m_lastDenseUserSid += dense.denseinfo().user_sid(m_currentEntity);
+        Node* N = STATIC_CAST_NODE(theDoc->getFeature(IFeature::FId(IFeature::Point, lastID)));
+        if (!N) {
+            N = g_backend.allocNode(aLayer, pos);
+            N->setId(IFeature::FId(IFeature::Point, lastID));
+            aLayer->add(N);
+        } else {
+            N->setPosition(pos);
+            N->setLastUpdated(Feature::OSMServer);
+        }
 
 #ifndef FRISIUS_BUILD
-        N->setVersionNumber(dense.denseinfo().version(m_currentEntity));
-        N->setTime(m_lastDenseTimestamp);
-        N->setUser(m_primitiveBlock.stringtable().s(m_lastDenseUserSid).data());
-#endif
-    }
-
-    while ( true ){
-        if ( m_lastDenseTag >= dense.keys_vals_size() )
-            break;
-
-        int tagValue = dense.keys_vals( m_lastDenseTag );
-        if ( tagValue == 0 ) {
-            m_lastDenseTag++;
-            break;
+        if ( dense.has_denseinfo() ) {
+            N->setVersionNumber(dense.denseinfo().version(entity));
+            N->setTime(lastTimestamp);
+            N->setUser(block.strings.at(lastUserSid));
         }
+#endif
 
-        QString key = QString::fromUtf8( m_primitiveBlock.stringtable().s( dense.keys_vals( m_lastDenseTag ) ).data() );
-        QString value = QString::fromUtf8( m_primitiveBlock.stringtable().s( dense.keys_vals( m_lastDenseTag + 1 ) ).data() );
-        N->setTag(key, value);
-
-        m_lastDenseTag += 2;
-    }
-
-    m_currentEntity++;
-    if ( m_currentEntity >= dense.id_size() ) {
-        m_currentEntity = 0;
-        m_currentGroup++;
-        if ( m_currentGroup >= m_primitiveBlock.primitivegroup_size() )
-            m_loadBlock = true;
-        else
-            loadGroup();
+        for ( int tag = firstTag; tag < endTag; tag += 2 )
+            N->setTag( block.strings.at( dense.keys_vals( tag ) ), block.strings.at( dense.keys_vals( tag + 1 ) ) );
     }
 }
 
@@ -535,13 +547,15 @@ bool ImportExportPBF::loadFile(QString filename)
         return false;
     }
 
-    if ( !readBlob() )
+    QByteArray raw;
+    if ( !readBlobData( raw ) || !unpackBlob( raw, m_buffer ) )
         return false;
 
     if ( !m_headerBlock.ParseFromArray( m_buffer.data(), m_buffer.size() ) ) {
         qCritical() << "failed to parse HeaderBlock";
         return false;
     }
+    m_dataStart = m_file.pos();
     for ( int i = 0; i < m_headerBlock.required_features_size(); i++ ) {
         const std::string& feature = m_headerBlock.required_features( i );
         bool supported = false;
@@ -555,10 +569,498 @@ bool ImportExportPBF::loadFile(QString filename)
             return false;
         }
     }
-    m_loadBlock = true;
     return true;
 }
 
+/* Reads the blocks up to the end of the file into aLayer, or only those
+ * starting at offsets, in that order */
+bool ImportExportPBF::readBlocks( Layer* aLayer, QProgressDialog& progress, const QList<qint64>* offsets )
+{
+    /* The blobs are read here and decoded on the thread pool, a few more
+     * than the workers being queued; the features are created here, in file
+     * order, since ways and relations refer to the nodes before them */
+    const int inFlight = QThreadPool::globalInstance()->maxThreadCount() * 2;
+    QList<QFuture<PBFBlockPtr> > pending;
+    QList<qint64> pendingEnd;
+    bool atEnd = false;
+    bool ok = true;
+    int next = 0;
+
+    while (!progress.wasCanceled()) {
+        while (!atEnd && pending.size() < inFlight) {
+            QByteArray raw;
+            if ( offsets && next == offsets->size() ) {
+                atEnd = true;
+                break;
+            }
+            if ( offsets && !m_file.seek( offsets->at( next++ ) ) ) {
+                qCritical() << "failed to seek to block at" << offsets->at( next-1 );
+                ok = false;
+                atEnd = true;
+                break;
+            }
+            /* Only the end of the file before a header is a normal end */
+            bool eof = false;
+            if ( !readBlockHeader( &eof ) ) {
+                if ( offsets || !eof )
+                    ok = false;
+                atEnd = true;
+                break;
+            }
+            if ( m_blockHeader.type() != "OSMData" ) {
+                qCritical() << "invalid block type, found" << m_blockHeader.type().data() << "instead of OSMData";
+                ok = false;
+                atEnd = true;
+                break;
+            }
+            if ( !readBlobData( raw ) ) {
+                ok = false;
+                atEnd = true;
+                break;
+            }
+            pending << QtConcurrent::run(decodeBlock, raw, true);
+            pendingEnd << m_file.pos();
+        }
+        if (pending.isEmpty() || !ok)
+            break;
+
+        PBFBlockPtr block = pending.takeFirst().result();
+        qint64 blockEnd = pendingEnd.takeFirst();
+        if (!block->ok) {
+            ok = false;
+            break;
+        }
+        parseBlock(*block, aLayer);
+
+        progress.setValue(blockEnd);
+        qApp->processEvents();
+    }
+    foreach (QFuture<PBFBlockPtr> f, pending)
+        f.waitForFinished();
+
+    return ok;
+}
+
+static inline void addId( PBFBlockInfo& info, qint64 id )
+{
+    info.minId = qMin( info.minId, id );
+    info.maxId = qMax( info.maxId, id );
+}
+
+static inline void addBox( PBFBlockInfo& info, const CoordBox& B )
+{
+    if ( info.hasBox ) {
+        info.bbox.merge( B );
+    } else {
+        info.bbox = B;
+        info.hasBox = true;
+    }
+}
+
+static inline int cellX( qreal lon )
+{
+    return qBound( 0, int( ( lon + 180. ) / INDEX_CELL_SIZE ), INDEX_GRID_WIDTH - 1 );
+}
+
+static inline int cellY( qreal lat )
+{
+    return qBound( 0, int( ( lat + 90. ) / INDEX_CELL_SIZE ), INDEX_GRID_HEIGHT - 1 );
+}
+
+/* tight is cleared, and cells emptied, once a block covers too many cells */
+static inline void addCell( QSet<quint32>& cells, bool& tight, const Coord& pos )
+{
+    if ( !tight )
+        return;
+    cells.insert( cellY( pos.y() ) * INDEX_GRID_WIDTH + cellX( pos.x() ) );
+    if ( cells.size() > INDEX_MAX_CELLS ) {
+        cells.clear();
+        tight = false;
+    }
+}
+
+/* Those of a block holding members */
+static void addCells( QSet<quint32>& cells, bool& tight, const PBFBlockInfo& from )
+{
+    if ( !tight )
+        return;
+    if ( from.cells.isEmpty() ) {
+        cells.clear();
+        tight = false;
+        return;
+    }
+    foreach ( quint32 c, from.cells ) {
+        cells.insert( c );
+        if ( cells.size() > INDEX_MAX_CELLS ) {
+            cells.clear();
+            tight = false;
+            return;
+        }
+    }
+}
+
+/* Unlike QRectF::intersects, also true for flat boxes such as those of a
+ * single node */
+static bool overlaps( const CoordBox& a, const CoordBox& b )
+{
+    return a.left() <= b.right() && b.left() <= a.right()
+            && a.bottom() <= b.top() && b.bottom() <= a.top();
+}
+
+/* Whether the block may hold features in area */
+static bool inArea( const PBFBlockInfo& info, const CoordBox& area )
+{
+    if ( !info.hasBox )
+        return true;
+    if ( !overlaps( info.bbox, area ) )
+        return false;
+    if ( info.cells.isEmpty() )
+        return true;
+
+    int left = cellX( area.left() );
+    int right = cellX( area.right() );
+    int bottom = cellY( area.bottom() );
+    int top = cellY( area.top() );
+    foreach ( quint32 c, info.cells ) {
+        int x = c % INDEX_GRID_WIDTH;
+        int y = c / INDEX_GRID_WIDTH;
+        if ( left <= x && x <= right && bottom <= y && y <= top )
+            return true;
+    }
+    return false;
+}
+
+/* The index in m_index of the block of blocks holding id, or -1. hint is
+ * the position in blocks of the last one found, tried first. */
+int ImportExportPBF::findBlock( const QVector<int>& blocks, qint64 id, int& hint ) const
+{
+    if ( hint < blocks.size() ) {
+        const PBFBlockInfo& b = m_index[blocks[hint]];
+        if ( b.minId <= id && id <= b.maxId )
+            return blocks[hint];
+    }
+    int lo = 0;
+    int hi = blocks.size();
+    while ( lo < hi ) {
+        int mid = ( lo + hi ) / 2;
+        if ( m_index[blocks[mid]].maxId < id )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if ( lo == blocks.size() || m_index[blocks[lo]].minId > id )
+        return -1;
+    hint = lo;
+    return blocks[lo];
+}
+
+/* Fills info from block and adds it to the index, unless it is empty. The
+ * box and cells of a way or relation block are made of those of the blocks
+ * holding its members, which are already indexed since they come first in
+ * the file.
+ * False if the index cannot describe the block: several types in it, or
+ * ids not following those of the previous block of its type. */
+bool ImportExportPBF::indexBlock( const PBFBlock& block, PBFBlockInfo& info )
+{
+    const OSMPBF::PrimitiveBlock& primitive = block.primitive;
+    int count[3] = { 0, 0, 0 };
+    int nodeHint = 0;
+    int wayHint = 0;
+    info.minId = std::numeric_limits<qint64>::max();
+    info.maxId = std::numeric_limits<qint64>::min();
+    info.hasBox = false;
+    info.cells.clear();
+    QSet<quint32> cells;
+    bool tight = true;
+    /* The member blocks whose cells were added */
+    QSet<int> members;
+
+    for ( int g = 0; g < primitive.primitivegroup_size(); g++ ) {
+        const OSMPBF::PrimitiveGroup& group = primitive.primitivegroup( g );
+        for ( int i = 0; i < group.nodes_size(); i++ ) {
+            const OSMPBF::Node& node = group.nodes( i );
+            Coord pos = blockCoord( primitive, node.lon(), node.lat() );
+            addId( info, node.id() );
+            addBox( info, CoordBox( pos, pos ) );
+            addCell( cells, tight, pos );
+            count[PBFBlockInfo::Nodes]++;
+        }
+        if ( group.has_dense() ) {
+            const OSMPBF::DenseNodes& dense = group.dense();
+            long long id = 0;
+            long long lat = 0;
+            long long lon = 0;
+            for ( int i = 0; i < dense.id_size(); i++ ) {
+                id += dense.id( i );
+                lat += dense.lat( i );
+                lon += dense.lon( i );
+                Coord pos = blockCoord( primitive, lon, lat );
+                addId( info, id );
+                addBox( info, CoordBox( pos, pos ) );
+                addCell( cells, tight, pos );
+                count[PBFBlockInfo::Nodes]++;
+            }
+        }
+        for ( int i = 0; i < group.ways_size(); i++ ) {
+            const OSMPBF::Way& way = group.ways( i );
+            addId( info, way.id() );
+            long long ref = 0;
+            for ( int j = 0; j < way.refs_size(); j++ ) {
+                ref += way.refs( j );
+                int b = findBlock( m_nodeBlocks, ref, nodeHint );
+                if ( b >= 0 && !members.contains( b ) ) {
+                    addBox( info, m_index[b].bbox );
+                    addCells( cells, tight, m_index[b] );
+                    members.insert( b );
+                }
+            }
+            count[PBFBlockInfo::Ways]++;
+        }
+        for ( int i = 0; i < group.relations_size(); i++ ) {
+            const OSMPBF::Relation& relation = group.relations( i );
+            addId( info, relation.id() );
+            long long ref = 0;
+            for ( int j = 0; j < relation.types_size(); j++ ) {
+                ref += relation.memids( j );
+                int b = -1;
+                if ( relation.types( j ) == OSMPBF::Relation::NODE )
+                    b = findBlock( m_nodeBlocks, ref, nodeHint );
+                else if ( relation.types( j ) == OSMPBF::Relation::WAY )
+                    b = findBlock( m_wayBlocks, ref, wayHint );
+                if ( b >= 0 && m_index[b].hasBox && !members.contains( b ) ) {
+                    addBox( info, m_index[b].bbox );
+                    addCells( cells, tight, m_index[b] );
+                    members.insert( b );
+                }
+            }
+            count[PBFBlockInfo::Relations]++;
+        }
+    }
+
+    int kinds = 0;
+    for ( int k = 0; k < 3; k++ )
+        if ( count[k] ) {
+            info.kind = k;
+            kinds++;
+        }
+    if ( !kinds )
+        return true;
+    if ( kinds > 1 ) {
+        qWarning() << "PBF index: a block holds several types of elements";
+        return false;
+    }
+
+    QVector<int>* blocks = 0;
+    if ( info.kind == PBFBlockInfo::Nodes )
+        blocks = &m_nodeBlocks;
+    else if ( info.kind == PBFBlockInfo::Ways )
+        blocks = &m_wayBlocks;
+    if ( blocks ) {
+        if ( !blocks->isEmpty() && m_index[blocks->last()].maxId >= info.minId ) {
+            qWarning() << "PBF index: the blocks are not sorted by id";
+            return false;
+        }
+        *blocks << m_index.size();
+    }
+    if ( tight ) {
+        info.cells.reserve( cells.size() );
+        foreach ( quint32 c, cells )
+            info.cells << c;
+        std::sort( info.cells.begin(), info.cells.end() );
+    }
+    m_index << info;
+    return true;
+}
+
+/* Decodes all the blocks once, without creating anything, on the thread
+ * pool like readBlocks */
+bool ImportExportPBF::buildIndex( QProgressDialog& progress )
+{
+    m_index.clear();
+    m_nodeBlocks.clear();
+    m_wayBlocks.clear();
+    if ( !m_file.seek( m_dataStart ) )
+        return false;
+
+    const int inFlight = QThreadPool::globalInstance()->maxThreadCount() * 2;
+    QList<QFuture<PBFBlockPtr> > pending;
+    QList<qint64> pendingOffset;
+    bool atEnd = false;
+    bool ok = true;
+
+    while (!progress.wasCanceled()) {
+        while (!atEnd && pending.size() < inFlight) {
+            qint64 offset = m_file.pos();
+            QByteArray raw;
+            bool eof = false;
+            if ( !readBlockHeader( &eof ) ) {
+                if ( !eof )
+                    ok = false;
+                atEnd = true;
+                break;
+            }
+            if ( m_blockHeader.type() != "OSMData" || !readBlobData( raw ) ) {
+                ok = false;
+                atEnd = true;
+                break;
+            }
+            pending << QtConcurrent::run(decodeBlock, raw, false);
+            pendingOffset << offset;
+        }
+        if (pending.isEmpty())
+            break;
+
+        PBFBlockPtr block = pending.takeFirst().result();
+        PBFBlockInfo info;
+        info.offset = pendingOffset.takeFirst();
+        if ( !block->ok || !indexBlock( *block, info ) ) {
+            ok = false;
+            break;
+        }
+
+        progress.setValue(info.offset);
+        qApp->processEvents();
+    }
+    foreach (QFuture<PBFBlockPtr> f, pending)
+        f.waitForFinished();
+
+    return ok && !progress.wasCanceled();
+}
+
+bool ImportExportPBF::saveIndex( const QString& filename, bool usable ) const
+{
+    QFile f( filename );
+    if ( !f.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+        return false;
+
+    QFileInfo fi( FileName );
+    QDataStream out( &f );
+    out.setVersion( QDataStream::Qt_4_6 );
+    out << (quint32)INDEX_MAGIC << (quint32)INDEX_VERSION
+        << (qint64)fi.size() << fi.lastModified() << m_dataStart << usable;
+    if ( usable ) {
+        out << (quint32)m_index.size();
+        foreach ( const PBFBlockInfo& b, m_index )
+            out << b.offset << (qint32)b.kind << b.minId << b.maxId << b.hasBox
+                << b.bbox.left() << b.bbox.bottom() << b.bbox.right() << b.bbox.top() << b.cells;
+    }
+    return out.status() == QDataStream::Ok;
+}
+
+/* Reads the sidecar index, or builds and saves it if it is missing or does
+ * not match the file. False if the file cannot be indexed. */
+bool ImportExportPBF::loadIndex( QProgressDialog& progress )
+{
+    const QString indexName = FileName + ".idx";
+    QFileInfo fi( FileName );
+
+    QFile f( indexName );
+    if ( f.open( QIODevice::ReadOnly ) ) {
+        QDataStream in( &f );
+        in.setVersion( QDataStream::Qt_4_6 );
+        quint32 magic = 0, version = 0;
+        qint64 size = 0, dataStart = 0;
+        QDateTime modified;
+        bool usable = false;
+        in >> magic >> version >> size >> modified >> dataStart >> usable;
+        if ( in.status() == QDataStream::Ok && magic == INDEX_MAGIC && version == INDEX_VERSION
+                && size == fi.size() && modified == fi.lastModified() && dataStart == m_dataStart ) {
+            if ( !usable )
+                return false;
+
+            quint32 count = 0;
+            in >> count;
+            m_index.resize( count );
+            m_nodeBlocks.clear();
+            m_wayBlocks.clear();
+            for ( int i = 0; i < m_index.size() && in.status() == QDataStream::Ok; i++ ) {
+                PBFBlockInfo& b = m_index[i];
+                qint32 kind;
+                qreal left, bottom, right, top;
+                in >> b.offset >> kind >> b.minId >> b.maxId >> b.hasBox >> left >> bottom >> right >> top >> b.cells;
+                b.kind = kind;
+                b.bbox = CoordBox( Coord( left, bottom ), Coord( right, top ) );
+                if ( b.kind == PBFBlockInfo::Nodes )
+                    m_nodeBlocks << i;
+                else if ( b.kind == PBFBlockInfo::Ways )
+                    m_wayBlocks << i;
+            }
+            if ( in.status() == QDataStream::Ok )
+                return true;
+        }
+        f.close();
+    }
+
+    progress.setLabelText( QApplication::tr( "Indexing..." ) );
+    bool ok = buildIndex( progress );
+    if ( ( ok || !progress.wasCanceled() ) && !saveIndex( indexName, ok ) )
+        qWarning() << "PBF index could not be written to" << indexName;
+    progress.setLabelText( QApplication::tr( "Importing..." ) );
+    return ok;
+}
+
+/* Only reads the blocks that may hold features in the area of theFilter. A
+ * scan of them finds the ways and relations kept; the load reads them again
+ * with the way blocks holding the ways of the relations kept, and the node
+ * blocks holding the nodes these refer to. */
+bool ImportExportPBF::importRegion( Layer* aLayer, QProgressDialog& progress )
+{
+    QList<int> blocks;
+    for ( int i = 0; i < m_index.size(); i++ )
+        if ( inArea( m_index[i], theFilter->area() ) )
+            blocks << i;
+
+    QList<qint64> offsets;
+    foreach ( int i, blocks )
+        offsets << m_index[i].offset;
+    theFilter->beginScan();
+    progress.setLabelText( QApplication::tr( "Selecting features..." ) );
+    if ( !readBlocks( aLayer, progress, &offsets ) || progress.wasCanceled() )
+        return false;
+
+    QSet<int> selected = blocks.toSet();
+    int hint = 0;
+    if ( theFilter->hasMemberWays() ) {
+        /* The ways of the relations kept, outside of the area or not kept
+         * for themselves: their blocks are scanned for their nodes */
+        QList<qint64> ways = theFilter->memberWays().toList();
+        std::sort( ways.begin(), ways.end() );
+        QSet<int> wayBlocks;
+        foreach ( qint64 id, ways ) {
+            int b = findBlock( m_wayBlocks, id, hint );
+            if ( b >= 0 )
+                wayBlocks.insert( b );
+        }
+        QList<int> scan = wayBlocks.toList();
+        std::sort( scan.begin(), scan.end() );
+        offsets.clear();
+        foreach ( int i, scan )
+            offsets << m_index[i].offset;
+        theFilter->beginWayScan();
+        if ( !readBlocks( aLayer, progress, &offsets ) || progress.wasCanceled() )
+            return false;
+        selected.unite( wayBlocks );
+    }
+
+    QList<qint64> needed = theFilter->neededNodes().toList();
+    std::sort( needed.begin(), needed.end() );
+    hint = 0;
+    foreach ( qint64 id, needed ) {
+        int b = findBlock( m_nodeBlocks, id, hint );
+        if ( b >= 0 )
+            selected.insert( b );
+    }
+    blocks = selected.toList();
+    std::sort( blocks.begin(), blocks.end() );
+
+    offsets.clear();
+    foreach ( int i, blocks )
+        offsets << m_index[i].offset;
+    theFilter->beginLoad();
+    progress.setLabelText( QApplication::tr( "Importing..." ) );
+    return readBlocks( aLayer, progress, &offsets );
+}
+
 // import the  input
 bool ImportExportPBF::import(Layer* aLayer)
 {
@@ -567,36 +1069,363 @@ bool ImportExportPBF::import(Layer* aLayer)
     progress.setRange(0, m_file.size());
     progress.show();
 
-    while (true && !progress.wasCanceled()) {
-        if ( m_loadBlock ) {
-            if ( !readNextBlock() )
-                break;
-            loadBlock();
-            loadGroup();
+    bool ok = true;
+    if ( theFilter && theFilter->hasArea() ) {
+        if ( loadIndex( progress ) ) {
+            ok = importRegion( aLayer, progress );
+            progress.reset();
+            return ok;
+        }
+        if ( progress.wasCanceled() )
+            return false;
+        ok = m_file.seek( m_dataStart );
+    }
+    if ( ok && theFilter && theFilter->keepReferences() ) {
+        /* A first pass finds the ways and relations kept, so that the
+         * second one also keeps their nodes */
+        theFilter->beginScan();
+        progress.setLabelText(QApplication::tr("Selecting features..."));
+        ok = readBlocks( aLayer, progress ) && !progress.wasCanceled() && m_file.seek( m_dataStart );
+        /* The ways of the relations kept were passed before the relations:
+         * read them again for their nodes */
+        if ( ok && theFilter->hasMemberWays() ) {
+            theFilter->beginWayScan();
+            ok = readBlocks( aLayer, progress ) && !progress.wasCanceled() && m_file.seek( m_dataStart );
         }
+        progress.setLabelText(QApplication::tr("Importing..."));
+    }
+    if ( theFilter )
+        theFilter->beginLoad();
+    if ( ok )
+        ok = readBlocks( aLayer, progress );
+    progress.reset();
 
-        switch ( m_mode ) {
-        case ModeNode:
-            parseNode( aLayer );
-            break;
-        case ModeWay:
-            parseWay( aLayer );
-            break;
-        case ModeRelation:
-            parseRelation( aLayer );
-            break;
-        case ModeDense:
-            parseDense( aLayer );
+    return ok;
+}
+
+/***************************************************/
+/* Export */
+
+/* Features of one type, written as one PrimitiveBlock */
+struct PBFSlice
+{
+    enum Kind { Nodes, Ways, Relations };
+
+    Kind kind;
+    QVector<Feature*> features;
+};
+
+/* The string table of a block being written */
+class PBFStrings
+{
+public:
+    PBFStrings(OSMPBF::StringTable* aTable)
+        : theTable(aTable)
+    {
+        theTable->add_s( std::string() );   // 0 is the delimiter
+    }
+
+    int id( const QString& s )
+    {
+        QHash<QString, int>::const_iterator it = theIds.constFind( s );
+        if ( it != theIds.constEnd() )
+            return it.value();
+        int i = theTable->s_size();
+        QByteArray utf8 = s.toUtf8();
+        theTable->add_s( std::string( utf8.constData(), utf8.size() ) );
+        theIds.insert( s, i );
+        return i;
+    }
+
+private:
+    OSMPBF::StringTable* theTable;
+    QHash<QString, int> theIds;
+};
+
+static bool byId( const Feature* a, const Feature* b )
+{
+    return a->id().numId < b->id().numId;
+}
+
+static long long toUnits( qreal deg )
+{
+    return qRound64( deg * NANO / EXPORT_GRANULARITY );
+}
+
+/* Merkaartor's own _key_ tags are not written, as in a strict XML export */
+template<class T>
+static void addTags( T* out, const Feature* F, PBFStrings& S )
+{
+    for ( int i = 0; i < F->tagSize(); i++ ) {
+        const QString& key = F->tagKey( i );
+        if ( key.startsWith( '_' ) && key.endsWith( '_' ) )
+            continue;
+        out->add_keys( S.id( key ) );
+        out->add_vals( S.id( F->tagValue( i ) ) );
+    }
+}
+
+template<class T>
+static void addInfo( T* out, const Feature* F, PBFStrings& S )
+{
+#ifndef FRISIUS_BUILD
+    OSMPBF::Info* info = out->mutable_info();
+    info->set_version( F->versionNumber() );
+    if ( F->time().isValid() )
+        info->set_timestamp( F->time().toTime_t() );
+    info->set_user_sid( S.id( F->user() ) );
+#else
+    Q_UNUSED( out );
+    Q_UNUSED( F );
+    Q_UNUSED( S );
+#endif
+}
+
+static void encodeNodes( const QVector<Feature*>& features, OSMPBF::PrimitiveBlock& block, PBFStrings& S )
+{
+    OSMPBF::DenseNodes* dense = block.add_primitivegroup()->mutable_dense();
+#ifndef FRISIUS_BUILD
+    OSMPBF::DenseInfo* info = dense->mutable_denseinfo();
+    long long lastTimestamp = 0;
+    long long lastUserSid = 0;
+#endif
+    long long lastID = 0;
+    long long lastLatitude = 0;
+    long long lastLongitude = 0;
+
+    foreach ( Feature* F, features ) {
+        const Node* N = STATIC_CAST_NODE( F );
+        long long id = N->id().numId;
+        long long lat = toUnits( N->position().y() );
+        long long lon = toUnits( N->position().x() );
+        dense->add_id( id - lastID );
+        dense->add_lat( lat - lastLatitude );
+        dense->add_lon( lon - lastLongitude );
+        lastID = id;
+        lastLatitude = lat;
+        lastLongitude = lon;
+
+#ifndef FRISIUS_BUILD
+        long long timestamp = N->time().isValid() ? N->time().toTime_t() : 0;
+        long long userSid = S.id( N->user() );
+        info->add_version( N->versionNumber() );
+        info->add_timestamp( timestamp - lastTimestamp );
+        info->add_changeset( 0 );
+        info->add_uid( 0 );
+        info->add_user_sid( userSid - lastUserSid );
+        lastTimestamp = timestamp;
+        lastUserSid = userSid;
+#endif
+
+        for ( int i = 0; i < N->tagSize(); i++ ) {
+            const QString& key = N->tagKey( i );
+            if ( key.startsWith( '_' ) && key.endsWith( '_' ) )
+                continue;
+            dense->add_keys_vals( S.id( key ) );
+            dense->add_keys_vals( S.id( N->tagValue( i ) ) );
+        }
+        dense->add_keys_vals( 0 );
+    }
+}
+
+static void encodeWays( const QVector<Feature*>& features, OSMPBF::PrimitiveBlock& block, PBFStrings& S )
+{
+    OSMPBF::PrimitiveGroup* group = block.add_primitivegroup();
+    foreach ( Feature* F, features ) {
+        const Way* W = STATIC_CAST_WAY( F );
+        OSMPBF::Way* outputWay = group->add_ways();
+        outputWay->set_id( W->id().numId );
+        addTags( outputWay, W, S );
+        addInfo( outputWay, W, S );
+
+        /* Same nodes as in the XML export: no virtual nodes, no repeats */
+        long long lastRef = 0;
+        for ( int i = 0; i < W->size(); i++ ) {
+            const Node* N = W->getNode( i );
+            if ( i && ( N->isVirtual() || N->id().numId == W->getNode( i - 1 )->id().numId ) )
+                continue;
+            outputWay->add_refs( N->id().numId - lastRef );
+            lastRef = N->id().numId;
+        }
+    }
+}
+
+static void encodeRelations( const QVector<Feature*>& features, OSMPBF::PrimitiveBlock& block, PBFStrings& S )
+{
+    OSMPBF::PrimitiveGroup* group = block.add_primitivegroup();
+    foreach ( Feature* F, features ) {
+        const Relation* R = STATIC_CAST_RELATION( F );
+        OSMPBF::Relation* outputRelation = group->add_relations();
+        outputRelation->set_id( R->id().numId );
+        addTags( outputRelation, R, S );
+        addInfo( outputRelation, R, S );
+
+        long long lastRef = 0;
+        for ( int i = 0; i < R->size(); i++ ) {
+            const Feature* M = R->get( i );
+            if ( CHECK_WAY( M ) )
+                outputRelation->add_types( OSMPBF::Relation::WAY );
+            else if ( CHECK_RELATION( M ) )
+                outputRelation->add_types( OSMPBF::Relation::RELATION );
+            else
+                outputRelation->add_types( OSMPBF::Relation::NODE );
+            outputRelation->add_roles_sid( S.id( R->getRole( i ) ) );
+            outputRelation->add_memids( M->id().numId - lastRef );
+            lastRef = M->id().numId;
+        }
+    }
+}
+
+/* A fileblock: the size of its header, the header and the deflated blob.
+ * Empty on error. */
+static QByteArray packBlob( const std::string& data, const char* type )
+{
+    uLongf size = compressBound( data.size() );
+    QByteArray deflated( size, Qt::Uninitialized );
+    if ( compress2( ( Bytef* ) deflated.data(), &size, ( const Bytef* ) data.data(), data.size(), Z_DEFAULT_COMPRESSION ) != Z_OK ) {
+        qCritical() << "failed to deflate block";
+        return QByteArray();
+    }
+
+    OSMPBF::Blob blob;
+    blob.set_raw_size( data.size() );
+    blob.set_zlib_data( std::string( deflated.constData(), size ) );
+    std::string blobData;
+    blob.SerializeToString( &blobData );
+    if ( blobData.size() > ( size_t ) MAX_BLOB_SIZE ) {
+        qCritical() << "block too large:" << blobData.size();
+        return QByteArray();
+    }
+
+    OSMPBF::BlobHeader header;
+    header.set_type( type );
+    header.set_datasize( blobData.size() );
+    std::string headerData;
+    header.SerializeToString( &headerData );
+
+    QByteArray out;
+    out.reserve( 4 + headerData.size() + blobData.size() );
+    uchar sizeData[4];
+    qToBigEndian<quint32>( headerData.size(), sizeData );
+    out.append( ( const char* ) sizeData, 4 );
+    out.append( headerData.data(), headerData.size() );
+    out.append( blobData.data(), blobData.size() );
+    return out;
+}
+
+/* Runs on the thread pool: the features are only read */
+static QByteArray encodeSlice( const PBFSlice& slice )
+{
+    OSMPBF::PrimitiveBlock block;
+    block.set_granularity( EXPORT_GRANULARITY );
+    PBFStrings S( block.mutable_stringtable() );
+    switch ( slice.kind ) {
+    case PBFSlice::Nodes:
+        encodeNodes( slice.features, block, S );
+        break;
+    case PBFSlice::Ways:
+        encodeWays( slice.features, block, S );
+        break;
+    case PBFSlice::Relations:
+        encodeRelations( slice.features, block, S );
+        break;
+    }
+
+    std::string data;
+    block.SerializeToString( &data );
+    return packBlob( data, "OSMData" );
+}
+
+static void addSlices( QList<PBFSlice>& slices, PBFSlice::Kind kind, const QVector<Feature*>& features )
+{
+    for ( int i = 0; i < features.size(); i += EXPORT_BLOCK_ENTITIES ) {
+        PBFSlice slice;
+        slice.kind = kind;
+        slice.features = features.mid( i, EXPORT_BLOCK_ENTITIES );
+        slices << slice;
+    }
+}
+
+// export
+bool ImportExportPBF::export_(const QList<Feature *>& featList)
+{
+    if ( !Device || !Device->isOpen() )
+        return false;
+
+    /* Nodes, ways then relations, each by id */
+    QVector<Feature*> nodes, ways, relations;
+    CoordBox bbox;
+    foreach ( Feature* F, featList ) {
+        if ( F->isDeleted() || F->isVirtual() )
+            continue;
+        if ( CHECK_NODE( F ) ) {
+            if ( nodes.isEmpty() )
+                bbox = F->boundingBox();
+            else
+                bbox.merge( F->boundingBox() );
+            nodes << F;
+        } else if ( CHECK_WAY( F ) )
+            ways << F;
+        else if ( CHECK_RELATION( F ) )
+            relations << F;
+    }
+    std::sort( nodes.begin(), nodes.end(), byId );
+    std::sort( ways.begin(), ways.end(), byId );
+    std::sort( relations.begin(), relations.end(), byId );
+
+    OSMPBF::HeaderBlock header;
+    header.add_required_features( "OsmSchema-V0.6" );
+    header.add_required_features( "DenseNodes" );
+    header.add_optional_features( "Sort.Type_then_ID" );
+    header.set_writingprogram( QString( "%1 %2" ).arg( qApp->applicationName() ).arg( STRINGIFY( VERSION ) ).toUtf8().constData() );
+    if ( !nodes.isEmpty() ) {
+        /* Always in nanodegrees */
+        OSMPBF::HeaderBBox* box = header.mutable_bbox();
+        box->set_left( qRound64( bbox.left() * NANO ) );
+        box->set_right( qRound64( bbox.right() * NANO ) );
+        box->set_top( qRound64( bbox.top() * NANO ) );
+        box->set_bottom( qRound64( bbox.bottom() * NANO ) );
+    }
+    std::string headerData;
+    header.SerializeToString( &headerData );
+    QByteArray headerBlob = packBlob( headerData, "OSMHeader" );
+    if ( headerBlob.isEmpty() || Device->write( headerBlob ) != headerBlob.size() )
+        return false;
+
+    QList<PBFSlice> slices;
+    addSlices( slices, PBFSlice::Nodes, nodes );
+    addSlices( slices, PBFSlice::Ways, ways );
+    addSlices( slices, PBFSlice::Relations, relations );
+
+    QProgressDialog progress(QApplication::tr("Exporting..."), QApplication::tr("Cancel"), 0, slices.size());
+    progress.setWindowModality(Qt::WindowModal);
+    progress.show();
+
+    /* Encoded and deflated on the thread pool, written here in order */
+    const int inFlight = QThreadPool::globalInstance()->maxThreadCount() * 2;
+    QList<QFuture<QByteArray> > pending;
+    int next = 0;
+    bool ok = true;
+    for ( int done = 0; done < slices.size(); done++ ) {
+        while ( next < slices.size() && pending.size() < inFlight )
+            pending << QtConcurrent::run( encodeSlice, slices.at( next++ ) );
+
+        QByteArray data = pending.takeFirst().result();
+        if ( data.isEmpty() || Device->write( data ) != data.size() ) {
+            qCritical() << "failed to write block" << done << Device->errorString();
+            ok = false;
             break;
         }
-        progress.setValue(m_file.pos());
+        progress.setValue( done + 1 );
         qApp->processEvents();
-//#ifndef NDEBUG
-//        if (aLayer->size() > 1000000)
-//            break;
-//#endif
+        if ( progress.wasCanceled() ) {
+            ok = false;
+            break;
+        }
     }
+    foreach ( QFuture<QByteArray> f, pending )
+        f.waitForFinished();
     progress.reset();
 
-    return true;
+    return ok;
 }
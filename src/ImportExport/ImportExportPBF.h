@@ -13,21 +13,39 @@
 #define ImportExportPBF_H
 
 #include "IImportExport.h"
+#include "ImportFilter.h"
 
 #include "fileformat.pb.h"
 #include "osmformat.pb.h"
 
 class QDomDocument;
+class QProgressDialog;
+struct PBFBlock;
+
+/* What the sidecar index knows of a block */
+struct PBFBlockInfo
+{
+    enum Kind { Nodes, Ways, Relations };
+
+    qint64 offset;      /* of its BlobHeader */
+    int kind;
+    /* Of the elements it holds */
+    qint64 minId;
+    qint64 maxId;
+    /* Covers its nodes; for ways and relations, the node and way blocks of
+     * their members. Without one, the block is always read. */
+    bool hasBox;
+    CoordBox bbox;
+    /* The cells of the index grid it covers, sorted, which are tighter than
+     * the box of blocks of scattered nodes. Empty if there are too many. */
+    QVector<quint32> cells;
+};
+
 /**
     @author cbro <cbro@semperpax.com>
 */
 class ImportExportPBF : public IImportExport
 {
-protected:
-    enum Mode {
-        ModeNode, ModeWay, ModeRelation, ModeDense
-    };
-
 public:
     ImportExportPBF(Document* doc);
 
@@ -43,52 +61,46 @@ public:
 
 protected:
     OSMPBF::BlobHeader m_blockHeader;
-    OSMPBF::Blob m_blob;
-
     OSMPBF::HeaderBlock m_headerBlock;
-    OSMPBF::PrimitiveBlock m_primitiveBlock;
-
-    int m_currentGroup;
-    int m_currentEntity;
-    bool m_loadBlock;
-
-    Mode m_mode;
-
-    QHash< QString, int > m_nodeTags;
-    QHash< QString, int > m_wayTags;
-    QHash< QString, int > m_relationTags;
-
-    std::vector< int > m_nodeTagIDs;
-    std::vector< int > m_wayTagIDs;
-    std::vector< int > m_relationTagIDs;
-
-    long long m_lastDenseID;
-    long long m_lastDenseLatitude;
-    long long m_lastDenseLongitude;
-    long long m_lastDenseTimestamp;
-    long long m_lastDenseChangeset;
-    long long m_lastDenseUId;
-    long long m_lastDenseUserSid;
-    int m_lastDenseTag;
 
     QFile m_file;
     QByteArray m_buffer;
-    QByteArray m_bzip2Buffer;
+    /* Where the blocks after the header start */
+    qint64 m_dataStart;
+
+    /* The blocks of the file, when it has been indexed; m_nodeBlocks and
+     * m_wayBlocks are their indices in m_index, by increasing ids */
+    QVector<PBFBlockInfo> m_index;
+    QVector<int> m_nodeBlocks;
+    QVector<int> m_wayBlocks;
+
+    /* What theFilter is given about an element */
+    ImportFilter::Tags m_tags;
+    QVector<qint64> m_refs;
+    QVector<IFeature::FId> m_members;
 
 protected:
-    void loadGroup();
-    void loadBlock();
-    bool readNextBlock();
-    bool readBlockHeader();
-    bool readBlob();
-    bool unpackZlib();
-    bool unpackBzip2();
-    bool unpackLzma();
-
-    void parseNode( Layer* aLayer );
-    void parseWay( Layer* aLayer );
-    void parseRelation( Layer* aLayer );
-    void parseDense( Layer* aLayer );
+    /* eof is set if the file ends cleanly before the header */
+    bool readBlockHeader( bool* eof = 0 );
+    bool readBlobData(QByteArray& data);
+    /* Reads the blocks up to the end of the file, or only those starting
+     * at offsets */
+    bool readBlocks( Layer* aLayer, QProgressDialog& progress, const QList<qint64>* offsets = 0 );
+
+    /* Region import through the sidecar index (filename.idx) */
+    bool loadIndex( QProgressDialog& progress );
+    bool buildIndex( QProgressDialog& progress );
+    bool indexBlock( const PBFBlock& block, PBFBlockInfo& info );
+    bool saveIndex( const QString& filename, bool usable ) const;
+    int findBlock( const QVector<int>& blocks, qint64 id, int& hint ) const;
+    bool importRegion( Layer* aLayer, QProgressDialog& progress );
+
+    /* Materialization of a decoded block, on the calling thread */
+    void parseBlock( const PBFBlock& block, Layer* aLayer );
+    void parseNode( const PBFBlock& block, const OSMPBF::Node& inputNode, Layer* aLayer );
+    void parseWay( const PBFBlock& block, const OSMPBF::Way& inputWay, Layer* aLayer );
+    void parseRelation( const PBFBlock& block, const OSMPBF::Relation& inputRelation, Layer* aLayer );
+    void parseDense( const PBFBlock& block, const OSMPBF::DenseNodes& dense, Layer* aLayer );
 };
 
 #endif
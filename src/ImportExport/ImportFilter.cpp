@@ -0,0 +1,350 @@
+//
+// C++ Implementation: ImportFilter
+//
+// Description: Area and tag filter of OSM imports.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#include "ImportFilter.h"
+
+#include "Features.h"
+#include "TagSelector.h"
+
+#include <QFile>
+#include <QPainterPath>
+#include <QStringList>
+#include <QTextStream>
+
+/* The interned tags of an element being parsed, seen as a feature by the
+   selector: the program reads the (key, value) id pairs directly, without
+   creating a feature or touching the global tag list. */
+class ImportTags : public IFeature
+{
+public:
+    ImportTags(int aType, const ImportFilter::Tags& aTags)
+        : theType(aType), theTags(aTags), theId(aType, 0) {}
+
+    char getType() const { return theType; }
+    QString xmlId() const { return QString(); }
+#ifndef FRISIUS_BUILD
+    const QDateTime time() const { return QDateTime(); }
+    int versionNumber() const { return 0; }
+    const QString& user() const { static const QString None; return None; }
+#endif
+
+    int sizeParents() const { return 0; }
+    IFeature* getParent(int) { return 0; }
+    const IFeature* getParent(int) const { return 0; }
+    bool hasPainter(qreal) const { return false; }
+    const IFeature::FId& id() const { return theId; }
+    bool isDeleted() const { return false; }
+
+    int tagSize() const { return theTags.size(); }
+    int findKey(const QString& k) const
+    {
+        for (int i = 0; i < theTags.size(); ++i)
+            if (g_getTagKey(theTags[i].first) == k)
+                return i;
+        return theTags.size();
+    }
+    QString tagValue(int i) const { return g_getTagValue(theTags[i].second); }
+    QString tagValue(const QString& k, const QString& Default) const
+    {
+        int i = findKey(k);
+        return i < theTags.size() ? tagValue(i) : Default;
+    }
+    QString tagKey(int i) const { return g_getTagKey(theTags[i].first); }
+    quint32 tagKeyId(int i) const { return theTags[i].first; }
+    quint32 tagValueId(int i) const { return theTags[i].second; }
+
+    bool isUploaded() const { return false; }
+    bool isDirty() const { return false; }
+    bool isVisible() { return true; }
+    bool isReadonly() { return false; }
+    const QPainterPath& getPath() const { static const QPainterPath None; return None; }
+
+private:
+    char theType;
+    const ImportFilter::Tags& theTags;
+    IFeature::FId theId;
+};
+
+ImportFilter::ImportFilter()
+    : HasArea(false), theSelector(0), KeepReferences(false), Scanning(false), ScanningWays(false), Scanned(false)
+{
+}
+
+ImportFilter::~ImportFilter()
+{
+    delete theSelector;
+}
+
+void ImportFilter::setArea(const CoordBox& aBox)
+{
+    HasArea = true;
+    theBox = aBox;
+    theOuters.clear();
+    theHoles.clear();
+}
+
+void ImportFilter::setArea(const QList<QPolygonF>& Outers, const QList<QPolygonF>& Holes)
+{
+    QRectF r;
+    foreach (const QPolygonF& P, Outers)
+        r |= P.boundingRect();
+
+    HasArea = true;
+    theBox = CoordBox(Coord(r.topLeft()), Coord(r.bottomRight()));
+    theOuters = Outers;
+    theHoles = Holes;
+}
+
+/* A name line, then rings of "lon lat" lines each closed by END, holes
+ * having their name starting with '!'; the file ends with END */
+bool ImportFilter::loadPoly(const QString& filename)
+{
+    QFile f(filename);
+    if (!f.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        theError = QString("%1 could not be opened.").arg(filename);
+        return false;
+    }
+
+    QList<QPolygonF> Outers;
+    QList<QPolygonF> Holes;
+    QTextStream in(&f);
+    in.readLine();
+    for (;;) {
+        QString ring = in.readLine().trimmed();
+        if (ring.isNull()) {
+            theError = QString("%1: unexpected end of file").arg(filename);
+            return false;
+        }
+        if (ring == "END")
+            break;
+
+        QPolygonF P;
+        for (;;) {
+            QString line = in.readLine().simplified();
+            if (line.isNull()) {
+                theError = QString("%1: unexpected end of file").arg(filename);
+                return false;
+            }
+            if (line == "END")
+                break;
+            QStringList c = line.split(' ');
+            bool okLon = false, okLat = false;
+            qreal lon = c[0].toDouble(&okLon);
+            qreal lat = c.size() == 2 ? c[1].toDouble(&okLat) : 0.;
+            if (!okLon || !okLat) {
+                theError = QString("%1: invalid coordinates: %2").arg(filename).arg(line);
+                return false;
+            }
+            P << QPointF(lon, lat);
+        }
+        if (ring.startsWith('!'))
+            Holes << P;
+        else
+            Outers << P;
+    }
+    if (Outers.isEmpty()) {
+        theError = QString("%1 does not contain an area").arg(filename);
+        return false;
+    }
+    setArea(Outers, Holes);
+    return true;
+}
+
+bool ImportFilter::setSelector(const QString& anExpression)
+{
+    delete theSelector;
+    theSelector = TagSelector::parse(anExpression);
+    if (!theSelector) {
+        theError = QString("Invalid tag selector: %1").arg(anExpression);
+        return false;
+    }
+    return true;
+}
+
+void ImportFilter::setKeepReferences(bool b)
+{
+    KeepReferences = b;
+}
+
+void ImportFilter::beginScan()
+{
+    Scanning = true;
+    ScanningWays = false;
+    Scanned = false;
+    theNodesInArea.clear();
+    theWaysInArea.clear();
+    theRelationsInArea.clear();
+    theWays.clear();
+    theRelations.clear();
+    theNeededNodes.clear();
+    theMemberWays.clear();
+}
+
+void ImportFilter::beginWayScan()
+{
+    ScanningWays = true;
+}
+
+void ImportFilter::beginLoad()
+{
+    /* After a scan, the ways and relations are known: only the nodes are
+     * still decided here */
+    Scanned = Scanning;
+    Scanning = false;
+    ScanningWays = false;
+    theNodesInArea.clear();
+    theWaysInArea.clear();
+    theRelationsInArea.clear();
+    theMemberWays.clear();
+}
+
+bool ImportFilter::inArea(const Coord& C) const
+{
+    if (!HasArea)
+        return true;
+    if (!theBox.contains(C))
+        return false;
+    if (theOuters.isEmpty())
+        return true;
+
+    bool inside = false;
+    foreach (const QPolygonF& P, theOuters)
+        if (P.containsPoint(C, Qt::OddEvenFill)) {
+            inside = true;
+            break;
+        }
+    if (!inside)
+        return false;
+    foreach (const QPolygonF& P, theHoles)
+        if (P.containsPoint(C, Qt::OddEvenFill))
+            return false;
+    return true;
+}
+
+bool ImportFilter::matches(int aType, const Tags& T) const
+{
+    if (!theSelector)
+        return true;
+
+    ImportTags Probe(aType, T);
+    return theSelector->matches(&Probe, 0.) != TagSelect_NoMatch;
+}
+
+bool ImportFilter::matches(const Feature* F) const
+{
+    return !theSelector || theSelector->matches(F, 0.) != TagSelect_NoMatch;
+}
+
+bool ImportFilter::acceptNode(qint64 id, const Coord& C, const Tags& T)
+{
+    if (ScanningWays)
+        return false;
+
+    bool keep = false;
+    if (inArea(C)) {
+        if (HasArea && !Scanned)
+            theNodesInArea.insert(id);
+        keep = matches(IFeature::Point, T);
+    }
+    if (!keep)
+        keep = theNeededNodes.contains(id);
+    return keep && !Scanning;
+}
+
+bool ImportFilter::acceptWay(qint64 id, const QVector<qint64>& Refs, const Tags& T)
+{
+    if (ScanningWays) {
+        if (theMemberWays.contains(id))
+            for (int i=0; i<Refs.size(); ++i)
+                theNeededNodes.insert(Refs[i]);
+        return false;
+    }
+    if (Scanned)
+        return theWays.contains(id);
+
+    bool keep = true;
+    if (HasArea) {
+        keep = false;
+        for (int i=0; i<Refs.size() && !keep; ++i)
+            keep = theNodesInArea.contains(Refs[i]);
+        if (keep)
+            theWaysInArea.insert(id);
+    }
+    if (keep)
+        keep = matches(IFeature::LineString, T);
+    if (!keep)
+        return false;
+
+    theWays.insert(id);
+    if (Scanning)
+        for (int i=0; i<Refs.size(); ++i)
+            theNeededNodes.insert(Refs[i]);
+    return !Scanning;
+}
+
+bool ImportFilter::acceptRelation(qint64 id, const QVector<IFeature::FId>& Members, const Tags& T)
+{
+    if (ScanningWays)
+        return false;
+    if (Scanned)
+        return theRelations.contains(id);
+
+    bool keep = true;
+    if (HasArea) {
+        keep = false;
+        for (int i=0; i<Members.size() && !keep; ++i) {
+            const IFeature::FId& M = Members[i];
+            if (M.type & IFeature::Point)
+                keep = theNodesInArea.contains(M.numId);
+            else if (M.type & IFeature::LineString)
+                keep = theWaysInArea.contains(M.numId);
+            else if (M.type & IFeature::OsmRelation)
+                keep = theRelationsInArea.contains(M.numId);
+        }
+        if (keep)
+            theRelationsInArea.insert(id);
+    }
+    if (keep)
+        keep = matches(IFeature::OsmRelation, T);
+    if (!keep)
+        return false;
+
+    theRelations.insert(id);
+    /* The ways of a relation are only known as ids by now: those not kept
+     * for themselves are kept too, their nodes found by a scan of the ways */
+    if (Scanning)
+        for (int i=0; i<Members.size(); ++i) {
+            const IFeature::FId& M = Members[i];
+            if (M.type & IFeature::Point)
+                theNeededNodes.insert(M.numId);
+            else if ((M.type & IFeature::LineString) && !theWays.contains(M.numId)) {
+                theWays.insert(M.numId);
+                theMemberWays.insert(M.numId);
+            }
+        }
+    return !Scanning;
+}
+
+bool ImportFilter::accept(const Feature* F) const
+{
+    if (!matches(F))
+        return false;
+    if (!HasArea)
+        return true;
+
+    if (const Node* N = dynamic_cast<const Node*>(F))
+        return inArea(N->position());
+    if (const Way* W = dynamic_cast<const Way*>(F)) {
+        for (int i=0; i<W->size(); ++i)
+            if (inArea(W->getNode(i)->position()))
+                return true;
+        return false;
+    }
+    return theBox.intersects(F->boundingBox());
+}
@@ -0,0 +1,123 @@
+//
+// C++ Interface: ImportFilter
+//
+// Description: Area and tag filter of OSM imports, applied while the input
+//              is parsed so that only the features kept are created.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#ifndef IMPORTFILTER_H
+#define IMPORTFILTER_H
+
+#include <QList>
+#include <QPair>
+#include <QPolygonF>
+#include <QSet>
+#include <QString>
+#include <QVector>
+
+#include "Coord.h"
+#include "IFeature.h"
+
+class Feature;
+class TagSelector;
+
+/**
+ * Decides which elements of an import are kept before they are created:
+ *  - a node if it is inside the area and matches the selector;
+ *  - a way if it matches and one of its nodes is inside the area;
+ *  - a relation if it matches and one of its members is inside the area
+ *    (a node, a way with a node or a relation with a member inside it).
+ * The elements are expected in the order of OSM files: nodes, ways, then
+ * relations.
+ *
+ * In one pass, the nodes of a kept way and the members of a kept relation
+ * that are not kept themselves are left as placeholders. With
+ * setKeepReferences(), the input is read twice: the scan only records which
+ * ways and relations are kept, and the load creates them with their nodes
+ * and the ways of the relations. As these ways are only known once passed,
+ * a scan of the ways (beginWayScan) in between finds their nodes, if
+ * hasMemberWays(). Either way only the ids of the elements in the area are
+ * held besides the features kept.
+ */
+class ImportFilter
+{
+public:
+    typedef QVector<QPair<quint32, quint32> > Tags;
+
+    ImportFilter();
+    ~ImportFilter();
+
+    /* Only keeps what is inside aBox; by default, the whole world */
+    void setArea(const CoordBox& aBox);
+    /* Inside one of Outers but none of Holes, in lon/lat */
+    void setArea(const QList<QPolygonF>& Outers, const QList<QPolygonF>& Holes);
+    /* Reads the area from an osmosis .poly file */
+    bool loadPoly(const QString& filename);
+    /* Only keeps what matches anExpression; false if it cannot be parsed */
+    bool setSelector(const QString& anExpression);
+    void setKeepReferences(bool b);
+
+    bool keepReferences() const { return KeepReferences; }
+    bool hasSelector() const { return theSelector != 0; }
+    bool hasArea() const { return HasArea; }
+    /* The bounding box of the area */
+    const CoordBox& area() const { return theBox; }
+    QString errorString() const { return theError; }
+
+    /* Starts the first pass of the two-pass mode: nothing is accepted, the
+     * ways and relations to keep are only recorded */
+    void beginScan();
+    /* After a scan, if the relations kept have ways that are not kept for
+     * themselves, starts a pass reading their nodes: again nothing is
+     * accepted */
+    bool hasMemberWays() const { return !theMemberWays.isEmpty(); }
+    const QSet<qint64>& memberWays() const { return theMemberWays; }
+    void beginWayScan();
+    /* Starts the pass creating the features */
+    void beginLoad();
+    bool scanning() const { return Scanning; }
+    /* After a scan, the nodes the ways and relations kept refer to */
+    const QSet<qint64>& neededNodes() const { return theNeededNodes; }
+
+    bool inArea(const Coord& C) const;
+
+    /* T may be left empty if there is no selector. Always false while
+     * scanning. */
+    bool acceptNode(qint64 id, const Coord& C, const Tags& T);
+    bool acceptWay(qint64 id, const QVector<qint64>& Refs, const Tags& T);
+    bool acceptRelation(qint64 id, const QVector<IFeature::FId>& Members, const Tags& T);
+
+    /* For a feature already created, as those of osmChange files */
+    bool accept(const Feature* F) const;
+
+private:
+    bool matches(int aType, const Tags& T) const;
+    bool matches(const Feature* F) const;
+
+    bool HasArea;
+    CoordBox theBox;
+    QList<QPolygonF> theOuters;
+    QList<QPolygonF> theHoles;
+    TagSelector* theSelector;
+    bool KeepReferences;
+    bool Scanning;
+    bool ScanningWays;
+    bool Scanned;
+    QString theError;
+
+    /* Whether kept or not, for the area test of the relations */
+    QSet<qint64> theNodesInArea;
+    QSet<qint64> theWaysInArea;
+    QSet<qint64> theRelationsInArea;
+    QSet<qint64> theWays;
+    QSet<qint64> theRelations;
+    /* Found by the scan: the nodes of the ways and relations kept, and the
+     * ways of the relations that were not kept when read */
+    QSet<qint64> theNeededNodes;
+    QSet<qint64> theMemberWays;
+};
+
+#endif // IMPORTFILTER_H
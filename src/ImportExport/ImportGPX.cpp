@@ -11,42 +11,65 @@
 #include <QDateTime>
 #include <QFile>
 #include <QMessageBox>
-#include <QDomDocument>
 #include <QProgressDialog>
+#include <QXmlStreamReader>
 
 
-static TrackNode* importTrkPt(const QDomElement& Root, Document* /* theDocument */, Layer* theLayer)
+/* Progress is in KB read, updated every PROGRESS_BYTES */
+#define PROGRESS_BYTES (256*1024)
+
+/* False if the import is cancelled */
+static bool updateProgress(QXmlStreamReader& stream, QProgressDialog& progress)
 {
-    qreal Lat = Root.attribute("lat").toDouble();
-    qreal Lon = Root.attribute("lon").toDouble();
+    int kb = stream.device()->pos() / 1024;
+    if (kb - progress.value() >= PROGRESS_BYTES / 1024)
+        progress.setValue(kb);
+    return !progress.wasCanceled();
+}
+
+/* The text of the first <id> in an <extensions>, which is read to its end */
+static QString readExtensionId(QXmlStreamReader& stream)
+{
+    QString id;
+    bool found = false;
+    int depth = 1;
+    while (depth && !stream.atEnd()) {
+        stream.readNext();
+        if (stream.isStartElement()) {
+            if (!found && stream.name() == "id") {
+                id = stream.readElementText(QXmlStreamReader::IncludeChildElements);
+                found = true;
+            } else
+                ++depth;
+        } else if (stream.isEndElement())
+            --depth;
+    }
+    return id;
+}
+
+/* Reads the <trkpt>, <rtept> or <wpt> the stream is on, up to its end */
+static TrackNode* importTrkPt(QXmlStreamReader& stream, Document* /* theDocument */, Layer* theLayer)
+{
+    QXmlStreamAttributes atts = stream.attributes();
+    qreal Lat = atts.value("lat").toString().toDouble();
+    qreal Lon = atts.value("lon").toString().toDouble();
 
     TrackNode* Pt = g_backend.allocTrackNode(theLayer, Coord(Lon,Lat));
     Pt->setLastUpdated(Feature::Log);
-    if (Root.hasAttribute("xml:id"))
-        Pt->setId(IFeature::FId(IFeature::Point, Root.attribute("xml:id").toLongLong()));
+    if (atts.hasAttribute("xml:id"))
+        Pt->setId(IFeature::FId(IFeature::Point, atts.value("xml:id").toString().toLongLong()));
 
     theLayer->add(Pt);
 
-    if (Root.tagName() == "wpt")
+    if (stream.name() == "wpt")
         Pt->setTag("_waypoint_", "yes");
 
     bool hasTimestamp = false;
-    for(QDomNode n = Root.firstChild(); !n.isNull(); n = n.nextSibling())
+    while (stream.readNextStartElement())
     {
-        QDomElement t = n.toElement();
-
-        if (t.isNull())
-            continue;
-
-        if (t.tagName() == "time")
+        if (stream.name() == "time")
         {
-            QString Value;
-            for (QDomNode s = t.firstChild(); !s.isNull(); s = s.nextSibling())
-            {
-                QDomText ss = s.toText();
-                if (!ss.isNull())
-                    Value += ss.data();
-            }
+            QString Value = stream.readElementText(QXmlStreamReader::IncludeChildElements);
             if (!Value.isEmpty())
             {
                 QDateTime dt(QDateTime::fromString(Value.left(19), Qt::ISODate));
@@ -55,36 +78,37 @@ static TrackNode* importTrkPt(const QDomElement& Root, Document* /* theDocument
                 hasTimestamp = true;
             }
         }
-        else if (t.tagName() == "ele")
+        else if (stream.name() == "ele")
         {
-            Pt->setElevation( t.text().toDouble() );
+            Pt->setElevation( stream.readElementText(QXmlStreamReader::IncludeChildElements).toDouble() );
         }
-        else if (t.tagName() == "speed")
+        else if (stream.name() == "speed")
         {
-            Pt->setSpeed( t.text().toDouble() );
+            Pt->setSpeed( stream.readElementText(QXmlStreamReader::IncludeChildElements).toDouble() );
         }
-        else if (t.tagName() == "name")
+        else if (stream.name() == "name")
         {
-            Pt->setTag("name", t.text());
+            Pt->setTag("name", stream.readElementText(QXmlStreamReader::IncludeChildElements));
         }
-        else if (t.tagName() == "desc")
+        else if (stream.name() == "desc")
         {
-            Pt->setTag("_description_", t.text());
+            Pt->setTag("_description_", stream.readElementText(QXmlStreamReader::IncludeChildElements));
         }
-        else if (t.tagName() == "cmt")
+        else if (stream.name() == "cmt")
         {
-            Pt->setTag("_comment_", t.text());
+            Pt->setTag("_comment_", stream.readElementText(QXmlStreamReader::IncludeChildElements));
         }
-        else if (t.tagName() == "extensions") // for OpenStreetBugs
+        else if (stream.name() == "extensions") // for OpenStreetBugs
         {
-            QDomNodeList li = t.elementsByTagName("id");
-            if (li.size()) {
-                QString id = li.at(0).toElement().text();
+            QString id = readExtensionId(stream);
+            if (!id.isNull()) {
                 Pt->setId(IFeature::FId(IFeature::Point | IFeature::Special, id.toLongLong()));
                 Pt->setTag("_special_", "yes"); // Assumed to be OpenstreetBugs as they don't use their own namesoace
                 Pt->setSpecial(true);
             }
         }
+        else
+            stream.skipCurrentElement();
     }
     if (!hasTimestamp) {
         /* If a point does not have timestamp, make sure this is reflected in
@@ -98,30 +122,30 @@ static TrackNode* importTrkPt(const QDomElement& Root, Document* /* theDocument
 }
 
 
-static void importTrkSeg(const QDomElement& Root, Document* theDocument, Layer* theLayer, ImportGPX::Options importOptions, QProgressDialog & progress)
+static void importTrkSeg(QXmlStreamReader& stream, Document* theDocument, Layer* theLayer, ImportGPX::Options importOptions, QProgressDialog & progress)
 {
     TrackSegment* S = g_backend.allocSegment(theLayer);
     theLayer->add(S);
 
-    if (Root.hasAttribute("xml:id"))
-        S->setId(IFeature::FId(IFeature::GpxSegment, Root.attribute("xml:id").toLongLong()));
+    if (stream.attributes().hasAttribute("xml:id"))
+        S->setId(IFeature::FId(IFeature::GpxSegment, stream.attributes().value("xml:id").toString().toLongLong()));
 
     Node* lastPoint = NULL;
 
     /* Counters to keep the number of found normal and anonymized (if detection is enabled) points. */
     int nAnon = 0, nNormal = 0;
 
-    for(QDomNode n = Root.firstChild(); !n.isNull(); n = n.nextSibling())
+    while (stream.readNextStartElement())
     {
-        QDomElement t = n.toElement();
-        if (t.isNull() || t.tagName() != "trkpt")
+        if (stream.name() != "trkpt") {
+            stream.skipCurrentElement();
             continue;
+        }
 
-        progress.setValue(progress.value()+1);
-        if (progress.wasCanceled())
+        if (!updateProgress(stream, progress))
             return;
 
-        TrackNode* Pt = importTrkPt(t,theDocument, theLayer);
+        TrackNode* Pt = importTrkPt(stream, theDocument, theLayer);
 
         if (importOptions.testFlag( ImportGPX::Option::MakeSegmented ) && lastPoint)
         {
@@ -177,32 +201,30 @@ static void importTrkSeg(const QDomElement& Root, Document* theDocument, Layer*
     }
 }
 
-static void importRte(const QDomElement& Root, Document* theDocument, Layer* theLayer, ImportGPX::Options importOptions, QProgressDialog & progress)
+static void importRte(QXmlStreamReader& stream, Document* theDocument, Layer* theLayer, ImportGPX::Options importOptions, QProgressDialog & progress)
 {
     TrackSegment* S = g_backend.allocSegment(theLayer);
     theLayer->add(S);
 
-    if (Root.hasAttribute("xml:id"))
-        S->setId(IFeature::FId(IFeature::GpxSegment, Root.attribute("xml:id").toLongLong()));
+    if (stream.attributes().hasAttribute("xml:id"))
+        S->setId(IFeature::FId(IFeature::GpxSegment, stream.attributes().value("xml:id").toString().toLongLong()));
 
     TrackNode* lastPoint = NULL;
 
-    for(QDomNode n = Root.firstChild(); !n.isNull(); n = n.nextSibling())
+    while (stream.readNextStartElement())
     {
-        QDomElement t = n.toElement();
-        if (!t.isNull() && t.tagName() == "name") {
-            theLayer->setName(t.text());
+        if (stream.name() == "name") {
+            theLayer->setName(stream.readElementText(QXmlStreamReader::IncludeChildElements));
         } else
-        if (!t.isNull() && t.tagName() == "desc") {
-            theLayer->setDescription(t.text());
+        if (stream.name() == "desc") {
+            theLayer->setDescription(stream.readElementText(QXmlStreamReader::IncludeChildElements));
         } else
-        if (!t.isNull() && t.tagName() == "rtept") {
+        if (stream.name() == "rtept") {
 
-            progress.setValue(progress.value()+1);
-            if (progress.wasCanceled())
+            if (!updateProgress(stream, progress))
                 return;
 
-            TrackNode* Pt = importTrkPt(t,theDocument, theLayer);
+            TrackNode* Pt = importTrkPt(stream, theDocument, theLayer);
 
             if (! importOptions.testFlag( ImportGPX::Option::MakeSegmented ))
                 continue;
@@ -221,50 +243,42 @@ static void importRte(const QDomElement& Root, Document* theDocument, Layer* the
             }
             S->add(Pt);
             lastPoint = Pt;
-        }
+        } else
+            stream.skipCurrentElement();
     }
 
     if (!S->size())
         g_backend.deallocFeature(theLayer, S);
 }
 
-static void importTrk(const QDomElement& Root, Document* theDocument, Layer* theLayer, ImportGPX::Options importOptions, QProgressDialog & progress)
+static void importTrk(QXmlStreamReader& stream, Document* theDocument, Layer* theLayer, ImportGPX::Options importOptions, QProgressDialog & progress)
 {
-    QDomElement trkSegElement;
-    for(QDomNode n = Root.firstChild(); !n.isNull(); n = n.nextSibling())
+    while (stream.readNextStartElement())
     {
-        QDomElement t = n.toElement();
-        if (!t.isNull() && t.tagName() == "trkseg") {
-            trkSegElement = t;
+        if (stream.name() == "trkseg") {
+            importTrkSeg(stream, theDocument, theLayer, importOptions, progress);
+            if (progress.wasCanceled())
+                return;
         } else
-        if (!t.isNull() && t.tagName() == "name") {
-            theLayer->setName(t.text());
+        if (stream.name() == "name") {
+            theLayer->setName(stream.readElementText(QXmlStreamReader::IncludeChildElements));
         } else
-        if (!t.isNull() && t.tagName() == "desc") {
-            theLayer->setDescription(t.text());
-        }
-    }
-
-    if (!trkSegElement.isNull()) {
-        importTrkSeg(trkSegElement, theDocument, theLayer, importOptions, progress);
-        if (progress.wasCanceled())
-            return;
+        if (stream.name() == "desc") {
+            theLayer->setDescription(stream.readElementText(QXmlStreamReader::IncludeChildElements));
+        } else
+            stream.skipCurrentElement();
     }
 }
 
-static void importGPX(const QDomElement& Root, Document* theDocument, QList<TrackLayer*>& theTracklayers, ImportGPX::Options importOptions, QProgressDialog & progress)
+static void importGPX(QXmlStreamReader& stream, Document* theDocument, QList<TrackLayer*>& theTracklayers, ImportGPX::Options importOptions, QProgressDialog & progress)
 {
-    for(QDomNode n = Root.firstChild(); !n.isNull(); n = n.nextSibling())
+    while (stream.readNextStartElement())
     {
-        QDomElement t = n.toElement();
-        if (t.isNull())
-            continue;
-
-        if (t.tagName() == "trk")
+        if (stream.name() == "trk")
         {
             TrackLayer* newLayer = new TrackLayer();
             theDocument->add(newLayer);
-            importTrk(t,theDocument, newLayer, importOptions, progress);
+            importTrk(stream, theDocument, newLayer, importOptions, progress);
             if (!newLayer->size()) {
                 theDocument->remove(newLayer);
                 delete newLayer;
@@ -272,11 +286,11 @@ static void importGPX(const QDomElement& Root, Document* theDocument, QList<Trac
                 theTracklayers.append(newLayer);
             }
         }
-        else if (t.tagName() == "rte")
+        else if (stream.name() == "rte")
         {
             TrackLayer* newLayer = new TrackLayer();
             theDocument->add(newLayer);
-            importRte(t,theDocument, newLayer, importOptions, progress);
+            importRte(stream, theDocument, newLayer, importOptions, progress);
             if (!newLayer->size()) {
                 theDocument->remove(newLayer);
                 delete newLayer;
@@ -284,51 +298,63 @@ static void importGPX(const QDomElement& Root, Document* theDocument, QList<Trac
                 theTracklayers.append(newLayer);
             }
         }
-        else if (t.tagName() == "wpt")
+        else if (stream.name() == "wpt")
         {
-            importTrkPt(t,theDocument, theTracklayers[0]);
-            progress.setValue(progress.value()+1);
+            importTrkPt(stream, theDocument, theTracklayers[0]);
+            updateProgress(stream, progress);
         }
+        else
+            stream.skipCurrentElement();
         if (progress.wasCanceled())
             return;
     }
 }
 
+/* The file is read as it is parsed and the track nodes are created on the
+ * way, so the memory used is that of the features, whatever the size of
+ * the file */
 static bool importGPX(QWidget* aParent, QIODevice& File, Document* theDocument, QList<TrackLayer*>& theTracklayers, ImportGPX::Options importOptions)
 {
-    // TODO remove debug messageboxes
-    QDomDocument DomDoc;
-    QString ErrorStr;
-    int ErrorLine;
-    int ErrorColumn;
-    if (!DomDoc.setContent(&File, true, &ErrorStr, &ErrorLine,&ErrorColumn))
+    if (!File.isOpen() && !File.open(QIODevice::ReadOnly))
+        return false;
+
+    QXmlStreamReader stream(&File);
+    if (!stream.readNextStartElement())
     {
-        File.close();
         QMessageBox::warning(aParent,"Parse error",
             QString("Parse error at line %1, column %2:\n%3")
-                                  .arg(ErrorLine)
-                                  .arg(ErrorColumn)
-                                  .arg(ErrorStr));
+                                  .arg(stream.lineNumber())
+                                  .arg(stream.columnNumber())
+                                  .arg(stream.errorString()));
         return false;
     }
-    QDomElement root = DomDoc.documentElement();
-    if (root.tagName() != "gpx")
+    if (stream.name() != "gpx")
     {
         QMessageBox::information(aParent, "Parse error","Root is not a gpx node");
         return false;
     }
 
-    QProgressDialog progress("Importing GPX...", "Cancel", 0, 0);
+    QProgressDialog progress("Importing GPX...", "Cancel", 0, File.size() / 1024);
     progress.setWindowModality(Qt::WindowModal);
-    progress.setMaximum(progress.maximum() + DomDoc.elementsByTagName("trkpt").count());
-    progress.setMaximum(progress.maximum() + DomDoc.elementsByTagName("wpt").count());
 
-    importGPX(root, theDocument, theTracklayers, importOptions, progress);
+    importGPX(stream, theDocument, theTracklayers, importOptions, progress);
 
     progress.setValue(progress.maximum());
     if (progress.wasCanceled())
         return false;
 
+    /* The layers read before the error are in theTracklayers, for the
+     * caller to remove */
+    if (stream.hasError())
+    {
+        QMessageBox::warning(aParent,"Parse error",
+            QString("Parse error at line %1, column %2:\n%3")
+                                  .arg(stream.lineNumber())
+                                  .arg(stream.columnNumber())
+                                  .arg(stream.errorString()));
+        return false;
+    }
+
     return true;
 }
 
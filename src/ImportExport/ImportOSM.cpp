@@ -20,50 +20,120 @@
 #include <QProgressBar>
 #include <QProgressDialog>
 #include <QDomDocument>
-#include <QXmlAttributes>
 
+/* Bytes parsed between two updates of the progress bar */
+#define PROGRESS_BYTES (256*1024)
+/* Id of the keys that are not imported */
+#define SKIPPED_KEY 0xffffffff
 
-OSMHandler::OSMHandler(Document* aDoc, Layer* aLayer, Layer* aConflict)
-: theDocument(aDoc), theLayer(aLayer), conflictLayer(aConflict), Current(0)
+OSMHandler::OSMHandler(Document* aDoc, Layer* aLayer, Layer* aConflict, ImportFilter* aFilter)
+: theDocument(aDoc), theLayer(aLayer), conflictLayer(aConflict), theFilter(aFilter), Current(0)
 {
+    theElement.Type = IFeature::Uninitialized;
 }
 
-void OSMHandler::parseTag(const QXmlAttributes &atts)
+void OSMHandler::parseTag(const OsmXmlReader& xml)
 {
-    if (!Current) return;
+    if (theElement.Type == IFeature::Uninitialized)
+        return;
+
+    OsmXmlReader::Span k = xml.attribute("k");
+    QHash<QByteArray, quint32>::const_iterator ik = theKeyIds.constFind(k.bytes());
+    if (ik == theKeyIds.constEnd()) {
+        QString key = k.toString();
+        quint32 id = key.toLower() == "created_by" ? SKIPPED_KEY : g_addTagKey(key);
+        ik = theKeyIds.insert(QByteArray(k.data, k.size), id);
+    }
+    if (ik.value() == SKIPPED_KEY)
+        return;
+
+    OsmXmlReader::Span v = xml.attribute("v");
+    QHash<QByteArray, quint32>::const_iterator iv = theValueIds.constFind(v.bytes());
+    if (iv == theValueIds.constEnd())
+        iv = theValueIds.insert(QByteArray(v.data, v.size), g_addTagValue(v.toString()));
+
+    theElement.Tags << qMakePair(ik.value(), iv.value());
+}
+
+static int digitsAt(const char* p, int n)
+{
+    int v = 0;
+    for (int i=0; i<n; ++i) {
+        if (p[i] < '0' || p[i] > '9')
+            return -1;
+        v = v*10 + (p[i] - '0');
+    }
+    return v;
+}
+
+/* Same as QDateTime::fromString(ts.left(19), Qt::ISODate), for the usual
+ * 2010-01-31T12:34:56Z without going through a QString */
+static QDateTime parseTimestamp(const OsmXmlReader::Span& ts)
+{
+    const char* p = ts.data;
+    if (ts.size >= 19 && p[4] == '-' && p[7] == '-' && p[10] == 'T' && p[13] == ':' && p[16] == ':') {
+        QDateTime time(QDate(digitsAt(p, 4), digitsAt(p+5, 2), digitsAt(p+8, 2)),
+                       QTime(digitsAt(p+11, 2), digitsAt(p+14, 2), digitsAt(p+17, 2)));
+        if (time.isValid())
+            return time;
+    }
+    return QDateTime::fromString(ts.toString().left(19), Qt::ISODate);
+}
 
-    Current->setTag(atts.value("k"),atts.value("v"));
+void OSMHandler::setStandardAttributes(Feature* F)
+{
+#ifndef FRISIUS_BUILD
+    F->setTime(theElement.Time);
+    F->setUser(theElement.User);
+    if (theElement.Version >= 0)
+        F->setVersionNumber(theElement.Version);
+#else
+    Q_UNUSED(F);
+#endif
 }
 
-void parseStandardAttributes(const QXmlAttributes& atts, Feature* F)
+void OSMHandler::beginElement(const OsmXmlReader& xml, int aType)
 {
+    theElement.Type = aType;
+    theElement.Id = xml.attribute("id").toLongLong();
+    if (aType == IFeature::Point)
+        theElement.Position = Coord(xml.attribute("lon").toDouble(), xml.attribute("lat").toDouble());
+    theElement.Tags.clear();
+    theElement.Refs.clear();
+    theElement.Members.clear();
+    theElement.Roles.clear();
+
 #ifndef FRISIUS_BUILD
-    QString ts = atts.value("timestamp");
-    QDateTime time = QDateTime::fromString(ts.left(19), Qt::ISODate);
-    if (!time.isValid())
-        time = QDateTime::currentDateTime();
-    QString user = atts.value("user");
-    F->setTime(time);
-    F->setUser(user);
-    QString version = atts.value("version");
-    if (!version.isEmpty())
-        F->setVersionNumber(version.toInt());
+    /* Not needed to select the features */
+    if (theFilter && theFilter->scanning())
+        return;
+
+    theElement.Time = parseTimestamp(xml.attribute("timestamp"));
+    if (!theElement.Time.isValid())
+        theElement.Time = QDateTime::currentDateTime();
+    OsmXmlReader::Span user = xml.attribute("user");
+    QHash<QByteArray, QString>::const_iterator it = theUsers.constFind(user.bytes());
+    if (it == theUsers.constEnd())
+        it = theUsers.insert(QByteArray(user.data, user.size), user.toString());
+    theElement.User = it.value();
+    OsmXmlReader::Span version = xml.attribute("version");
+    theElement.Version = version.size ? version.toInt() : -1;
 #endif
 }
 
-void OSMHandler::parseNode(const QXmlAttributes& atts)
+void OSMHandler::createNode()
 {
-    qreal Lat = atts.value("lat").toDouble();
-    qreal Lon = atts.value("lon").toDouble();
-    QString id = atts.value("id");
-    Node* Pt = CAST_NODE(theDocument->getFeature(IFeature::FId(IFeature::Point, id.toLongLong())));
+    qreal Lat = theElement.Position.y();
+    qreal Lon = theElement.Position.x();
+    qint64 id = theElement.Id;
+    Node* Pt = CAST_NODE(theDocument->getFeature(IFeature::FId(IFeature::Point, id)));
     if (Pt)
     {
         Node* userPt = Pt;
         Pt = g_backend.allocNode(theLayer, Coord(Lon,Lat));
-        Pt->setId(IFeature::FId(IFeature::Point | IFeature::Conflict, id.toLongLong()));
+        Pt->setId(IFeature::FId(IFeature::Point | IFeature::Conflict, id));
         Pt->setLastUpdated(Feature::OSMServerConflict);
-        parseStandardAttributes(atts,Pt);
+        setStandardAttributes(Pt);
 
         if (userPt->lastUpdated() == Feature::User)
         {
@@ -115,14 +185,14 @@ void OSMHandler::parseNode(const QXmlAttributes& atts)
     else
     {
         Pt = g_backend.allocNode(theLayer, Coord(Lon,Lat));
-        Pt->setId(IFeature::FId(IFeature::Point, id.toLongLong()));
+        Pt->setId(IFeature::FId(IFeature::Point, id));
         Pt->setLastUpdated(Feature::OSMServer);
         theLayer->add(Pt);
         NewFeature = true;
     }
 
     if (NewFeature) {
-        parseStandardAttributes(atts,Pt);
+        setStandardAttributes(Pt);
         Current = Pt;
         for (int i=0; i<Pt->sizeParents(); ++i) {
             if (Pt->getParent(i)->isDeleted()) continue;
@@ -133,27 +203,23 @@ void OSMHandler::parseNode(const QXmlAttributes& atts)
         Current = NULL;
 }
 
-void OSMHandler::parseNd(const QXmlAttributes& atts)
+void OSMHandler::parseNd(const OsmXmlReader& xml)
 {
-    Way* R = dynamic_cast<Way*>(Current);
-    if (!R) return;
-    Node *Part = Feature::getNodeOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::Point, atts.value("ref").toLongLong()));
-    if (NewFeature)
-        R->add(Part);
+    if (theElement.Type == IFeature::LineString)
+        theElement.Refs << xml.attribute("ref").toLongLong();
 }
 
-void OSMHandler::parseWay(const QXmlAttributes& atts)
+void OSMHandler::createWay()
 {
-    QString id = atts.value("id");
-    QString ts = atts.value("timestamp"); ts.truncate(19);
-    Way* R = CAST_WAY(theDocument->getFeature(IFeature::FId(IFeature::LineString, id.toLongLong())));
+    qint64 id = theElement.Id;
+    Way* R = CAST_WAY(theDocument->getFeature(IFeature::FId(IFeature::LineString, id)));
     if (R)
     {
         Way* userRd = R;
         R = g_backend.allocWay(theLayer);
-        R->setId(IFeature::FId(IFeature::LineString | IFeature::Conflict, id.toLongLong()));
+        R->setId(IFeature::FId(IFeature::LineString | IFeature::Conflict, id));
         R->setLastUpdated(Feature::OSMServerConflict);
-        parseStandardAttributes(atts,R);
+        setStandardAttributes(R);
 
         if (userRd->lastUpdated() == Feature::User)
         {
@@ -201,50 +267,51 @@ void OSMHandler::parseWay(const QXmlAttributes& atts)
     else
     {
         R = g_backend.allocWay(theLayer);
-        R->setId(IFeature::FId(IFeature::LineString, id.toLongLong()));
+        R->setId(IFeature::FId(IFeature::LineString, id));
         R->setLastUpdated(Feature::OSMServer);
         theLayer->add(R);
         NewFeature = true;
     }
 
     if (NewFeature) {
-        parseStandardAttributes(atts,R);
+        setStandardAttributes(R);
         Current = R;
         touchedWays << R;
+        for (int i=0; i<theElement.Refs.size(); ++i)
+            R->add(Feature::getNodeOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::Point, theElement.Refs[i])));
     } else
         Current = NULL;
 }
 
-void OSMHandler::parseMember(const QXmlAttributes& atts)
+void OSMHandler::parseMember(const OsmXmlReader& xml)
 {
-    Relation* R = dynamic_cast<Relation*>(Current);
-    if (!R)
+    if (theElement.Type != IFeature::OsmRelation)
         return;
-    QString Type = atts.value("type");
-    Feature* F = 0;
+    OsmXmlReader::Span Type = xml.attribute("type");
+    char t;
     if (Type == "node")
-        F = Feature::getNodeOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::Point, atts.value("ref").toLongLong()));
+        t = IFeature::Point;
     else if (Type == "way")
-        F = Feature::getWayOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::LineString, atts.value("ref").toLongLong()));
+        t = IFeature::LineString;
     else if (Type == "relation")
-        F = Feature::getRelationOrCreatePlaceHolder(theDocument, theLayer, IFeature::FId(IFeature::OsmRelation, atts.value("ref").toLongLong()));
-
-    if (F && F != R)
-        R->add(atts.value("role"),F);
+        t = IFeature::OsmRelation;
+    else
+        return;
+    theElement.Members << IFeature::FId(t, xml.attribute("ref").toLongLong());
+    theElement.Roles << xml.attribute("role").toString();
 }
 
-void OSMHandler::parseRelation(const QXmlAttributes& atts)
+void OSMHandler::createRelation()
 {
-    QString id = atts.value("id");
-    QString ts = atts.value("timestamp"); ts.truncate(19);
-    Relation* R = CAST_RELATION(theDocument->getFeature(IFeature::FId(IFeature::OsmRelation, id.toLongLong())));
+    qint64 id = theElement.Id;
+    Relation* R = CAST_RELATION(theDocument->getFeature(IFeature::FId(IFeature::OsmRelation, id)));
     if (R)
     {
         Relation* userR = R;
         R = g_backend.allocRelation(theLayer);
-        R->setId(IFeature::FId(IFeature::OsmRelation | IFeature::Conflict, id.toLongLong()));
+        R->setId(IFeature::FId(IFeature::OsmRelation | IFeature::Conflict, id));
         R->setLastUpdated(Feature::OSMServerConflict);
-        parseStandardAttributes(atts,R);
+        setStandardAttributes(R);
 
         if (R->lastUpdated() == Feature::User)
         {
@@ -292,42 +359,119 @@ void OSMHandler::parseRelation(const QXmlAttributes& atts)
     else
     {
         R = g_backend.allocRelation(theLayer);
-        R->setId(IFeature::FId(IFeature::OsmRelation, id.toLongLong()));
+        R->setId(IFeature::FId(IFeature::OsmRelation, id));
         R->setLastUpdated(Feature::OSMServer);
         NewFeature = true;
         theLayer->add(R);
     }
 
     if (NewFeature) {
-        parseStandardAttributes(atts,R);
+        setStandardAttributes(R);
         Current = R;
         touchedRelations << R;
+        for (int i=0; i<theElement.Members.size(); ++i) {
+            const IFeature::FId& M = theElement.Members[i];
+            Feature* F = 0;
+            if (M.type == IFeature::Point)
+                F = Feature::getNodeOrCreatePlaceHolder(theDocument, theLayer, M);
+            else if (M.type == IFeature::LineString)
+                F = Feature::getWayOrCreatePlaceHolder(theDocument, theLayer, M);
+            else
+                F = Feature::getRelationOrCreatePlaceHolder(theDocument, theLayer, M);
+            if (F && F != R)
+                R->add(theElement.Roles[i], F);
+        }
     } else
         Current = NULL;
 }
 
-bool OSMHandler::startElement ( const QString &, const QString & /* localName */, const QString & qName, const QXmlAttributes & atts )
+void OSMHandler::endFeature()
 {
-    if (qName == "tag")
-        parseTag(atts);
+    const Element& E = theElement;
+    bool keep = true;
+    if (theFilter) {
+        if (E.Type == IFeature::Point)
+            keep = theFilter->acceptNode(E.Id, E.Position, E.Tags);
+        else if (E.Type == IFeature::LineString)
+            keep = theFilter->acceptWay(E.Id, E.Refs, E.Tags);
+        else
+            keep = theFilter->acceptRelation(E.Id, E.Members, E.Tags);
+    }
+
+    if (keep) {
+        if (E.Type == IFeature::Point)
+            createNode();
+        else if (E.Type == IFeature::LineString)
+            createWay();
+        else
+            createRelation();
+        if (Current)
+            for (int i=0; i<E.Tags.size(); ++i)
+                Current->setTagIds(E.Tags[i].first, E.Tags[i].second);
+    }
+    Current = 0;
+    theElement.Type = IFeature::Uninitialized;
+}
+
+void OSMHandler::startElement(const OsmXmlReader& xml)
+{
+    OsmXmlReader::Span qName = xml.name();
+    if (qName == "nd")
+        parseNd(xml);
+    else if (qName == "tag")
+        parseTag(xml);
     else if (qName == "node")
-        parseNode(atts);
-    else if (qName == "nd")
-        parseNd(atts);
+        beginElement(xml, IFeature::Point);
     else if (qName == "way")
-        parseWay(atts);
+        beginElement(xml, IFeature::LineString);
     else if (qName == "member")
-        parseMember(atts);
+        parseMember(xml);
     else if (qName == "relation")
-        parseRelation(atts);
-    return true;
+        beginElement(xml, IFeature::OsmRelation);
 }
 
-bool OSMHandler::endElement ( const QString &, const QString & /* localName */, const QString & qName )
+void OSMHandler::endElement(const OsmXmlReader& xml)
 {
-    if (qName == "node")
-        Current = 0;
-    return true;
+    if (theElement.Type == IFeature::Uninitialized)
+        return;
+    OsmXmlReader::Span qName = xml.name();
+    if (qName == "node" || qName == "way" || qName == "relation")
+        endFeature();
+}
+
+bool OSMHandler::parse(QIODevice& File, QProgressDialog* dlg, QProgressBar* Bar)
+{
+    OsmXmlReader xml(&File);
+    if (Bar)
+        Bar->setMaximum(File.size());
+
+    qint64 lastUpdate = 0;
+    for (;;) {
+        switch (xml.readNext()) {
+        case OsmXmlReader::StartElement:
+            startElement(xml);
+            break;
+        case OsmXmlReader::EndElement:
+            endElement(xml);
+            break;
+        case OsmXmlReader::EndDocument:
+            if (Bar)
+                Bar->setValue(Bar->maximum());
+            return true;
+        case OsmXmlReader::Invalid:
+            theError = xml.errorString();
+            return false;
+        }
+
+        if (xml.position() - lastUpdate >= PROGRESS_BYTES) {
+            lastUpdate = xml.position();
+            if (Bar)
+                Bar->setValue(lastUpdate);
+            qApp->processEvents();
+            if (dlg && dlg->wasCanceled())
+                return false;
+        }
+    }
 }
 
 static bool downloadToResolve(const QList<Feature*>& Resolution, QWidget* aParent, Document* theDocument, Layer* theLayer, Downloader* theDownloader)
@@ -360,22 +504,8 @@ static bool downloadToResolve(const QList<Feature*>& Resolution, QWidget* aParen
                 File.open(QIODevice::ReadOnly);
 
                 OSMHandler theHandler(theDocument,theLayer,NULL);
-
-                QXmlSimpleReader xmlReader;
-                xmlReader.setContentHandler(&theHandler);
-                QXmlInputSource source;
-                QByteArray buf(File.read(10240));
-                source.setData(buf);
-                xmlReader.parse(&source,true);
-                while (!File.atEnd())
-                {
-                    QByteArray buf(File.read(20480));
-                    source.setData(buf);
-                    xmlReader.parseContinue();
-                    qApp->processEvents();
-                    if (dlg && dlg->wasCanceled())
-                        break;
-                }
+                if (!theHandler.parse(File, dlg) && !theHandler.errorString().isEmpty())
+                    qWarning() << "Parsing unresolved" << Resolution[i]->xmlId() << ":" << theHandler.errorString();
             }
             Resolution[i]->setLastUpdated(Feature::OSMServer);
         }
@@ -443,7 +573,7 @@ static bool deleteIncompleteRelations(QWidget* /*aParent*/, Document* /*theDocum
     return true;
 }
 
-bool importOSM(QWidget* aParent, QIODevice& File, Document* theDocument, Layer* theLayer, Downloader* theDownloader)
+bool importOSM(QWidget* aParent, QIODevice& File, Document* theDocument, Layer* theLayer, Downloader* theDownloader, ImportFilter* aFilter)
 {
     QDomDocument DomDoc;
     QString ErrorStr;
@@ -474,30 +604,38 @@ bool importOSM(QWidget* aParent, QIODevice& File, Document* theDocument, Layer*
     Layer* conflictLayer = new DrawingLayer(QApplication::translate("Downloader","Conflicts from %1").arg(theLayer->name()));
     theDocument->add(conflictLayer);
 
-    OSMHandler theHandler(theDocument,theLayer,conflictLayer);
-
-    QXmlSimpleReader xmlReader;
-    xmlReader.setContentHandler(&theHandler);
-    QXmlInputSource source;
-    QByteArray buf(File.read(10240));
-    source.setData(buf);
-    xmlReader.parse(&source,true);
-    if (Bar) {
-        Bar->setMaximum(File.size());
-        Bar->setValue(Bar->value()+buf.size());
-    }
-
-    while (!File.atEnd())
-    {
-        QByteArray buf(File.read(20480));
-        source.setData(buf);
-        xmlReader.parseContinue();
-        if (Bar)
-            Bar->setValue(Bar->value()+buf.size());
-        qApp->processEvents();
-        if (dlg && dlg->wasCanceled())
-            break;
+    OSMHandler theHandler(theDocument,theLayer,conflictLayer,aFilter);
+    bool parsed = true;
+    if (aFilter && aFilter->keepReferences()) {
+        /* A first pass finds the ways and relations kept, so that the
+         * second one also keeps their nodes */
+        aFilter->beginScan();
+        if (Lbl)
+            Lbl->setText(QApplication::translate("Downloader","Selecting features"));
+        parsed = theHandler.parse(File, dlg, Bar);
+        if (parsed && !File.reset()) {
+            qWarning() << "Cannot read the OSM XML again:" << File.errorString();
+            parsed = false;
+        }
+        /* The ways of the relations kept were passed before the relations:
+         * read them again for their nodes */
+        if (parsed && aFilter->hasMemberWays()) {
+            aFilter->beginWayScan();
+            parsed = theHandler.parse(File, dlg, Bar);
+            if (parsed && !File.reset()) {
+                qWarning() << "Cannot read the OSM XML again:" << File.errorString();
+                parsed = false;
+            }
+        }
+        if (Lbl)
+            Lbl->setText(QApplication::translate("Downloader","Parsing XML"));
     }
+    if (aFilter)
+        aFilter->beginLoad();
+    if (parsed)
+        parsed = theHandler.parse(File, dlg, Bar);
+    if (!parsed && !theHandler.errorString().isEmpty())
+        qWarning() << "Parsing OSM XML:" << theHandler.errorString();
 
     bool WasCanceled = false;
     if (dlg)
@@ -540,7 +678,7 @@ bool importOSM(QWidget* aParent, QIODevice& File, Document* theDocument, Layer*
                 EmptyFeature.push_back(r);
         }
 
-        if (EmptyFeature.size()) {
+        if (EmptyFeature.size() && !g_Merk_Headless) {
             if (QMessageBox::warning(aParent,QApplication::translate("Downloader","Empty roads/relations detected"),
                     QApplication::translate("Downloader",
                     "Empty roads/relations are probably errors.\n"
@@ -561,6 +699,8 @@ bool importOSM(QWidget* aParent, QIODevice& File, Document* theDocument, Layer*
         if (!conflictLayer->size()) {
             theDocument->remove(conflictLayer);
             delete conflictLayer;
+        } else if (g_Merk_Headless) {
+            qWarning() << "Conflicts have been detected; see the" << conflictLayer->name() << "layer";
         } else {
             QMessageBox::warning(aParent,QApplication::translate("Downloader","Conflicts have been detected"),
                 QApplication::translate("Downloader",
@@ -576,19 +716,19 @@ bool importOSM(QWidget* aParent, QIODevice& File, Document* theDocument, Layer*
     return true;
 }
 
-bool importOSM(QWidget* aParent, const QString& aFilename, Document* theDocument, Layer* theLayer)
+bool importOSM(QWidget* aParent, const QString& aFilename, Document* theDocument, Layer* theLayer, ImportFilter* aFilter)
 {
     QFile File(aFilename);
     if (!File.open(QIODevice::ReadOnly))
          return false;
-    return importOSM(aParent, File, theDocument, theLayer, 0 );
+    return importOSM(aParent, File, theDocument, theLayer, 0, aFilter);
 }
 
 bool importOSM(QWidget* aParent, QByteArray& Content, Document* theDocument, Layer* theLayer, Downloader* theDownloader)
 {
     QBuffer File(&Content);
     File.open(QIODevice::ReadOnly);
-    return importOSM(aParent, File, theDocument, theLayer, theDownloader);
+    return importOSM(aParent, File, theDocument, theLayer, theDownloader, 0);
 }
 
 
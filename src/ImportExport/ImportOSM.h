@@ -10,40 +10,82 @@ class Way;
 class Relation;
 
 class QByteArray;
+class QIODevice;
+class QProgressBar;
+class QProgressDialog;
 class QString;
 class QWidget;
 
-#include <QXmlDefaultHandler>
+#include <QDateTime>
+#include <QHash>
 #include <QSet>
+#include <QVector>
 
-class OSMHandler : public QXmlDefaultHandler
+#include "ImportFilter.h"
+#include "OsmXmlReader.h"
+
+class OSMHandler
 {
 public:
-    OSMHandler(Document* aDoc, Layer* aLayer, Layer* aConflict);
+    OSMHandler(Document* aDoc, Layer* aLayer, Layer* aConflict, ImportFilter* aFilter = 0);
 
-    virtual bool startElement ( const QString & namespaceURI, const QString & localName, const QString & qName, const QXmlAttributes & atts );
-    virtual bool endElement ( const QString & namespaceURI, const QString & localName, const QString & qName );
+    /* Reads the whole of File; false on malformed XML or if dlg is cancelled.
+     * What was read before stays in the layer. */
+    bool parse(QIODevice& File, QProgressDialog* dlg = 0, QProgressBar* Bar = 0);
+    QString errorString() const { return theError; }
 
 private:
-    void parseNode(const QXmlAttributes & atts);
-    void parseTag(const QXmlAttributes & atts);
-    void parseWay(const QXmlAttributes & atts);
-    void parseNd(const QXmlAttributes & atts);
-    void parseMember(const QXmlAttributes & atts);
-    void parseRelation(const QXmlAttributes& atts);
+    void startElement(const OsmXmlReader& xml);
+    void endElement(const OsmXmlReader& xml);
+
+    void beginElement(const OsmXmlReader& xml, int aType);
+    void endFeature();
+    void setStandardAttributes(Feature* F);
+    void parseTag(const OsmXmlReader& xml);
+    void parseNd(const OsmXmlReader& xml);
+    void parseMember(const OsmXmlReader& xml);
+    void createNode();
+    void createWay();
+    void createRelation();
 
     Document* theDocument;
     Layer* theLayer;
     Layer* conflictLayer;
+    ImportFilter* theFilter;
     Feature* Current;
     bool NewFeature;
+    QString theError;
+
+    /* The node, way or relation being read. It is created at its end, once
+     * its tags and members are known to the filter. */
+    struct Element
+    {
+        int Type;       /* IFeature::FeatureType; Uninitialized between them */
+        qint64 Id;
+        Coord Position;
+        QDateTime Time;
+        QString User;
+        int Version;    /* -1 if not given */
+        ImportFilter::Tags Tags;
+        QVector<qint64> Refs;
+        QVector<IFeature::FId> Members;
+        QVector<QString> Roles;
+    };
+    Element theElement;
+
+    /* Interned tag strings and users by their bytes in the file, so that
+     * repeated ones are neither decoded nor hashed as QStrings again */
+    QHash<QByteArray, quint32> theKeyIds;
+    QHash<QByteArray, quint32> theValueIds;
+    QHash<QByteArray, QString> theUsers;
 
 public:
         QSet<Way*> touchedWays;
         QSet<Relation*> touchedRelations;
 };
 
-bool importOSM(QWidget* aParent, const QString& aFilename, Document* theDocument, Layer* theLayer);
+/* With aFilter, only what it accepts is imported */
+bool importOSM(QWidget* aParent, const QString& aFilename, Document* theDocument, Layer* theLayer, ImportFilter* aFilter = 0);
 bool importOSM(QWidget* aParent, QByteArray& Content, Document* theDocument, Layer* theLayer, Downloader* theDownloader);
 
 #endif
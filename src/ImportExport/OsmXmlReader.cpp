@@ -0,0 +1,321 @@
+//
+// C++ Implementation: OsmXmlReader
+//
+// Description: Pull parser for OSM XML over UTF-8 bytes.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#include "OsmXmlReader.h"
+
+#include <QIODevice>
+
+#include <string.h>
+
+/* Bytes read from the device at once */
+#define READ_CHUNK (1024*1024)
+
+static inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+bool OsmXmlReader::Span::operator==(const char* s) const
+{
+    int len = qstrlen(s);
+    return size == len && !memcmp(data, s, len);
+}
+
+static bool appendEntity(QString& out, const char* p, int len)
+{
+    if (len > 1 && p[0] == '#') {
+        bool ok;
+        uint code = (p[1] == 'x' || p[1] == 'X')
+                ? QByteArray(p+2, len-2).toUInt(&ok, 16)
+                : QByteArray(p+1, len-1).toUInt(&ok, 10);
+        if (!ok)
+            return false;
+        out += QString::fromUcs4(&code, 1);
+    } else if (len == 3 && !memcmp(p, "amp", 3))
+        out += QLatin1Char('&');
+    else if (len == 2 && !memcmp(p, "lt", 2))
+        out += QLatin1Char('<');
+    else if (len == 2 && !memcmp(p, "gt", 2))
+        out += QLatin1Char('>');
+    else if (len == 4 && !memcmp(p, "quot", 4))
+        out += QLatin1Char('"');
+    else if (len == 4 && !memcmp(p, "apos", 4))
+        out += QLatin1Char('\'');
+    else
+        return false;
+    return true;
+}
+
+QString OsmXmlReader::Span::toString() const
+{
+    if (!size)
+        return QString("");
+    const char* amp = (const char*)memchr(data, '&', size);
+    if (!amp)
+        return QString::fromUtf8(data, size);
+
+    QString out;
+    const char* p = data;
+    const char* end = data + size;
+    while (amp) {
+        out += QString::fromUtf8(p, amp - p);
+        const char* semi = (const char*)memchr(amp, ';', end - amp);
+        if (!semi || !appendEntity(out, amp + 1, semi - amp - 1)) {
+            /* Not an entity: kept as is */
+            out += QLatin1Char('&');
+            p = amp + 1;
+        } else
+            p = semi + 1;
+        amp = (const char*)memchr(p, '&', end - p);
+    }
+    out += QString::fromUtf8(p, end - p);
+    return out;
+}
+
+qint64 OsmXmlReader::Span::toLongLong() const
+{
+    const char* p = data;
+    const char* end = data + size;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+    qint64 v = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p)
+        v = v*10 + (*p - '0');
+    return negative ? -v : v;
+}
+
+double OsmXmlReader::Span::toDouble() const
+{
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15
+    };
+
+    /* Plain decimals of up to 15 digits, as in coordinates, are exact as
+     * an integer divided by a power of ten; the rest goes to strtod */
+    const char* p = data;
+    const char* end = data + size;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+    qint64 mantissa = 0;
+    int digits = 0;
+    int decimals = -1;
+    for (; p < end; ++p) {
+        if (*p >= '0' && *p <= '9') {
+            mantissa = mantissa*10 + (*p - '0');
+            ++digits;
+            if (decimals >= 0)
+                ++decimals;
+        } else if (*p == '.' && decimals < 0)
+            decimals = 0;
+        else
+            break;
+    }
+    if (p != end || digits == 0 || digits > 15)
+        return QByteArray(data, size).toDouble();
+
+    double v = decimals > 0 ? mantissa / powers[decimals] : (double)mantissa;
+    return negative ? -v : v;
+}
+
+/*********************/
+
+OsmXmlReader::OsmXmlReader(QIODevice* aDevice)
+    : theDevice(aDevice), thePos(0), theBufferOffset(0), hasPendingEnd(false)
+{
+}
+
+OsmXmlReader::Span OsmXmlReader::attribute(const char* aName) const
+{
+    for (int i=0; i<theAttributes.size(); ++i)
+        if (theAttributes[i].Name == aName)
+            return theAttributes[i].Value;
+    return Span();
+}
+
+OsmXmlReader::Token OsmXmlReader::fail(const QString& error)
+{
+    theError = QString("%1 at byte %2").arg(error).arg(position());
+    return Invalid;
+}
+
+/* Drops what was parsed and appends the next chunk of the device */
+bool OsmXmlReader::fill()
+{
+    theBuffer.remove(0, thePos);
+    theBufferOffset += thePos;
+    thePos = 0;
+
+    QByteArray more = theDevice->read(READ_CHUNK);
+    if (more.isEmpty())
+        return false;
+    theBuffer.append(more);
+    return true;
+}
+
+/* Index just past the markup starting at lt, or -1 if it is not all in the
+ * buffer yet */
+int OsmXmlReader::tagEnd(int lt) const
+{
+    const char* b = theBuffer.constData();
+    const int size = theBuffer.size();
+    const char* p = b + lt + 1;
+    const int avail = size - lt - 1;
+
+    int i;
+    if (avail >= 3 && !memcmp(p, "!--", 3)) {
+        i = theBuffer.indexOf("-->", lt + 4);
+        return i < 0 ? -1 : i + 3;
+    }
+    if (avail >= 8 && !memcmp(p, "![CDATA[", 8)) {
+        i = theBuffer.indexOf("]]>", lt + 9);
+        return i < 0 ? -1 : i + 3;
+    }
+    if (avail >= 1 && *p == '?') {
+        i = theBuffer.indexOf("?>", lt + 2);
+        return i < 0 ? -1 : i + 2;
+    }
+
+    /* A '>' may be in an attribute value */
+    char quote = 0;
+    for (i = lt + 1; i < size; ++i) {
+        char c = b[i];
+        if (quote) {
+            if (c == quote)
+                quote = 0;
+        } else if (c == '"' || c == '\'')
+            quote = c;
+        else if (c == '>')
+            return i + 1;
+    }
+    return -1;
+}
+
+bool OsmXmlReader::parseAttributes(const char* p, const char* end)
+{
+    theAttributes.clear();
+    for (;;) {
+        while (p < end && isSpace(*p))
+            ++p;
+        if (p == end)
+            return true;
+
+        Attribute a;
+        const char* n = p;
+        while (p < end && *p != '=' && !isSpace(*p))
+            ++p;
+        a.Name = Span(n, p - n);
+        while (p < end && isSpace(*p))
+            ++p;
+        if (p == end || *p != '=' || a.Name.size == 0)
+            return false;
+        ++p;
+        while (p < end && isSpace(*p))
+            ++p;
+        if (p == end || (*p != '"' && *p != '\''))
+            return false;
+        char quote = *p++;
+        const char* v = p;
+        while (p < end && *p != quote)
+            ++p;
+        if (p == end)
+            return false;
+        a.Value = Span(v, p - v);
+        ++p;
+        theAttributes.append(a);
+    }
+}
+
+/* Only UTF-8 and its ASCII subset are read: fails on the XML declaration
+ * (between "<?" and ">") of any other encoding */
+bool OsmXmlReader::checkDeclaration(const char* p, const char* end)
+{
+    if (end - p < 4 || memcmp(p, "xml", 3) || !isSpace(p[3]))
+        return true;
+    if (end[-1] == '?')
+        --end;
+    if (!parseAttributes(p + 3, end)) {
+        fail("Invalid XML declaration");
+        return false;
+    }
+    Span encoding = attribute("encoding");
+    theAttributes.clear();
+    if (encoding.isNull())
+        return true;
+    QByteArray name = encoding.bytes().toLower();
+    if (name == "utf-8" || name == "utf8" || name == "us-ascii" || name == "ascii")
+        return true;
+    fail(QString("Unsupported encoding %1, only UTF-8 is read").arg(QString::fromLatin1(name)));
+    return false;
+}
+
+OsmXmlReader::Token OsmXmlReader::readNext()
+{
+    if (hasPendingEnd) {
+        /* The buffer is unchanged since the <element/>: its name still holds */
+        hasPendingEnd = false;
+        return EndElement;
+    }
+
+    for (;;) {
+        int lt = theBuffer.indexOf('<', thePos);
+        if (lt < 0) {
+            thePos = theBuffer.size();
+            if (!fill())
+                return EndDocument;
+            continue;
+        }
+        thePos = lt;
+        int end = tagEnd(lt);
+        if (end < 0) {
+            if (!fill())
+                return fail("Unexpected end of document");
+            continue;
+        }
+        thePos = end;
+
+        const char* b = theBuffer.constData();
+        const char* p = b + lt + 1;
+        const char* e = b + end - 1;     /* the '>' */
+        if (*p == '\0')
+            return fail("UTF-16 documents are not supported");
+        if (*p == '?') {
+            if (!checkDeclaration(p + 1, e))
+                return Invalid;
+            continue;
+        }
+        if (*p == '!')
+            continue;
+
+        if (*p == '/') {
+            const char* n = ++p;
+            while (p < e && !isSpace(*p))
+                ++p;
+            theName = Span(n, p - n);
+            theAttributes.clear();
+            return EndElement;
+        }
+
+        if (e > p && e[-1] == '/') {
+            hasPendingEnd = true;
+            --e;
+        }
+        const char* n = p;
+        while (p < e && !isSpace(*p))
+            ++p;
+        theName = Span(n, p - n);
+        if (!theName.size)
+            return fail("Element without a name");
+        if (!parseAttributes(p, e))
+            return fail(QString("Invalid attributes in <%1>").arg(QString::fromUtf8(theName.data, theName.size)));
+        return StartElement;
+    }
+}
@@ -0,0 +1,88 @@
+//
+// C++ Interface: OsmXmlReader
+//
+// Description: Pull parser for OSM XML. Works on the UTF-8 bytes read from
+//              the device: names and attribute values are spans of its buffer,
+//              numbers are parsed from them without building strings.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#ifndef OSMXMLREADER_H
+#define OSMXMLREADER_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVarLengthArray>
+
+class QIODevice;
+
+/**
+ * Only what OSM files use is supported: elements, attributes, the
+ * predefined and numeric entities in attribute values. Text, comments,
+ * processing instructions, CDATA and the doctype are skipped; namespaces
+ * are not resolved and the encoding must be UTF-8: documents declaring
+ * another encoding, or in UTF-16, are rejected as invalid.
+ */
+class OsmXmlReader
+{
+public:
+    /* Bytes of the buffer, valid until the next readNext() */
+    struct Span
+    {
+        Span() : data(0), size(0) {}
+        Span(const char* aData, int aSize) : data(aData), size(aSize) {}
+
+        const char* data;
+        int size;
+
+        bool isNull() const { return !data; }
+        bool operator==(const char* s) const;
+        bool operator!=(const char* s) const { return !operator==(s); }
+        /* Not copied: only for lookups while the span is valid */
+        QByteArray bytes() const { return QByteArray::fromRawData(data, size); }
+        /* With the entities decoded */
+        QString toString() const;
+        qint64 toLongLong() const;
+        int toInt() const { return (int)toLongLong(); }
+        double toDouble() const;
+    };
+
+    enum Token { StartElement, EndElement, EndDocument, Invalid };
+
+    OsmXmlReader(QIODevice* aDevice);
+
+    Token readNext();
+    Span name() const { return theName; }
+    /* Null if the current element has no such attribute */
+    Span attribute(const char* aName) const;
+
+    /* Bytes of the device parsed so far */
+    qint64 position() const { return theBufferOffset + thePos; }
+    QString errorString() const { return theError; }
+
+private:
+    bool fill();
+    int tagEnd(int lt) const;
+    Token fail(const QString& error);
+    bool parseAttributes(const char* p, const char* end);
+    bool checkDeclaration(const char* p, const char* end);
+
+    struct Attribute
+    {
+        Span Name;
+        Span Value;
+    };
+
+    QIODevice* theDevice;
+    QByteArray theBuffer;
+    int thePos;
+    qint64 theBufferOffset;
+    Span theName;
+    QVarLengthArray<Attribute, 16> theAttributes;
+    bool hasPendingEnd;
+    QString theError;
+};
+
+#endif // OSMXMLREADER_H
@@ -184,6 +184,22 @@ void Layer::deleteFeature(Feature* aFeature)
     }
 }
 
+void Layer::deleteFeatures(const QSet<Feature*>& Features)
+{
+    QList<Feature*> kept;
+    kept.reserve(p->Features.size());
+    foreach (Feature* F, p->Features) {
+        if (!Features.contains(F)) {
+            kept.append(F);
+            continue;
+        }
+        g_backend.deallocFeature(this, F);
+        F->setLayer(0);
+        notifyIdUpdate(F->id(),0);
+    }
+    p->Features = kept;
+}
+
 void Layer::clear()
 {
     while (p->Features.count())
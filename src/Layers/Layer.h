@@ -6,6 +6,7 @@
 #include "Feature.h"
 
 #include <QProgressDialog>
+#include <QSet>
 
 #include "ILayer.h"
 
@@ -78,6 +79,10 @@ public:
     virtual void add(Feature* aFeature);
     virtual void remove(Feature* aFeature);
     virtual void deleteFeature(Feature* aFeature);
+    /* deleteFeature() on each of them, in one pass over the layer. Like
+     * deleteFeature(), no command is made: nothing, the undo history
+     * included, may still refer to them. */
+    void deleteFeatures(const QSet<Feature*>& Features);
     virtual void clear();
     virtual void deleteAll();
     bool exists(Feature* aFeature) const;
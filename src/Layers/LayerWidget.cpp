@@ -206,7 +206,7 @@ void LayerWidget::initActions()
 void LayerWidget::setOpacity(QAction *act)
 {
     theLayer->setAlpha(act->data().toDouble());
-    emit (layerChanged(this, false));
+    emit (layerAppearanceChanged(this));
 }
 
 void LayerWidget::close()
@@ -265,7 +265,7 @@ void LayerWidget::setLayerVisible(bool b, bool updateLayer)
 
     if (updateLayer) {
         theLayer->setVisible(b);
-        emit(layerChanged(this, false));
+        emit(layerAppearanceChanged(this));
     }
 }
 
@@ -274,7 +274,7 @@ void LayerWidget::setLayerReadonly(bool b)
     theLayer->setReadonly(b);
     actReadonly->setChecked(b);
     update();
-    emit(layerChanged(this, false));
+    emit(layerAppearanceChanged(this));
 }
 
 void LayerWidget::associatedAboutToShow()
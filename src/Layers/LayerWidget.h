@@ -54,6 +54,8 @@ protected:
 signals:
     void layerSelected(LayerWidget *);
     void layerChanged(LayerWidget *, bool adjustViewport);
+    /* Visibility, alpha or read-only state changed, not the features */
+    void layerAppearanceChanged(LayerWidget *);
     void layerClosed(Layer *);
     void layerCleared(Layer *);
     void layerZoom(Layer *);
@@ -4,11 +4,20 @@
 
 #include "Document.h"
 #include "MapRenderer.h"
+#include "MapView.h"
+#include "Feature.h"
+#include "TrackSegment.h"
 #include "MerkaartorPreferences.h"
+#include "RenderStatistics.h"
 
-#if QT_VERSION >= 0x050000
-#include <QtConcurrent>
-#endif
+#include <QColor>
+#include <QElapsedTimer>
+#include <QFutureInterface>
+#include <QRunnable>
+#include <QSet>
+#include <QSharedPointer>
+#include <QThreadPool>
+#include <QVector>
 
 inline uint qHash(const QPoint& p)
 {
@@ -20,6 +29,9 @@ inline uint qHash(const QPoint& p)
 #define TILE_X(t) t.x()
 #define TILE_Y(t) t.y()
 
+/* Duration of the cross-fade from the placeholder to the new tiles */
+#define TILE_FADE_MSECS 250
+
 /* Static member declaration. */
 QReadWriteLock OsmRenderLayer::renderLock;
 
@@ -27,115 +39,452 @@ QReadWriteLock OsmRenderLayer::renderLock;
  * This is a helper class to manage rendered tiles and their lifecycle. Any
  * reference to the images here can vanish at any point in time. Do not escape
  * the pointers!
+ *
+ * Each tile has one image per document layer, composited when drawn, so that
+ * the visibility, order or alpha of a layer can change without rendering the
+ * others again. The images of the wireframe renderer, which draws all the
+ * layers at once, are stored under the 0 layer.
  */
 class TileContainer : public QObject
 {
 public:
+    /* A null image means that the layer has nothing on the tile */
+    typedef QHash<Layer*, QImage*> Images;
+
     TileContainer(QObject* parent) : QObject(parent) {}
     /**
      * Insert and take ownership of the image contained. Replaced entries will
      * be automatically deleted.
      */
-    void insert(const TILE_TYPE& k, QImage* v)
+    void insert(const TILE_TYPE& k, Layer* l, QImage* v)
     {
-        if (m_container.contains(k)) {
-            delete m_container.value(k);
-        }
-        m_container.insert(k, v);
+        Images& images = m_container[k];
+        delete images.value(l, nullptr);
+        images.insert(l, v);
+    }
+    /* Marks the tile as rendered, even if no layer has anything on it */
+    void insert(const TILE_TYPE& k)
+    {
+        m_container[k];
     }
     bool contains(const TILE_TYPE& k)
     {
         return m_container.contains(k);
     }
-    QImage* get(const TILE_TYPE& k)
+    bool contains(const TILE_TYPE& k, Layer* l)
     {
-        return m_container.value(k, nullptr);
+        QHash<TILE_TYPE, Images>::const_iterator it = m_container.constFind(k);
+        return it != m_container.constEnd() && it.value().contains(l);
+    }
+    bool isEmpty() const
+    {
+        return m_container.isEmpty();
+    }
+    const Images* get(const TILE_TYPE& k)
+    {
+        QHash<TILE_TYPE, Images>::const_iterator it = m_container.constFind(k);
+        return it == m_container.constEnd() ? nullptr : &it.value();
+    }
+    /* Drops the images of a layer, to have it rendered again */
+    void remove(Layer* l)
+    {
+        for (auto it = m_container.begin(); it != m_container.end(); ++it)
+            delete it.value().take(l);
+    }
+    /* Drops the images of the layers not in theLayers (removed from the document) */
+    void retain(const QSet<Layer*>& theLayers)
+    {
+        for (auto it = m_container.begin(); it != m_container.end(); ++it) {
+            Images& images = it.value();
+            for (auto i = images.begin(); i != images.end(); ) {
+                if (i.key() && !theLayers.contains(i.key())) {
+                    delete i.value();
+                    i = images.erase(i);
+                } else
+                    ++i;
+            }
+        }
     }
     void clear() {
-        for ( auto value : m_container ) {
-            delete value;
+        for ( auto& images : m_container ) {
+            qDeleteAll(images);
         }
         m_container.clear();
     }
 private:
-    QHash<const TILE_TYPE, QImage*> m_container;
+    QHash<TILE_TYPE, Images> m_container;
 };
 
+/* The images of a tile in the order of the layers, with their opacity */
+static void drawTileImages(QPainter* P, const TileContainer::Images& images, const QList<QPair<Layer*, qreal> >& theLayers,
+                           const QPointF& tl, qreal opacity)
+{
+    for (int k=0; k<theLayers.size(); ++k) {
+        QImage* img = images.value(theLayers[k].first, nullptr);
+        if (!img)
+            continue;
+        P->setOpacity(opacity * theLayers[k].second);
+        P->drawImage(tl, *img);
+    }
+}
+
 /**
- * A helper class for QtConcurrent::map(). An instance is created and the
- * operator() is called for each element that needs processing.
+ * The state shared by the workers rendering one set of tiles. The future
+ * interface provides the QFuture used for cancellation, progress and the
+ * finished notification.
  */
-class RenderTile
+class RenderBatch
 {
 public:
-    RenderTile(OsmRenderLayer* orl)
-        : p(orl) { }
+    RenderBatch(const QList<TILE_TYPE>& aTiles, int aWorkers)
+        : tiles(aTiles), next(0), done(0), running(aWorkers)
+    {
+        fi.reportStarted();
+        fi.setProgressRange(0, tiles.size());
+    }
 
-    typedef void result_type;
+    QFutureInterface<void> fi;
+    QList<TILE_TYPE> tiles;
+    QAtomicInt next;
+    QAtomicInt done;
+    QAtomicInt running;
+};
+
+/**
+ * A worker started on the global thread pool. Each worker takes the next
+ * tile of the batch until none is left or the batch is cancelled; the last
+ * worker to leave reports the batch as finished.
+ */
+class RenderTile : public QRunnable
+{
+public:
+    RenderTile(OsmRenderLayer* orl, const QSharedPointer<RenderBatch>& aBatch)
+        : p(orl), batch(aBatch) { }
 
-    void operator()(const TILE_TYPE& theTile)
+    void run()
     {
-        if (!p->theDocument)
-            return;
+        for (;;) {
+            if (batch->fi.isCanceled())
+                break;
+            int i = batch->next.fetchAndAddOrdered(1);
+            if (i >= batch->tiles.size())
+                break;
+            p->renderTile(batch->tiles.at(i));
+            batch->fi.setProgressValue(batch->done.fetchAndAddOrdered(1) + 1);
+            p->wakeWaiters();
+        }
+        if (batch->running.fetchAndAddOrdered(-1) == 1) {
+            /* Report under the mutex: cancel() takes it after waiting, so
+             * the layer is not touched anymore once it returns. */
+            p->waitMutex.lock();
+            batch->fi.reportFinished();
+            p->tileRendered.wakeAll();
+            p->waitMutex.unlock();
+        }
+    }
 
-        if (!p->renderLock.tryLockForRead()) return;
-        p->theDocument->lockPainters();
+    OsmRenderLayer* p;
+    QSharedPointer<RenderBatch> batch;
+};
 
-        TILE_TYPE tile = theTile;
+/**************************/
 
-        QPointF projTL((TILE_X(tile)*p->tileSizeCoordW)+p->tileOriginCoord.x(), (TILE_Y(tile)*p->tileSizeCoordH)+p->tileOriginCoord.y());
-        QPointF projBR(((TILE_X(tile)+1)*p->tileSizeCoordW)+p->tileOriginCoord.x(), ((TILE_Y(tile)+1)*p->tileSizeCoordH)+p->tileOriginCoord.y());
-        QRectF projR(projTL, projBR);
+OsmRenderLayer::OsmRenderLayer(QObject *parent)
+    : QObject(parent)
+    , theDocument(0)
+    , theStatisticsName("styled")
+    , tiles(new TileContainer(this))
+    , layerCompositing(false)
+    , placeholderTiles(new TileContainer(this))
+    , hasPlaceholderTiles(false)
+    , thePriority(NormalPriority)
+{
+    fadeClock.start();
+    fadeTimer.setSingleShot(true);
+    fadeTimer.setInterval(40);
+    connect(&fadeTimer, SIGNAL(timeout()), SIGNAL(renderingProgress()));
+    connect(&(renderGatheringWatcher), SIGNAL(finished()), SIGNAL(renderingDone()));
+    connect(&(renderGatheringWatcher), SIGNAL(progressValueChanged(int)), SIGNAL(renderingProgress()));
+}
+
+void OsmRenderLayer::renderTile(const TILE_TYPE& theTile)
+{
+    if (!theDocument)
+        return;
+
+    if (!renderLock.tryLockForRead()) return;
+    theDocument->lockPainters();
+
+    TILE_TYPE tile = theTile;
+
+    QElapsedTimer timer;
+    TileStatistics stats;
+    bool withStats = M_RENDERSTATS->isEnabled();
+    if (withStats)
+        timer.start();
+
+    QPointF projTL((TILE_X(tile)*tileSizeCoordW)+tileOriginCoord.x(), (TILE_Y(tile)*tileSizeCoordH)+tileOriginCoord.y());
+    QPointF projBR(((TILE_X(tile)+1)*tileSizeCoordW)+tileOriginCoord.x(), ((TILE_Y(tile)+1)*tileSizeCoordH)+tileOriginCoord.y());
+    QRectF projR(projTL, projBR);
 
 #define TILE_SURROUND 2.0
-        qreal z = TILE_SURROUND * ((TILE_SIZE*TILE_SURROUND) / (p->theTransform.m11()*projR.width()*TILE_SURROUND));    // Adjust to main transform
-        qreal dlat = (projR.top()-projR.bottom())*(z-1)/2;
-        qreal dlon = (projR.right()-projR.left())*(z-1)/2;
-        projR.setBottom(projR.bottom()-dlat);
-        projR.setLeft(projR.left()-dlon);
-        projR.setTop(projR.top()+dlat);
-        projR.setRight(projR.right()+dlon);
-
-        Coord tl = p->theProjection.inverse2Coord(projR.topLeft());
-        Coord br = p->theProjection.inverse2Coord(projR.bottomRight());
-        CoordBox invalidRect(tl, br);
+    qreal z = TILE_SURROUND * ((TILE_SIZE*TILE_SURROUND) / (theTransform.m11()*projR.width()*TILE_SURROUND));    // Adjust to main transform
+    qreal dlat = (projR.top()-projR.bottom())*(z-1)/2;
+    qreal dlon = (projR.right()-projR.left())*(z-1)/2;
+    projR.setBottom(projR.bottom()-dlat);
+    projR.setLeft(projR.left()-dlon);
+    projR.setTop(projR.top()+dlat);
+    projR.setRight(projR.right()+dlon);
+
+    Coord tl = theProjection.inverse2Coord(projR.topLeft());
+    Coord br = theProjection.inverse2Coord(projR.bottomRight());
+    CoordBox invalidRect(tl, br);
 
+    /* With layer compositing, only the visible layers missing on the tile
+     * are rendered, each to its own image: all of them after a redraw, a
+     * single one when it was just made visible. Otherwise all the layers are
+     * rendered together to the 0 image, so that the style priorities and
+     * the labels apply across layers. */
+    QList<Layer*> theLayers;
+    if (layerCompositing) {
+        tileLock.lockForRead();
+        for (int i=0; i<theDocument->layerSize(); ++i) {
+            Layer* L = theDocument->getLayer(i);
+            if (L->isVisible() && !tiles->contains(tile, L))
+                theLayers << L;
+        }
+        tileLock.unlock();
+    } else
+        theLayers << 0;
+
+    QList<QPair<Layer*, QImage*> > images;
+    g_backend.delayDeletes();
+    foreach (Layer* L, theLayers) {
         QMap<RenderPriority, QSet <Feature*> > theFeatures;
+        qint64 gatherStart = withStats ? timer.nsecsElapsed() : 0;
+        for (int i=0; i<theDocument->layerSize(); ++i) {
+            Layer* source = theDocument->getLayer(i);
+            if (!L || source == L)
+                g_backend.getFeatureSet(source, theFeatures, invalidRect, theProjection,
+                                        withStats ? &stats.nsecs[TileStatistics::BuildPath] : 0);
+        }
+        if (withStats)
+            stats.nsecs[TileStatistics::Gather] += timer.nsecsElapsed() - gatherStart;
 
-        g_backend.delayDeletes();
-        for (int i=0; i<p->theDocument->layerSize(); ++i)
-            g_backend.getFeatureSet(p->theDocument->getLayer(i), theFeatures, invalidRect, p->theProjection);
+        QImage* img = 0;
+        if (!theFeatures.isEmpty()) {
+            img = new QImage(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32);
+            img->fill(Qt::transparent);
 
-        QImage* img = new QImage(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32);
-        img->fill(Qt::transparent);
+            QPainter P(img);
+            if (M_PREFS->getUseAntiAlias())
+                P.setRenderHint(QPainter::Antialiasing);
+            MapRenderer r;
+            r.theLayerComposited = (L != 0);
+            if (withStats)
+                r.theStatistics = &stats;
+            r.render(&P, theFeatures, projR, /*QRect(0, 0, TILE_SIZE, TILE_SIZE)*/QRect(-((TILE_SIZE*TILE_SURROUND)-TILE_SIZE)/2, -((TILE_SIZE*TILE_SURROUND)-TILE_SIZE)/2, TILE_SIZE*TILE_SURROUND, TILE_SIZE*TILE_SURROUND), PixelPerM, ROptions);
+            P.end();
+        }
+        images << qMakePair(L, img);
+    }
+    g_backend.resumeDeletes();
+    theDocument->unlockPainters();
+    renderLock.unlock();
 
-        QPainter P(img);
-        if (M_PREFS->getUseAntiAlias())
-            P.setRenderHint(QPainter::Antialiasing);
-        MapRenderer r;
-        r.render(&P, theFeatures, projR, /*QRect(0, 0, TILE_SIZE, TILE_SIZE)*/QRect(-((TILE_SIZE*TILE_SURROUND)-TILE_SIZE)/2, -((TILE_SIZE*TILE_SURROUND)-TILE_SIZE)/2, TILE_SIZE*TILE_SURROUND, TILE_SIZE*TILE_SURROUND), p->PixelPerM, p->ROptions);
-        P.end();
-        g_backend.resumeDeletes();
-        p->theDocument->unlockPainters();
-        p->renderLock.unlock();
+    /* Insert the tile into the results map. Take care to remove the original item first. */
+    tileLock.lockForWrite();
+    if (!tiles->contains(tile)) {
+        tiles->insert(tile);
+        markTileReady(tile);
+    }
+    for (int i=0; i<images.size(); ++i)
+        tiles->insert(tile, images[i].first, images[i].second);
+    if (withStats)
+        recordStatistics(tile, stats, timer.nsecsElapsed());
+    tileLock.unlock();
+}
+
+/* Called with tileLock held for writing */
+void OsmRenderLayer::recordStatistics(const TILE_TYPE& tile, TileStatistics& stats, qint64 totalNsecs)
+{
+    stats.renderer = theStatisticsName;
+    stats.tile = tile;
+    stats.pixelPerM = PixelPerM;
+    stats.totalNsecs = totalNsecs;
+    tileStatistics.insert(tile, stats);
+    M_RENDERSTATS->record(stats);
+}
+
+void OsmRenderLayer::drawStatistics(QPainter *P)
+{
+    P->save();
+    P->setFont(QFont(P->font().family(), 7));
+
+    tileLock.lockForRead();
+    QPointF origin = theTransform.map(tileOriginCoord);
+    for (int i=tileViewport.top(); i<=tileViewport.bottom(); ++i) {
+        for (int j=tileViewport.left(); j<=tileViewport.right(); ++j) {
+            QHash<TILE_TYPE, TileStatistics>::const_iterator it = tileStatistics.constFind(TILE_CONSTRUCTOR(j, i));
+            if (it == tileStatistics.constEnd())
+                continue;
+            const TileStatistics& s = it.value();
+
+            QRectF R(QPointF((j*TILE_SIZE)+origin.x(), (i*TILE_SIZE)+origin.y()), QSizeF(TILE_SIZE, TILE_SIZE));
+            P->setPen(QPen(QColor(255, 0, 0, 128), 1, Qt::DashLine));
+            P->setBrush(Qt::NoBrush);
+            P->drawRect(R);
+
+            QString text = QString("%1 %2 ms\n").arg(s.renderer).arg(s.totalNsecs / 1e6, 0, 'f', 1);
+            for (int k=0; k<TileStatistics::StageCount; ++k)
+                if (s.nsecs[k])
+                    text += QString("%1 %2\n").arg(TileStatistics::stageName(k)).arg(s.nsecs[k] / 1e6, 0, 'f', 1);
+            text += QString("%1w %2n %3r %4o").arg(s.ways).arg(s.nodes).arg(s.relations).arg(s.others);
+
+            QRectF textR = P->boundingRect(R.adjusted(4, 4, -4, -4), Qt::AlignLeft | Qt::AlignTop, text);
+            P->fillRect(textR.adjusted(-2, -1, 2, 1), QColor(255, 255, 255, 192));
+            P->setPen(Qt::black);
+            P->drawText(textR, Qt::AlignLeft | Qt::AlignTop, text);
+        }
+    }
+    tileLock.unlock();
+
+    P->restore();
+}
 
-        /* Insert the tile into the results map. Take care to remove the original item first. */
-        p->tileLock.lockForWrite();
-        p->tiles->insert(tile,img);
-        p->tileLock.unlock();
+void OsmRenderLayer::clearTiles()
+{
+    tiles->clear();
+    tileStatistics.clear();
+    tileFadeStart.clear();
+}
+
+/* Called with tileLock held for writing */
+void OsmRenderLayer::markTileReady(const TILE_TYPE& tile)
+{
+    if (hasPlaceholderTiles)
+        tileFadeStart.insert(tile, fadeClock.elapsed());
+}
+
+/* Called with tileLock held for writing, before the new transform is set */
+void OsmRenderLayer::keepPlaceholder(const Projection& aProjection, const QTransform& aTransform)
+{
+    /* Only a complete set of tiles is worth keeping: while zooming
+     * repeatedly, stay on the last one that finished. At the same scale
+     * (edits, style changes), the old tiles would only flash the change. */
+    bool complete = renderGathering.isFinished() && !renderGathering.isCanceled() && !tiles->isEmpty();
+    bool zoomed = !qFuzzyCompare(theTransform.m11(), aTransform.m11()) || !qFuzzyCompare(theTransform.m22(), aTransform.m22());
+    if (thePriority != NormalPriority || theProjection.projectionRevision() != aProjection.projectionRevision() || !zoomed) {
+        dropPlaceholder();
+    } else if (complete) {
+        qSwap(tiles, placeholderTiles);
+        placeholderTransform = theTransform;
+        placeholderOriginCoord = tileOriginCoord;
+        placeholderViewport = tileViewport;
+        hasPlaceholderTiles = true;
     }
+}
 
-    OsmRenderLayer* p;
-};
+/* Called with tileLock held for writing */
+void OsmRenderLayer::dropPlaceholder()
+{
+    placeholderTiles->clear();
+    hasPlaceholderTiles = false;
+    tileFadeStart.clear();
+}
 
-/**************************/
+/* Opacity of a new tile fading in over the placeholder; called with tileLock held */
+qreal OsmRenderLayer::tileOpacity(const TILE_TYPE& tile, qint64 now) const
+{
+    QHash<TILE_TYPE, qint64>::const_iterator it = tileFadeStart.constFind(tile);
+    if (it == tileFadeStart.constEnd())
+        return 1.0;
+    return qBound<qreal>(0.0, qreal(now - it.value()) / TILE_FADE_MSECS, 1.0);
+}
 
-OsmRenderLayer::OsmRenderLayer(QObject *parent)
-    : QObject(parent)
-    , theDocument(0)
-    , tiles(new TileContainer(this))
+bool OsmRenderLayer::hasPlaceholder()
 {
-    connect(&(renderGatheringWatcher), SIGNAL(finished()), SIGNAL(renderingDone()));
+    tileLock.lockForRead();
+    bool result = hasPlaceholderTiles;
+    tileLock.unlock();
+    return result;
+}
+
+/**
+ * Draws the tiles of the previous transform, scaled to the current one,
+ * wherever the new tiles are missing or still fading in.
+ */
+void OsmRenderLayer::drawPlaceholder(QPainter *P)
+{
+    tileLock.lockForRead();
+    if (!hasPlaceholderTiles) {
+        tileLock.unlock();
+        return;
+    }
+
+    qint64 now = fadeClock.elapsed();
+    bool fading = false;
+    QPointF origin = theTransform.map(tileOriginCoord);
+    QRegion uncovered(QRect(QPoint(tileViewport.left()*TILE_SIZE, tileViewport.top()*TILE_SIZE) + origin.toPoint(),
+                            QSize(tileViewport.width()*TILE_SIZE, tileViewport.height()*TILE_SIZE)));
+    QList<QPair<QRect, qreal> > fadingRects;
+    for (int i=tileViewport.top(); i<=tileViewport.bottom(); ++i) {
+        for (int j=tileViewport.left(); j<=tileViewport.right(); ++j) {
+            TILE_TYPE tile = TILE_CONSTRUCTOR(j, i);
+            if (!tiles->contains(tile))
+                continue;
+            QRect R(QPoint(j*TILE_SIZE, i*TILE_SIZE) + origin.toPoint(), QSize(TILE_SIZE, TILE_SIZE));
+            uncovered -= R;
+            qreal opacity = tileOpacity(tile, now);
+            if (opacity < 1.0) {
+                fadingRects << qMakePair(R, 1.0 - opacity);
+                fading = true;
+            }
+        }
+    }
+
+    /* Map the old screen coordinates to the current ones */
+    QTransform T = placeholderTransform.inverted() * theTransform;
+    QPointF oldOrigin = placeholderTransform.map(placeholderOriginCoord);
+    QList<QPair<Layer*, qreal> > theLayers = compositedLayers();
+
+    P->save();
+    P->setRenderHint(QPainter::SmoothPixmapTransform);
+    qreal baseOpacity = P->opacity();
+    for (int k=-1; k<fadingRects.size(); ++k) {
+        qreal opacity = baseOpacity;
+        if (k < 0) {
+            if (uncovered.isEmpty())
+                continue;
+            P->setClipRegion(uncovered);
+        } else {
+            P->setClipRect(fadingRects[k].first);
+            opacity *= fadingRects[k].second;
+        }
+        P->save();
+        P->setTransform(T, true);
+        for (int i=placeholderViewport.top(); i<=placeholderViewport.bottom(); ++i) {
+            for (int j=placeholderViewport.left(); j<=placeholderViewport.right(); ++j) {
+                const TileContainer::Images* images = placeholderTiles->get(TILE_CONSTRUCTOR(j, i));
+                if (images)
+                    drawTileImages(P, *images, theLayers, QPointF((j*TILE_SIZE)+oldOrigin.x(), (i*TILE_SIZE)+oldOrigin.y()), opacity);
+            }
+        }
+        P->restore();
+    }
+    P->restore();
+
+    bool finished = uncovered.isEmpty() && !fading && renderGathering.isFinished();
+    tileLock.unlock();
+
+    if (fading)
+        fadeTimer.start();
+    else if (finished) {
+        /* The new tiles cover the view: the placeholder is not needed anymore */
+        tileLock.lockForWrite();
+        dropPlaceholder();
+        tileLock.unlock();
+    }
 }
 
 void OsmRenderLayer::setDocument(Document *aDocument)
@@ -156,26 +505,27 @@ void OsmRenderLayer::setProjection(const Projection& aProjection)
 
 void OsmRenderLayer::forceRedraw(const Projection& aProjection, const QTransform &aTransform, const QRect& rect, qreal ppm, const RendererOptions& roptions)
 {
-    if (renderGathering.isRunning()) {
-        renderGathering.cancel();
-        renderGathering.waitForFinished();
-    }
+    cancel();
 
     if (!theDocument)
         return;
 
     if (!renderLock.tryLockForRead()) return;
 
+    /* Clear the cache and rendered tiles. Any settings could have changed.
+     * The last complete tiles are kept to be drawn until replaced. */
+    tileLock.lockForWrite();
+    keepPlaceholder(aProjection, aTransform);
+    clearTiles();
+    updateLayerStates(false);
+    tileLock.unlock();
+
     setProjection(aProjection);
     setTransform(aTransform);
 
     PixelPerM = ppm;
     ROptions = roptions;
-
-    /* Clear the cache and rendered tiles. Any settings could have changed. */
-    tileLock.lockForWrite();
-    tiles->clear();
-    tileLock.unlock();
+    layerCompositing = M_PREFS->getLayerCompositing();
 
     tileOriginCoord = theInvertedTransform.map(QPointF(rect.topLeft()));
 
@@ -199,21 +549,18 @@ void OsmRenderLayer::forceRedraw(const Projection& aProjection, const QTransform
             tilesToRender << tile;
         }
     }
+    if (M_RENDERSTATS->isEnabled())
+        M_RENDERSTATS->recordCache(theStatisticsName, 0, tilesToRender.size());
 
-    if (tilesToRender.size()) {
-        renderGathering = QtConcurrent::map(tilesToRender, RenderTile(this));
-        renderGatheringWatcher.setFuture(renderGathering);
-    }
+    if (tilesToRender.size())
+        startRendering();
 
     renderLock.unlock();
 }
 
 void OsmRenderLayer::pan(QPoint delta)
 {
-    if (renderGathering.isRunning()) {
-        renderGathering.cancel();
-        renderGathering.waitForFinished();
-    }
+    cancel();
 
     theTransform.translate((qreal)(delta.x())/theTransform.m11(), (qreal)(delta.y())/theTransform.m22());
     theInvertedTransform = theTransform.inverted();
@@ -227,30 +574,147 @@ void OsmRenderLayer::pan(QPoint delta)
 
     tileLock.lockForWrite();
     tilesToRender.clear();
+    int hits = 0;
     for (int i=tileViewport.top(); i<=tileViewport.bottom(); ++i)
         for (int j=tileViewport.left(); j<=tileViewport.right(); ++j) {
             TILE_TYPE tile = TILE_CONSTRUCTOR(j, i);
-            if (!tiles->contains(tile)) {
+            if (!isTileComplete(tile)) {
                 tilesToRender << tile;
-            }
+            } else
+                ++hits;
         }
     tileLock.unlock();
+    if (M_RENDERSTATS->isEnabled())
+        M_RENDERSTATS->recordCache(theStatisticsName, hits, tilesToRender.size());
+
+    if (tilesToRender.size())
+        startRendering();
+}
+
+void OsmRenderLayer::recomposite()
+{
+    cancel();
 
-    if (tilesToRender.size()) {
-        renderGathering = QtConcurrent::map(tilesToRender, RenderTile(this));
-        renderGatheringWatcher.setFuture(renderGathering);
+    if (!theDocument)
+        return;
+
+    if (!renderLock.tryLockForRead()) return;
+
+    /* Keep the tiles, only render the layers that are missing on them.
+     * Without layer compositing, the tiles have to be rendered again. */
+    tileLock.lockForWrite();
+    if (!layerCompositing)
+        clearTiles();
+    updateLayerStates(true);
+    tilesToRender.clear();
+    int hits = 0;
+    for (int i=tileViewport.top(); i<=tileViewport.bottom(); ++i)
+        for (int j=tileViewport.left(); j<=tileViewport.right(); ++j) {
+            TILE_TYPE tile = TILE_CONSTRUCTOR(j, i);
+            if (!isTileComplete(tile)) {
+                tilesToRender << tile;
+            } else
+                ++hits;
+        }
+    tileLock.unlock();
+    if (M_RENDERSTATS->isEnabled())
+        M_RENDERSTATS->recordCache(theStatisticsName, hits, tilesToRender.size());
+
+    if (tilesToRender.size())
+        startRendering();
+
+    renderLock.unlock();
+}
+
+/* Called with tileLock held */
+bool OsmRenderLayer::isTileComplete(const TILE_TYPE& tile)
+{
+    const TileContainer::Images* images = tiles->get(tile);
+    if (!images)
+        return false;
+    if (images->contains(0) || !theDocument)
+        return true;
+    for (int i=0; i<theDocument->layerSize(); ++i) {
+        Layer* L = theDocument->getLayer(i);
+        if (L->isVisible() && !images->contains(L))
+            return false;
     }
+    return true;
+}
+
+/**
+ * Remembers how each layer was rendered. Called with tileLock held for
+ * writing; if dropChanged, the images of the removed layers are dropped, and
+ * those of the layers whose features would now be drawn differently.
+ */
+void OsmRenderLayer::updateLayerStates(bool dropChanged)
+{
+    QHash<Layer*, int> states;
+    QSet<Layer*> current;
+    bool filtered = false;
+    for (int i=0; i<theDocument->layerSize(); ++i) {
+        Layer* L = theDocument->getLayer(i);
+        states.insert(L, (L->getAlpha() != 1.0 ? 1 : 0) | (L->isReadonly() ? 2 : 0));
+        current << L;
+        if (L->classType() == Layer::FilterLayerType && (L->getAlpha() != 1.0 || L->isReadonly()))
+            filtered = true;
+    }
+
+    if (dropChanged) {
+        tiles->retain(current);
+        placeholderTiles->retain(current);
+        /* The alpha and read-only state of a filter layer only apply to the
+         * features of layers without their own (see MapRenderer::featureAlpha) */
+        if (filtered) {
+            QHash<Layer*, int>::const_iterator it;
+            for (it = states.constBegin(); it != states.constEnd(); ++it)
+                if (layerStates.value(it.key(), it.value()) != it.value())
+                    tiles->remove(it.key());
+        }
+    }
+    layerStates = states;
+}
+
+/* The layers in drawing order with their opacity; the 0 layer stands for the
+ * images showing all the layers */
+QList<QPair<Layer*, qreal> > OsmRenderLayer::compositedLayers() const
+{
+    QList<QPair<Layer*, qreal> > result;
+    result << qMakePair((Layer*)0, (qreal)1.0);
+    if (!theDocument)
+        return result;
+    for (int i=0; i<theDocument->layerSize(); ++i) {
+        Layer* L = theDocument->getLayer(i);
+        if (!L->isVisible())
+            continue;
+        qreal opacity = L->getAlpha();
+        if (L->isReadonly() && !(ROptions.options & RendererOptions::ForPrinting))
+            opacity /= 2.0;
+        result << qMakePair(L, opacity);
+    }
+    return result;
 }
 
 void OsmRenderLayer::drawImage(QPainter *P)
 {
+    drawPlaceholder(P);
+    drawTiles(P, tiles);
+}
+
+void OsmRenderLayer::drawTiles(QPainter *P, TileContainer* theTiles, bool withFade)
+{
+    QList<QPair<Layer*, qreal> > theLayers = compositedLayers();
     tileLock.lockForRead();
+    qint64 now = fadeClock.elapsed();
+    qreal baseOpacity = P->opacity();
     QPointF origin = theTransform.map(tileOriginCoord);
     for (int i=tileViewport.top(); i<=tileViewport.bottom(); ++i) {
         for (int j=tileViewport.left(); j<=tileViewport.right(); ++j) {
-            if (tiles->contains(TILE_CONSTRUCTOR(j, i))) {
+            const TileContainer::Images* images = theTiles->get(TILE_CONSTRUCTOR(j, i));
+            if (images) {
                 QPointF tl = QPointF((j*TILE_SIZE)+origin.x(), (i*TILE_SIZE)+origin.y());
-                P->drawImage(tl, *(tiles->get(TILE_CONSTRUCTOR(j, i))));
+                qreal opacity = withFade ? tileOpacity(TILE_CONSTRUCTOR(j, i), now) : 1.0;
+                drawTileImages(P, *images, theLayers, tl, baseOpacity * opacity);
             }
             /* In some cases, the image is not accessible. This is OK if we are
              * drawing on screen and not everything is ready yet. It might
@@ -258,9 +722,79 @@ void OsmRenderLayer::drawImage(QPainter *P)
              * rendering is done in that case. */
         }
     }
+    P->setOpacity(baseOpacity);
     tileLock.unlock();
 }
 
+void OsmRenderLayer::startRendering()
+{
+    QThreadPool* pool = QThreadPool::globalInstance();
+    int workers = qBound(1, pool->maxThreadCount(), tilesToRender.size());
+
+    QSharedPointer<RenderBatch> batch(new RenderBatch(tilesToRender, workers));
+    renderGathering = batch->fi.future();
+    renderGatheringWatcher.setFuture(renderGathering);
+
+    for (int i=0; i<workers; ++i)
+        pool->start(new RenderTile(this, batch), thePriority);
+}
+
+void OsmRenderLayer::setRenderingPriority(int aPriority)
+{
+    thePriority = aPriority;
+    /* Synchronous renders must not show stale or half faded tiles */
+    if (thePriority != NormalPriority) {
+        tileLock.lockForWrite();
+        dropPlaceholder();
+        tileLock.unlock();
+    }
+}
+
+void OsmRenderLayer::wakeWaiters()
+{
+    waitMutex.lock();
+    tileRendered.wakeAll();
+    waitMutex.unlock();
+}
+
+bool OsmRenderLayer::waitForRendering(int msecs, const RenderProgressCallback& progress)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    while (!renderGathering.isFinished()) {
+        if (progress)
+            progress(renderGathering.progressValue(), renderGathering.progressMaximum());
+
+        /* Wake up at least periodically: a wake-up may be missed between the
+         * check above and the wait below. */
+        unsigned long slice = 100;
+        if (msecs >= 0) {
+            qint64 left = msecs - timer.elapsed();
+            if (left <= 0)
+                return false;
+            slice = qMin<qint64>(slice, left);
+        }
+        waitMutex.lock();
+        if (!renderGathering.isFinished())
+            tileRendered.wait(&waitMutex, slice);
+        waitMutex.unlock();
+    }
+    if (progress)
+        progress(renderGathering.progressMaximum(), renderGathering.progressMaximum());
+    return true;
+}
+
+void OsmRenderLayer::cancel()
+{
+    if (renderGathering.isRunning()) {
+        renderGathering.cancel();
+        renderGathering.waitForFinished();
+    }
+    waitMutex.lock();
+    waitMutex.unlock();
+}
+
 bool OsmRenderLayer::isRenderingDone()
 {
     return renderGathering.isFinished();
@@ -273,3 +807,256 @@ void OsmRenderLayer::stopRendering() {
 void OsmRenderLayer::resumeRendering() {
     renderLock.unlock();
 }
+
+/**************************/
+
+/* Extra screen margin (pixels) around a wireframe tile when gathering
+ * features, so that node markers and wide strokes crossing the tile border
+ * are drawn on both sides. */
+#define WIREFRAME_TILE_MARGIN 32
+/* Opacity added by each track crossing a pixel of the density map */
+#define DENSITY_TRACK_ALPHA 24
+
+/**
+ * Colour ramp of the GPX density map, indexed by the accumulated alpha:
+ * transparent blue for a single track up to opaque red for dense bundles.
+ */
+static QVector<QRgb> buildDensityRamp()
+{
+    QVector<QRgb> ramp(256);
+    ramp[0] = 0;
+    for (int i=1; i<256; ++i) {
+        QColor c = QColor::fromHsvF((1.0 - i / 255.0) * 0.66, 1.0, 1.0);
+        ramp[i] = qPremultiply(qRgba(c.red(), c.green(), c.blue(), qMin(255, 96 + i)));
+    }
+    return ramp;
+}
+
+static const QVector<QRgb>& densityRamp()
+{
+    static const QVector<QRgb> ramp = buildDensityRamp();
+    return ramp;
+}
+
+/**
+ * Accumulates the visible tracks crossing clip, the box of the tile, with
+ * additive blending and maps the resulting coverage through densityRamp().
+ */
+static void drawTrackDensity(QPainter& P, const QPointF& tl, const CoordBox& clip, const QMap<RenderPriority, QSet<Feature*> >& theFeatures, MapView* theView)
+{
+    QImage density(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32_Premultiplied);
+    density.fill(Qt::transparent);
+
+    QPainter D(&density);
+    D.translate(-tl);
+    D.setRenderHint(QPainter::Antialiasing);
+    D.setCompositionMode(QPainter::CompositionMode_Plus);
+    QPen pen(QColor(0, 0, 0, DENSITY_TRACK_ALPHA));
+    pen.setWidthF(qMax(1, M_PREFS->getGpxTrackWidth()));
+    pen.setCapStyle(Qt::RoundCap);
+    pen.setJoinStyle(Qt::RoundJoin);
+    D.setPen(pen);
+
+    bool any = false;
+    QMap<RenderPriority, QSet<Feature*> >::const_iterator itm;
+    QSet<Feature*>::const_iterator it;
+    for (itm = theFeatures.constBegin(); itm != theFeatures.constEnd(); ++itm) {
+        for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
+            if (!CHECK_SEGMENT(*it))
+                continue;
+            STATIC_CAST_SEGMENT(*it)->drawDensity(D, theView, clip);
+            any = true;
+        }
+    }
+    D.end();
+    if (!any)
+        return;
+
+    const QVector<QRgb>& ramp = densityRamp();
+    for (int y=0; y<density.height(); ++y) {
+        QRgb* line = reinterpret_cast<QRgb*>(density.scanLine(y));
+        for (int x=0; x<density.width(); ++x)
+            line[x] = ramp[qAlpha(line[x])];
+    }
+
+    P.save();
+    P.resetTransform();
+    P.setOpacity(1.0);
+    P.drawImage(0, 0, density);
+    P.restore();
+}
+
+WireframeRenderLayer::WireframeRenderLayer(MapView* aView)
+    : OsmRenderLayer(aView)
+    , theView(aView)
+    , touchupTiles(new TileContainer(this))
+    , wireframeShown(true)
+    , keepTouchup(false)
+{
+    theStatisticsName = "wireframe";
+}
+
+void WireframeRenderLayer::setWireframeShown(bool shown)
+{
+    wireframeShown = shown;
+}
+
+bool WireframeRenderLayer::isWireframeShown() const
+{
+    return wireframeShown;
+}
+
+/* Called with tileLock held for writing, before the new transform is set */
+void WireframeRenderLayer::keepPlaceholder(const Projection& aProjection, const QTransform& aTransform)
+{
+    OsmRenderLayer::keepPlaceholder(aProjection, aTransform);
+    /* At the same transform (edits), the touchup tiles stay in place until
+     * replaced, so that the tracks and markers do not blink */
+    keepTouchup = thePriority == NormalPriority && theTransform == aTransform
+            && theProjection.projectionRevision() == aProjection.projectionRevision();
+}
+
+void WireframeRenderLayer::clearTiles()
+{
+    OsmRenderLayer::clearTiles();
+    if (!keepTouchup)
+        touchupTiles->clear();
+    keepTouchup = false;
+}
+
+void WireframeRenderLayer::drawTouchup(QPainter *P)
+{
+    drawTiles(P, touchupTiles, false);
+}
+
+/* The box of the features to draw on a tile; tl is its top left corner on the view */
+CoordBox WireframeRenderLayer::tileBox(const TILE_TYPE& theTile, QPointF& tl) const
+{
+    /* Features draw in view coordinates; shift them into the tile */
+    QPointF origin = theTransform.map(tileOriginCoord);
+    tl = QPointF((TILE_X(theTile)*TILE_SIZE)+origin.x(), (TILE_Y(theTile)*TILE_SIZE)+origin.y());
+    QRectF screenR(tl, QSizeF(TILE_SIZE, TILE_SIZE));
+    screenR.adjust(-WIREFRAME_TILE_MARGIN, -WIREFRAME_TILE_MARGIN, WIREFRAME_TILE_MARGIN, WIREFRAME_TILE_MARGIN);
+    QRectF projR = theInvertedTransform.mapRect(screenR);
+
+    Coord ctl = theProjection.inverse2Coord(projR.topLeft());
+    Coord cbr = theProjection.inverse2Coord(projR.bottomRight());
+    return CoordBox(ctl, cbr);
+}
+
+/**
+ * Renders the wireframe image of a tile, while it is shown, and its touchup
+ * image. The track segments only draw their part crossing the tile.
+ */
+void WireframeRenderLayer::renderTile(const TILE_TYPE& theTile)
+{
+    if (!theDocument)
+        return;
+
+    if (!renderLock.tryLockForRead()) return;
+    theDocument->lockPainters();
+
+    TILE_TYPE tile = theTile;
+
+    QElapsedTimer timer;
+    TileStatistics stats;
+    bool withStats = M_RENDERSTATS->isEnabled();
+    if (withStats)
+        timer.start();
+
+    QPointF tl;
+    CoordBox invalidRect = tileBox(tile, tl);
+
+    QMap<RenderPriority, QSet <Feature*> > theFeatures;
+    QMap<RenderPriority, QSet<Feature*> >::const_iterator itm;
+    QSet<Feature*>::const_iterator it;
+
+    g_backend.delayDeletes();
+    for (int i=0; i<theDocument->layerSize(); ++i)
+        g_backend.getFeatureSet(theDocument->getLayer(i), theFeatures, invalidRect, theProjection,
+                                withStats ? &stats.nsecs[TileStatistics::BuildPath] : 0);
+
+    qint64 stageStart = 0;
+    if (withStats) {
+        stageStart = timer.nsecsElapsed();
+        stats.nsecs[TileStatistics::Gather] = stageStart;
+        for (itm = theFeatures.constBegin(); itm != theFeatures.constEnd(); ++itm) {
+            for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
+                if (CHECK_WAY(*it))
+                    stats.ways++;
+                else if (CHECK_NODE(*it))
+                    stats.nodes++;
+                else if (CHECK_RELATION(*it))
+                    stats.relations++;
+                else
+                    stats.others++;
+            }
+        }
+    }
+
+    /* The wireframe (drawSimple) pass is accounted as the foreground */
+    QImage* wireImg = 0;
+    if (wireframeShown) {
+        wireImg = new QImage(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32_Premultiplied);
+        wireImg->fill(Qt::transparent);
+
+        QPainter P(wireImg);
+        P.translate(-tl);
+        if (M_PREFS->getWireframeView() && M_PREFS->getUseAntiAlias())
+            P.setRenderHint(QPainter::Antialiasing);
+        else if (M_PREFS->getEditRendering() == 1)
+            P.setRenderHint(QPainter::Antialiasing);
+        for (itm = theFeatures.constBegin(); itm != theFeatures.constEnd() && !renderGathering.isCanceled(); ++itm) {
+            for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
+                P.setOpacity((*it)->getAlpha());
+                (*it)->drawSimple(P, theView);
+            }
+        }
+        P.end();
+        if (withStats) {
+            stats.nsecs[TileStatistics::Foreground] = timer.nsecsElapsed() - stageStart;
+            stageStart = timer.nsecsElapsed();
+        }
+    }
+
+    QImage* touchupImg = new QImage(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32_Premultiplied);
+    touchupImg->fill(Qt::transparent);
+
+    QPainter P(touchupImg);
+    if (M_PREFS->getGpxTrackDensity())
+        drawTrackDensity(P, tl, invalidRect, theFeatures, theView);
+    P.translate(-tl);
+    P.setRenderHint(QPainter::Antialiasing);
+    for (itm = theFeatures.constBegin(); itm != theFeatures.constEnd() && !renderGathering.isCanceled(); ++itm) {
+        for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
+            P.setOpacity((*it)->getAlpha());
+            if (CHECK_SEGMENT(*it))
+                STATIC_CAST_SEGMENT(*it)->drawTrack(P, theView, invalidRect);
+            else
+                (*it)->drawTouchup(P, theView);
+        }
+    }
+    P.end();
+    if (withStats)
+        stats.nsecs[TileStatistics::Touchup] = timer.nsecsElapsed() - stageStart;
+
+    g_backend.resumeDeletes();
+    theDocument->unlockPainters();
+    renderLock.unlock();
+
+    /* A cancelled tile may be incomplete: do not keep it */
+    if (renderGathering.isCanceled()) {
+        delete wireImg;
+        delete touchupImg;
+        return;
+    }
+
+    tileLock.lockForWrite();
+    /* Without the wireframe, a null image still marks the tile as rendered */
+    tiles->insert(tile, 0, wireImg);
+    markTileReady(tile);
+    touchupTiles->insert(tile, 0, touchupImg);
+    if (withStats)
+        recordStatistics(tile, stats, timer.nsecsElapsed());
+    tileLock.unlock();
+}
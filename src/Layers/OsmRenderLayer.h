@@ -7,12 +7,22 @@
 #include <QFuture>
 #include <QFutureWatcher>
 #include <QTransform>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QElapsedTimer>
+#include <QTimer>
 
 #include "IRenderer.h"
 #include "Projection.h"
+#include "RenderStatistics.h"
 
 class Document;
+class Layer;
 class Projection;
+class MapView;
 
 /* Private containers, defined in .cpp */
 class TileContainer;
@@ -31,18 +41,57 @@ public:
     void setProjection(const Projection& aProjection);
 
     void forceRedraw(const Projection& aProjection, const QTransform &aTransform, const QRect& rect, qreal ppm, const RendererOptions& roptions);
+    /* Like forceRedraw, after a change of the visibility, order, alpha or
+     * read-only state of layers: the rendered layers are only composited
+     * again, and the missing ones rendered. */
+    void recomposite();
     void pan(QPoint delta);
     void drawImage(QPainter* P);
 
     bool isRenderingDone();
+    /* True while the tiles of the previous zoom are drawn in place of missing ones */
+    bool hasPlaceholder();
+    /* Block until all tiles are rendered or msecs (if >= 0) elapsed, without
+     * spinning. Returns false on timeout. */
+    bool waitForRendering(int msecs = -1, const RenderProgressCallback& progress = RenderProgressCallback());
+    /* Cancel pending tiles and wait for the running ones to finish. */
+    void cancel();
+
+    /* Priority of the tile workers in the global thread pool. Synchronous
+     * renders (printing, export) use ExportPriority to get ahead of the
+     * tiles queued for the screen. */
+    enum { NormalPriority = 0, ExportPriority = 10 };
+    void setRenderingPriority(int aPriority);
 
     void stopRendering();
     void resumeRendering();
+    /* For renderers working outside of the tile grid (PosterRenderer): hold
+     * it for reading while rendering */
+    static QReadWriteLock& renderingLock() { return renderLock; }
+
+    /* Outline each rendered tile with its timings (RenderStatistics must be enabled) */
+    void drawStatistics(QPainter* P);
 
 signals:
     void renderingDone();
+    void renderingProgress();
 
 protected:
+    virtual void renderTile(const TILE_TYPE& theTile);
+    virtual void clearTiles();
+    void drawTiles(QPainter* P, TileContainer* theTiles, bool withFade = true);
+    void startRendering();
+    void wakeWaiters();
+    void recordStatistics(const TILE_TYPE& tile, TileStatistics& stats, qint64 totalNsecs);
+    void markTileReady(const TILE_TYPE& tile);
+    virtual void keepPlaceholder(const Projection& aProjection, const QTransform& aTransform);
+    void dropPlaceholder();
+    void drawPlaceholder(QPainter* P);
+    qreal tileOpacity(const TILE_TYPE& tile, qint64 now) const;
+    bool isTileComplete(const TILE_TYPE& tile);
+    void updateLayerStates(bool dropChanged);
+    QList<QPair<Layer*, qreal> > compositedLayers() const;
+
     Document* theDocument;
 
     QRectF projRect;
@@ -61,9 +110,29 @@ protected:
     qreal PixelPerM;
     RendererOptions ROptions;
 
+    const char* theStatisticsName;
     TileContainer* tiles;
-    /* Contains a list of tiles to be rendered using QtConcurrent. */
+    QHash<TILE_TYPE, TileStatistics> tileStatistics; /* Protected by tileLock */
+    QHash<Layer*, int> layerStates; /* Alpha and read-only of the rendered layers; protected by tileLock */
+    /* One image per layer (see MerkaartorPreferences::getLayerCompositing),
+     * read at each redraw */
+    bool layerCompositing;
+
+    /* The last complete set of tiles before a zoom, drawn scaled under the
+     * new ones while they are rendered, then cross-faded. Protected by tileLock. */
+    TileContainer* placeholderTiles;
+    bool hasPlaceholderTiles;
+    QTransform placeholderTransform;
+    QPointF placeholderOriginCoord;
+    QRect placeholderViewport;
+    QHash<TILE_TYPE, qint64> tileFadeStart;
+    QElapsedTimer fadeClock;
+    QTimer fadeTimer;
+    /* Contains a list of tiles to be rendered on the global thread pool. */
     QList<TILE_TYPE> tilesToRender;
+    int thePriority;
+    QMutex waitMutex;
+    QWaitCondition tileRendered; /* Signalled after each tile and when done */
     QReadWriteLock tileLock; /* Protects 'tiles' variable */
 
     /* Read locks indicate rendering threads, Write lock blocks them. This is a
@@ -71,4 +140,40 @@ protected:
     static QReadWriteLock renderLock;
 };
 
+/**
+ * Renders the wireframe (Feature::drawSimple) and touchup
+ * (Feature::drawTouchup) layers of a MapView on the same tile grid and worker
+ * pool as the styled rendering, instead of on the GUI thread.
+ *
+ * The features draw themselves through the MapView, so the view transform
+ * must not change while tiles are being rendered: the view calls cancel()
+ * before modifying it.
+ */
+class WireframeRenderLayer : public OsmRenderLayer
+{
+    Q_OBJECT
+
+public:
+    WireframeRenderLayer(MapView* aView);
+
+    /* The wireframe images are only rendered while they are drawn: in
+     * wireframe view, or standing in for the styled tiles. */
+    void setWireframeShown(bool shown);
+    bool isWireframeShown() const;
+
+    void drawTouchup(QPainter* P);
+
+protected:
+    virtual void renderTile(const TILE_TYPE& theTile);
+    virtual void clearTiles();
+    virtual void keepPlaceholder(const Projection& aProjection, const QTransform& aTransform);
+    CoordBox tileBox(const TILE_TYPE& theTile, QPointF& tl) const;
+
+    MapView* theView;
+    TileContainer* touchupTiles;
+    bool wireframeShown;
+    /* Set by keepPlaceholder when the touchup tiles survive the next clearTiles */
+    bool keepTouchup;
+};
+
 #endif // OSMRENDERLAYER_H
@@ -6,8 +6,11 @@
 #include <QLibraryInfo>
 #include <QSplashScreen>
 
+#include <string.h>
+
 #include <qtsingleapplication.h>
 #include "MainWindow.h"
+#include "CommandLineRender.h"
 #include "Preferences/MerkaartorPreferences.h"
 #ifndef ACCEPT_USE_OF_DEPRECATED_PROJ_API_H
 #define ACCEPT_USE_OF_DEPRECATED_PROJ_API_H
@@ -47,6 +50,7 @@ void showHelp()
     fprintf(stdout, "  --ignore-preferences\t\tIgnore saved preferences\n");
     fprintf(stdout, "  --reset-preferences\t\tReset saved preferences to default\n");
     fprintf(stdout, "  --ignore-startup-template\t\tIgnore the saved startup template document and start with a new document\n");
+    fprintf(stdout, "  --render [options] filenames\t\tRender files without the GUI (see \"--render --help\")\n");
     fprintf(stdout, "  [filenames]\t\tOpen designated files \n");
 }
 
@@ -70,8 +74,62 @@ void loadPluginsFromDir( QDir & pluginsDir ) {
     }
 }
 
+/* Headless rendering: no main window, no single instance handling. */
+int renderMain(int argc, char** argv)
+{
+#if QT_VERSION >= 0x050000
+    if (qgetenv("QT_QPA_PLATFORM").isEmpty())
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+#endif
+    QApplication app(argc, argv);
+    g_Merk_Headless = true;
+
+    QStringList argsIn = QCoreApplication::arguments();
+    QStringList argsOut;
+    argsIn.removeFirst();
+    for (int i=0; i < argsIn.size(); ++i) {
+        if (argsIn[i] == "-h" || argsIn[i] == "--help") {
+            CommandLineRender::showHelp();
+            return 0;
+        } else if (argsIn[i] == "-p" || argsIn[i] == "--portable") {
+            g_Merk_Portable = true;
+        } else if (argsIn[i] == "--ignore-preferences") {
+            g_Merk_Ignore_Preferences = true;
+        } else
+            argsOut << argsIn[i];
+    }
+
+    QCoreApplication::setOrganizationName("Merkaartor");
+    QCoreApplication::setOrganizationDomain("merkaartor.org");
+#ifdef FRISIUS_BUILD
+    QCoreApplication::setApplicationName("Frisius");
+#else
+    QCoreApplication::setApplicationName("Merkaartor");
+#endif
+
+    CommandLineRender theRender;
+    if (!theRender.parseArguments(argsOut)) {
+        fprintf(stderr, "%s\n\n", theRender.errorString().toLocal8Bit().data());
+        CommandLineRender::showHelp();
+        return 1;
+    }
+
+    int x;
+    try {
+        x = theRender.exec();
+    } catch (const std::bad_alloc &) {
+        fprintf(stderr, "Out of memory\n");
+        x = 254;
+    }
+    return x;
+}
+
 int main(int argc, char** argv)
 {
+    for (int i=1; i < argc; ++i)
+        if (!strcmp(argv[i], "--render"))
+            return renderMain(argc, argv);
+
     QtSingleApplication instance(argc,argv);
 
     bool reuse = true;
@@ -44,8 +44,9 @@
 #include "FeatureManipulations.h"
 #include "LayerIterator.h"
 #include "MasPaintStyle.h"
-#include "MapCSSPaintstyle.h"
 #include "PaintStyleEditor.h"
+#include "RenderStatistics.h"
+#include "StyleProfiler.h"
 #include "Utils/Utils.h"
 #include "DirtyList.h"
 #include "DirtyListExecutorOSC.h"
@@ -228,7 +229,7 @@ MainWindow::MainWindow(QWidget *parent)
         QApplication::setStyle(QStyleFactory::create(M_PREFS->getMerkaartorStyleString()));
 
     ui->setupUi(this);
-    M_STYLE->loadPainters(M_PREFS->getDefaultStyle());
+    MerkaartorPreferences::loadStyle(M_PREFS->getDefaultStyle());
 
     blockSignals(true);
 
@@ -294,6 +295,7 @@ MainWindow::MainWindow(QWidget *parent)
 #endif
 
     connect(theLayers, SIGNAL(layersChanged(bool)), this, SLOT(adjustLayers(bool)));
+    connect(theLayers, SIGNAL(layersAppearanceChanged(Layer*)), this, SLOT(recompositeLayers(Layer*)));
     connect(theLayers, SIGNAL(layersCleared()), this, SIGNAL(content_changed()));
     connect(theLayers, SIGNAL(layersClosed()), this, SIGNAL(content_changed()));
     connect(theLayers, SIGNAL(layersProjection(const QString&)), this, SLOT(projectionSet(const QString&)));
@@ -419,6 +421,10 @@ MainWindow::MainWindow(QWidget *parent)
     ui->viewPhotosAction->setVisible(false);
 #endif
 
+#ifndef USE_PROTOBUF
+    ui->exportOSMBinAction->setVisible(false);
+#endif
+
     ui->viewStyleBackgroundAction->setVisible(false);
     ui->viewStyleForegroundAction->setVisible(false);
     ui->viewStyleTouchupAction->setVisible(false);
@@ -680,6 +686,18 @@ void MainWindow::onLoadingfinished(ImageMapLayer *)
 #endif
 }
 
+void MainWindow::onPaintersprogress(int value, int maximum)
+{
+    if (maximum > 0)
+        statusBar()->showMessage(tr("Applying the map style... %1%").arg(value * 100 / maximum));
+}
+
+void MainWindow::onPainterschanged()
+{
+    statusBar()->clearMessage();
+    invalidateView(false);
+}
+
 void MainWindow::updateSegmentMode(QMouseEvent* mouseEvent)
 {
     g_Merk_Segment_Mode = (mouseEvent->modifiers() & Qt::AltModifier) || dynamic_cast<ExtrudeInteraction*>(theView->interaction());
@@ -1174,6 +1192,19 @@ void MainWindow::adjustLayers(bool adjustViewport)
     invalidateView(true);
 }
 
+void MainWindow::recompositeLayers(Layer* aLayer)
+{
+    /* Filter layers change how the features of the other layers are drawn,
+     * and the first image layer may set the projection */
+    if (!aLayer || aLayer->classType() == Layer::FilterLayerType || M_PREFS->getZoomBoris()) {
+        adjustLayers(false);
+        return;
+    }
+    theView->setRenderOptions(p->renderOptions);
+    theView->recompositeLayers();
+    p->theProperties->resetValues();
+}
+
 void MainWindow::invalidateView(bool UpdateDock)
 {
     theView->setRenderOptions(p->renderOptions);
@@ -1660,13 +1691,19 @@ MainWindow::ImportStatus MainWindow::importFile(Document * mapDocument, const QS
     }
 #ifndef FRISIUS_BUILD
     else if (fileName.toLower().endsWith(".osc")) {
-        if (g_Merk_Frisius) {
-            newLayer = new DrawingLayer( baseFileName );
-            mapDocument->add(newLayer);
+        if (QMessageBox::question(this, tr("osmChange file"),
+                tr("Apply %1 as data from the server (e.g. a replication diff) instead of importing it as edits?").arg(baseFileName),
+                QMessageBox::Yes | QMessageBox::No, QMessageBox::No) == QMessageBox::Yes) {
+            result = applyOSC(mapDocument, fileName, newLayer);
         } else {
-            newLayer = mapDocument->getDirtyOrOriginLayer();
+            if (g_Merk_Frisius) {
+                newLayer = new DrawingLayer( baseFileName );
+                mapDocument->add(newLayer);
+            } else {
+                newLayer = mapDocument->getDirtyOrOriginLayer();
+            }
+            result = mapDocument->importOSC(fileName, (DrawingLayer*)newLayer) ? IMPORT_OK : IMPORT_ERROR;
         }
-        result = mapDocument->importOSC(fileName, (DrawingLayer*)newLayer) ? IMPORT_OK : IMPORT_ERROR;
     }
 #endif
     else if (fileName.toLower().endsWith(".ngt")) {
@@ -1725,9 +1762,22 @@ MainWindow::ImportStatus MainWindow::importFile(Document * mapDocument, const QS
     }
 #ifdef USE_PROTOBUF
     else if (fileName.toLower().endsWith(".pbf")) {
+        /* Extracts are usually opened to edit a small part of them: only
+         * the blocks of the current view are then read */
+        ImportFilter regionFilter;
+        ImportFilter* aFilter = NULL;
+        if (QFileInfo(fileName).size() > 64*1024*1024 &&
+                QMessageBox::question(this, tr("Large file"),
+                    tr("%1 is a large file. Import only the features in the current view?").arg(baseFileName),
+                    QMessageBox::Yes | QMessageBox::No, QMessageBox::Yes) == QMessageBox::Yes) {
+            regionFilter.setArea(theView->viewport());
+            aFilter = &regionFilter;
+        }
         newLayer = new DrawingLayer( baseFileName );
         mapDocument->add(newLayer);
-        result = mapDocument->importPBF(fileName, (DrawingLayer*)newLayer) ? IMPORT_OK : IMPORT_ERROR;
+        result = mapDocument->importPBF(fileName, (DrawingLayer*)newLayer, aFilter) ? IMPORT_OK : IMPORT_ERROR;
+        if (result == IMPORT_OK && aFilter)
+            mapDocument->addDownloadBox(newLayer, theView->viewport());
     }
 #endif
     else {
@@ -1743,6 +1793,58 @@ MainWindow::ImportStatus MainWindow::importFile(Document * mapDocument, const QS
     return result;
 }
 
+#ifndef FRISIUS_BUILD
+/* The changes are made in place, outside of the undo history, and features
+ * may be deleted: this needs a document without edits to upload, whose
+ * history is then cleaned up so that no command refers to them. */
+MainWindow::ImportStatus MainWindow::applyOSC(Document* mapDocument, const QString& fileName, Layer*& newLayer)
+{
+    if (mapDocument->getDirtySize()) {
+        QMessageBox::warning(this, tr("osmChange file"),
+                             tr("Please upload or discard your changes before applying server data."));
+        return IMPORT_ABORTED;
+    }
+
+    ImportExportOSC osc(mapDocument);
+    if (!osc.loadFile(fileName))
+        return IMPORT_ERROR;
+
+    theView->stopRendering();
+    p->theProperties->setSelection(0);
+    p->theFeats->invalidate();
+    mapDocument->history().cleanup();
+    mapDocument->history().updateActions();
+
+    /* The features created go to a layer named after the file */
+    DrawingLayer* aLayer = new DrawingLayer(fileName.section('/', - 1));
+    mapDocument->add(aLayer);
+    bool ok = osc.apply(aLayer);
+    if (!aLayer->size()) {
+        mapDocument->remove(aLayer);
+        delete aLayer;
+    } else
+        newLayer = aLayer;
+    theView->resumeRendering();
+    theDirty->updateList();
+
+    if (!ok) {
+        QMessageBox::warning(this, tr("osmChange file"), osc.errorString());
+        return IMPORT_ABORTED;
+    }
+
+    QStringList conflicts;
+    foreach (const ImportExportOSC::Conflict& c, osc.conflicts())
+        conflicts << c.toString();
+    QMessageBox msg(QMessageBox::Information, tr("osmChange file"),
+                    tr("%1 changes applied, %2 conflicts.").arg(osc.applied()).arg(conflicts.size()),
+                    QMessageBox::Ok, this);
+    if (!conflicts.isEmpty())
+        msg.setDetailedText(conflicts.join("\n"));
+    msg.exec();
+    return IMPORT_OK;
+}
+#endif
+
 MainWindow::ImportStatus MainWindow::importFileUsingGDAL( Document* mapDocument, const QString& fileName, Layer*& newLayer ) {
     MainWindow::ImportStatus result;
 
@@ -2201,6 +2303,25 @@ void MainWindow::on_viewShowLatLonGridAction_triggered()
     invalidateView();
 }
 
+void MainWindow::on_viewRenderStatisticsAction_triggered()
+{
+    bool visible = ui->viewRenderStatisticsAction->isChecked();
+    M_RENDERSTATS->setEnabled(visible);
+    SetOptionValue(p->renderOptions, RendererOptions::RenderStatisticsVisible, visible);
+    invalidateView();
+}
+
+void MainWindow::on_viewExportRenderStatisticsAction_triggered()
+{
+    QString path;
+    if (!getPathToSave(tr("Export render statistics"), "csv", tr("CSV files (*.csv)") + "\n" + tr("All Files (*)"), &path))
+        return;
+
+    QString error;
+    if (!M_RENDERSTATS->exportCsv(path, &error))
+        QMessageBox::critical(this, tr("Export render statistics"), tr("Unable to write %1: %2").arg(path).arg(error));
+}
+
 void MainWindow::on_viewStyleBackgroundAction_triggered()
 {
     M_PREFS->setBackgroundVisible(!M_PREFS->getBackgroundVisible());
@@ -2340,6 +2461,10 @@ void MainWindow::on_fileNewAction_triggered()
                 this, SLOT(onImagereceived(ImageMapLayer*)), Qt::QueuedConnection);
         connect(theDocument, SIGNAL(loadingFinished(ImageMapLayer*)),
                 this, SLOT(onLoadingfinished(ImageMapLayer*)), Qt::QueuedConnection);
+        connect(theDocument, SIGNAL(paintersProgress(int,int)),
+                this, SLOT(onPaintersprogress(int,int)));
+        connect(theDocument, SIGNAL(paintersChanged()),
+                this, SLOT(onPainterschanged()));
         theDirty->updateList();
 
         currentProjectFile.clear();
@@ -2882,8 +3007,8 @@ void MainWindow::applyStyles(QString NewStyle)
             on_mapStyleSaveAction_triggered();
         }
         M_PREFS->setDefaultStyle(NewStyle);
-        M_STYLE->loadPainters(M_PREFS->getDefaultStyle());
-        theDocument->setPainters(M_STYLE->getPainters());
+        MerkaartorPreferences::loadStyle(M_PREFS->getDefaultStyle());
+        theDocument->setPainters(M_STYLE->getPainters(), M_STYLE->getStyleSheet());
         invalidateView(false);
     }
 }
@@ -2893,7 +3018,7 @@ void MainWindow::applyPainters(GlobalPainter* theGlobalPainter, QList<Painter>*
     M_STYLE->setGlobalPainter(*theGlobalPainter);
     M_STYLE->setPainters(*thePainters);
 
-    theDocument->setPainters(*thePainters);
+    theDocument->setPainters(*thePainters, M_STYLE->getStyleSheet());
     invalidateView(false);
 }
 
@@ -2948,16 +3073,36 @@ void MainWindow::on_mapStyleLoadAction_triggered()
                                              + tr("Merkaartor map style (*.mas)\n")
                                              + tr("MapCSS stylesheet (*.css)"));
     if (!f.isNull()) {
-        if (f.endsWith("css"))
-            MapCSSPaintstyle::instance()->loadPainters(f);
-        else {
-            M_STYLE->loadPainters(f);
-            document()->setPainters(M_STYLE->getPainters());
-            invalidateView();
+        if (!MerkaartorPreferences::loadStyle(f)) {
+            QMessageBox::warning(this, tr("Load map style"), tr("Unable to load the map style %1.").arg(f));
+            return;
         }
+        document()->setPainters(M_STYLE->getPainters(), M_STYLE->getStyleSheet());
+        invalidateView();
     }
 }
 
+void MainWindow::on_styleProfileAction_triggered()
+{
+    bool enabled = ui->styleProfileAction->isChecked();
+    /* A new profile each time, over the tiles rendered from now on */
+    if (enabled)
+        M_STYLEPROFILER->clear();
+    M_STYLEPROFILER->setEnabled(enabled);
+    invalidateView();
+}
+
+void MainWindow::on_styleExportProfileAction_triggered()
+{
+    QString path;
+    if (!getPathToSave(tr("Export style profile"), "csv", tr("CSV files (*.csv)") + "\n" + tr("All Files (*)"), &path))
+        return;
+
+    QString error;
+    if (!M_STYLEPROFILER->exportCsv(path, &error))
+        QMessageBox::critical(this, tr("Export style profile"), tr("Unable to write %1: %2").arg(path).arg(error));
+}
+
 void MainWindow::on_toolsWMSServersAction_triggered()
 {
     WMSPreferencesDialog* WMSPref;
@@ -3274,6 +3419,10 @@ void MainWindow::loadDocument(QString fn)
                 this, SLOT(onImagereceived(ImageMapLayer*)), Qt::QueuedConnection);
         connect(theDocument, SIGNAL(loadingFinished(ImageMapLayer*)),
                 this, SLOT(onLoadingfinished(ImageMapLayer*)), Qt::QueuedConnection);
+        connect(theDocument, SIGNAL(paintersProgress(int,int)),
+                this, SLOT(onPaintersprogress(int,int)));
+        connect(theDocument, SIGNAL(paintersChanged()),
+                this, SLOT(onPainterschanged()));
         theDirty->updateList();
         currentProjectFile = fn;
         setWindowTitle(QString("%1 - %2").arg(theDocument->title()).arg(p->title));
@@ -3322,6 +3471,25 @@ void MainWindow::on_exportOSMAction_triggered()
     deleteProgressDialog();
 }
 
+void MainWindow::on_exportOSMBinAction_triggered()
+{
+#ifdef USE_PROTOBUF
+    QList<Feature*> theFeatures;
+
+    createProgressDialog();
+    if (!selectExportedFeatures(theFeatures))
+        return;
+
+    QString path;
+    if (getPathToSave(tr("Export OSM (binary)"), "osm.pbf", tr("OSM binary files (*.pbf)") + "\n" + tr("All Files (*)"), &path)) {
+        ImportExportPBF pbf(document());
+        if (!pbf.saveFile(path) || !pbf.export_(theFeatures))
+            QMessageBox::critical(this, tr("Export OSM (binary)"), tr("Unable to write %1").arg(path));
+    }
+    deleteProgressDialog();
+#endif
+}
+
 void MainWindow::on_exportOSCAction_triggered()
 {
 #ifndef FRISIUS_BUILD
@@ -3688,7 +3856,7 @@ void MainWindow::updateStyleMenu()
         p->theStyle->addItem(a);
     }
     if (!M_PREFS->getCustomStyle().isEmpty()) {
-        QDir customStyles(M_PREFS->getCustomStyle(), "*.mas *.msz");
+        QDir customStyles(M_PREFS->getCustomStyle(), "*.mas *.msz *.css");
         for (int i=0; i < customStyles.entryList().size(); ++i) {
             QAction* a = new QAction(customStyles.entryList().at(i), ui->menuStyles);
             actgrp->addAction(a);
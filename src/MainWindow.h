@@ -104,6 +104,8 @@ public slots:
     virtual void on_viewScaleAction_triggered();
     virtual void on_viewPhotosAction_triggered();
     virtual void on_viewShowLatLonGridAction_triggered();
+    virtual void on_viewRenderStatisticsAction_triggered();
+    virtual void on_viewExportRenderStatisticsAction_triggered();
     virtual void on_viewStyleBackgroundAction_triggered();
     virtual void on_viewStyleForegroundAction_triggered();
     virtual void on_viewStyleTouchupAction_triggered();
@@ -154,7 +156,10 @@ public slots:
     virtual void on_mapStyleSaveAction_triggered();
     virtual void on_mapStyleSaveAsAction_triggered();
     virtual void on_mapStyleLoadAction_triggered();
+    virtual void on_styleProfileAction_triggered();
+    virtual void on_styleExportProfileAction_triggered();
     virtual void on_exportOSMAction_triggered();
+    virtual void on_exportOSMBinAction_triggered();
     virtual void on_exportOSCAction_triggered();
     virtual void on_exportGPXAction_triggered();
     virtual void on_exportKMLAction_triggered();
@@ -207,6 +212,8 @@ protected slots:
     void onImagerequested(ImageMapLayer*);
     void onImagereceived(ImageMapLayer* aLayer);
     void onLoadingfinished(ImageMapLayer*);
+    void onPaintersprogress(int value, int maximum);
+    void onPainterschanged();
 
 signals:
     void remove_triggered();
@@ -244,6 +251,7 @@ public slots:
     void handleMessage(const QString& msg);
 
     void adjustLayers(bool adjustViewport);
+    void recompositeLayers(Layer* aLayer);
     void bookmarkTriggered(QAction* anAction);
     void recentOpenTriggered(QAction* anAction);
     void recentImportTriggered(QAction* anAction);
@@ -311,6 +319,9 @@ private:
     void importAction( bool useGdal = false );
     ImportStatus importFile(Document* mapDocument, const QString& fileName, Layer*& newLayer);
     ImportStatus importFileUsingGDAL(Document* mapDocument, const QString& fileName, Layer*& newLayer);
+#ifndef FRISIUS_BUILD
+    ImportStatus applyOSC(Document* mapDocument, const QString& fileName, Layer*& newLayer);
+#endif
     void updateMenu();
     void updateRecentOpenMenu();
     void updateRecentImportMenu();
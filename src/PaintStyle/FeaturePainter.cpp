@@ -5,6 +5,8 @@
 #include "Features.h"
 #include "LineF.h"
 #include "SvgCache.h"
+#include "VertexTransform.h"
+#include "StyleProfiler.h"
 
 #include <QtCore/QString>
 #include <QtGui/QPainter>
@@ -17,6 +19,133 @@
 #define CAPSTYLE Qt::RoundCap
 #define JOINSTYLE Qt::RoundJoin
 
+/* Draws the parts of the geometry clipped to the render rectangle: the
+ * areas filled without pen, then the outline runs with the dash pattern
+ * kept in phase. */
+static void drawClipped(QPainter* thePainter, const ClippedGeometry& g, bool filled)
+{
+    QPen thePen = thePainter->pen();
+    if (filled && g.Areas.size()) {
+        QPainterPath area;
+        area.setFillRule(Qt::OddEvenFill);
+        for (int i=0; i<g.Areas.size(); ++i)
+            area.addPolygon(g.Areas[i]);
+        thePainter->setPen(Qt::NoPen);
+        thePainter->drawPath(area);
+        thePainter->setPen(thePen);
+    }
+    if (thePen.style() == Qt::NoPen)
+        return;
+
+    bool dashed = thePen.style() != Qt::SolidLine;
+    qreal w = thePen.widthF() > 0 ? thePen.widthF() : 1.0;
+    for (int i=0; i<g.Lines.size(); ++i) {
+        if (dashed) {
+            QPen aPen(thePen);
+            aPen.setDashOffset(thePen.dashOffset() + g.LineOffsets[i] / w);
+            thePainter->setPen(aPen);
+        }
+        thePainter->drawPolyline(g.Lines[i]);
+    }
+    thePainter->setPen(thePen);
+}
+
+/* Whether the screen geometry is worth clipping before drawing */
+static bool needsClipping(const QRectF& bbox, int count, QPainter* thePainter, MapRenderer* theRenderer)
+{
+    if (count < CLIP_MIN_VERTICES)
+        return false;
+    if (thePainter->pen().style() != Qt::NoPen && thePainter->pen().widthF() / 2 > CLIP_MARGIN)
+        return false;
+    return !theRenderer->theClipRect.contains(bbox);
+}
+
+/* Draws a path already mapped to the screen, clipped to the render rectangle
+ * if it is large and not fully visible. */
+static void drawClippedPath(Feature* F, const QPainterPath& thePath, QPainter* thePainter, MapRenderer* theRenderer)
+{
+    if (!needsClipping(thePath.controlPointRect(), thePath.elementCount(), thePainter, theRenderer)) {
+        thePainter->drawPath(thePath);
+        return;
+    }
+
+    bool filled = thePainter->brush().style() != Qt::NoBrush;
+    ClippedGeometry& g = theRenderer->theClipCache[F];
+    if (!g.HasLines || (filled && !g.HasAreas)) {
+        QList<QPolygonF> parts = thePath.toSubpathPolygons();
+        for (int i=0; i<parts.size(); ++i) {
+            if (!g.HasLines)
+                clipPolyline(parts[i].constData(), parts[i].size(), theRenderer->theClipRect, g.Lines, g.LineOffsets);
+            if (filled && !g.HasAreas) {
+                QPolygonF ring = clipPolygon(parts[i].constData(), parts[i].size(), theRenderer->theClipRect);
+                if (ring.size() > 2)
+                    g.Areas << ring;
+            }
+        }
+        g.HasLines = true;
+        g.HasAreas = g.HasAreas || filled;
+    }
+    drawClipped(thePainter, g, filled);
+}
+
+/* Draws a way with the current pen and brush from its packed projected
+ * vertices, transformed into a per-thread buffer. Ways whose path has holes
+ * cut out (multipolygon outers) have no vertices and use the path. Large
+ * ways crossing the render rectangle are clipped to it first. */
+static void drawWayVertices(Way* R, QPainter* thePainter, MapRenderer* theRenderer)
+{
+    R->getLock();
+    const QVector<double>& vertices = R->getProjectedVertices();
+    if (vertices.isEmpty()) {
+        QPainterPath thePath = theRenderer->theTransform.map(R->getPath());
+        R->releaseLock();
+        drawClippedPath(R, thePath, thePainter, theRenderer);
+        return;
+    }
+    int n;
+    const QPointF* pts = transformToScratch(theRenderer->theTransform, vertices, &n);
+    R->releaseLock();
+
+    if (n >= CLIP_MIN_VERTICES) {
+        QRectF bbox(pts[0], QSizeF(0, 0));
+        for (int i=1; i<n; ++i) {
+            bbox.setLeft(qMin(bbox.left(), pts[i].x()));
+            bbox.setRight(qMax(bbox.right(), pts[i].x()));
+            bbox.setTop(qMin(bbox.top(), pts[i].y()));
+            bbox.setBottom(qMax(bbox.bottom(), pts[i].y()));
+        }
+        if (needsClipping(bbox, n, thePainter, theRenderer)) {
+            bool filled = thePainter->brush().style() != Qt::NoBrush;
+            ClippedGeometry& g = theRenderer->theClipCache[R];
+            if (!g.HasLines) {
+                clipPolyline(pts, n, theRenderer->theClipRect, g.Lines, g.LineOffsets);
+                g.HasLines = true;
+            }
+            if (filled && !g.HasAreas) {
+                QPolygonF ring = clipPolygon(pts, n, theRenderer->theClipRect);
+                if (ring.size() > 2)
+                    g.Areas << ring;
+                g.HasAreas = true;
+            }
+            drawClipped(thePainter, g, filled);
+            return;
+        }
+    }
+
+    if (thePainter->brush().style() == Qt::NoBrush) {
+        thePainter->drawPolyline(pts, n);
+    } else if (pts[0] == pts[n-1]) {
+        thePainter->drawPolygon(pts, n);
+    } else {
+        /* Filled but open: drawPolygon would also stroke the closing segment */
+        QPen thePen = thePainter->pen();
+        thePainter->setPen(Qt::NoPen);
+        thePainter->drawPolygon(pts, n);
+        thePainter->setPen(thePen);
+        thePainter->drawPolyline(pts, n);
+    }
+}
+
 FeaturePainter::FeaturePainter()
 : Painter(), theTagSelector(0){
 }
@@ -160,6 +289,7 @@ TagSelectorMatchResult FeaturePainter::matchesTag(const Feature* F, MapRenderer*
     TagSelectorMatchResult res;
 
     if (!theTagSelector) return TagSelect_NoMatch;
+    StyleProfiler::Scope profile(this, PainterStatistics::Match);
     // Special casing for multipolygon roads
     //if (const Road* R = dynamic_cast<const Road*>(F))
     //{
@@ -175,8 +305,10 @@ TagSelectorMatchResult FeaturePainter::matchesTag(const Feature* F, MapRenderer*
         res = theTagSelector->matches(F,theRender->thePixelPerM);
     else
         res = theTagSelector->matches(F,0);
-    if (res)
+    if (res) {
+        profile.setMatched(true);
         return res;
+    }
     // Special casing for multipolygon relations
     //if (const Relation* R = dynamic_cast<const Relation*>(F))
     //{
@@ -208,6 +340,7 @@ void FeaturePainter::drawBackground(Node* N, QPainter* thePainter, MapRenderer*
 {
     if (!DrawBackground)
         return;
+    StyleProfiler::Scope profile(this, PainterStatistics::Background);
 
     qreal PixelPerM = theRenderer->thePixelPerM;
     qreal WW = PixelPerM*BackgroundScale+BackgroundOffset;
@@ -222,6 +355,7 @@ void FeaturePainter::drawBackground(Node* N, QPainter* thePainter, MapRenderer*
 void FeaturePainter::drawBackground(Way* R, QPainter* thePainter, MapRenderer* theRenderer) const
 {
     if (!DrawBackground && !ForegroundFill && !ForegroundFillUseIcon) return;
+    StyleProfiler::Scope profile(this, PainterStatistics::Background);
 
     thePainter->setPen(Qt::NoPen);
     if (M_PREFS->getAreaOpacity() != 100 && ForegroundFill) {
@@ -297,14 +431,13 @@ void FeaturePainter::drawBackground(Way* R, QPainter* thePainter, MapRenderer* t
         }
     }
 
-    R->getLock();
-    thePainter->drawPath(theRenderer->theTransform.map(R->getPath()));
-    R->releaseLock();
+    drawWayVertices(R, thePainter, theRenderer);
 }
 
 void FeaturePainter::drawBackground(Relation* R, QPainter* thePainter, MapRenderer* theRenderer) const
 {
     if (!DrawBackground && !ForegroundFill && !ForegroundFillUseIcon) return;
+    StyleProfiler::Scope profile(this, PainterStatistics::Background);
 
     thePainter->setPen(Qt::NoPen);
     if (M_PREFS->getAreaOpacity() != 100 && ForegroundFill) {
@@ -380,14 +513,16 @@ void FeaturePainter::drawBackground(Relation* R, QPainter* thePainter, MapRender
     }
 
     R->getLock();
-    thePainter->drawPath(theRenderer->theTransform.map(R->getPath()));
+    QPainterPath thePath = theRenderer->theTransform.map(R->getPath());
     R->releaseLock();
+    drawClippedPath(R, thePath, thePainter, theRenderer);
 }
 
 void FeaturePainter::drawForeground(Node* N, QPainter* thePainter, MapRenderer* theRenderer) const
 {
     if (!DrawForeground)
         return;
+    StyleProfiler::Scope profile(this, PainterStatistics::Foreground);
 
     qreal PixelPerM = theRenderer->thePixelPerM;
     qreal WW = PixelPerM*ForegroundScale+ForegroundOffset;
@@ -402,6 +537,7 @@ void FeaturePainter::drawForeground(Node* N, QPainter* thePainter, MapRenderer*
 void FeaturePainter::drawForeground(Way* R, QPainter* thePainter, MapRenderer* theRenderer) const
 {
     if (!DrawForeground) return;
+    StyleProfiler::Scope profile(this, PainterStatistics::Foreground);
 
     qreal WW = 0.0;
     if (DrawForeground)
@@ -425,14 +561,13 @@ void FeaturePainter::drawForeground(Way* R, QPainter* thePainter, MapRenderer* t
 
     thePainter->setBrush(Qt::NoBrush);
 
-    R->getLock();
-    thePainter->drawPath(theRenderer->theTransform.map(R->getPath()));
-    R->releaseLock();
+    drawWayVertices(R, thePainter, theRenderer);
 }
 
 void FeaturePainter::drawForeground(Relation* R, QPainter* thePainter, MapRenderer* theRenderer) const
 {
     if (!DrawForeground) return;
+    StyleProfiler::Scope profile(this, PainterStatistics::Foreground);
 
     qreal WW = 0.0;
     if (DrawForeground)
@@ -457,13 +592,16 @@ void FeaturePainter::drawForeground(Relation* R, QPainter* thePainter, MapRender
     thePainter->setBrush(Qt::NoBrush);
 
     R->getLock();
-    thePainter->drawPath(theRenderer->theTransform.map(R->getPath()));
+    QPainterPath thePath = theRenderer->theTransform.map(R->getPath());
     R->releaseLock();
+    drawClippedPath(R, thePath, thePainter, theRenderer);
 }
 
 
 void FeaturePainter::drawTouchup(Node* Pt, QPainter* thePainter, MapRenderer* theRenderer) const
 {
+    /* Only profiled when drawing something */
+    StyleProfiler::Scope profile(DrawIcon ? this : 0, PainterStatistics::Touchup);
     bool IconOK = false;
     if (DrawIcon)
     {
@@ -509,6 +647,11 @@ void FeaturePainter::drawTouchup(Node* Pt, QPainter* thePainter, MapRenderer* th
 
 void FeaturePainter::drawTouchup(Way* R, QPainter* thePainter, MapRenderer* theRenderer) const
 {
+    /* Only profiled when drawing something: the touchup line, the icon or the arrows */
+    bool DrawArrows = (DrawTrafficDirectionMarks && theRenderer->theOptions.arrowOptions == RendererOptions::ArrowsOneway)
+            || theRenderer->theOptions.arrowOptions == RendererOptions::ArrowsAlways;
+    bool Draws = DrawTouchup || (DrawIcon && !ForegroundFillUseIcon && !IconName.isEmpty()) || DrawArrows;
+    StyleProfiler::Scope profile(Draws ? this : 0, PainterStatistics::Touchup);
     if (DrawTouchup)
     {
         qreal PixelPerM = theRenderer->thePixelPerM;
@@ -544,7 +687,7 @@ void FeaturePainter::drawTouchup(Way* R, QPainter* thePainter, MapRenderer* theR
             }
         }
     }
-    if ( ((DrawTrafficDirectionMarks) && (theRenderer->theOptions.arrowOptions == RendererOptions::ArrowsOneway)) ||  theRenderer->theOptions.arrowOptions == RendererOptions::ArrowsAlways)
+    if (DrawArrows)
     {
         Feature::TrafficDirectionType TT = trafficDirection(R);
         if ( (TT != Feature::UnknownDirection) || (theRenderer->theOptions.arrowOptions == RendererOptions::ArrowsAlways) )
@@ -671,6 +814,7 @@ void FeaturePainter::drawLabel(Node* Pt, QPainter* thePainter, MapRenderer* theR
 {
     if (!DrawLabel)
         return;
+    StyleProfiler::Scope profile(this, PainterStatistics::Label);
 
     QString str = Pt->tagValue(getLabelTag(), QString());
     QString strBg = Pt->tagValue(getLabelBackgroundTag(), QString());
@@ -686,6 +830,7 @@ void FeaturePainter::drawLabel(Way* R, QPainter* thePainter, MapRenderer* theRen
 {
     if (!DrawLabel)
         return;
+    StyleProfiler::Scope profile(this, PainterStatistics::Label);
 
     QString str = R->tagValue(getLabelTag(), QString());
     QString strBg = R->tagValue(getLabelBackgroundTag(), QString());
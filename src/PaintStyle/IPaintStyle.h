@@ -4,8 +4,10 @@
 #include "Painter.h"
 
 class MapView;
+class MapCSSStyleSheet;
 
 #include <QList>
+#include <QSharedPointer>
 
 class IPaintStyle
 {
@@ -17,10 +19,12 @@ public:
     virtual QList<Painter> getPainters() const = 0;
     virtual void setPainters(QList<Painter> aPainters) = 0;
     virtual bool isDirty() = 0;
+    /* The MapCSS sheet styling the features instead of the painters, if any */
+    virtual QSharedPointer<MapCSSStyleSheet> getStyleSheet() const { return QSharedPointer<MapCSSStyleSheet>(); }
 
     virtual QString getFilename() = 0;
     virtual void savePainters(const QString& filename) = 0;
-    virtual void loadPainters(const QString& filename) = 0;
+    virtual bool loadPainters(const QString& filename) = 0;
     
     virtual ~IPaintStyle() {};
 };
@@ -1,43 +1,39 @@
 #ifndef MERKAARTOR_MAPCSSPAINTSTYLE_H_
 #define MERKAARTOR_MAPCSSPAINTSTYLE_H_
 
+#include "IPaintStyle.h"
 #include "Painter.h"
 
 class MapView;
-class PaintStylePrivate;
 
 #include <QList>
 
-class MapCSSPaintstyle
+/* A MapCSS style sheet as the map style. It has no painters of its own: the
+ * document asks the sheet for the style of each tag set. */
+class MapCSSPaintstyle : public IPaintStyle
 {
-    public:
-        static MapCSSPaintstyle* instance() {
-            if (!m_MapCSSInstance) {
-                m_MapCSSInstance = new MapCSSPaintstyle;
-            }
-
-            return m_MapCSSInstance;
-        }
-
-        MapCSSPaintstyle();
-        virtual ~MapCSSPaintstyle();
-        void initialize(QPainter& P, MapView& theView);
-
-        int painterSize();
-        const GlobalPainter& getGlobalPainter() const;
-        void setGlobalPainter(GlobalPainter aGlobalPainter);
-        const Painter* getPainter(int i) const;
-        QList<Painter> getPainters() const;
-        void setPainters(QList<Painter> aPainters);
-
-        void savePainters(const QString& filename);
-        void loadPainters(const QString& filename);
-
-    private:
-        QList<Painter> Painters;
-        GlobalPainter globalPainter;
-
-        static MapCSSPaintstyle* m_MapCSSInstance;
+public:
+    MapCSSPaintstyle();
+    virtual ~MapCSSPaintstyle();
+
+    int painterSize();
+    const GlobalPainter& getGlobalPainter() const;
+    void setGlobalPainter(GlobalPainter aGlobalPainter);
+    const Painter* getPainter(int i) const;
+    QList<Painter> getPainters() const;
+    void setPainters(QList<Painter> aPainters);
+    bool isDirty();
+    QSharedPointer<MapCSSStyleSheet> getStyleSheet() const;
+
+    QString getFilename();
+    void savePainters(const QString& filename);
+    bool loadPainters(const QString& filename);
+
+private:
+    QString m_filename;
+    QList<Painter> Painters;
+    GlobalPainter globalPainter;
+    QSharedPointer<MapCSSStyleSheet> theSheet;
 };
 
 #endif
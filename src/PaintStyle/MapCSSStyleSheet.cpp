@@ -0,0 +1,1138 @@
+//
+// C++ Implementation: MapCSSStyleSheet
+//
+// Description: MapCSS 0.2 tokenizer, parser and cascade.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#include "Global.h"
+
+#include "MapCSSStyleSheet.h"
+
+#include "Feature.h"
+#include "FeaturePainter.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSet>
+#include <QTextStream>
+
+#include <algorithm>
+#include <math.h>
+
+#define ALWAYS 10e6
+/* Meters per pixel at zoom 0 on the equator, as for the tile servers */
+#define ZOOM0_M_PER_PIXEL 156543.034
+/* How far up the parents a descendant selector looks */
+#define MAPCSS_MAXDEPTH 3
+
+static const quint32 AllZooms = (1u << (MAPCSS_MAXZOOM + 1)) - 1;
+
+static const struct {
+    const char* Name;
+    int Property;
+} PropertyNames[] = {
+    { "width", MapCSSStyleSheet::Width },
+    { "color", MapCSSStyleSheet::Color },
+    { "opacity", MapCSSStyleSheet::Opacity },
+    { "dashes", MapCSSStyleSheet::Dashes },
+    { "casing-width", MapCSSStyleSheet::CasingWidth },
+    { "casing-color", MapCSSStyleSheet::CasingColor },
+    { "casing-opacity", MapCSSStyleSheet::CasingOpacity },
+    { "fill-color", MapCSSStyleSheet::FillColor },
+    { "background-color", MapCSSStyleSheet::FillColor },
+    { "fill-opacity", MapCSSStyleSheet::FillOpacity },
+    { "fill-image", MapCSSStyleSheet::FillImage },
+    { "icon-image", MapCSSStyleSheet::IconImage },
+    { "icon-width", MapCSSStyleSheet::IconWidth },
+    { "text", MapCSSStyleSheet::Text },
+    { "text-color", MapCSSStyleSheet::TextColor },
+    { "text-halo-radius", MapCSSStyleSheet::TextHaloRadius },
+    { "text-position", MapCSSStyleSheet::TextPosition },
+    { "font-size", MapCSSStyleSheet::FontSize },
+    { "font-family", MapCSSStyleSheet::FontFamily },
+    { "font-weight", MapCSSStyleSheet::FontWeight },
+    { "font-style", MapCSSStyleSheet::FontStyle },
+    { "z-index", MapCSSStyleSheet::ZIndex }
+};
+
+static int propertyOf(const QString& name)
+{
+    static QHash<QString, int> Properties;
+    if (Properties.isEmpty())
+        for (unsigned i=0; i<sizeof(PropertyNames)/sizeof(PropertyNames[0]); ++i)
+            Properties.insert(PropertyNames[i].Name, PropertyNames[i].Property);
+    return Properties.value(name, -1);
+}
+
+static QColor toColor(const QString& s)
+{
+    QString v = s.trimmed();
+    if (v.startsWith("rgb(", Qt::CaseInsensitive) && v.endsWith(')')) {
+        QStringList c = v.mid(4, v.size()-5).split(',');
+        if (c.size() != 3)
+            return QColor();
+        return QColor(c[0].trimmed().toInt(), c[1].trimmed().toInt(), c[2].trimmed().toInt());
+    }
+    return QColor(v);
+}
+
+/* MapCSSParser */
+
+class MapCSSParser
+{
+public:
+    MapCSSParser(MapCSSStyleSheet& aSheet, const QString& aCss, const QString& aBaseDir)
+        : theSheet(aSheet), Css(aCss), BaseDir(aBaseDir), Pos(0)
+    {
+    }
+
+    bool parse();
+
+private:
+    QChar peek(int ahead = 0) const
+    {
+        return Pos+ahead < Css.size() ? Css.at(Pos+ahead) : QChar();
+    }
+    bool atEnd() const { return Pos >= Css.size(); }
+    bool skipSpace();
+    QString readName(bool isKey);
+    QString readQuoted();
+    QString readValue(const QString& stops);
+    bool readInt(int& v);
+
+    bool readRule();
+    bool readSelector(MapCSSSelector& S, bool& isCanvas);
+    bool readSimpleSelector(MapCSSSimpleSelector& S, QString& Subpart, bool& isCanvas);
+    bool readZoom(quint32& Zooms);
+    bool readCondition(MapCSSSimpleSelector& S);
+    bool readDeclarations(MapCSSRule& R);
+    bool readDeclaration(MapCSSRule& R);
+    bool toDeclaration(const QString& name, const QString& value, MapCSSDeclaration& D);
+
+    bool error(const QString& msg);
+    void note(const QString& msg);
+    void skipTo(QChar c);
+
+    MapCSSStyleSheet& theSheet;
+    QString Css;
+    QString BaseDir;
+    int Pos;
+    QSet<QString> Noted;
+};
+
+bool MapCSSParser::error(const QString& msg)
+{
+    int line = Css.left(Pos).count('\n') + 1;
+    theSheet.theErrors << QString("line %1: %2").arg(line).arg(msg);
+    return false;
+}
+
+/* Reports something ignored only once, as most styles repeat it */
+void MapCSSParser::note(const QString& msg)
+{
+    if (Noted.contains(msg))
+        return;
+    Noted.insert(msg);
+    error(msg);
+}
+
+/* Skips blanks and comments, true if there were some */
+bool MapCSSParser::skipSpace()
+{
+    int start = Pos;
+    while (!atEnd()) {
+        if (peek().isSpace())
+            ++Pos;
+        else if (peek() == '/' && peek(1) == '*') {
+            int end = Css.indexOf("*/", Pos+2);
+            Pos = end < 0 ? Css.size() : end+2;
+        } else if (peek() == '/' && peek(1) == '/') {
+            int end = Css.indexOf('\n', Pos);
+            Pos = end < 0 ? Css.size() : end+1;
+        } else
+            break;
+    }
+    return Pos != start;
+}
+
+/* Skips past the next c outside of quotes */
+void MapCSSParser::skipTo(QChar c)
+{
+    while (!atEnd()) {
+        if (peek() == '"' || peek() == '\'')
+            readQuoted();
+        else if (Css.at(Pos++) == c)
+            return;
+    }
+}
+
+QString MapCSSParser::readName(bool isKey)
+{
+    if (isKey && (peek() == '"' || peek() == '\''))
+        return readQuoted();
+    int start = Pos;
+    while (!atEnd()) {
+        QChar c = peek();
+        if (c.isLetterOrNumber() || c == '_' || c == '-' || (isKey && c == ':'))
+            ++Pos;
+        else
+            break;
+    }
+    return Css.mid(start, Pos-start);
+}
+
+QString MapCSSParser::readQuoted()
+{
+    QChar quote = Css.at(Pos++);
+    QString s;
+    while (!atEnd() && peek() != quote) {
+        if (peek() == '\\' && Pos+1 < Css.size())
+            ++Pos;
+        s += Css.at(Pos++);
+    }
+    ++Pos;
+    return s;
+}
+
+/* Reads up to one of stops, outside of quotes and parentheses */
+QString MapCSSParser::readValue(const QString& stops)
+{
+    QString s;
+    int depth = 0;
+    while (!atEnd()) {
+        QChar c = peek();
+        if (!depth && stops.contains(c))
+            break;
+        if (c == '"' || c == '\'') {
+            s += c + readQuoted() + c;
+            continue;
+        }
+        if (c == '(')
+            ++depth;
+        else if (c == ')' && depth)
+            --depth;
+        s += c;
+        ++Pos;
+    }
+    return s.trimmed();
+}
+
+bool MapCSSParser::readInt(int& v)
+{
+    int start = Pos;
+    while (peek().isDigit())
+        ++Pos;
+    if (Pos == start)
+        return false;
+    v = Css.mid(start, Pos-start).toInt();
+    return true;
+}
+
+bool MapCSSParser::parse()
+{
+    for (;;) {
+        skipSpace();
+        if (atEnd())
+            break;
+        if (peek() == '@') {
+            note("@ rules are not supported");
+            skipTo(';');
+            continue;
+        }
+        readRule();
+    }
+    return theSheet.theErrors.isEmpty();
+}
+
+bool MapCSSParser::readRule()
+{
+    MapCSSRule R;
+    bool hasCanvas = false;
+    for (;;) {
+        MapCSSSelector S;
+        bool isCanvas = false;
+        if (!readSelector(S, isCanvas)) {
+            skipTo('}');
+            return false;
+        }
+        if (isCanvas)
+            hasCanvas = true;
+        else
+            R.Selectors.append(S);
+
+        skipSpace();
+        if (peek() != ',')
+            break;
+        ++Pos;
+        skipSpace();
+    }
+    if (peek() != '{') {
+        error("'{' expected");
+        skipTo('}');
+        return false;
+    }
+    ++Pos;
+    if (!readDeclarations(R))
+        return false;
+
+    if (hasCanvas) {
+        for (int i=0; i<R.Declarations.size(); ++i)
+            if (R.Declarations[i].Property == MapCSSStyleSheet::FillColor)
+                theSheet.theCanvas.backgroundActive(true).background(R.Declarations[i].Color);
+    }
+    if (!R.Selectors.isEmpty())
+        theSheet.Rules.append(R);
+    return true;
+}
+
+bool MapCSSParser::readSelector(MapCSSSelector& S, bool& isCanvas)
+{
+    for (;;) {
+        MapCSSSimpleSelector P;
+        if (!readSimpleSelector(P, S.Subpart, isCanvas))
+            return false;
+        S.Parts.append(P);
+
+        bool spaced = skipSpace();
+        if (peek() == '>') {
+            ++Pos;
+            skipSpace();
+            S.Parts.last().Child = true;
+        } else if (!spaced || !(peek().isLetter() || peek() == '*'))
+            break;
+    }
+    if (isCanvas && S.Parts.size() > 1)
+        return error("canvas cannot be combined with other selectors");
+    if (!S.Subpart.isEmpty() && S.Subpart != "default")
+        note(QString("Subparts are not supported, ::%1 ignored").arg(S.Subpart));
+    return true;
+}
+
+bool MapCSSParser::readSimpleSelector(MapCSSSimpleSelector& S, QString& Subpart, bool& isCanvas)
+{
+    QString type;
+    if (peek() == '*') {
+        ++Pos;
+        type = "*";
+    } else
+        type = readName(false);
+
+    if (type == "node")
+        S.Types = MapCSSStyleSheet::Node;
+    else if (type == "way" || type == "line")
+        S.Types = MapCSSStyleSheet::Way;
+    else if (type == "area")
+        S.Types = MapCSSStyleSheet::Closed | MapCSSStyleSheet::Multipolygon;
+    else if (type == "relation")
+        S.Types = MapCSSStyleSheet::Relation;
+    else if (type == "*")
+        S.Types = MapCSSStyleSheet::AnyKind;
+    else if (type == "canvas")
+        isCanvas = true;
+    else if (type.isEmpty())
+        return error("Selector expected");
+    else
+        return error(QString("Unknown object type: %1").arg(type));
+
+    S.Zooms = AllZooms;
+    for (;;) {
+        QChar c = peek();
+        if (c == '|' && peek(1) == 'z') {
+            Pos += 2;
+            if (!readZoom(S.Zooms))
+                return false;
+        } else if (c == '[') {
+            ++Pos;
+            if (!readCondition(S))
+                return false;
+        } else if (c == ':' && peek(1) == ':') {
+            Pos += 2;
+            Subpart = readName(false);
+        } else if (c == ':') {
+            ++Pos;
+            QString pseudo = readName(false);
+            MapCSSCondition C;
+            if (pseudo == "closed")
+                C.theOp = MapCSSCondition::Closed;
+            else if (pseudo == "unclosed")
+                C.theOp = MapCSSCondition::NotClosed;
+            else
+                /* :hover, :selected... do not apply to the rendered map */
+                C.theOp = MapCSSCondition::Never;
+            S.Conditions.append(C);
+        } else if (c == '.' || (c == '!' && peek(1) == '.')) {
+            MapCSSCondition C;
+            C.theOp = (c == '.') ? MapCSSCondition::HasClass : MapCSSCondition::NotClass;
+            Pos += (c == '.') ? 1 : 2;
+            C.Value = readName(false);
+            S.Conditions.append(C);
+        } else
+            break;
+    }
+    return true;
+}
+
+/* |zN, |zN-, |z-M or |zN-M */
+bool MapCSSParser::readZoom(quint32& Zooms)
+{
+    int from = 0, to = MAPCSS_MAXZOOM;
+    if (peek().isDigit()) {
+        readInt(from);
+        if (peek() == '-') {
+            ++Pos;
+            if (peek().isDigit())
+                readInt(to);
+        } else
+            to = from;
+    } else if (peek() == '-') {
+        ++Pos;
+        if (!readInt(to))
+            return error("Zoom level expected");
+    } else
+        return error("Zoom level expected");
+
+    /* The last level stands for all the closer views */
+    from = qMin(from, MAPCSS_MAXZOOM);
+    to = qMin(to, MAPCSS_MAXZOOM);
+    Zooms = 0;
+    for (int z=from; z<=to; ++z)
+        Zooms |= 1u << z;
+    return true;
+}
+
+bool MapCSSParser::readCondition(MapCSSSimpleSelector& S)
+{
+    MapCSSCondition C;
+    skipSpace();
+    bool negated = false;
+    if (peek() == '!') {
+        negated = true;
+        ++Pos;
+        skipSpace();
+    }
+    C.Key = readName(true);
+    if (C.Key.isEmpty())
+        return error("Tag key expected");
+    skipSpace();
+
+    if (peek() == ']' || peek() == '?') {
+        if (peek() == '?') {
+            C.theOp = negated ? MapCSSCondition::IsFalse : MapCSSCondition::IsTrue;
+            ++Pos;
+            skipSpace();
+        } else
+            C.theOp = negated ? MapCSSCondition::NotExists : MapCSSCondition::Exists;
+    } else {
+        if (negated)
+            return error("'!' only applies to [!key] and [!key?]");
+
+        static const struct {
+            const char* Text;
+            MapCSSCondition::Op theOp;
+        } Ops[] = {
+            { "=~", MapCSSCondition::Matches }, { "!~", MapCSSCondition::NotMatches },
+            { "!=", MapCSSCondition::NotEquals }, { "<=", MapCSSCondition::LessEqual },
+            { ">=", MapCSSCondition::GreaterEqual }, { "^=", MapCSSCondition::Prefix },
+            { "$=", MapCSSCondition::Suffix }, { "*=", MapCSSCondition::Substring },
+            { "~=", MapCSSCondition::ListContains }, { "<", MapCSSCondition::Less },
+            { ">", MapCSSCondition::Greater }, { "=", MapCSSCondition::Equals }
+        };
+        unsigned i = 0;
+        for (; i<sizeof(Ops)/sizeof(Ops[0]); ++i)
+            if (Css.midRef(Pos, qstrlen(Ops[i].Text)) == QLatin1String(Ops[i].Text))
+                break;
+        if (i == sizeof(Ops)/sizeof(Ops[0]))
+            return error("Operator expected");
+        C.theOp = Ops[i].theOp;
+        Pos += qstrlen(Ops[i].Text);
+        skipSpace();
+
+        if (C.theOp == MapCSSCondition::Matches || C.theOp == MapCSSCondition::NotMatches) {
+            if (peek() != '/')
+                return error("Regular expression expected");
+            ++Pos;
+            QString re;
+            while (!atEnd() && peek() != '/') {
+                if (peek() == '\\' && peek(1) == '/')
+                    ++Pos;
+                re += Css.at(Pos++);
+            }
+            ++Pos;
+            QRegularExpression::PatternOptions opt = QRegularExpression::NoPatternOption;
+            if (peek() == 'i') {
+                opt |= QRegularExpression::CaseInsensitiveOption;
+                ++Pos;
+            }
+            C.Regex = QRegularExpression(re, opt);
+            if (!C.Regex.isValid())
+                return error(QString("Invalid regular expression: %1").arg(C.Regex.errorString()));
+            C.Regex.optimize();
+        } else {
+            C.Value = (peek() == '"' || peek() == '\'') ? readQuoted() : readValue("]");
+            if (C.theOp >= MapCSSCondition::Less && C.theOp <= MapCSSCondition::GreaterEqual) {
+                bool ok;
+                C.Number = C.Value.toDouble(&ok);
+                if (!ok)
+                    return error(QString("Number expected: %1").arg(C.Value));
+            }
+            C.ValueFold = g_foldTagValue(C.Value);
+        }
+        skipSpace();
+    }
+    if (peek() != ']')
+        return error("']' expected");
+    ++Pos;
+
+    C.KeyId = g_addTagKey(C.Key);
+    S.Conditions.append(C);
+    return true;
+}
+
+bool MapCSSParser::readDeclarations(MapCSSRule& R)
+{
+    for (;;) {
+        skipSpace();
+        if (atEnd())
+            return error("'}' expected");
+        if (peek() == '}') {
+            ++Pos;
+            return true;
+        }
+        if (peek() == ';') {
+            ++Pos;
+            continue;
+        }
+        if (!readDeclaration(R)) {
+            /* Carry on with the next declaration */
+            QString rest = readValue(";}");
+            Q_UNUSED(rest);
+        }
+    }
+}
+
+bool MapCSSParser::readDeclaration(MapCSSRule& R)
+{
+    QString name = readName(false);
+    if (name.isEmpty())
+        return error("Property expected");
+    skipSpace();
+
+    if (name == "set") {
+        if (peek() == '.')
+            ++Pos;
+        QString cls = readName(true);
+        skipSpace();
+        if (cls.isEmpty())
+            return error("Class expected after set");
+        if (peek() == '=') {
+            note("Setting tags is not supported");
+            return false;
+        }
+        R.SetClasses << cls;
+        return true;
+    }
+    if (name == "exit")
+        return true;
+
+    if (peek() != ':')
+        return error(QString("':' expected after %1").arg(name));
+    ++Pos;
+    skipSpace();
+    QString value = readValue(";}");
+
+    MapCSSDeclaration D;
+    if (!toDeclaration(name, value, D))
+        return false;
+    R.Declarations.append(D);
+    return true;
+}
+
+bool MapCSSParser::toDeclaration(const QString& name, const QString& value, MapCSSDeclaration& D)
+{
+    D.Property = propertyOf(name);
+    if (D.Property < 0) {
+        note(QString("Property not supported: %1").arg(name));
+        return false;
+    }
+    if (value.startsWith("eval(")) {
+        note("eval() is not supported");
+        return false;
+    }
+
+    QString text = value;
+    if (text.size() >= 2 && (text.startsWith('"') || text.startsWith('\'')) && text.endsWith(text.at(0)))
+        text = text.mid(1, text.size()-2);
+
+    switch (D.Property) {
+    case MapCSSStyleSheet::Color:
+    case MapCSSStyleSheet::CasingColor:
+    case MapCSSStyleSheet::FillColor:
+    case MapCSSStyleSheet::TextColor:
+        D.Color = toColor(text);
+        if (!D.Color.isValid())
+            return error(QString("Invalid color: %1").arg(value));
+        break;
+
+    case MapCSSStyleSheet::Dashes: {
+        QStringList l = text.split(',');
+        for (int i=0; i<l.size(); ++i) {
+            bool ok;
+            D.Dashes << l[i].trimmed().toDouble(&ok);
+            if (!ok || D.Dashes.last() < 0)
+                return error(QString("Invalid dashes: %1").arg(value));
+        }
+        /* An odd pattern is repeated, as in SVG */
+        if (D.Dashes.size() % 2)
+            D.Dashes += D.Dashes;
+        break;
+    }
+
+    case MapCSSStyleSheet::FillImage:
+    case MapCSSStyleSheet::IconImage:
+        if (QDir::isRelativePath(text) && !text.startsWith(":"))
+            text = QDir(BaseDir).filePath(text);
+        D.Text = text;
+        break;
+
+    case MapCSSStyleSheet::Text:
+        D.Text = (text == "auto") ? QString("name") : text;
+        break;
+
+    case MapCSSStyleSheet::TextPosition:
+    case MapCSSStyleSheet::FontFamily:
+    case MapCSSStyleSheet::FontWeight:
+    case MapCSSStyleSheet::FontStyle:
+        D.Text = text;
+        break;
+
+    default: {
+        /* Numbers, sizes in pixels */
+        if (text.endsWith("px"))
+            text.chop(2);
+        bool ok;
+        D.Number = text.toDouble(&ok);
+        if (!ok)
+            return error(QString("Number expected for %1: %2").arg(name).arg(value));
+        break;
+    }
+    }
+    return true;
+}
+
+/* MapCSSStyleSheet */
+
+MapCSSStyleSheet::MapCSSStyleSheet()
+{
+}
+
+bool MapCSSStyleSheet::load(const QString& filename)
+{
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        theErrors << file.errorString();
+        return false;
+    }
+    QTextStream in(&file);
+    in.setCodec("UTF-8");
+    return parse(in.readAll(), QFileInfo(filename).absolutePath());
+}
+
+bool MapCSSStyleSheet::parse(const QString& css, const QString& baseDir)
+{
+    Rules.clear();
+    theErrors.clear();
+    theCanvas = GlobalPainter();
+
+    MapCSSParser parser(*this, css, baseDir);
+    bool ok = parser.parse();
+    buildIndex();
+    return ok;
+}
+
+const QStringList& MapCSSStyleSheet::errors() const
+{
+    return theErrors;
+}
+
+int MapCSSStyleSheet::ruleSize() const
+{
+    return Rules.size();
+}
+
+const GlobalPainter& MapCSSStyleSheet::canvas() const
+{
+    return theCanvas;
+}
+
+/* Each selector is filed under the first tag key it needs, or matched
+ * against every feature if it needs none */
+void MapCSSStyleSheet::buildIndex()
+{
+    Entries.clear();
+    Always.clear();
+    ByKey.clear();
+    TestedKeys.clear();
+
+    for (int r=0; r<Rules.size(); ++r) {
+        for (int s=0; s<Rules[r].Selectors.size(); ++s) {
+            const MapCSSSelector& S = Rules[r].Selectors[s];
+            Entry E;
+            E.Rule = r;
+            E.Selector = s;
+            E.Zooms = AllZooms;
+            for (int i=0; i<S.Parts.size(); ++i)
+                E.Zooms &= S.Parts[i].Zooms;
+            if (!E.Zooms)
+                continue;
+
+            const MapCSSSimpleSelector& Last = S.Parts.last();
+            for (int i=0; i<Last.Conditions.size(); ++i) {
+                const MapCSSCondition& C = Last.Conditions[i];
+                switch (C.theOp) {
+                case MapCSSCondition::HasClass:
+                case MapCSSCondition::NotClass:
+                case MapCSSCondition::Closed:
+                case MapCSSCondition::NotClosed:
+                case MapCSSCondition::Never:
+                    break;
+                case MapCSSCondition::Exists:
+                case MapCSSCondition::NotExists:
+                    if (!TestedKeys.contains(C.KeyId))
+                        TestedKeys.insert(C.KeyId, false);
+                    break;
+                default:
+                    TestedKeys.insert(C.KeyId, true);
+                    break;
+                }
+            }
+
+            QVector<int>* B = &Always;
+            for (int i=0; i<Last.Conditions.size(); ++i) {
+                switch (Last.Conditions[i].theOp) {
+                case MapCSSCondition::Exists:
+                case MapCSSCondition::Equals:
+                case MapCSSCondition::Matches:
+                case MapCSSCondition::Less:
+                case MapCSSCondition::LessEqual:
+                case MapCSSCondition::Greater:
+                case MapCSSCondition::GreaterEqual:
+                case MapCSSCondition::Prefix:
+                case MapCSSCondition::Suffix:
+                case MapCSSCondition::Substring:
+                case MapCSSCondition::ListContains:
+                case MapCSSCondition::IsTrue:
+                    B = &ByKey[Last.Conditions[i].KeyId];
+                    break;
+                default:
+                    continue;
+                }
+                break;
+            }
+            B->append(Entries.size());
+            Entries.append(E);
+        }
+    }
+}
+
+int MapCSSStyleSheet::kindOf(const Feature* F)
+{
+    if (CHECK_NODE(F))
+        return Node;
+    if (CHECK_WAY(F))
+        return (F->getType() & IFeature::Polygon) ? (Way | Closed) : Way;
+    if (CHECK_RELATION(F))
+        return F->tagValue("type", QString()) == "multipolygon" ? (Relation | Multipolygon) : Relation;
+    return 0;
+}
+
+qreal MapCSSStyleSheet::zoomToPixelPerM(int zoom)
+{
+    return pow(2.0, zoom) / ZOOM0_M_PER_PIXEL;
+}
+
+/* MapCSSCascade */
+
+uint qHash(const MapCSSCascade::Key& k)
+{
+    uint h = k.Kind ^ qHash(k.Ancestors);
+    for (int i=0; i<k.Tags.size(); ++i)
+        h = h * 31 + (k.Tags[i].first ^ (k.Tags[i].second << 16));
+    return h;
+}
+
+MapCSSCascade::MapCSSCascade(QSharedPointer<MapCSSStyleSheet> aSheet)
+    : theSheet(aSheet)
+{
+}
+
+MapCSSCascade::~MapCSSCascade()
+{
+    qDeleteAll(thePainters);
+}
+
+int MapCSSCascade::cacheSize() const
+{
+    return theCache.size();
+}
+
+static int findKeyId(const Feature* F, quint32 k)
+{
+    for (int i=0; i<F->tagSize(); ++i)
+        if (F->tagKeyId(i) == k)
+            return i;
+    return -1;
+}
+
+static bool isTrue(const QString& v)
+{
+    return v == "yes" || v == "true" || v == "1";
+}
+
+/* The class conditions are left to the cascade */
+bool MapCSSCascade::matchesTags(const MapCSSSimpleSelector& S, const Feature* F, int aKind) const
+{
+    if (!(S.Types & aKind))
+        return false;
+
+    for (int i=0; i<S.Conditions.size(); ++i) {
+        const MapCSSCondition& C = S.Conditions[i];
+        if (C.theOp == MapCSSCondition::HasClass || C.theOp == MapCSSCondition::NotClass)
+            continue;
+        if (C.theOp == MapCSSCondition::Closed || C.theOp == MapCSSCondition::NotClosed) {
+            bool closed = aKind & (MapCSSStyleSheet::Closed | MapCSSStyleSheet::Multipolygon);
+            if (closed != (C.theOp == MapCSSCondition::Closed))
+                return false;
+            continue;
+        }
+        if (C.theOp == MapCSSCondition::Never)
+            return false;
+
+        int t = findKeyId(F, C.KeyId);
+        bool result;
+        switch (C.theOp) {
+        case MapCSSCondition::Exists:
+            result = t >= 0;
+            break;
+        case MapCSSCondition::NotExists:
+            result = t < 0;
+            break;
+        case MapCSSCondition::Equals:
+        case MapCSSCondition::NotEquals:
+            /* The folded ids tell most values apart without comparing them */
+            result = t >= 0 && g_getTagValueFold(F->tagValueId(t)) == C.ValueFold && g_getTagValue(F->tagValueId(t)) == C.Value;
+            if (C.theOp == MapCSSCondition::NotEquals)
+                result = !result;
+            break;
+        case MapCSSCondition::Matches:
+        case MapCSSCondition::NotMatches:
+            result = t >= 0 && C.Regex.match(F->tagValue(t)).hasMatch();
+            if (C.theOp == MapCSSCondition::NotMatches)
+                result = !result;
+            break;
+        case MapCSSCondition::IsTrue:
+        case MapCSSCondition::IsFalse:
+            result = t >= 0 && isTrue(F->tagValue(t));
+            if (C.theOp == MapCSSCondition::IsFalse)
+                result = !result;
+            break;
+        default: {
+            if (t < 0)
+                return false;
+            QString v = F->tagValue(t);
+            switch (C.theOp) {
+            case MapCSSCondition::Prefix:
+                result = v.startsWith(C.Value);
+                break;
+            case MapCSSCondition::Suffix:
+                result = v.endsWith(C.Value);
+                break;
+            case MapCSSCondition::Substring:
+                result = v.contains(C.Value);
+                break;
+            case MapCSSCondition::ListContains: {
+                QStringList l = v.split(';');
+                result = false;
+                for (int j=0; j<l.size() && !result; ++j)
+                    result = l[j].trimmed() == C.Value;
+                break;
+            }
+            default: {
+                bool ok;
+                qreal n = v.toDouble(&ok);
+                if (!ok)
+                    return false;
+                switch (C.theOp) {
+                case MapCSSCondition::Less:
+                    result = n < C.Number;
+                    break;
+                case MapCSSCondition::LessEqual:
+                    result = n <= C.Number;
+                    break;
+                case MapCSSCondition::Greater:
+                    result = n > C.Number;
+                    break;
+                default:
+                    result = n >= C.Number;
+                    break;
+                }
+            }
+            }
+        }
+        }
+        if (!result)
+            return false;
+    }
+    return true;
+}
+
+/* Whether Parts[0..Part] of S match the parents of F, from its own */
+bool MapCSSCascade::matchesAncestors(const MapCSSSelector& S, int Part, const Feature* F, int Depth) const
+{
+    if (Part < 0)
+        return true;
+
+    const MapCSSSimpleSelector& P = S.Parts[Part];
+    for (int i=0; i<F->sizeParents(); ++i) {
+        const Feature* A = dynamic_cast<const Feature*>(F->getParent(i));
+        if (!A || A->isDeleted())
+            continue;
+        if (matchesTags(P, A, MapCSSStyleSheet::kindOf(A)) && matchesAncestors(S, Part-1, A, 0))
+            return true;
+        if (!P.Child && Depth < MAPCSS_MAXDEPTH && matchesAncestors(S, Part, A, Depth+1))
+            return true;
+    }
+    return false;
+}
+
+void MapCSSCascade::candidates(const Feature* F, QVector<int>& Result) const
+{
+    const MapCSSStyleSheet& theStyle = *theSheet;
+    Result = theStyle.Always;
+    for (int i=0; i<F->tagSize(); ++i) {
+        QHash<quint32, QVector<int> >::const_iterator it = theStyle.ByKey.constFind(F->tagKeyId(i));
+        if (it != theStyle.ByKey.constEnd())
+            Result += it.value();
+    }
+
+    /* The declarations cascade in the order of the sheet */
+    std::sort(Result.begin(), Result.end());
+    Result.erase(std::unique(Result.begin(), Result.end()), Result.end());
+}
+
+void MapCSSCascade::painters(const Feature* F, QList<const FeaturePainter*>& Result)
+{
+    Result.clear();
+    int kind = MapCSSStyleSheet::kindOf(F);
+    if (!kind)
+        return;
+
+    QVector<int> Candidates;
+    candidates(F, Candidates);
+
+    /* Only the tags the selectors test go in the key, without their value
+     * when it is not compared; the tests on the parents are in Ancestors */
+    Key k;
+    k.Kind = kind;
+    for (int i=0; i<F->tagSize(); ++i) {
+        QHash<quint32, bool>::const_iterator t = theSheet->TestedKeys.constFind(F->tagKeyId(i));
+        if (t != theSheet->TestedKeys.constEnd())
+            k.Tags.append(qMakePair(F->tagKeyId(i), t.value() ? F->tagValueId(i) : 0));
+    }
+    std::sort(k.Tags.begin(), k.Tags.end());
+    for (int i=0; i<Candidates.size(); ++i) {
+        const MapCSSStyleSheet::Entry& E = theSheet->Entries[Candidates[i]];
+        const MapCSSSelector& S = theSheet->Rules[E.Rule].Selectors[E.Selector];
+        if (S.Parts.size() > 1)
+            k.Ancestors.append(matchesAncestors(S, S.Parts.size()-2, F, 0) ? '1' : '0');
+    }
+
+    theLock.lockForRead();
+    QHash<Key, QList<const FeaturePainter*> >::const_iterator it = theCache.constFind(k);
+    if (it != theCache.constEnd()) {
+        Result = it.value();
+        theLock.unlock();
+        return;
+    }
+    theLock.unlock();
+
+    QList<StyleRange> Ranges;
+    compute(F, kind, Candidates, k.Ancestors, Ranges);
+
+    QWriteLocker locker(&theLock);
+    it = theCache.constFind(k);
+    if (it != theCache.constEnd()) {
+        Result = it.value();
+        return;
+    }
+    bool isArea = kind & (MapCSSStyleSheet::Closed | MapCSSStyleSheet::Multipolygon);
+    for (int i=0; i<Ranges.size(); ++i)
+        Result.append(painterFor(Ranges[i], isArea));
+    theCache.insert(k, Result);
+}
+
+void MapCSSCascade::compute(const Feature* F, int aKind, const QVector<int>& Candidates, const QByteArray& Ancestors,
+                            QList<StyleRange>& Ranges) const
+{
+    const MapCSSStyleSheet& theStyle = *theSheet;
+
+    /* The tags are tested once, the zooms and classes for each zoom */
+    QVector<bool> Matched(Candidates.size());
+    quint32 Zooms = 0;
+    for (int i=0, a=0; i<Candidates.size(); ++i) {
+        const MapCSSStyleSheet::Entry& E = theStyle.Entries[Candidates[i]];
+        const MapCSSSelector& S = theStyle.Rules[E.Rule].Selectors[E.Selector];
+        Matched[i] = matchesTags(S.Parts.last(), F, aKind);
+        if (S.Parts.size() > 1)
+            Matched[i] = (Ancestors.at(a++) == '1') && Matched[i];
+        if (!S.Subpart.isEmpty() && S.Subpart != "default")
+            Matched[i] = false;
+        if (Matched[i])
+            Zooms |= E.Zooms;
+    }
+
+    QVector<const MapCSSDeclaration*> Style;
+    for (int z=0; z<=MAPCSS_MAXZOOM; ++z) {
+        Style.fill(0, MapCSSStyleSheet::PropertyCount);
+        bool any = false;
+        if (Zooms & (1u << z)) {
+            QSet<QString> Classes;
+            for (int i=0; i<Candidates.size(); ++i) {
+                if (!Matched[i])
+                    continue;
+                const MapCSSStyleSheet::Entry& E = theStyle.Entries[Candidates[i]];
+                if (!(E.Zooms & (1u << z)))
+                    continue;
+                const MapCSSRule& R = theStyle.Rules[E.Rule];
+                const MapCSSSimpleSelector& S = R.Selectors[E.Selector].Parts.last();
+                bool ok = true;
+                for (int j=0; j<S.Conditions.size() && ok; ++j) {
+                    if (S.Conditions[j].theOp == MapCSSCondition::HasClass)
+                        ok = Classes.contains(S.Conditions[j].Value);
+                    else if (S.Conditions[j].theOp == MapCSSCondition::NotClass)
+                        ok = !Classes.contains(S.Conditions[j].Value);
+                }
+                if (!ok)
+                    continue;
+                for (int j=0; j<R.Declarations.size(); ++j)
+                    Style[R.Declarations[j].Property] = &R.Declarations[j];
+                any = any || R.Declarations.size();
+                for (int j=0; j<R.SetClasses.size(); ++j)
+                    Classes.insert(R.SetClasses[j]);
+            }
+        }
+
+        /* Zooms styled alike share a painter */
+        if (!Ranges.isEmpty() && Ranges.last().To == z-1 && Ranges.last().Style == Style)
+            Ranges.last().To = z;
+        else if (any) {
+            StyleRange R;
+            R.From = R.To = z;
+            R.Style = Style;
+            Ranges.append(R);
+        }
+    }
+}
+
+static QColor colorOf(const QVector<const MapCSSDeclaration*>& S, int aColor, int anOpacity, const QColor& aDefault)
+{
+    QColor c = S[aColor] ? S[aColor]->Color : aDefault;
+    if (anOpacity >= 0 && S[anOpacity])
+        c.setAlphaF(qBound(0.0, (double)S[anOpacity]->Number, 1.0));
+    return c;
+}
+
+/* The MapCSS properties as a Merkaartor painter: the casing is the
+ * background, the line the foreground */
+static void toPainter(const QVector<const MapCSSDeclaration*>& S, bool isArea, Painter& P)
+{
+    qreal width = S[MapCSSStyleSheet::Width] ? S[MapCSSStyleSheet::Width]->Number : 1.0;
+    bool line = S[MapCSSStyleSheet::Color] && width > 0;
+    if (line) {
+        P.foregroundActive(true);
+        P.foreground(colorOf(S, MapCSSStyleSheet::Color, MapCSSStyleSheet::Opacity, Qt::black), 0, width);
+        const MapCSSDeclaration* dashes = S[MapCSSStyleSheet::Dashes];
+        if (dashes && dashes->Dashes.size() >= 2)
+            /* Pen dash patterns are in line widths */
+            P.foregroundDash(dashes->Dashes[0] / width, dashes->Dashes[1] / width);
+    }
+
+    const MapCSSDeclaration* casing = S[MapCSSStyleSheet::CasingWidth];
+    if (casing && casing->Number > 0) {
+        P.backgroundActive(true);
+        P.background(colorOf(S, MapCSSStyleSheet::CasingColor, MapCSSStyleSheet::CasingOpacity, Qt::black),
+                     0, (line ? width : 0) + 2*casing->Number);
+    }
+
+    if (S[MapCSSStyleSheet::FillColor])
+        P.foregroundFill(colorOf(S, MapCSSStyleSheet::FillColor, MapCSSStyleSheet::FillOpacity, Qt::black));
+    if (S[MapCSSStyleSheet::FillImage]) {
+        P.foregroundUseIcon(true);
+        P.IconName = S[MapCSSStyleSheet::FillImage]->Text;
+    }
+
+    if (S[MapCSSStyleSheet::IconImage]) {
+        qreal size = S[MapCSSStyleSheet::IconWidth] ? S[MapCSSStyleSheet::IconWidth]->Number : 0;
+        P.iconActive(true);
+        P.setIcon(S[MapCSSStyleSheet::IconImage]->Text, 0, size);
+    }
+
+    if (S[MapCSSStyleSheet::Text] && !S[MapCSSStyleSheet::Text]->Text.isEmpty()) {
+        qreal size = S[MapCSSStyleSheet::FontSize] ? S[MapCSSStyleSheet::FontSize]->Number : 10;
+        P.labelActive(true);
+        P.labelTag(S[MapCSSStyleSheet::Text]->Text);
+        P.label(colorOf(S, MapCSSStyleSheet::TextColor, -1, Qt::black), 0, size);
+
+        QFont font;
+        if (S[MapCSSStyleSheet::FontFamily])
+            font.setFamily(S[MapCSSStyleSheet::FontFamily]->Text);
+        if (S[MapCSSStyleSheet::FontWeight])
+            font.setBold(S[MapCSSStyleSheet::FontWeight]->Text == "bold");
+        if (S[MapCSSStyleSheet::FontStyle])
+            font.setItalic(S[MapCSSStyleSheet::FontStyle]->Text == "italic");
+        P.LabelFont = font;
+        P.labelHalo(S[MapCSSStyleSheet::TextHaloRadius] && S[MapCSSStyleSheet::TextHaloRadius]->Number > 0);
+        if (S[MapCSSStyleSheet::TextPosition])
+            P.labelArea(S[MapCSSStyleSheet::TextPosition]->Text == "center");
+        else
+            P.labelArea(isArea);
+    }
+}
+
+/* Called with the write lock held */
+const FeaturePainter* MapCSSCascade::painterFor(const StyleRange& R, bool isArea)
+{
+    QByteArray sig((const char*)R.Style.constData(), R.Style.size() * sizeof(const MapCSSDeclaration*));
+    sig.append((char)R.From).append((char)R.To).append(isArea ? 'a' : 'l');
+    QHash<QByteArray, FeaturePainter*>::const_iterator it = thePainters.constFind(sig);
+    if (it != thePainters.constEnd())
+        return it.value();
+
+    Painter P;
+    toPainter(R.Style, isArea, P);
+    P.zoomBoundary(R.From ? MapCSSStyleSheet::zoomToPixelPerM(R.From) : 0,
+                   R.To < MAPCSS_MAXZOOM ? MapCSSStyleSheet::zoomToPixelPerM(R.To+1) : ALWAYS);
+    /* Named after the rules it takes declarations from, for the style profiler */
+    QStringList rules;
+    for (int i=0; i<R.Style.size(); ++i) {
+        if (!R.Style[i])
+            continue;
+        for (int r=0; r<theSheet->Rules.size(); ++r) {
+            const QVector<MapCSSDeclaration>& D = theSheet->Rules[r].Declarations;
+            if (R.Style[i] >= D.constData() && R.Style[i] < D.constData() + D.size()) {
+                QString rule = QString("rule %1").arg(r+1);
+                if (!rules.contains(rule))
+                    rules << rule;
+                break;
+            }
+        }
+    }
+    FeaturePainter* FP = new FeaturePainter(P);
+    /* Only a name: the cascade, not a tag selector, picks the features */
+    FP->theSelector = rules.join(", ");
+    thePainters.insert(sig, FP);
+    return FP;
+}
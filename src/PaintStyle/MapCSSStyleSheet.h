@@ -0,0 +1,196 @@
+//
+// C++ Interface: MapCSSStyleSheet
+//
+// Description: MapCSS 0.2 style sheets. Selectors are compiled to tests over
+//              interned tag ids and indexed by the tag key they need, with the
+//              zoom levels they apply to. The cascade computed for a feature is
+//              cached per set of tested tags and turned into FeaturePainters.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#ifndef MAPCSSSTYLESHEET_H
+#define MAPCSSSTYLESHEET_H
+
+#include <QColor>
+#include <QHash>
+#include <QList>
+#include <QReadWriteLock>
+#include <QRegularExpression>
+#include <QSharedPointer>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include "Painter.h"
+
+class Feature;
+class FeaturePainter;
+
+/* Zoom levels of the selectors (|z12-16); the last one holds for all closer views */
+#define MAPCSS_MAXZOOM 20
+
+/* One test of a simple selector: [key=value], :closed, .class... */
+struct MapCSSCondition
+{
+    enum Op {
+        Exists, NotExists, Equals, NotEquals, Matches, NotMatches,
+        Less, LessEqual, Greater, GreaterEqual,
+        Prefix, Suffix, Substring, ListContains, IsTrue, IsFalse,
+        HasClass, NotClass, Closed, NotClosed, Never
+    };
+
+    MapCSSCondition() : theOp(Exists), KeyId(0), ValueFold(0), Number(0) {}
+
+    Op theOp;
+    QString Key;
+    quint32 KeyId;
+    QString Value;
+    quint32 ValueFold;
+    qreal Number;
+    QRegularExpression Regex;
+};
+
+/* The part of a selector about one object: type|zoom[conditions] */
+struct MapCSSSimpleSelector
+{
+    MapCSSSimpleSelector() : Types(0), Zooms(0), Child(false) {}
+
+    int Types;      /* MapCSSStyleSheet::Kind bits accepted */
+    quint32 Zooms;  /* Bit z set if the selector applies at zoom z */
+    bool Child;     /* Joined to the next part with '>' instead of a space */
+    QVector<MapCSSCondition> Conditions;
+};
+
+struct MapCSSSelector
+{
+    /* The ancestors first, the selected object last */
+    QVector<MapCSSSimpleSelector> Parts;
+    QString Subpart;
+};
+
+struct MapCSSDeclaration
+{
+    MapCSSDeclaration() : Property(-1), Number(0) {}
+
+    int Property;   /* MapCSSStyleSheet::Property */
+    QString Text;
+    qreal Number;
+    QColor Color;
+    QVector<qreal> Dashes;
+};
+
+struct MapCSSRule
+{
+    QVector<MapCSSSelector> Selectors;
+    QVector<MapCSSDeclaration> Declarations;
+    QStringList SetClasses;
+};
+
+class MapCSSStyleSheet
+{
+public:
+    /* What a feature is for the selectors */
+    enum Kind {
+        Node = 0x01, Way = 0x02, Closed = 0x04, Relation = 0x08, Multipolygon = 0x10,
+        AnyKind = 0x1f
+    };
+
+    enum Property {
+        Width, Color, Opacity, Dashes, CasingWidth, CasingColor, CasingOpacity,
+        FillColor, FillOpacity, FillImage, IconImage, IconWidth,
+        Text, TextColor, TextHaloRadius, TextPosition,
+        FontSize, FontFamily, FontWeight, FontStyle, ZIndex,
+        PropertyCount
+    };
+
+    MapCSSStyleSheet();
+
+    /* Parses css; icon names are relative to baseDir. On errors the rules
+     * that could be read are kept, and errors() tells what was skipped. */
+    bool parse(const QString& css, const QString& baseDir);
+    bool load(const QString& filename);
+    const QStringList& errors() const;
+
+    int ruleSize() const;
+    /* The style of canvas {} */
+    const GlobalPainter& canvas() const;
+
+    static int kindOf(const Feature* F);
+    static qreal zoomToPixelPerM(int zoom);
+
+private:
+    friend class MapCSSCascade;
+    friend class MapCSSParser;
+
+    void buildIndex();
+
+    /* A selector of a rule, with the zooms it applies to */
+    struct Entry
+    {
+        int Rule;
+        int Selector;
+        quint32 Zooms;
+    };
+    QVector<MapCSSRule> Rules;
+    QVector<Entry> Entries;
+    /* Entries without a tag key to look for, and by the key they need, in
+     * style order */
+    QVector<int> Always;
+    QHash<quint32, QVector<int> > ByKey;
+    /* The keys tested on the styled object, and whether their value is */
+    QHash<quint32, bool> TestedKeys;
+    GlobalPainter theCanvas;
+    QStringList theErrors;
+};
+
+/* The styles computed from a sheet, cached per kind of the features and
+ * the tags their selectors test. Used from the threads matching features, owned by the painter
+ * table of a document. */
+class MapCSSCascade
+{
+public:
+    MapCSSCascade(QSharedPointer<MapCSSStyleSheet> aSheet);
+    ~MapCSSCascade();
+
+    /* The painters of F, one per range of zooms with the same style */
+    void painters(const Feature* F, QList<const FeaturePainter*>& Result);
+    int cacheSize() const;
+
+private:
+    struct Key
+    {
+        int Kind;
+        QVector<QPair<quint32, quint32> > Tags;
+        QByteArray Ancestors;   /* Which selectors on parents matched */
+
+        bool operator==(const Key& other) const
+        {
+            return Kind == other.Kind && Tags == other.Tags && Ancestors == other.Ancestors;
+        }
+    };
+    friend uint qHash(const MapCSSCascade::Key& k);
+
+    /* The winning declaration of each property, for zooms From to To */
+    struct StyleRange
+    {
+        int From, To;
+        QVector<const MapCSSDeclaration*> Style;
+    };
+
+    void candidates(const Feature* F, QVector<int>& Result) const;
+    bool matchesTags(const MapCSSSimpleSelector& S, const Feature* F, int aKind) const;
+    bool matchesAncestors(const MapCSSSelector& S, int Part, const Feature* F, int Depth) const;
+    void compute(const Feature* F, int aKind, const QVector<int>& Candidates, const QByteArray& Ancestors,
+                 QList<StyleRange>& Ranges) const;
+    const FeaturePainter* painterFor(const StyleRange& R, bool isArea);
+
+    QSharedPointer<MapCSSStyleSheet> theSheet;
+    QReadWriteLock theLock;
+    QHash<Key, QList<const FeaturePainter*> > theCache;
+    /* Painters by style, shared by all the tag sets styled alike */
+    QHash<QByteArray, FeaturePainter*> thePainters;
+};
+
+#endif // MAPCSSSTYLESHEET_H
@@ -54,7 +54,7 @@ void MasPaintStyle::savePainters(const QString& filename)
     m_isDirty = false;
 }
 
-void MasPaintStyle::loadPainters(const QString& fn)
+bool MasPaintStyle::loadPainters(const QString& fn)
 {
     QString filename = fn;
     if (filename.endsWith("msz", Qt::CaseInsensitive)) {
@@ -66,11 +66,11 @@ void MasPaintStyle::loadPainters(const QString& fn)
     QDomDocument doc;
     QFile file(filename);
     if (!file.open(QIODevice::ReadOnly))
-        return;
+        return false;
     if (!doc.setContent(&file))
     {
         file.close();
-        return;
+        return false;
     }
     file.close();
     GlobalPainter gp;
@@ -94,6 +94,7 @@ void MasPaintStyle::loadPainters(const QString& fn)
     }
     m_isDirty = false;
     m_filename = filename;
+    return true;
 }
 
 int MasPaintStyle::painterSize()
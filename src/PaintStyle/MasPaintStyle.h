@@ -24,7 +24,7 @@ public:
 
     QString getFilename();
     void savePainters(const QString& filename);
-    void loadPainters(const QString& filename);
+    bool loadPainters(const QString& filename);
 
 private:
     bool m_isDirty;
@@ -5,13 +5,17 @@ DEPENDPATH += $$MERKAARTOR_SRC_DIR/PaintStyle
 HEADERS +=  \
     MasPaintStyle.h \
     MapCSSPaintstyle.h \
+    MapCSSStyleSheet.h \
     PrimitivePainter.h \
     Painter.h \
+    PainterIndex.h \
     IPaintStyle.h
 
 # Source files
 SOURCES +=  \
     MasPaintStyle.cpp \
     MapCSSPaintstyle.cpp \
+    MapCSSStyleSheet.cpp \
     PrimitivePainter.cpp \
-    Painter.cpp
+    Painter.cpp \
+    PainterIndex.cpp
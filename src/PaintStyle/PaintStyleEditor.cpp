@@ -60,6 +60,12 @@ PaintStyleEditor::PaintStyleEditor(QWidget *aParent, const GlobalPainter& aGloba
     GlobalNodesFixed->setEnabled(theGlobalPainter.getDrawNodes());
     GlobalNodesProportional->setValue(theGlobalPainter.NodesProportional);
     GlobalNodesFixed->setValue(theGlobalPainter.NodesFixed);
+    CullGlobalAreas->setChecked(theGlobalPainter.CullAreas);
+    GlobalCullPixels->setEnabled(theGlobalPainter.CullAreas);
+    GlobalCullPixels->setValue(theGlobalPainter.CullPixels);
+    ClusterGlobalPoints->setChecked(theGlobalPainter.ClusterPoints);
+    GlobalClusterPixels->setEnabled(theGlobalPainter.ClusterPoints);
+    GlobalClusterPixels->setValue(theGlobalPainter.ClusterPixels);
 
     FreezeUpdate = false;
 
@@ -347,6 +353,26 @@ void PaintStyleEditor::on_GlobalNodesFixed_valueChanged()
     theGlobalPainter.NodesFixed = GlobalNodesFixed->value();
 }
 
+void PaintStyleEditor::on_CullGlobalAreas_clicked(bool b)
+{
+    theGlobalPainter.CullAreas = b;
+}
+
+void PaintStyleEditor::on_GlobalCullPixels_valueChanged()
+{
+    theGlobalPainter.CullPixels = GlobalCullPixels->value();
+}
+
+void PaintStyleEditor::on_ClusterGlobalPoints_clicked(bool b)
+{
+    theGlobalPainter.ClusterPoints = b;
+}
+
+void PaintStyleEditor::on_GlobalClusterPixels_valueChanged()
+{
+    theGlobalPainter.ClusterPixels = GlobalClusterPixels->value();
+}
+
 void PaintStyleEditor::on_DrawBackground_clicked(bool b)
 {
     QListWidgetItem* it = PaintList->currentItem();
@@ -22,6 +22,10 @@ class PaintStyleEditor : public QDialog, public Ui::PaintStyleEditor
         void on_GlobalNodesColor_clicked();
         void on_GlobalNodesProportional_valueChanged();
         void on_GlobalNodesFixed_valueChanged();
+        void on_CullGlobalAreas_clicked(bool b);
+        void on_GlobalCullPixels_valueChanged();
+        void on_ClusterGlobalPoints_clicked(bool b);
+        void on_GlobalClusterPixels_valueChanged();
 
         void on_PaintList_itemSelectionChanged();
         void on_TagSelection_editingFinished();
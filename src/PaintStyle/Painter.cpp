@@ -640,12 +640,14 @@ bool Painter::matchesZoom(qreal PixelPerM) const
 
 GlobalPainter::GlobalPainter()
     : DrawBackground(false), DrawNodes(false)
+    , CullAreas(false), CullPixels(1.0), ClusterPoints(false), ClusterPixels(32)
 {
 }
 
 GlobalPainter::GlobalPainter(const GlobalPainter& f)
     : DrawBackground(f.DrawBackground), BackgroundColor(f.BackgroundColor)
     , DrawNodes(f.DrawNodes), NodesColor(f.NodesColor), NodesProportional(f.NodesProportional), NodesFixed(f.NodesFixed)
+    , CullAreas(f.CullAreas), CullPixels(f.CullPixels), ClusterPoints(f.ClusterPoints), ClusterPixels(f.ClusterPixels)
 {
 }
 
@@ -661,6 +663,11 @@ GlobalPainter& GlobalPainter::operator=(const GlobalPainter& f)
     NodesProportional = f.NodesProportional;
     NodesFixed = f.NodesFixed;
 
+    CullAreas = f.CullAreas;
+    CullPixels = f.CullPixels;
+    ClusterPoints = f.ClusterPoints;
+    ClusterPixels = f.ClusterPixels;
+
     return *this;
 }
 
@@ -676,6 +683,10 @@ QString GlobalPainter::toXML() const
         r += " " + colorAsXML("background",BackgroundColor);
     if (DrawNodes)
         r += " " + boundaryAsXML("nodes",NodesColor, NodesProportional, NodesFixed);
+    if (CullAreas)
+        r += " cullPixels=\""+QString::number(CullPixels)+"\"\n";
+    if (ClusterPoints)
+        r += " clusterPixels=\""+QString::number(ClusterPixels)+"\"\n";
     r += "/>\n";
     return r;
 }
@@ -694,6 +705,14 @@ GlobalPainter GlobalPainter::fromXML(const QDomElement& e)
         FP.NodesProportional = e.attribute("nodesScale").toDouble();
         FP.NodesFixed = e.attribute("nodesOffset").toDouble();
     }
+    if (e.hasAttribute("cullPixels")) {
+        FP.CullAreas = true;
+        FP.CullPixels = e.attribute("cullPixels").toDouble();
+    }
+    if (e.hasAttribute("clusterPixels")) {
+        FP.ClusterPoints = true;
+        FP.ClusterPixels = e.attribute("clusterPixels").toInt();
+    }
 
     return FP;
 }
@@ -168,6 +168,13 @@ public:
     QColor NodesColor;
     qreal NodesProportional;
     qreal NodesFixed;
+
+    /* Areas smaller than CullPixels on screen are drawn as a dot */
+    bool CullAreas;
+    qreal CullPixels;
+    /* Points closer than ClusterPixels are merged into a marker with their count */
+    bool ClusterPoints;
+    int ClusterPixels;
 };
 
 #endif
@@ -0,0 +1,83 @@
+#include "PainterIndex.h"
+
+#include "Feature.h"
+#include "FeaturePainter.h"
+#include "MapCSSStyleSheet.h"
+
+#include <QAtomicInt>
+
+#include <algorithm>
+
+static QAtomicInt lastGeneration(0);
+
+PainterTable::PainterTable()
+    : Generation(lastGeneration.fetchAndAddRelaxed(1) + 1), Cascade(0)
+{
+}
+
+PainterTable::~PainterTable()
+{
+    delete Cascade;
+}
+
+void PainterTable::build(const QList<Painter>& thePainters, QSharedPointer<MapCSSStyleSheet> aSheet)
+{
+    Painters.clear();
+    for (int i=0; i<thePainters.size(); ++i)
+        Painters.append(FeaturePainter(thePainters[i]));
+    Index.build(Painters);
+
+    delete Cascade;
+    Cascade = aSheet ? new MapCSSCascade(aSheet) : 0;
+}
+
+void PainterIndex::clear()
+{
+    Always.clear();
+    ByKey.clear();
+    ByTag.clear();
+}
+
+void PainterIndex::build(const QList<FeaturePainter>& thePainters)
+{
+    clear();
+    for (int i=0; i<thePainters.size(); ++i) {
+        const TagSelector* sel = thePainters[i].theTagSelector;
+        /* Without selector a painter never matches */
+        if (!sel)
+            continue;
+
+        QList<QPair<QString, QString> > Tags;
+        if (!sel->requiredTags(Tags) || Tags.isEmpty()) {
+            Always.append(i);
+            continue;
+        }
+        for (int j=0; j<Tags.size(); ++j) {
+            QVector<int>& L = Tags[j].second.isEmpty() ? ByKey[Tags[j].first] : ByTag[Tags[j].first][Tags[j].second];
+            if (L.isEmpty() || L.last() != i)
+                L.append(i);
+        }
+    }
+}
+
+void PainterIndex::candidates(const Feature* F, QVector<int>& Result) const
+{
+    Result = Always;
+    for (int i=0; i<F->tagSize(); ++i) {
+        const QString k = F->tagKey(i);
+        QHash<QString, QVector<int> >::const_iterator itk = ByKey.constFind(k);
+        if (itk != ByKey.constEnd())
+            Result += itk.value();
+
+        QHash<QString, QHash<QString, QVector<int> > >::const_iterator itt = ByTag.constFind(k);
+        if (itt != ByTag.constEnd()) {
+            QHash<QString, QVector<int> >::const_iterator itv = itt.value().constFind(F->tagValue(i).toLower());
+            if (itv != itt.value().constEnd())
+                Result += itv.value();
+        }
+    }
+
+    /* The first matching painter wins: keep the order of the style */
+    std::sort(Result.begin(), Result.end());
+    Result.erase(std::unique(Result.begin(), Result.end()), Result.end());
+}
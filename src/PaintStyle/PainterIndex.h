@@ -0,0 +1,53 @@
+#ifndef PAINTERINDEX_H
+#define PAINTERINDEX_H
+
+#include <QHash>
+#include <QList>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+
+#include "FeaturePainter.h"
+
+class Feature;
+class MapCSSCascade;
+class MapCSSStyleSheet;
+
+/* Painters of a style indexed by the tags their selector needs, so that a
+ * feature is only matched against the few painters that may select it. */
+class PainterIndex
+{
+public:
+    void build(const QList<FeaturePainter>& thePainters);
+    void clear();
+
+    /* Positions of the painters that may match F, in style order */
+    void candidates(const Feature* F, QVector<int>& Result) const;
+
+private:
+    /* Painters without a required tag, matched against every feature */
+    QVector<int> Always;
+    QHash<QString, QVector<int> > ByKey;
+    QHash<QString, QHash<QString, QVector<int> > > ByTag;
+};
+
+/* The painters of a document with their index. Features point into the
+ * table they were matched against, and know it by its generation. */
+struct PainterTable
+{
+    PainterTable();
+    ~PainterTable();
+    /* With a MapCSS sheet, the features are styled by its cascade */
+    void build(const QList<Painter>& thePainters,
+               QSharedPointer<MapCSSStyleSheet> aSheet = QSharedPointer<MapCSSStyleSheet>());
+
+    int Generation;
+    QList<FeaturePainter> Painters;
+    PainterIndex Index;
+    MapCSSCascade* Cascade;
+
+private:
+    Q_DISABLE_COPY(PainterTable)
+};
+
+#endif // PAINTERINDEX_H
@@ -28,6 +28,8 @@
 #include "IMapAdapterFactory.h"
 #include "IPaintStyle.h"
 #include "MasPaintStyle.h"
+#include "MapCSSPaintstyle.h"
+#include "OsmRenderLayer.h"
 
 
 // TODO: Replace 'g_Merk_Ignore_Preferences' by having two implementations
@@ -210,6 +212,29 @@ IPaintStyle* MerkaartorPreferences::styleinstance() {
     return m_EPSInstance;
 }
 
+bool MerkaartorPreferences::loadStyle(const QString& filename)
+{
+    /* The render workers read the current style: load the new one aside */
+    IPaintStyle* aStyle;
+    if (filename.endsWith(".css", Qt::CaseInsensitive))
+        aStyle = new MapCSSPaintstyle;
+    else
+        aStyle = new MasPaintStyle;
+    if (!aStyle->loadPainters(filename)) {
+        qWarning() << "Unable to load the map style" << filename;
+        delete aStyle;
+        return false;
+    }
+
+    /* Taking the lock for writing waits for the tiles being rendered */
+    OsmRenderLayer::renderingLock().lockForWrite();
+    IPaintStyle* oldStyle = m_EPSInstance;
+    m_EPSInstance = aStyle;
+    OsmRenderLayer::renderingLock().unlock();
+    delete oldStyle;
+    return true;
+}
+
 Tool::Tool(QString Name, QString Path)
     : ToolName(Name), ToolPath(Path)
 {
@@ -1188,6 +1213,7 @@ M_PARAM_IMPLEMENT_BOOL(UseStyledWireframe, style, false)
 M_PARAM_IMPLEMENT_STRING(DefaultStyle, style, ":/Styles/Mapnik.mas")
 M_PARAM_IMPLEMENT_STRING(CustomStyle, style, QString())
 M_PARAM_IMPLEMENT_BOOL(DisableStyleForTracks, style, true)
+M_PARAM_IMPLEMENT_BOOL(LayerCompositing, style, true)
 M_PARAM_IMPLEMENT_STRINGLIST(TechnicalTags, style, TECHNICAL_TAGS)
 M_PARAM_IMPLEMENT_INT(EditRendering, style, 0)
 
@@ -1202,6 +1228,7 @@ M_PARAM_IMPLEMENT_INT(AreaOpacity, visual, 100)
 M_PARAM_IMPLEMENT_BOOL(UseShapefileForBackground, visual, false)
 M_PARAM_IMPLEMENT_BOOL(DrawingHack, visual, true)
 M_PARAM_IMPLEMENT_BOOL(SimpleGpxTrack, visual, false)
+M_PARAM_IMPLEMENT_BOOL(GpxTrackDensity, visual, false)
 M_PARAM_IMPLEMENT_BOOL(UseVirtualNodes, visual, true)
 M_PARAM_IMPLEMENT_BOOL(RelationsSelectableWhenHidden, visual, true)
 M_PARAM_IMPLEMENT_DOUBLE(LocalZoom, visual, 0.5)
@@ -168,6 +168,9 @@ Q_OBJECT
 public:
     static MerkaartorPreferences* instance();
     static IPaintStyle* styleinstance();
+    /* Loads a map style, switching between .mas and MapCSS (.css) styles.
+     * On failure the current style is kept. */
+    static bool loadStyle(const QString& filename);
 
     MerkaartorPreferences();
     ~MerkaartorPreferences();
@@ -294,6 +297,7 @@ public:
     M_PARAM_DECLARE_STRING(DefaultStyle)
     M_PARAM_DECLARE_STRING(CustomStyle)
     M_PARAM_DECLARE_BOOL(DisableStyleForTracks)
+    M_PARAM_DECLARE_BOOL(LayerCompositing)
     M_PARAM_DECLARE_STRINGList(TechnicalTags)
     M_PARAM_DECLARE_INT(EditRendering)
 
@@ -306,6 +310,7 @@ public:
     M_PARAM_DECLARE_BOOL(UseShapefileForBackground)
     M_PARAM_DECLARE_BOOL(DrawingHack)
     M_PARAM_DECLARE_BOOL(SimpleGpxTrack)
+    M_PARAM_DECLARE_BOOL(GpxTrackDensity)
     M_PARAM_DECLARE_BOOL(VirtualNodesVisible)
     M_PARAM_DECLARE_BOOL(UseVirtualNodes)
     M_PARAM_DECLARE_BOOL(RelationsSelectableWhenHidden)
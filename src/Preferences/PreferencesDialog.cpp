@@ -127,7 +127,7 @@ void PreferencesDialog::updateStyles()
         cbStyles->addItem(intStyles.entryList().at(i) + " (int)", QVariant(intStyles.entryInfoList().at(i).absoluteFilePath()));
     }
     if (!CustomStylesDir->text().isEmpty()) {
-        QDir customStyles(CustomStylesDir->text(), "*.mas");
+        QDir customStyles(CustomStylesDir->text(), "*.mas *.css");
         for (int i=0; i < customStyles.entryList().size(); ++i) {
             cbStyles->addItem(customStyles.entryList().at(i), QVariant(customStyles.entryInfoList().at(i).absoluteFilePath()));
         }
@@ -273,6 +273,7 @@ void PreferencesDialog::loadPrefs()
     rbFullEdit->setChecked(M_PREFS->getEditRendering() == 2);
 
     cbDisableStyleForTracks->setChecked(M_PREFS->getDisableStyleForTracks());
+    cbLayerCompositing->setChecked(M_PREFS->getLayerCompositing());
 
     QString t = M_PREFS->getDefaultTemplate();
     QString ct = M_PREFS->getCustomTemplate();
@@ -315,6 +316,7 @@ void PreferencesDialog::loadPrefs()
     RelationsWidth->setValue(M_PREFS->getRelationsWidth());
     GpxTrackWidth->setValue(M_PREFS->getGpxTrackWidth());
     cbSimpleGpxTrack->setChecked(M_PREFS->getSimpleGpxTrack());
+    cbGpxTrackDensity->setChecked(M_PREFS->getGpxTrackDensity());
 
     cbAutoLoadDoc->setChecked(M_PREFS->getHasAutoLoadDocument());
     edAutoLoadDoc->setText(M_PREFS->getAutoLoadDocumentFilename());
@@ -425,6 +427,8 @@ void PreferencesDialog::savePrefs()
     else
         M_PREFS->setEditRendering(2);
 
+    M_PREFS->setLayerCompositing(cbLayerCompositing->isChecked());
+
     bool PainterToInvalidate = false;
     if (cbDisableStyleForTracks->isChecked() != M_PREFS->getDisableStyleForTracks()) {
         M_PREFS->setDisableStyleForTracks(cbDisableStyleForTracks->isChecked());
@@ -434,6 +438,10 @@ void PreferencesDialog::savePrefs()
         M_PREFS->setSimpleGpxTrack(cbSimpleGpxTrack->isChecked());
         PainterToInvalidate = true;
     }
+    if (cbGpxTrackDensity->isChecked() != M_PREFS->getGpxTrackDensity()) {
+        M_PREFS->setGpxTrackDensity(cbGpxTrackDensity->isChecked());
+        PainterToInvalidate = true;
+    }
     if (PainterToInvalidate) {
         for (FeatureIterator it(((MainWindow*)parent())->document()); !it.isEnd(); ++it)
         {
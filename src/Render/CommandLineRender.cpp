@@ -0,0 +1,576 @@
+//
+// C++ Implementation: CommandLineRender
+//
+// Description: Headless rendering of documents to PNG, TIFF, SVG or PDF files,
+//              driven from the command line ("merkaartor --render ...").
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#include "CommandLineRender.h"
+
+#include "Global.h"
+#include "Document.h"
+#include "MapView.h"
+#include "OsmRenderLayer.h"
+#include "Layer.h"
+#include "ImportOSM.h"
+#include "ImportFilter.h"
+#include "MerkaartorPreferences.h"
+#include "IPaintStyle.h"
+#include "PosterRenderer.h"
+#ifdef USE_PROTOBUF
+#include "ImportExportPBF.h"
+#endif
+#ifndef FRISIUS_BUILD
+#include "ImportExportOSC.h"
+#endif
+
+#include <QFile>
+#include <QFileInfo>
+#include <QPainter>
+#include <QPrinter>
+#include <QPageSize>
+#include <QSvgGenerator>
+#include <QThreadPool>
+#include <QXmlStreamReader>
+
+#include <stdio.h>
+
+#define INCH_PER_M 39.3700787
+
+CommandLineRender::CommandLineRender()
+    : hasBox(false)
+    , theScale(0.0)
+    , theDpi(96)
+    , theThreads(0)
+    , showNodes(false)
+    , showScale(false)
+    , showGrid(false)
+    , hideUnstyled(false)
+    , theImportFilter(0)
+    , theDocument(0)
+    , theView(0)
+{
+}
+
+CommandLineRender::~CommandLineRender()
+{
+    delete theView;
+    delete theDocument;
+    delete theImportFilter;
+}
+
+void CommandLineRender::showHelp()
+{
+    fprintf(stdout, "Usage: merkaartor --render [options] -o outputfile inputfiles...\n");
+    fprintf(stdout, "\n");
+    fprintf(stdout, "  -o, --output filename\t\tOutput file; the format is taken from the extension (.png, .tif, .svg, .pdf)\n");
+#ifdef USE_PROTOBUF
+    fprintf(stdout, "\t\t\tWith .pbf, the input is converted to an OSM binary file instead of rendered\n");
+#endif
+    fprintf(stdout, "  --style filename\t\tStyle (.mas, or MapCSS .css) used for rendering (default: the current default style)\n");
+    fprintf(stdout, "  --bbox minlon,minlat,maxlon,maxlat\t\tArea to render (default: the whole document)\n");
+    fprintf(stdout, "  --scale denominator\t\tRender at scale 1:denominator (used with --dpi to size the output)\n");
+    fprintf(stdout, "  --size WIDTHxHEIGHT\t\tOutput size in pixels (overrides --scale)\n");
+    fprintf(stdout, "  --dpi value\t\tOutput resolution (default: 96)\n");
+    fprintf(stdout, "  --threads count\t\tNumber of rendering threads (default: number of cores)\n");
+    fprintf(stdout, "  --nodes\t\tDraw nodes\n");
+    fprintf(stdout, "  --scalebar\t\tDraw the scale bar\n");
+    fprintf(stdout, "  --grid\t\tDraw the lat/lon grid\n");
+    fprintf(stdout, "  --hide-unstyled\t\tDo not draw unstyled features\n");
+    fprintf(stdout, "  --import-bbox minlon,minlat,maxlon,maxlat\t\tOnly import the .osm and .pbf features in this area\n");
+    fprintf(stdout, "  --import-poly filename\t\tOnly import the features in the area of an osmosis .poly file\n");
+    fprintf(stdout, "  --import-filter expression\t\tOnly import the features matching this tag selector\n");
+    fprintf(stdout, "  --import-references\t\tRead the input again to also import the nodes and ways of the ways and relations kept\n");
+#ifndef FRISIUS_BUILD
+    fprintf(stdout, "  --apply-osc filename\t\tApply an osmChange diff to the input (may be repeated)\n");
+#endif
+    fprintf(stdout, "  inputfiles\t\tOne or more .osm, .osm.pbf or .mdc files\n");
+}
+
+/* minlon,minlat,maxlon,maxlat */
+static bool parseBox(const QString& s, CoordBox& B)
+{
+    QStringList c = s.split(',');
+    if (c.size() != 4)
+        return false;
+    bool ok = true;
+    qreal v[4];
+    for (int j=0; j<4 && ok; ++j)
+        v[j] = c[j].toDouble(&ok);
+    if (!ok || v[0] >= v[2] || v[1] >= v[3])
+        return false;
+    B = CoordBox(Coord(v[0], v[1]), Coord(v[2], v[3]));
+    return true;
+}
+
+ImportFilter* CommandLineRender::importFilter()
+{
+    if (!theImportFilter)
+        theImportFilter = new ImportFilter;
+    return theImportFilter;
+}
+
+bool CommandLineRender::parseArguments(const QStringList& args)
+{
+    static const QStringList valueOptions = QStringList()
+            << "-o" << "--output" << "--style" << "--bbox" << "--scale"
+            << "--size" << "--dpi" << "--threads"
+            << "--import-bbox" << "--import-poly" << "--import-filter"
+            << "--apply-osc";
+
+    bool ok = true;
+    for (int i=0; i < args.size(); ++i) {
+        const QString& a = args[i];
+        if (valueOptions.contains(a) && i+1 >= args.size()) {
+            theError = QString("Missing value for %1").arg(a);
+            return false;
+        }
+        if (a == "--render") {
+            continue;
+        } else if (a == "-o" || a == "--output") {
+            theOutputFile = args[++i];
+        } else if (a == "--style") {
+            theStyleFile = args[++i];
+        } else if (a == "--bbox") {
+            if (!parseBox(args[++i], theBox)) {
+                theError = QString("Invalid bounding box: %1").arg(args[i]);
+                return false;
+            }
+            hasBox = true;
+        } else if (a == "--import-bbox") {
+            CoordBox B;
+            if (!parseBox(args[++i], B)) {
+                theError = QString("Invalid bounding box: %1").arg(args[i]);
+                return false;
+            }
+            importFilter()->setArea(B);
+        } else if (a == "--import-poly") {
+            if (!importFilter()->loadPoly(args[++i])) {
+                theError = theImportFilter->errorString();
+                return false;
+            }
+        } else if (a == "--import-filter") {
+            if (!importFilter()->setSelector(args[++i])) {
+                theError = theImportFilter->errorString();
+                return false;
+            }
+        } else if (a == "--import-references") {
+            importFilter()->setKeepReferences(true);
+#ifndef FRISIUS_BUILD
+        } else if (a == "--apply-osc") {
+            theChangeFiles << args[++i];
+#endif
+        } else if (a == "--scale") {
+            QString s = args[++i];
+            if (s.startsWith("1:"))
+                s = s.mid(2);
+            theScale = s.toDouble(&ok);
+            if (!ok || theScale <= 0) {
+                theError = QString("Invalid scale: %1").arg(args[i]);
+                return false;
+            }
+        } else if (a == "--size") {
+            QStringList s = args[++i].split('x');
+            bool okh = false;
+            if (s.size() == 2)
+                theSize = QSize(s[0].toInt(&ok), s[1].toInt(&okh));
+            if (!ok || !okh || theSize.isEmpty()) {
+                theError = QString("Invalid size: %1").arg(args[i]);
+                return false;
+            }
+        } else if (a == "--dpi") {
+            theDpi = args[++i].toInt(&ok);
+            if (!ok || theDpi <= 0) {
+                theError = QString("Invalid resolution: %1").arg(args[i]);
+                return false;
+            }
+        } else if (a == "--threads") {
+            theThreads = args[++i].toInt(&ok);
+            if (!ok || theThreads <= 0) {
+                theError = QString("Invalid thread count: %1").arg(args[i]);
+                return false;
+            }
+        } else if (a == "--nodes") {
+            showNodes = true;
+        } else if (a == "--scalebar") {
+            showScale = true;
+        } else if (a == "--grid") {
+            showGrid = true;
+        } else if (a == "--hide-unstyled") {
+            hideUnstyled = true;
+        } else if (a.startsWith("-")) {
+            theError = QString("Unknown option: %1").arg(a);
+            return false;
+        } else
+            theInputFiles << a;
+    }
+
+    if (theOutputFile.isEmpty()) {
+        theError = "No output file given";
+        return false;
+    }
+    if (theInputFiles.isEmpty()) {
+        theError = "No input file given";
+        return false;
+    }
+    QString suffix = QFileInfo(theOutputFile).suffix().toLower();
+    bool supported = suffix == "png" || suffix == "tif" || suffix == "tiff" || suffix == "svg" || suffix == "pdf";
+#ifdef USE_PROTOBUF
+    supported = supported || suffix == "pbf";
+#endif
+    if (!supported) {
+        theError = QString("Unsupported output format: %1").arg(suffix);
+        return false;
+    }
+    return true;
+}
+
+bool CommandLineRender::loadStyle()
+{
+    QString theStyle = theStyleFile.isEmpty() ? M_PREFS->getDefaultStyle() : theStyleFile;
+    if (!QFile::exists(theStyle)) {
+        theError = QString("Style not found: %1").arg(theStyle);
+        return false;
+    }
+    if (!MerkaartorPreferences::loadStyle(theStyle)) {
+        theError = QString("Unable to load the style: %1").arg(theStyle);
+        return false;
+    }
+    return true;
+}
+
+bool CommandLineRender::loadMerkaartorDocument(const QString& fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        theError = QString("%1 could not be opened.").arg(fileName);
+        return false;
+    }
+
+    QXmlStreamReader stream(&file);
+    while (stream.readNext() && stream.tokenType() != QXmlStreamReader::Invalid && stream.tokenType() != QXmlStreamReader::StartElement)
+        ;
+    if (stream.tokenType() != QXmlStreamReader::StartElement || stream.name() != "MerkaartorDocument") {
+        theError = QString("%1 is not a valid Merkaartor document.").arg(fileName);
+        return false;
+    }
+    double version = stream.attributes().value("version").toString().toDouble();
+
+    Document* newDoc = NULL;
+    if (version < 2.) {
+        stream.readNext();
+        while(!stream.atEnd() && !stream.isEndElement()) {
+            if (stream.name() == "MapDocument" && !newDoc) {
+                newDoc = Document::fromXML(QFileInfo(file).fileName(), stream, version, NULL, NULL);
+            } else if (!stream.isWhitespace()) {
+                stream.skipCurrentElement();
+            }
+            stream.readNext();
+        }
+    }
+    if (!newDoc) {
+        theError = QString("%1 does not contain a document.").arg(fileName);
+        return false;
+    }
+
+    /* Only the first document provides the layers; additional .mdc files are merged in. */
+    if (!theDocument) {
+        theDocument = newDoc;
+    } else {
+        while (newDoc->layerSize()) {
+            Layer* l = newDoc->getLayer(0);
+            newDoc->remove(l);
+            theDocument->add(l);
+        }
+        delete newDoc;
+    }
+    return true;
+}
+
+bool CommandLineRender::loadFile(const QString& fileName)
+{
+    if (fileName.toLower().endsWith(".mdc"))
+        return loadMerkaartorDocument(fileName);
+
+    if (!theDocument)
+        theDocument = new Document(NULL);
+
+    QString baseFileName = QFileInfo(fileName).fileName();
+    bool importOK = false;
+    DrawingLayer* newLayer = new DrawingLayer(baseFileName);
+    theDocument->add(newLayer);
+    if (fileName.toLower().endsWith(".osm")) {
+        importOK = importOSM(NULL, fileName, theDocument, newLayer, theImportFilter);
+    }
+#ifdef USE_PROTOBUF
+    else if (fileName.toLower().endsWith(".pbf")) {
+        importOK = theDocument->importPBF(fileName, newLayer, theImportFilter);
+    }
+#endif
+    else {
+        theError = QString("File type not recognized: %1").arg(fileName);
+    }
+
+    if (!importOK) {
+        if (theError.isEmpty())
+            theError = QString("Could not import %1").arg(fileName);
+        theDocument->remove(newLayer);
+        delete newLayer;
+        return false;
+    }
+    return true;
+}
+
+#ifndef FRISIUS_BUILD
+/* The features created go to a layer named after the file */
+bool CommandLineRender::applyChanges(const QString& fileName)
+{
+    DrawingLayer* newLayer = new DrawingLayer(QFileInfo(fileName).fileName());
+    theDocument->add(newLayer);
+
+    ImportExportOSC osc(theDocument);
+    osc.setFilter(theImportFilter);
+    bool ok = osc.loadFile(fileName);
+    if (!ok)
+        theError = QString("%1 could not be opened.").arg(fileName);
+    else if (!(ok = osc.apply(newLayer)))
+        theError = QString("%1: %2").arg(fileName).arg(osc.errorString());
+
+    if (!newLayer->size()) {
+        theDocument->remove(newLayer);
+        delete newLayer;
+    }
+    if (!ok)
+        return false;
+
+    fprintf(stderr, "%d changes applied, %d conflicts\n", osc.applied(), osc.conflicts().size());
+    foreach (const ImportExportOSC::Conflict& c, osc.conflicts())
+        fprintf(stderr, "  %s\n", c.toString().toLocal8Bit().data());
+    return true;
+}
+#endif
+
+bool CommandLineRender::loadDocument()
+{
+    foreach (QString fn, theInputFiles) {
+        fprintf(stderr, "Loading %s\n", fn.toLocal8Bit().data());
+        if (!loadFile(fn))
+            return false;
+    }
+    if (!theDocument)
+        return false;
+#ifndef FRISIUS_BUILD
+    foreach (QString fn, theChangeFiles) {
+        fprintf(stderr, "Applying %s\n", fn.toLocal8Bit().data());
+        if (!applyChanges(fn))
+            return false;
+    }
+#endif
+
+    /* The painters are copied when the document is created; make sure
+     * documents coming from .mdc files use the requested style as well. */
+    theDocument->setPainters(M_STYLE->getPainters(), M_STYLE->getStyleSheet());
+    theDocument->waitForPainters();
+
+    if (!hasBox) {
+        QPair<bool, CoordBox> bb = theDocument->boundingBox();
+        if (!bb.first) {
+            theError = "The document is empty";
+            return false;
+        }
+        theBox = bb.second;
+        hasBox = true;
+    }
+    return true;
+}
+
+QSize CommandLineRender::computeSize() const
+{
+    if (!theSize.isEmpty())
+        return theSize;
+
+    /* Ground distances through the center of the box */
+    Coord c = theBox.center();
+    qreal wm = Coord(theBox.topLeft().x(), c.y()).distanceFrom(Coord(theBox.topRight().x(), c.y())) * 1000.;
+    qreal hm = Coord(c.x(), theBox.bottomLeft().y()).distanceFrom(Coord(c.x(), theBox.topLeft().y())) * 1000.;
+
+    if (theScale > 0) {
+        qreal ppm = theDpi * INCH_PER_M / theScale;
+        return QSize(qMax(1, qRound(wm * ppm)), qMax(1, qRound(hm * ppm)));
+    }
+
+    /* Neither size nor scale given: 1024 pixels along the longest side */
+    if (wm >= hm)
+        return QSize(1024, qMax(1, qRound(1024 * hm / wm)));
+    else
+        return QSize(qMax(1, qRound(1024 * wm / hm)), 1024);
+}
+
+RendererOptions CommandLineRender::options() const
+{
+    RendererOptions opt;
+    opt.options |= RendererOptions::ForPrinting;
+    opt.options |= RendererOptions::BackgroundVisible;
+    opt.options |= RendererOptions::ForegroundVisible;
+    opt.options |= RendererOptions::TouchupVisible;
+    opt.options |= RendererOptions::NamesVisible;
+
+    if (showNodes)
+        opt.options |= RendererOptions::NodesVisible;
+    if (showScale)
+        opt.options |= RendererOptions::ScaleVisible;
+    if (showGrid)
+        opt.options |= RendererOptions::LatLonGridVisible;
+    if (hideUnstyled)
+        opt.options |= RendererOptions::UnstyledHidden;
+
+    return opt;
+}
+
+void CommandLineRender::render(QPainter& P, const QRect& theR, RendererOptions opt)
+{
+    P.setClipRect(theR);
+    P.setClipping(true);
+    P.setRenderHint(QPainter::Antialiasing);
+
+    theView->setGeometry(theR);
+    theView->setViewport(theBox, theR);
+    theView->setRenderOptions(opt);
+    theView->invalidate(true, true, false);
+    int lastPercent = -1;
+    theView->drawFeaturesSync(P, -1, [&lastPercent](int done, int total) {
+        int percent = total ? done * 100 / total : 100;
+        if (percent != lastPercent) {
+            fprintf(stderr, "\rRendering tiles: %d%%", percent);
+            lastPercent = percent;
+        }
+    });
+    fprintf(stderr, "\n");
+    if (opt.options & RendererOptions::ScaleVisible)
+        theView->drawScale(P);
+    if (opt.options & RendererOptions::LatLonGridVisible)
+        theView->drawLatLonGrid(P);
+}
+
+bool CommandLineRender::renderRaster(const QSize& size)
+{
+    /* Rendered in bands and streamed to the file: the size is not bounded by memory */
+    PosterRenderer poster(theView);
+    int lastPercent = -1;
+    bool ok = poster.render(theOutputFile, QRect(QPoint(0, 0), size), theBox, options(), theDpi, PosterRenderer::exportBackground(),
+                            [&lastPercent](int done, int total) {
+        int percent = total ? done * 100 / total : 100;
+        if (percent != lastPercent) {
+            fprintf(stderr, "\rRendering bands: %d%%", percent);
+            lastPercent = percent;
+        }
+    });
+    fprintf(stderr, "\n");
+    if (!ok)
+        theError = QString("Could not write %1: %2").arg(theOutputFile).arg(poster.errorString());
+    return ok;
+}
+
+bool CommandLineRender::renderSVG(const QSize& size)
+{
+    QSvgGenerator svgg;
+    QRect theR(QPoint(0, 0), size);
+    svgg.setSize(size);
+    svgg.setResolution(theDpi);
+    svgg.setFileName(theOutputFile);
+    svgg.setViewBox(theR);
+
+    QPainter P(&svgg);
+    RendererOptions opt = options();
+    opt.options |= RendererOptions::PrintAllLabels;
+    render(P, theR, opt);
+    return P.end();
+}
+
+bool CommandLineRender::renderPDF(const QSize& size)
+{
+    QPrinter printer;
+    printer.setOutputFormat(QPrinter::PdfFormat);
+    printer.setOutputFileName(theOutputFile);
+    printer.setDocName(theDocument->title());
+    printer.setResolution(theDpi);
+    printer.setFullPage(true);
+    printer.setPageSize(QPageSize(QSizeF((qreal)size.width() / theDpi, (qreal)size.height() / theDpi), QPageSize::Inch, QString(), QPageSize::ExactMatch));
+
+    QPainter P;
+    if (!P.begin(&printer)) {
+        theError = QString("Could not open %1 for writing").arg(theOutputFile);
+        return false;
+    }
+    QRect theR = printer.pageRect();
+    theR.moveTo(0, 0);
+    RendererOptions opt = options();
+    opt.options |= RendererOptions::PrintAllLabels;
+    render(P, theR, opt);
+    return P.end();
+}
+
+#ifdef USE_PROTOBUF
+bool CommandLineRender::exportPBF()
+{
+    fprintf(stderr, "Writing %s\n", theOutputFile.toLocal8Bit().data());
+    ImportExportPBF pbf(theDocument);
+    if (!pbf.saveFile(theOutputFile)) {
+        theError = QString("Could not open %1 for writing").arg(theOutputFile);
+        return false;
+    }
+    if (!pbf.export_(theDocument->getFeatures())) {
+        theError = QString("Could not write %1").arg(theOutputFile);
+        return false;
+    }
+    return true;
+}
+#endif
+
+int CommandLineRender::exec()
+{
+    if (theThreads > 0)
+        QThreadPool::globalInstance()->setMaxThreadCount(theThreads);
+
+    if (!loadStyle() || !loadDocument()) {
+        fprintf(stderr, "%s\n", theError.toLocal8Bit().data());
+        return 1;
+    }
+
+#ifdef USE_PROTOBUF
+    if (QFileInfo(theOutputFile).suffix().toLower() == "pbf") {
+        if (!exportPBF()) {
+            fprintf(stderr, "%s\n", theError.toLocal8Bit().data());
+            return 1;
+        }
+        return 0;
+    }
+#endif
+
+    QSize size = computeSize();
+    fprintf(stderr, "Rendering %dx%d pixels to %s\n", size.width(), size.height(), theOutputFile.toLocal8Bit().data());
+
+    theView = new MapView(NULL);
+    theView->setDocument(theDocument);
+    theView->setRenderingPriority(OsmRenderLayer::ExportPriority);
+
+    bool ok;
+    QString suffix = QFileInfo(theOutputFile).suffix().toLower();
+    if (suffix == "svg")
+        ok = renderSVG(size);
+    else if (suffix == "pdf")
+        ok = renderPDF(size);
+    else
+        ok = renderRaster(size);
+
+    if (!ok) {
+        if (theError.isEmpty())
+            theError = QString("Could not write %1").arg(theOutputFile);
+        fprintf(stderr, "%s\n", theError.toLocal8Bit().data());
+        return 1;
+    }
+    return 0;
+}
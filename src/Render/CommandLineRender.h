@@ -0,0 +1,86 @@
+//
+// C++ Interface: CommandLineRender
+//
+// Description: Headless rendering of documents to PNG, SVG or PDF files,
+//              driven from the command line ("merkaartor --render ...").
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#ifndef COMMANDLINERENDER_H
+#define COMMANDLINERENDER_H
+
+#include <QString>
+#include <QStringList>
+#include <QSize>
+#include <QRect>
+
+#include "Coord.h"
+#include "IRenderer.h"
+
+class Document;
+class ImportFilter;
+class MapView;
+class QPainter;
+
+class CommandLineRender
+{
+public:
+    CommandLineRender();
+    ~CommandLineRender();
+
+    /* Parse the arguments following "--render". Returns false and fills
+     * errorString on invalid input. */
+    bool parseArguments(const QStringList& args);
+    /* Load the input, render and save the output. Returns the process exit code. */
+    int exec();
+
+    QString errorString() const { return theError; }
+
+    static void showHelp();
+
+private:
+    bool loadStyle();
+    bool loadDocument();
+    bool loadFile(const QString& fileName);
+    bool loadMerkaartorDocument(const QString& fileName);
+#ifndef FRISIUS_BUILD
+    bool applyChanges(const QString& fileName);
+#endif
+    ImportFilter* importFilter();
+    QSize computeSize() const;
+    RendererOptions options() const;
+    void render(QPainter& P, const QRect& theR, RendererOptions opt);
+
+    bool renderRaster(const QSize& size);
+    bool renderSVG(const QSize& size);
+    bool renderPDF(const QSize& size);
+#ifdef USE_PROTOBUF
+    bool exportPBF();
+#endif
+
+    QStringList theInputFiles;
+    /* Set by --apply-osc, applied in order after the input */
+    QStringList theChangeFiles;
+    QString theStyleFile;
+    QString theOutputFile;
+    QString theError;
+    CoordBox theBox;
+    bool hasBox;
+    qreal theScale;
+    int theDpi;
+    QSize theSize;
+    int theThreads;
+    bool showNodes;
+    bool showScale;
+    bool showGrid;
+    bool hideUnstyled;
+    /* Set by the --import-* options */
+    ImportFilter* theImportFilter;
+
+    Document* theDocument;
+    MapView* theView;
+};
+
+#endif // COMMANDLINERENDER_H
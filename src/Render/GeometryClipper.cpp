@@ -0,0 +1,147 @@
+//
+// C++ Implementation: GeometryClipper
+//
+// Description: Clipping of screen space polylines and polygons.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#include "GeometryClipper.h"
+
+#include <math.h>
+
+enum { Inside = 0, Left = 1, Right = 2, Top = 4, Bottom = 8 };
+
+static inline int outCode(const QPointF& p, const QRectF& r)
+{
+    int c = Inside;
+    if (p.x() < r.left())
+        c |= Left;
+    else if (p.x() > r.right())
+        c |= Right;
+    if (p.y() < r.top())
+        c |= Top;
+    else if (p.y() > r.bottom())
+        c |= Bottom;
+    return c;
+}
+
+/* Cohen-Sutherland: clips the segment in place, false if it is outside */
+static bool clipSegment(QPointF& a, QPointF& b, const QRectF& r)
+{
+    int ca = outCode(a, r);
+    int cb = outCode(b, r);
+    for (;;) {
+        if (!(ca | cb))
+            return true;
+        if (ca & cb)
+            return false;
+
+        int c = ca ? ca : cb;
+        qreal x, y;
+        if (c & Top) {
+            x = a.x() + (b.x() - a.x()) * (r.top() - a.y()) / (b.y() - a.y());
+            y = r.top();
+        } else if (c & Bottom) {
+            x = a.x() + (b.x() - a.x()) * (r.bottom() - a.y()) / (b.y() - a.y());
+            y = r.bottom();
+        } else if (c & Right) {
+            y = a.y() + (b.y() - a.y()) * (r.right() - a.x()) / (b.x() - a.x());
+            x = r.right();
+        } else {
+            y = a.y() + (b.y() - a.y()) * (r.left() - a.x()) / (b.x() - a.x());
+            x = r.left();
+        }
+        if (c == ca) {
+            a = QPointF(x, y);
+            ca = outCode(a, r);
+        } else {
+            b = QPointF(x, y);
+            cb = outCode(b, r);
+        }
+    }
+}
+
+static inline qreal length(const QPointF& a, const QPointF& b)
+{
+    return sqrt((b.x()-a.x())*(b.x()-a.x()) + (b.y()-a.y())*(b.y()-a.y()));
+}
+
+void clipPolyline(const QPointF* pts, int count, const QRectF& clip, QVector<QPolygonF>& lines, QVector<qreal>& offsets)
+{
+    QPolygonF run;
+    qreal along = 0.0;
+    for (int i=1; i<count; ++i) {
+        QPointF a = pts[i-1];
+        QPointF b = pts[i];
+        if (clipSegment(a, b, clip)) {
+            /* Continue the run only if the segment enters where it ended */
+            if (run.isEmpty() || a != pts[i-1]) {
+                if (run.size() > 1) {
+                    lines << run;
+                } else if (!run.isEmpty())
+                    offsets.removeLast();
+                run.clear();
+                run << a;
+                offsets << along + length(pts[i-1], a);
+            }
+            run << b;
+            if (b != pts[i]) {
+                lines << run;
+                run.clear();
+            }
+        }
+        along += length(pts[i-1], pts[i]);
+    }
+    if (run.size() > 1)
+        lines << run;
+    else if (!run.isEmpty())
+        offsets.removeLast();
+}
+
+/* One Sutherland-Hodgman pass against the half plane of one clip edge */
+template <class InsideFn, class CrossFn>
+static void clipEdge(const QPolygonF& in, QPolygonF& out, InsideFn inside, CrossFn cross)
+{
+    out.clear();
+    if (in.isEmpty())
+        return;
+    QPointF prev = in.last();
+    bool prevIn = inside(prev);
+    for (int i=0; i<in.size(); ++i) {
+        const QPointF& cur = in[i];
+        bool curIn = inside(cur);
+        if (curIn) {
+            if (!prevIn)
+                out << cross(prev, cur);
+            out << cur;
+        } else if (prevIn)
+            out << cross(prev, cur);
+        prev = cur;
+        prevIn = curIn;
+    }
+}
+
+QPolygonF clipPolygon(const QPointF* pts, int count, const QRectF& clip)
+{
+    const qreal l = clip.left(), r = clip.right(), t = clip.top(), b = clip.bottom();
+
+    QPolygonF in(count), out;
+    for (int i=0; i<count; ++i)
+        in[i] = pts[i];
+
+    clipEdge(in, out,
+             [l](const QPointF& p) { return p.x() >= l; },
+             [l](const QPointF& p, const QPointF& q) { return QPointF(l, p.y() + (q.y()-p.y()) * (l-p.x()) / (q.x()-p.x())); });
+    clipEdge(out, in,
+             [r](const QPointF& p) { return p.x() <= r; },
+             [r](const QPointF& p, const QPointF& q) { return QPointF(r, p.y() + (q.y()-p.y()) * (r-p.x()) / (q.x()-p.x())); });
+    clipEdge(in, out,
+             [t](const QPointF& p) { return p.y() >= t; },
+             [t](const QPointF& p, const QPointF& q) { return QPointF(p.x() + (q.x()-p.x()) * (t-p.y()) / (q.y()-p.y()), t); });
+    clipEdge(out, in,
+             [b](const QPointF& p) { return p.y() <= b; },
+             [b](const QPointF& p, const QPointF& q) { return QPointF(p.x() + (q.x()-p.x()) * (b-p.y()) / (q.y()-p.y()), b); });
+    return in;
+}
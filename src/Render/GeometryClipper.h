@@ -0,0 +1,45 @@
+//
+// C++ Interface: GeometryClipper
+//
+// Description: Clipping of screen space polylines (Cohen-Sutherland) and
+//              polygons (Sutherland-Hodgman) to the rendered rectangle, so
+//              that QPainter only strokes and fills what is visible.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#ifndef GEOMETRYCLIPPER_H
+#define GEOMETRYCLIPPER_H
+
+#include <QPolygonF>
+#include <QRectF>
+#include <QVector>
+
+/* Margin (pixels) kept around the clip rectangle: pens up to twice as wide
+ * look the same clipped or not. Also the minimum size worth clipping. */
+#define CLIP_MARGIN 64
+#define CLIP_MIN_VERTICES 32
+
+/* The clipped geometry of one feature, cached by MapRenderer for the tile
+ * being rendered. */
+struct ClippedGeometry
+{
+    ClippedGeometry() : HasLines(false), HasAreas(false) {}
+
+    bool HasLines;
+    QVector<QPolygonF> Lines;   /* Visible runs of the outline */
+    QVector<qreal> LineOffsets; /* Length of the outline before each run */
+    bool HasAreas;
+    QVector<QPolygonF> Areas;   /* Clipped rings, to fill with the odd-even rule */
+};
+
+/* Appends the runs of the polyline that are inside clip to lines, and for
+ * each the distance along the polyline to its first point to offsets (used
+ * to keep dash patterns in phase). */
+void clipPolyline(const QPointF* pts, int count, const QRectF& clip, QVector<QPolygonF>& lines, QVector<qreal>& offsets);
+
+/* Returns the polygon (implicitly closed) clipped to clip. */
+QPolygonF clipPolygon(const QPointF* pts, int count, const QRectF& clip);
+
+#endif // GEOMETRYCLIPPER_H
@@ -17,6 +17,12 @@
 #include "MasPaintStyle.h"
 #include "ImageMapLayer.h"
 #include "LineF.h"
+#include "RenderStatistics.h"
+#include "StyleProfiler.h"
+
+#include <QElapsedTimer>
+
+#include <math.h>
 
 #define TEST_RFLAGS(x) theOptions.options.testFlag(x)
 #define TEST_RENDERER_RFLAGS(x) r->theOptions.options.testFlag(x)
@@ -206,6 +212,8 @@ void LabelStyleLayer::draw(Node* Pt)
 /*** MapRenderer ***/
 
 MapRenderer::MapRenderer()
+    : theStatistics(0)
+    , theLayerComposited(false)
 {
     bglayer = BackgroundStyleLayer(this);
     fglayer = ForegroundStyleLayer(this);
@@ -218,10 +226,159 @@ QPoint MapRenderer::toView(Node* aPt) const
     return theTransform.map(aPt->projected()).toPoint();
 }
 
+qreal MapRenderer::featureAlpha(Feature* F) const
+{
+    qreal alpha = F->getAlpha();
+    bool readonly = F->isReadonly();
+    if (theLayerComposited) {
+        Layer* L = F->layer();
+        if (L && L->getAlpha() != 1.0)
+            alpha = 1.0;
+        if (L && L->isReadonly())
+            readonly = false;
+    }
+    if (readonly && !TEST_RFLAGS(RendererOptions::ForPrinting))
+        alpha /= 2.0;
+    return alpha;
+}
+
+
+static quint64 cellKey(qreal x, qreal y)
+{
+    return ((quint64)(quint32)(qint32)floor(x) << 32) | (quint32)(qint32)floor(y);
+}
+
+void MapRenderer::cullFeatures(QMap<RenderPriority, QSet <Feature*> >& theFeatures)
+{
+    theDensityDots.clear();
+    thePointClusters.clear();
+
+    const qreal cullPixels = theGlobalPainter.CullAreas ? theGlobalPainter.CullPixels : 0.;
+    /* Points of a cell are only all gathered if the cell fits in the tile surround */
+    const int clusterPixels = theGlobalPainter.ClusterPoints ? qBound(4, theGlobalPainter.ClusterPixels, 128) : 0;
+    const qreal scaleX = fabs(theTransform.m11());
+    const qreal scaleY = fabs(theTransform.m22());
+
+    QList<QPair<RenderPriority, Feature*> > culled;
+    /* Cells are aligned on the projection origin rather than on the screen,
+     * so that adjacent tiles group the same points into the same marker */
+    QHash<quint64, QList<QPair<RenderPriority, Node*> > > cells;
+
+    QMap<RenderPriority, QSet<Feature*> >::const_iterator itm;
+    QSet<Feature*>::const_iterator it;
+    for (itm = theFeatures.constBegin(); itm != theFeatures.constEnd(); ++itm) {
+        for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
+            Feature* F = *it;
+            if (CHECK_NODE(F)) {
+                Node* N = STATIC_CAST_NODE(F);
+                if (!clusterPixels || !N->isPOI() || !N->hasPainter(thePixelPerM))
+                    continue;
+                QPointF p = N->projected();
+                cells[cellKey(p.x() * scaleX / clusterPixels, -p.y() * scaleY / clusterPixels)]
+                        << qMakePair(itm.key(), N);
+                continue;
+            }
+
+            if (cullPixels <= 0.)
+                continue;
+            if (!CHECK_RELATION(F) && !(CHECK_WAY(F) && STATIC_CAST_WAY(F)->isClosed()))
+                continue;
+            const FeaturePainter* paintsel = F->getPainter(thePixelPerM);
+            if (!paintsel)
+                continue;
+
+            F->getLock();
+            bool empty = F->getPath().isEmpty();
+            QRectF r = empty ? QRectF() : theTransform.mapRect(F->getPath().boundingRect());
+            F->releaseLock();
+            if (empty || r.width() >= cullPixels || r.height() >= cullPixels)
+                continue;
+
+            QColor c = paintsel->fillColor();
+            if (!c.isValid() && paintsel->DrawForeground)
+                c = paintsel->ForegroundColor;
+            if (!c.isValid() && paintsel->DrawBackground)
+                c = paintsel->BackgroundColor;
+            /* Relations without a fill are routes and the like: keep them */
+            if (!c.isValid() || (CHECK_RELATION(F) && !paintsel->fillColor().isValid()))
+                continue;
+
+            culled << qMakePair(itm.key(), F);
+            quint64 k = cellKey(r.center().x(), r.center().y());
+            if (theDensityDots.contains(k)) {
+                theDensityDots[k].Count++;
+            } else {
+                DensityDot dot;
+                dot.Center = QPointF(floor(r.center().x()) + 0.5, floor(r.center().y()) + 0.5);
+                dot.Color = c;
+                dot.Count = 1;
+                theDensityDots.insert(k, dot);
+            }
+        }
+    }
+
+    QHash<quint64, QList<QPair<RenderPriority, Node*> > >::const_iterator itc;
+    for (itc = cells.constBegin(); itc != cells.constEnd(); ++itc) {
+        if (itc.value().size() < 2)
+            continue;
+        QPointF sum;
+        for (int i=0; i<itc.value().size(); ++i) {
+            sum += theTransform.map(itc.value().at(i).second->projected());
+            culled << qMakePair(itc.value().at(i).first, (Feature*)itc.value().at(i).second);
+        }
+        PointCluster cluster;
+        cluster.Center = sum / itc.value().size();
+        cluster.Count = itc.value().size();
+        thePointClusters << cluster;
+    }
+
+    for (int i=0; i<culled.size(); ++i)
+        theFeatures[culled.at(i).first].remove(culled.at(i).second);
+}
+
+void MapRenderer::drawDensityDots()
+{
+    const qreal radius = qMax(qreal(0.75), theGlobalPainter.CullPixels / 2);
+
+    thePainter->save();
+    thePainter->setPen(Qt::NoPen);
+    QHash<quint64, DensityDot>::const_iterator it;
+    for (it = theDensityDots.constBegin(); it != theDensityDots.constEnd(); ++it) {
+        QColor c = it.value().Color;
+        c.setAlphaF(qMin(1.0, c.alphaF() * (0.4 + 0.2 * it.value().Count)));
+        thePainter->setBrush(c);
+        thePainter->drawEllipse(it.value().Center, radius, radius);
+    }
+    thePainter->restore();
+}
+
+void MapRenderer::drawPointClusters()
+{
+    thePainter->save();
+    QFont f = thePainter->font();
+    f.setPixelSize(10);
+    f.setBold(true);
+    thePainter->setFont(f);
+    thePainter->setPen(QPen(QColor(0x80, 0x40, 0x00), 1));
+    for (int i=0; i<thePointClusters.size(); ++i) {
+        const PointCluster& c = thePointClusters.at(i);
+        QString count = QString::number(c.Count);
+#if QT_VERSION >= QT_VERSION_CHECK(5,11,0)
+        qreal radius = qMax(qreal(8.), thePainter->fontMetrics().horizontalAdvance(count) / 2. + 4.);
+#else
+        qreal radius = qMax(qreal(8.), thePainter->fontMetrics().width(count) / 2. + 4.);
+#endif
+        thePainter->setBrush(QColor(0xff, 0xa0, 0x40, 0xd0));
+        thePainter->drawEllipse(c.Center, radius, radius);
+        thePainter->drawText(QRectF(c.Center.x() - radius, c.Center.y() - radius, 2*radius, 2*radius),
+                             Qt::AlignCenter, count);
+    }
+    thePainter->restore();
+}
 
 void MapRenderer::render(
         QPainter* P,
-        const QMap<RenderPriority, QSet <Feature*> >& theFeatures,
+        const QMap<RenderPriority, QSet <Feature*> >& aFeatures,
         const QRectF& pViewport,
         const QRect& screen,
         const qreal pixelPerM,
@@ -260,6 +417,13 @@ void MapRenderer::render(
             NodeWidth = M_PREFS->getNodeSize();
     }
 
+    /* A shallow copy: only the sets losing features to culling are detached */
+    QMap<RenderPriority, QSet <Feature*> > theFeatures = aFeatures;
+    theDensityDots.clear();
+    thePointClusters.clear();
+    if (theGlobalPainter.CullAreas || theGlobalPainter.ClusterPoints)
+        cullFeatures(theFeatures);
+
     bool bgLayerVisible = TEST_RFLAGS(RendererOptions::BackgroundVisible);
     bool fgLayerVisible = TEST_RFLAGS(RendererOptions::ForegroundVisible);
     bool tchpLayerVisible = TEST_RFLAGS(RendererOptions::TouchupVisible);
@@ -273,19 +437,38 @@ void MapRenderer::render(
     thePainter->save();
     thePainter->translate(screen.left(), screen.top());
 
+    theClipRect = QRectF(0, 0, screen.width(), screen.height()).adjusted(-CLIP_MARGIN, -CLIP_MARGIN, CLIP_MARGIN, CLIP_MARGIN);
+    theClipCache.clear();
+
+    QElapsedTimer timer;
+    if (theStatistics) {
+        for (itm = theFeatures.constBegin(); itm != theFeatures.constEnd(); ++itm) {
+            for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
+                if (CHECK_WAY(*it))
+                    theStatistics->ways++;
+                else if (CHECK_NODE(*it))
+                    theStatistics->nodes++;
+                else if (CHECK_RELATION(*it))
+                    theStatistics->relations++;
+                else
+                    theStatistics->others++;
+            }
+        }
+    }
+
     itm = theFeatures.constBegin();
     while (itm != theFeatures.constEnd())
     {
         int curLayer = (itm.key()).layer();
         itmCur = itm;
+        if (theStatistics)
+            timer.start();
         while (itm != theFeatures.constEnd() && (itm.key()).layer() == curLayer)
         {
             if (bgLayerVisible)
             {
                 for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
-                    qreal alpha = (*it)->getAlpha();
-                    if ((*it)->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
-                        alpha /= 2.0;
+                    qreal alpha = featureAlpha(*it);
                     if (alpha != 1.) {
                         P->save();
                         P->setOpacity(alpha);
@@ -308,15 +491,17 @@ void MapRenderer::render(
             }
             ++itm;
         }
+        if (theStatistics)
+            theStatistics->nsecs[TileStatistics::Background] += timer.nsecsElapsed();
         itm = itmCur;
+        if (theStatistics)
+            timer.start();
         while (itm != theFeatures.constEnd() && (itm.key()).layer() == curLayer)
         {
             if (fgLayerVisible)
             {
                 for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
-                    qreal alpha = (*it)->getAlpha();
-                    if ((*it)->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
-                        alpha /= 2.0;
+                    qreal alpha = featureAlpha(*it);
                     if (alpha != 1.) {
                         P->save();
                         P->setOpacity(alpha);
@@ -339,14 +524,18 @@ void MapRenderer::render(
             }
             ++itm;
         }
+        if (theStatistics)
+            theStatistics->nsecs[TileStatistics::Foreground] += timer.nsecsElapsed();
     }
+    if (!theDensityDots.isEmpty() && (bgLayerVisible || fgLayerVisible))
+        drawDensityDots();
+    if (theStatistics)
+        timer.start();
     if (tchpLayerVisible)
     {
         for (itm = theFeatures.constBegin() ;itm != theFeatures.constEnd(); ++itm) {
             for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
-                qreal alpha = (*it)->getAlpha();
-                if ((*it)->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
-                    alpha /= 2.0;
+                qreal alpha = featureAlpha(*it);
                 if (alpha != 1.) {
                     P->save();
                     P->setOpacity(alpha);
@@ -368,15 +557,17 @@ void MapRenderer::render(
             }
         }
     }
+    if (theStatistics) {
+        theStatistics->nsecs[TileStatistics::Touchup] += timer.nsecsElapsed();
+        timer.start();
+    }
 
     if (lblLayerVisible)
     {
         for (itm = theFeatures.constBegin() ;itm != theFeatures.constEnd(); ++itm) {
             for (it = itm.value().constBegin(); it != itm.value().constEnd(); ++it) {
                 P->save();
-                qreal alpha = (*it)->getAlpha();
-                if ((*it)->isReadonly() && !TEST_RFLAGS(RendererOptions::ForPrinting))
-                    alpha /= 2.0;
+                qreal alpha = featureAlpha(*it);
                 P->setOpacity(alpha);
 
                 if (CHECK_WAY(*it)) {
@@ -393,5 +584,13 @@ void MapRenderer::render(
             }
         }
     }
+    if (theStatistics)
+        theStatistics->nsecs[TileStatistics::Label] += timer.nsecsElapsed();
+    if (!thePointClusters.isEmpty())
+        drawPointClusters();
     thePainter->restore();
+    theClipCache.clear();
+    theDensityDots.clear();
+    thePointClusters.clear();
+    M_STYLEPROFILER->flush();
 }
@@ -20,10 +20,14 @@
 
 #include "Feature.h"
 #include "IRenderer.h"
+#include "GeometryClipper.h"
+
+#include <QHash>
 
 class Document;
 class PaintStylePrivate;
 class MapRenderer;
+struct TileStatistics;
 
 class PaintStyleLayer
 {
@@ -82,6 +86,22 @@ public:
     virtual void draw(Relation* R);
 };
 
+/* An area smaller than the style's cull size, drawn as a dot. Areas falling
+ * on the same pixel share a dot, which gets darker with their count. */
+struct DensityDot
+{
+    QPointF Center;
+    QColor Color;
+    int Count;
+};
+
+/* Points of the same clustering cell, drawn as one marker with their count */
+struct PointCluster
+{
+    QPointF Center;
+    int Count;
+};
+
 class MapRenderer
 {
 public:
@@ -89,7 +109,7 @@ public:
 
     void render(
             QPainter* P,
-            const QMap<RenderPriority, QSet <Feature*> >& theFeatures,
+            const QMap<RenderPriority, QSet <Feature*> >& aFeatures,
             const QRectF& pViewport,
             const QRect& screen,
             const qreal pixelPerM,
@@ -113,6 +133,31 @@ public:
     GlobalPainter theGlobalPainter;
 
     QPoint toView(Node *aPt) const;
+    qreal featureAlpha(Feature* F) const;
+
+    /* Removes the areas and points too small or too close to be told apart at
+     * this scale, as set in the global painter, and fills theDensityDots and
+     * thePointClusters in their place. */
+    void cullFeatures(QMap<RenderPriority, QSet <Feature*> >& theFeatures);
+    void drawDensityDots();
+    void drawPointClusters();
+
+    QHash<quint64, DensityDot> theDensityDots;
+    QList<PointCluster> thePointClusters;
+
+    /* If set, render() adds its per style layer timings and feature counts */
+    TileStatistics* theStatistics;
+
+    /* Set when the features of a single layer are rendered to be composited
+     * later: the alpha and read-only dimming of the layer itself are then
+     * left to the compositing. */
+    bool theLayerComposited;
+
+    /* The screen rectangle with a margin for wide pens, in painter
+     * coordinates. Large geometries are clipped to it before drawing, and
+     * the result kept for the other style layers of the same render. */
+    QRectF theClipRect;
+    QHash<Feature*, ClippedGeometry> theClipCache;
 
 protected:
     BackgroundStyleLayer bglayer;
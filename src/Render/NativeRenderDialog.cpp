@@ -14,12 +14,15 @@
 #include "MainWindow.h"
 #include "Document.h"
 #include "MapView.h"
+#include "OsmRenderLayer.h"
 #include "Projection.h"
 #include "Layer.h"
 #include "Features.h"
 #include "MerkaartorPreferences.h"
 #include "MasPaintStyle.h"
 #include "PictureViewerDialog.h"
+#include "PosterRenderer.h"
+#include "StreamingImageWriter.h"
 
 #include <QPrinter>
 #include <QPrintPreviewDialog>
@@ -30,6 +33,8 @@
 #include <QPainter>
 #include <QSvgGenerator>
 #include <QFileDialog>
+#include <QApplication>
+#include <QMessageBox>
 
 NativeRenderDialog::NativeRenderDialog(Document *aDoc, const CoordBox& aCoordBox, QWidget *parent)
     :QObject(parent), theDoc(aDoc), theOrigBox(aCoordBox)
@@ -39,6 +44,7 @@ NativeRenderDialog::NativeRenderDialog(Document *aDoc, const CoordBox& aCoordBox
 
     mapview = new MapView(NULL);
     mapview->setDocument(theDoc);
+    mapview->setRenderingPriority(OsmRenderLayer::ExportPriority);
 
     preview = new QPrintPreviewDialog( thePrinter, parent );
     QMainWindow* mw = preview->findChild<QMainWindow*>();
@@ -205,7 +211,7 @@ void NativeRenderDialog::exportPDF()
 void NativeRenderDialog::exportRaster()
 {
     QString s;
-    QFileDialog dlg(NULL, tr("Output filename"), QString("%1/%2.png").arg(M_PREFS->getworkingdir()).arg(tr("untitled")), tr("Image files (*.png *.jpg)") + "\n" + tr("All Files (*)"));
+    QFileDialog dlg(NULL, tr("Output filename"), QString("%1/%2.png").arg(M_PREFS->getworkingdir()).arg(tr("untitled")), tr("Image files (*.png *.tif *.tiff *.jpg)") + "\n" + tr("All Files (*)"));
     dlg.setFileMode(QFileDialog::AnyFile);
     dlg.setDefaultSuffix("png");
     dlg.setAcceptMode(QFileDialog::AcceptSave);
@@ -223,13 +229,31 @@ void NativeRenderDialog::exportRaster()
     QRect theR = thePrinter->pageRect();
     theR.moveTo(0, 0);
 
+    /* PNG and TIFF are rendered in bands and streamed to the file, so that
+     * posters larger than the memory can be exported */
+    if (StreamingImageWriter::canWrite(s)) {
+        QProgressDialog progress(tr("Rendering..."), tr("Cancel"), 0, 0);
+        progress.setWindowModality(Qt::ApplicationModal);
+        progress.setMinimumDuration(0);
+        progress.show();
+
+        PosterRenderer poster(mapview);
+        bool ok = poster.render(s, theR, boundingBox(), options(), ui.fieldDpi->currentText().toInt(), PosterRenderer::exportBackground(),
+                                [&progress, &poster](int done, int total) {
+            progress.setMaximum(total);
+            progress.setValue(done);
+            qApp->processEvents();
+            if (progress.wasCanceled())
+                poster.cancel();
+        });
+        progress.reset();
+        if (!ok && !progress.wasCanceled())
+            QMessageBox::critical(NULL, tr("Export"), tr("Could not write %1: %2").arg(s).arg(poster.errorString()));
+        return;
+    }
+
     QPixmap pix(theR.size());
-    if (M_PREFS->getUseShapefileForBackground())
-        pix.fill(M_PREFS->getWaterColor());
-    else if (M_PREFS->getBackgroundOverwriteStyle() || !M_STYLE->getGlobalPainter().getDrawBackground())
-        pix.fill(M_PREFS->getBgColor());
-    else
-        pix.fill(M_STYLE->getGlobalPainter().getBackgroundColor());
+    pix.fill(PosterRenderer::exportBackground());
 
     QPainter P(&pix);
     P.setRenderHint(QPainter::Antialiasing);
@@ -0,0 +1,201 @@
+//
+// C++ Implementation: PosterRenderer
+//
+// Description: Band-wise rendering of large raster exports.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#include "Global.h"
+
+#include "PosterRenderer.h"
+
+#include "Document.h"
+#include "Layer.h"
+#include "MapView.h"
+#include "MapRenderer.h"
+#include "OsmRenderLayer.h"
+#include "Projection.h"
+#include "MerkaartorPreferences.h"
+#include "IPaintStyle.h"
+#include "StreamingImageWriter.h"
+
+#include <QFuture>
+#include <QList>
+#include <QPainter>
+#include <QThreadPool>
+#include <QtConcurrentRun>
+
+struct PosterBand
+{
+    Document* theDocument;
+    Projection theProjection;
+    QTransform theInvertedTransform;
+    qreal PixelPerM;
+    RendererOptions ROptions;
+    QColor Background;
+    QAtomicInt* Cancelled;
+    int Width;
+    int Top;
+    int Height;
+};
+
+/* Runs on the thread pool, like OsmRenderLayer::renderTile */
+static QImage renderBand(PosterBand band)
+{
+    if (band.Cancelled->load())
+        return QImage();
+
+    QImage img(band.Width, band.Height, QImage::Format_ARGB32_Premultiplied);
+    if (img.isNull())
+        return img;
+    img.fill(band.Background);
+
+    /* Projected rect of the band with its margins; top keeps the max y */
+    const int m = PosterRenderer::BandMargin;
+    QPointF projTL = band.theInvertedTransform.map(QPointF(0, band.Top - m));
+    QPointF projBR = band.theInvertedTransform.map(QPointF(band.Width, band.Top + band.Height + m));
+    QRectF projR(projTL, projBR);
+
+    Coord tl = band.theProjection.inverse2Coord(projR.topLeft());
+    Coord br = band.theProjection.inverse2Coord(projR.bottomRight());
+    CoordBox invalidRect(tl, br);
+
+    OsmRenderLayer::renderingLock().lockForRead();
+    band.theDocument->lockPainters();
+
+    QMap<RenderPriority, QSet <Feature*> > theFeatures;
+    g_backend.delayDeletes();
+    for (int i=0; i<band.theDocument->layerSize(); ++i)
+        g_backend.getFeatureSet(band.theDocument->getLayer(i), theFeatures, invalidRect, band.theProjection);
+
+    QPainter P(&img);
+    if (M_PREFS->getUseAntiAlias())
+        P.setRenderHint(QPainter::Antialiasing);
+    MapRenderer r;
+    r.render(&P, theFeatures, projR, QRect(0, -m, band.Width, band.Height + 2*m), band.PixelPerM, band.ROptions);
+    P.end();
+
+    g_backend.resumeDeletes();
+    band.theDocument->unlockPainters();
+    OsmRenderLayer::renderingLock().unlock();
+
+    return img;
+}
+
+PosterRenderer::PosterRenderer(MapView* aView)
+    : theView(aView), theCancelled(0)
+{
+}
+
+void PosterRenderer::cancel()
+{
+    theCancelled.store(1);
+}
+
+bool PosterRenderer::render(const QString& fileName, const QRect& aRect, const CoordBox& aBox,
+                            const RendererOptions& opt, int dpi, const QColor& background,
+                            const RenderProgressCallback& progress)
+{
+    Document* theDocument = theView->document();
+    if (!theDocument) {
+        theError = "No document";
+        return false;
+    }
+    theCancelled.store(0);
+    theError.clear();
+
+    /* Only the transform of the view is needed: keep it from rendering the
+     * whole poster into its own tiles */
+    theView->stopRendering();
+    theView->setGeometry(aRect);
+    theView->setViewport(aBox, aRect);
+    theView->setRenderOptions(opt);
+    theView->resumeRendering();
+
+    StreamingImageWriter writer;
+    if (!writer.open(fileName, aRect.size(), dpi)) {
+        theError = writer.errorString();
+        return false;
+    }
+
+    PosterBand band;
+    band.theDocument = theDocument;
+    band.theProjection = theView->projection();
+    band.theInvertedTransform = theView->invertedTransform();
+    band.PixelPerM = theView->pixelPerM();
+    band.ROptions = opt;
+    band.Background = background;
+    band.Cancelled = &theCancelled;
+    band.Width = aRect.width();
+
+    const int total = (aRect.height() + BandHeight - 1) / BandHeight;
+    /* Bands are written in order; a few more than the workers are queued so
+     * that none of them waits on the writer */
+    const int inFlight = QThreadPool::globalInstance()->maxThreadCount() + 1;
+
+    QList<QFuture<QImage> > pending;
+    int next = 0;
+    bool ok = true;
+    for (int done=0; done<total; ++done) {
+        while (next < total && pending.size() < inFlight) {
+            band.Top = next * BandHeight;
+            band.Height = qMin(BandHeight, aRect.height() - band.Top);
+            pending << QtConcurrent::run(renderBand, band);
+            ++next;
+        }
+
+        QImage img = pending.takeFirst().result();
+        if (theCancelled.load()) {
+            theError = "Cancelled";
+            ok = false;
+            break;
+        }
+        if (img.isNull()) {
+            theError = QString("Could not allocate a %1x%2 band").arg(aRect.width()).arg(BandHeight);
+            ok = false;
+            break;
+        }
+
+        /* Scale bar and grid are drawn at their place on the whole poster */
+        if (opt.options & (RendererOptions::ScaleVisible | RendererOptions::LatLonGridVisible)) {
+            QPainter P(&img);
+            P.setRenderHint(QPainter::Antialiasing);
+            P.translate(0, -done * BandHeight);
+            if (opt.options & RendererOptions::ScaleVisible)
+                theView->drawScale(P);
+            if (opt.options & RendererOptions::LatLonGridVisible)
+                theView->drawLatLonGrid(P);
+        }
+
+        if (!writer.writeRows(img)) {
+            theError = writer.errorString();
+            ok = false;
+            break;
+        }
+        if (progress)
+            progress(done + 1, total);
+    }
+
+    if (!ok) {
+        theCancelled.store(1);
+        foreach (QFuture<QImage> f, pending)
+            f.waitForFinished();
+    }
+    if (!writer.close() && ok) {
+        theError = writer.errorString();
+        ok = false;
+    }
+    return ok;
+}
+
+QColor PosterRenderer::exportBackground()
+{
+    if (M_PREFS->getUseShapefileForBackground())
+        return M_PREFS->getWaterColor();
+    else if (M_PREFS->getBackgroundOverwriteStyle() || !M_STYLE->getGlobalPainter().getDrawBackground())
+        return M_PREFS->getBgColor();
+    else
+        return M_STYLE->getGlobalPainter().getBackgroundColor();
+}
@@ -0,0 +1,55 @@
+//
+// C++ Interface: PosterRenderer
+//
+// Description: Renders a print area in horizontal bands on the thread pool and
+//              streams them to a PNG or TIFF file, so that the memory used
+//              depends on the band size and not on the poster size.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#ifndef POSTERRENDERER_H
+#define POSTERRENDERER_H
+
+#include <QAtomicInt>
+#include <QColor>
+#include <QRect>
+#include <QString>
+
+#include "Coord.h"
+#include "IRenderer.h"
+
+class MapView;
+
+class PosterRenderer
+{
+public:
+    /* aView must show the document to render; its viewport is changed */
+    PosterRenderer(MapView* aView);
+
+    /* Renders aBox into an image of aRect's size and writes it to fileName
+     * (png, tif or tiff). progress is called from the calling thread after
+     * each band; cancel() may be called from it. */
+    bool render(const QString& fileName, const QRect& aRect, const CoordBox& aBox,
+                const RendererOptions& opt, int dpi, const QColor& background,
+                const RenderProgressCallback& progress = RenderProgressCallback());
+    void cancel();
+
+    QString errorString() const { return theError; }
+
+    /* The colour under the map of an export: the water colour when the
+     * shapefile background is used, else that of the style or preferences */
+    static QColor exportBackground();
+
+    /* Band height and the extra rows rendered above and below each band, so
+     * that wide pens and labels crossing a band border match on both sides */
+    enum { BandHeight = 512, BandMargin = 128 };
+
+private:
+    MapView* theView;
+    QAtomicInt theCancelled;
+    QString theError;
+};
+
+#endif // POSTERRENDERER_H
@@ -4,21 +4,35 @@ DEPENDPATH += $$MERKAARTOR_SRC_DIR/Render
 # Header files
 HEADERS += \
     FeaturePainter.h \
-    MapRenderer.h
+    GeometryClipper.h \
+    MapRenderer.h \
+    RenderStatistics.h \
+    StyleProfiler.h \
+    VertexTransform.h
 
 # Source files
 SOURCES += \
     FeaturePainter.cpp \
-    MapRenderer.cpp
+    GeometryClipper.cpp \
+    MapRenderer.cpp \
+    RenderStatistics.cpp \
+    StyleProfiler.cpp \
+    VertexTransform.cpp
 
 isEmpty(MOBILE) {
   QT += svg
 
   HEADERS += \
-    NativeRenderDialog.h
+    CommandLineRender.h \
+    NativeRenderDialog.h \
+    PosterRenderer.h \
+    StreamingImageWriter.h
 
   SOURCES += \
-    NativeRenderDialog.cpp
+    CommandLineRender.cpp \
+    NativeRenderDialog.cpp \
+    PosterRenderer.cpp \
+    StreamingImageWriter.cpp
 
   # Forms
   FORMS += NativeRenderDialog.ui
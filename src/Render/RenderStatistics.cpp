@@ -0,0 +1,162 @@
+//
+// C++ Implementation: RenderStatistics
+//
+// Description: Timings and counters collected by the tile renderers.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#include "RenderStatistics.h"
+
+#include <QFile>
+#include <QTextStream>
+
+TileStatistics::TileStatistics()
+    : pixelPerM(0.0), totalNsecs(0), ways(0), nodes(0), relations(0), others(0)
+{
+    for (int i=0; i<StageCount; ++i)
+        nsecs[i] = 0;
+}
+
+const char* TileStatistics::stageName(int aStage)
+{
+    switch (aStage) {
+    case Gather:        return "gather";
+    case BuildPath:     return "buildpath";
+    case Background:    return "background";
+    case Foreground:    return "foreground";
+    case Touchup:       return "touchup";
+    case Label:         return "label";
+    }
+    return "";
+}
+
+/*********************/
+
+RenderStatistics::RenderStatistics()
+    : theEnabled(0)
+{
+}
+
+RenderStatistics* RenderStatistics::instance()
+{
+    /* Used from the render threads: rely on thread-safe static initialization */
+    static RenderStatistics theInstance;
+    return &theInstance;
+}
+
+void RenderStatistics::setEnabled(bool enabled)
+{
+    theEnabled.store(enabled ? 1 : 0);
+}
+
+void RenderStatistics::record(const TileStatistics& aStats)
+{
+    QMutexLocker lock(&theMutex);
+    theSamples.append(aStats);
+    while (theSamples.size() > MaxSamples)
+        theSamples.removeFirst();
+}
+
+void RenderStatistics::recordCache(const QString& aRenderer, int hits, int misses)
+{
+    QMutexLocker lock(&theMutex);
+    QPair<qint64, qint64>& c = theCache[aRenderer];
+    c.first += hits;
+    c.second += misses;
+}
+
+void RenderStatistics::clear()
+{
+    QMutexLocker lock(&theMutex);
+    theSamples.clear();
+    theCache.clear();
+}
+
+QList<TileStatistics> RenderStatistics::samples() const
+{
+    QMutexLocker lock(&theMutex);
+    return theSamples;
+}
+
+QStringList RenderStatistics::summary() const
+{
+    QMutexLocker lock(&theMutex);
+
+    QMap<QString, TileStatistics> sums;
+    QMap<QString, int> counts;
+    foreach (const TileStatistics& s, theSamples) {
+        TileStatistics& sum = sums[s.renderer];
+        for (int i=0; i<TileStatistics::StageCount; ++i)
+            sum.nsecs[i] += s.nsecs[i];
+        sum.totalNsecs += s.totalNsecs;
+        sum.ways += s.ways;
+        sum.nodes += s.nodes;
+        sum.relations += s.relations;
+        sum.others += s.others;
+        counts[s.renderer]++;
+    }
+
+    QStringList result;
+    QMap<QString, TileStatistics>::const_iterator it;
+    for (it = sums.constBegin(); it != sums.constEnd(); ++it) {
+        int n = counts[it.key()];
+        QString line = QString("%1: %2 tiles, %3 ms/tile (")
+                .arg(it.key()).arg(n).arg(it.value().totalNsecs / 1e6 / n, 0, 'f', 1);
+        for (int i=0; i<TileStatistics::StageCount; ++i) {
+            if (i)
+                line += ", ";
+            line += QString("%1 %2").arg(TileStatistics::stageName(i)).arg(it.value().nsecs[i] / 1e6 / n, 0, 'f', 1);
+        }
+        line += QString("), %1 features/tile").arg(it.value().features() / n);
+
+        QPair<qint64, qint64> c = theCache.value(it.key());
+        if (c.first + c.second)
+            line += QString(", cache %1% hit").arg(100 * c.first / (c.first + c.second));
+        result << line;
+    }
+    return result;
+}
+
+bool RenderStatistics::exportCsv(const QString& fileName, QString* error) const
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+        if (error)
+            *error = f.errorString();
+        return false;
+    }
+
+    QList<TileStatistics> theList = samples();
+    QMap<QString, QPair<qint64, qint64> > cache;
+    {
+        QMutexLocker lock(&theMutex);
+        cache = theCache;
+    }
+
+    QTextStream out(&f);
+    out << "renderer,tile_x,tile_y,pixel_per_m";
+    for (int i=0; i<TileStatistics::StageCount; ++i)
+        out << "," << TileStatistics::stageName(i) << "_ms";
+    out << ",total_ms,ways,nodes,relations,others,cache_hits,cache_misses\n";
+
+    foreach (const TileStatistics& s, theList) {
+        out << s.renderer << "," << s.tile.x() << "," << s.tile.y() << "," << s.pixelPerM;
+        for (int i=0; i<TileStatistics::StageCount; ++i)
+            out << "," << QString::number(s.nsecs[i] / 1e6, 'f', 3);
+        out << "," << QString::number(s.totalNsecs / 1e6, 'f', 3);
+        out << "," << s.ways << "," << s.nodes << "," << s.relations << "," << s.others;
+        /* Cache counters are per renderer, repeated on each of its rows */
+        QPair<qint64, qint64> c = cache.value(s.renderer);
+        out << "," << c.first << "," << c.second << "\n";
+    }
+
+    out.flush();
+    if (f.error() != QFile::NoError) {
+        if (error)
+            *error = f.errorString();
+        return false;
+    }
+    return true;
+}
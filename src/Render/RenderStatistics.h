@@ -0,0 +1,86 @@
+//
+// C++ Interface: RenderStatistics
+//
+// Description: Timings and counters collected by the tile renderers, shown by
+//              the MapView performance overlay and exportable as CSV.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#ifndef RENDERSTATISTICS_H
+#define RENDERSTATISTICS_H
+
+#include <QAtomicInt>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QPair>
+#include <QPoint>
+#include <QStringList>
+
+#define M_RENDERSTATS RenderStatistics::instance()
+
+struct TileStatistics
+{
+    enum Stage {
+        Gather,         /* g_backend.getFeatureSet, including BuildPath */
+        BuildPath,      /* Feature::buildPath while gathering */
+        Background,
+        Foreground,
+        Touchup,
+        Label,
+        StageCount
+    };
+
+    TileStatistics();
+
+    QString renderer;   /* "styled" or "wireframe" */
+    QPoint tile;
+    qreal pixelPerM;
+    qint64 nsecs[StageCount];
+    qint64 totalNsecs;
+    int ways;
+    int nodes;
+    int relations;
+    int others;
+
+    int features() const { return ways + nodes + relations + others; }
+    static const char* stageName(int aStage);
+};
+
+/**
+ * Rolling store of the last tile statistics, filled by the render threads.
+ * Nothing is collected unless enabled, so the timers cost nothing in normal
+ * use.
+ */
+class RenderStatistics
+{
+public:
+    static RenderStatistics* instance();
+
+    void setEnabled(bool enabled);
+    bool isEnabled() const { return theEnabled.load(); }
+
+    void record(const TileStatistics& aStats);
+    /* Tiles reused from the tile cache (hits) or that had to be rendered (misses) */
+    void recordCache(const QString& aRenderer, int hits, int misses);
+    void clear();
+
+    QList<TileStatistics> samples() const;
+    /* One line per renderer with average stage timings and cache hit ratio */
+    QStringList summary() const;
+    bool exportCsv(const QString& fileName, QString* error = 0) const;
+
+private:
+    RenderStatistics();
+
+    enum { MaxSamples = 2000 };
+
+    QAtomicInt theEnabled;
+    mutable QMutex theMutex;
+    QList<TileStatistics> theSamples;
+    QMap<QString, QPair<qint64, qint64> > theCache;
+};
+
+#endif // RENDERSTATISTICS_H
@@ -0,0 +1,301 @@
+//
+// C++ Implementation: StreamingImageWriter
+//
+// Description: Row by row PNG (deflated with zlib) and baseline TIFF
+//              (uncompressed RGB) writer.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#include "StreamingImageWriter.h"
+
+#include <QFileInfo>
+#include <QtEndian>
+
+#include "zlib.h"
+
+#define INCH_PER_M 39.3700787
+/* Size of the zlib output buffer, and so of the PNG IDAT chunks */
+#define DEFLATE_CHUNK (64*1024)
+
+class StreamingImageWriterPrivate
+{
+public:
+    StreamingImageWriterPrivate()
+        : Initialized(false)
+    {
+    }
+
+    z_stream Stream;
+    bool Initialized;
+    QByteArray Out;
+};
+
+/* Little-endian helpers for the TIFF header */
+static void putShort(QByteArray& ba, quint16 v)
+{
+    uchar b[2];
+    qToLittleEndian<quint16>(v, b);
+    ba.append((const char*)b, 2);
+}
+
+static void putLong(QByteArray& ba, quint32 v)
+{
+    uchar b[4];
+    qToLittleEndian<quint32>(v, b);
+    ba.append((const char*)b, 4);
+}
+
+static void putEntry(QByteArray& ba, quint16 tag, quint16 type, quint32 count, quint32 value)
+{
+    putShort(ba, tag);
+    putShort(ba, type);
+    putLong(ba, count);
+    if (type == 3 && count == 1) {
+        /* SHORT values are left-justified in the value field */
+        putShort(ba, (quint16)value);
+        putShort(ba, 0);
+    } else
+        putLong(ba, value);
+}
+
+static void putBigLong(QByteArray& ba, quint32 v)
+{
+    uchar b[4];
+    qToBigEndian<quint32>(v, b);
+    ba.append((const char*)b, 4);
+}
+
+StreamingImageWriter::StreamingImageWriter()
+    : p(new StreamingImageWriterPrivate), theRow(0), isPng(true)
+{
+}
+
+StreamingImageWriter::~StreamingImageWriter()
+{
+    if (p->Initialized)
+        deflateEnd(&p->Stream);
+    delete p;
+}
+
+bool StreamingImageWriter::canWrite(const QString& fileName)
+{
+    QString suffix = QFileInfo(fileName).suffix().toLower();
+    return suffix == "png" || suffix == "tif" || suffix == "tiff";
+}
+
+bool StreamingImageWriter::setError(const QString& error)
+{
+    if (theError.isEmpty())
+        theError = error;
+    return false;
+}
+
+bool StreamingImageWriter::open(const QString& fileName, const QSize& size, int dpi)
+{
+    if (!canWrite(fileName))
+        return setError(QString("Unsupported image format: %1").arg(QFileInfo(fileName).suffix()));
+    if (size.isEmpty())
+        return setError("Empty image");
+
+    isPng = QFileInfo(fileName).suffix().toLower() == "png";
+    theSize = size;
+    theRow = 0;
+
+    /* The strip of a TIFF file is addressed with 32 bit offsets */
+    quint64 stripBytes = quint64(size.width()) * quint64(size.height()) * 3;
+    if (!isPng && stripBytes > Q_UINT64_C(0xFFFFFF00))
+        return setError("Image too large for a TIFF file (4GB), use PNG instead");
+
+    theFile.setFileName(fileName);
+    if (!theFile.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return setError(theFile.errorString());
+
+    theLine.resize(size.width() * 3 + (isPng ? 1 : 0));
+    if (isPng) {
+        thePreviousLine.fill(0, theLine.size());
+
+        static const char signature[8] = { (char)137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+        if (theFile.write(signature, 8) != 8)
+            return setError(theFile.errorString());
+
+        QByteArray ihdr;
+        putBigLong(ihdr, size.width());
+        putBigLong(ihdr, size.height());
+        ihdr.append((char)8);   // bit depth
+        ihdr.append((char)2);   // truecolor
+        ihdr.append((char)0);   // deflate
+        ihdr.append((char)0);   // adaptive filtering
+        ihdr.append((char)0);   // no interlace
+        if (!writePngChunk("IHDR", ihdr))
+            return false;
+
+        QByteArray phys;
+        quint32 ppm = qRound(dpi * INCH_PER_M);
+        putBigLong(phys, ppm);
+        putBigLong(phys, ppm);
+        phys.append((char)1);   // meter
+        if (!writePngChunk("pHYs", phys))
+            return false;
+
+        memset(&p->Stream, 0, sizeof(z_stream));
+        if (deflateInit(&p->Stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+            return setError("Cannot initialize zlib");
+        p->Initialized = true;
+        p->Out.resize(DEFLATE_CHUNK);
+        p->Stream.next_out = (Bytef*)p->Out.data();
+        p->Stream.avail_out = DEFLATE_CHUNK;
+    } else {
+        /* A single strip, so the whole header is known before the pixels */
+        const quint16 entries = 13;
+        const quint32 ifdEnd = 8 + 2 + entries * 12 + 4;
+        const quint32 bpsOffset = ifdEnd;
+        const quint32 xResOffset = bpsOffset + 6;
+        const quint32 yResOffset = xResOffset + 8;
+        const quint32 dataOffset = yResOffset + 8;
+
+        QByteArray hdr;
+        hdr.append("II");
+        putShort(hdr, 42);
+        putLong(hdr, 8);
+
+        putShort(hdr, entries);
+        putEntry(hdr, 256, 4, 1, size.width());             // ImageWidth
+        putEntry(hdr, 257, 4, 1, size.height());            // ImageLength
+        putEntry(hdr, 258, 3, 3, bpsOffset);                // BitsPerSample
+        putEntry(hdr, 259, 3, 1, 1);                        // Compression: none
+        putEntry(hdr, 262, 3, 1, 2);                        // PhotometricInterpretation: RGB
+        putEntry(hdr, 273, 4, 1, dataOffset);               // StripOffsets
+        putEntry(hdr, 277, 3, 1, 3);                        // SamplesPerPixel
+        putEntry(hdr, 278, 4, 1, size.height());            // RowsPerStrip
+        putEntry(hdr, 279, 4, 1, (quint32)stripBytes);      // StripByteCounts
+        putEntry(hdr, 282, 5, 1, xResOffset);               // XResolution
+        putEntry(hdr, 283, 5, 1, yResOffset);               // YResolution
+        putEntry(hdr, 284, 3, 1, 1);                        // PlanarConfiguration: chunky
+        putEntry(hdr, 296, 3, 1, 2);                        // ResolutionUnit: inch
+        putLong(hdr, 0);                                    // no next IFD
+
+        putShort(hdr, 8);
+        putShort(hdr, 8);
+        putShort(hdr, 8);
+        putLong(hdr, dpi);
+        putLong(hdr, 1);
+        putLong(hdr, dpi);
+        putLong(hdr, 1);
+
+        Q_ASSERT((quint32)hdr.size() == dataOffset);
+        if (theFile.write(hdr) != hdr.size())
+            return setError(theFile.errorString());
+    }
+    return true;
+}
+
+bool StreamingImageWriter::writePngChunk(const char* type, const QByteArray& data)
+{
+    QByteArray chunk;
+    chunk.reserve(data.size() + 12);
+    putBigLong(chunk, data.size());
+    chunk.append(type, 4);
+    chunk.append(data);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef*)chunk.constData() + 4, data.size() + 4);
+    putBigLong(chunk, crc);
+    if (theFile.write(chunk) != chunk.size())
+        return setError(theFile.errorString());
+    return true;
+}
+
+bool StreamingImageWriter::flushDeflate(bool finish)
+{
+    z_stream& zs = p->Stream;
+    for (;;) {
+        int ret = deflate(&zs, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR)
+            return setError("zlib error");
+
+        bool done = finish ? (ret == Z_STREAM_END) : (zs.avail_in == 0 && zs.avail_out != 0);
+        if (zs.avail_out == 0 || (finish && done)) {
+            int len = DEFLATE_CHUNK - zs.avail_out;
+            if (len && !writePngChunk("IDAT", QByteArray::fromRawData(p->Out.constData(), len)))
+                return false;
+            zs.next_out = (Bytef*)p->Out.data();
+            zs.avail_out = DEFLATE_CHUNK;
+        }
+        if (done)
+            return true;
+    }
+}
+
+bool StreamingImageWriter::writeRows(const QImage& band)
+{
+    if (!theFile.isOpen())
+        return setError("Image not open");
+    if (band.width() != theSize.width())
+        return setError("Band width does not match the image");
+
+    QImage rgb = band.format() == QImage::Format_RGB32 ? band : band.convertToFormat(QImage::Format_RGB32);
+    int rows = qMin(rgb.height(), theSize.height() - theRow);
+    const int w = theSize.width();
+
+    for (int y=0; y<rows; ++y) {
+        const QRgb* src = (const QRgb*)rgb.constScanLine(y);
+        uchar* line = (uchar*)theLine.data();
+        if (isPng) {
+            /* Filter type Up: difference with the row above, cheap and good on maps */
+            const uchar* prev = (const uchar*)thePreviousLine.constData() + 1;
+            *line++ = 2;
+            for (int x=0; x<w; ++x) {
+                uchar r = qRed(src[x]), g = qGreen(src[x]), b = qBlue(src[x]);
+                uchar* raw = (uchar*)thePreviousLine.data() + 1 + x*3;
+                line[0] = r - prev[0];
+                line[1] = g - prev[1];
+                line[2] = b - prev[2];
+                raw[0] = r;
+                raw[1] = g;
+                raw[2] = b;
+                line += 3;
+                prev += 3;
+            }
+            p->Stream.next_in = (Bytef*)theLine.data();
+            p->Stream.avail_in = theLine.size();
+            if (!flushDeflate(false))
+                return false;
+        } else {
+            for (int x=0; x<w; ++x) {
+                *line++ = qRed(src[x]);
+                *line++ = qGreen(src[x]);
+                *line++ = qBlue(src[x]);
+            }
+            if (theFile.write(theLine) != theLine.size())
+                return setError(theFile.errorString());
+        }
+        ++theRow;
+    }
+    return true;
+}
+
+bool StreamingImageWriter::close()
+{
+    if (!theFile.isOpen())
+        return theError.isEmpty();
+
+    bool ok = theError.isEmpty();
+    if (ok && theRow != theSize.height())
+        ok = setError(QString("Only %1 of %2 rows written").arg(theRow).arg(theSize.height()));
+    if (ok && isPng) {
+        p->Stream.next_in = Z_NULL;
+        p->Stream.avail_in = 0;
+        ok = flushDeflate(true) && writePngChunk("IEND", QByteArray());
+    }
+    if (p->Initialized) {
+        deflateEnd(&p->Stream);
+        p->Initialized = false;
+    }
+    theFile.close();
+    if (ok && theFile.error() != QFile::NoError)
+        ok = setError(theFile.errorString());
+    if (!ok)
+        theFile.remove();
+    return ok;
+}
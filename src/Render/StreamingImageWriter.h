@@ -0,0 +1,55 @@
+//
+// C++ Interface: StreamingImageWriter
+//
+// Description: Writes PNG or TIFF files row by row, so that images much larger
+//              than the available memory can be exported.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#ifndef STREAMINGIMAGEWRITER_H
+#define STREAMINGIMAGEWRITER_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QImage>
+#include <QSize>
+#include <QString>
+
+class StreamingImageWriterPrivate;
+
+class StreamingImageWriter
+{
+public:
+    StreamingImageWriter();
+    ~StreamingImageWriter();
+
+    /* True if the file name has a suffix handled here (png, tif, tiff) */
+    static bool canWrite(const QString& fileName);
+
+    /* Writes the header of a size image. The format is chosen from the suffix. */
+    bool open(const QString& fileName, const QSize& size, int dpi);
+    /* Appends the rows of band (same width, opaque; alpha is dropped) */
+    bool writeRows(const QImage& band);
+    /* Finishes the file. Fails if fewer rows than announced were written. */
+    bool close();
+
+    QString errorString() const { return theError; }
+
+private:
+    bool writePngChunk(const char* type, const QByteArray& data);
+    bool flushDeflate(bool finish);
+    bool setError(const QString& error);
+
+    StreamingImageWriterPrivate* p;
+    QFile theFile;
+    QString theError;
+    QSize theSize;
+    int theRow;
+    bool isPng;
+    QByteArray theLine;
+    QByteArray thePreviousLine;
+};
+
+#endif // STREAMINGIMAGEWRITER_H
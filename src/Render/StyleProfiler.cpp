@@ -0,0 +1,164 @@
+//
+// C++ Implementation: StyleProfiler
+//
+// Description: Per painter match and draw statistics.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#include "StyleProfiler.h"
+
+#include "FeaturePainter.h"
+
+#include <QFile>
+#include <QTextStream>
+
+#include <algorithm>
+
+/* Records kept by a thread before it merges them anyway */
+#define FLUSH_RECORDS 4096
+
+PainterStatistics::PainterStatistics()
+    : matches(0)
+{
+    for (int i=0; i<StageCount; ++i) {
+        counts[i] = 0;
+        nsecs[i] = 0;
+    }
+}
+
+qint64 PainterStatistics::totalNsecs() const
+{
+    qint64 total = 0;
+    for (int i=0; i<StageCount; ++i)
+        total += nsecs[i];
+    return total;
+}
+
+void PainterStatistics::add(const PainterStatistics& other)
+{
+    for (int i=0; i<StageCount; ++i) {
+        counts[i] += other.counts[i];
+        nsecs[i] += other.nsecs[i];
+    }
+    matches += other.matches;
+}
+
+const char* PainterStatistics::stageName(int aStage)
+{
+    switch (aStage) {
+    case Match:         return "match";
+    case Background:    return "background";
+    case Foreground:    return "foreground";
+    case Touchup:       return "touchup";
+    case Label:         return "label";
+    }
+    return "";
+}
+
+static bool byTotalTime(const PainterStatistics& a, const PainterStatistics& b)
+{
+    return a.totalNsecs() > b.totalNsecs();
+}
+
+/*********************/
+
+StyleProfiler::StyleProfiler()
+    : theEnabled(0)
+{
+}
+
+StyleProfiler* StyleProfiler::instance()
+{
+    /* Used from the render threads: rely on thread-safe static initialization */
+    static StyleProfiler theInstance;
+    return &theInstance;
+}
+
+void StyleProfiler::setEnabled(bool enabled)
+{
+    theEnabled.store(enabled ? 1 : 0);
+}
+
+void StyleProfiler::record(const FeaturePainter* aPainter, int aStage, qint64 nsecs, bool matched)
+{
+    Buffer& B = theBuffers.localData();
+    PainterKey key(aPainter->userName(), aPainter->zoomBoundaries());
+    PainterStatistics& S = B[key];
+    if (S.painter.isEmpty())
+        S.painter = QString("%1 [%2-%3]").arg(key.first).arg(key.second.first).arg(key.second.second);
+    S.counts[aStage]++;
+    S.nsecs[aStage] += nsecs;
+    if (matched)
+        S.matches++;
+
+    /* Threads that never reach a flush() still report, with some delay */
+    if (S.counts[aStage] % FLUSH_RECORDS == 0)
+        flush();
+}
+
+void StyleProfiler::flush()
+{
+    if (!theBuffers.hasLocalData())
+        return;
+    Buffer& B = theBuffers.localData();
+    if (B.isEmpty())
+        return;
+
+    QMutexLocker lock(&theMutex);
+    Buffer::const_iterator it;
+    for (it = B.constBegin(); it != B.constEnd(); ++it) {
+        PainterStatistics& S = theResults[it.value().painter];
+        S.painter = it.value().painter;
+        S.add(it.value());
+    }
+    B.clear();
+}
+
+void StyleProfiler::clear()
+{
+    QMutexLocker lock(&theMutex);
+    theResults.clear();
+}
+
+QList<PainterStatistics> StyleProfiler::results() const
+{
+    QMutexLocker lock(&theMutex);
+    QList<PainterStatistics> theList = theResults.values();
+    std::sort(theList.begin(), theList.end(), byTotalTime);
+    return theList;
+}
+
+bool StyleProfiler::exportCsv(const QString& fileName, QString* error) const
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+        if (error)
+            *error = f.errorString();
+        return false;
+    }
+
+    QTextStream out(&f);
+    out << "painter,matches";
+    for (int i=0; i<PainterStatistics::StageCount; ++i)
+        out << "," << PainterStatistics::stageName(i) << "_count," << PainterStatistics::stageName(i) << "_ms";
+    out << ",total_ms\n";
+
+    foreach (const PainterStatistics& s, results()) {
+        QString name = s.painter;
+        name.replace('"', "\"\"");
+        out << "\"" << name << "\"," << s.matches;
+        for (int i=0; i<PainterStatistics::StageCount; ++i)
+            out << "," << s.counts[i] << "," << QString::number(s.nsecs[i] / 1e6, 'f', 3);
+        out << "," << QString::number(s.totalNsecs() / 1e6, 'f', 3) << "\n";
+    }
+
+    out.flush();
+    if (f.error() != QFile::NoError) {
+        if (error)
+            *error = f.errorString();
+        return false;
+    }
+    return true;
+}
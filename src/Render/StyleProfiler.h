@@ -0,0 +1,114 @@
+//
+// C++ Interface: StyleProfiler
+//
+// Description: Per painter match and draw counts and timings, to find the
+//              rules of a style that cost the most on real data.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#ifndef STYLEPROFILER_H
+#define STYLEPROFILER_H
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QPair>
+#include <QString>
+#include <QThreadStorage>
+
+#define M_STYLEPROFILER StyleProfiler::instance()
+
+class FeaturePainter;
+
+struct PainterStatistics
+{
+    enum Stage {
+        Match,          /* FeaturePainter::matchesTag */
+        Background,
+        Foreground,
+        Touchup,
+        Label,
+        StageCount
+    };
+
+    PainterStatistics();
+
+    QString painter;    /* Selector and zoom range of the painter */
+    qint64 counts[StageCount];
+    qint64 nsecs[StageCount];
+    qint64 matches;     /* Calls to matchesTag that selected the feature */
+
+    qint64 totalNsecs() const;
+    void add(const PainterStatistics& other);
+    static const char* stageName(int aStage);
+};
+
+/**
+ * Accumulates PainterStatistics while enabled. The render and matching
+ * threads record into a buffer of their own, merged at the end of each tile
+ * and of each feature match, so that the painters are not serialized on a
+ * lock. Painters are told apart by their selector and zoom range, which
+ * survive a change of the painter table.
+ */
+class StyleProfiler
+{
+public:
+    static StyleProfiler* instance();
+
+    void setEnabled(bool enabled);
+    bool isEnabled() const { return theEnabled.load(); }
+
+    void record(const FeaturePainter* aPainter, int aStage, qint64 nsecs, bool matched = false);
+    /* Merges the buffer of the calling thread */
+    void flush();
+    void clear();
+
+    /* By decreasing total time */
+    QList<PainterStatistics> results() const;
+    bool exportCsv(const QString& fileName, QString* error = 0) const;
+
+    /* Times its scope for a painter (if not null), if the profiler is enabled */
+    class Scope
+    {
+    public:
+        Scope(const FeaturePainter* aPainter, int aStage)
+            : thePainter(0), theStage(aStage), isMatched(false)
+        {
+            if (M_STYLEPROFILER->isEnabled()) {
+                thePainter = aPainter;
+                theTimer.start();
+            }
+        }
+        ~Scope()
+        {
+            if (thePainter)
+                M_STYLEPROFILER->record(thePainter, theStage, theTimer.nsecsElapsed(), isMatched);
+        }
+        void setMatched(bool b) { isMatched = b; }
+
+    private:
+        const FeaturePainter* thePainter;
+        int theStage;
+        bool isMatched;
+        QElapsedTimer theTimer;
+    };
+
+private:
+    StyleProfiler();
+
+    /* Keyed by selector and zoom range: a painter address may be reused by
+     * the next painter table before the buffer is flushed */
+    typedef QPair<QString, QPair<qreal, qreal> > PainterKey;
+    typedef QHash<PainterKey, PainterStatistics> Buffer;
+
+    QAtomicInt theEnabled;
+    QThreadStorage<Buffer> theBuffers;
+    mutable QMutex theMutex;
+    QHash<QString, PainterStatistics> theResults;
+};
+
+#endif // STYLEPROFILER_H
@@ -0,0 +1,83 @@
+//
+// C++ Implementation: VertexTransform
+//
+// Description: Affine transform of packed projected vertices into per-thread
+//              scratch buffers, used to draw ways without building and
+//              mapping a QPainterPath for every feature.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#include "VertexTransform.h"
+
+#include <QThreadStorage>
+
+/* The vector kernels store straight into QPointF, which needs qreal == double */
+#if !defined(QT_COORD_TYPE)
+#if defined(__AVX__)
+#include <immintrin.h>
+#define VERTEX_TRANSFORM_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VERTEX_TRANSFORM_SSE2
+#endif
+#endif
+
+void transformVertices(const QTransform& t, const double* in, int count, QPointF* out)
+{
+    if (t.type() > QTransform::TxShear) {
+        for (int i=0; i<count; ++i)
+            out[i] = t.map(QPointF(in[2*i], in[2*i+1]));
+        return;
+    }
+
+    /* x' = m11*x + m21*y + dx, y' = m12*x + m22*y + dy */
+    int i = 0;
+#if defined(VERTEX_TRANSFORM_AVX)
+    const __m256d cx = _mm256_setr_pd(t.m11(), t.m12(), t.m11(), t.m12());
+    const __m256d cy = _mm256_setr_pd(t.m21(), t.m22(), t.m21(), t.m22());
+    const __m256d d = _mm256_setr_pd(t.dx(), t.dy(), t.dx(), t.dy());
+    double* o = reinterpret_cast<double*>(out);
+    for (; i+2 <= count; i += 2) {
+        __m256d v = _mm256_loadu_pd(in + 2*i);              // x0 y0 x1 y1
+        __m256d xx = _mm256_permute_pd(v, 0x0);              // x0 x0 x1 x1
+        __m256d yy = _mm256_permute_pd(v, 0xF);              // y0 y0 y1 y1
+        __m256d r = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(xx, cx), _mm256_mul_pd(yy, cy)), d);
+        _mm256_storeu_pd(o + 2*i, r);
+    }
+#endif
+#if defined(VERTEX_TRANSFORM_AVX) || defined(VERTEX_TRANSFORM_SSE2)
+    const __m128d cx2 = _mm_setr_pd(t.m11(), t.m12());
+    const __m128d cy2 = _mm_setr_pd(t.m21(), t.m22());
+    const __m128d d2 = _mm_setr_pd(t.dx(), t.dy());
+    double* o2 = reinterpret_cast<double*>(out);
+    for (; i < count; ++i) {
+        __m128d v = _mm_loadu_pd(in + 2*i);                  // x y
+        __m128d xx = _mm_unpacklo_pd(v, v);                  // x x
+        __m128d yy = _mm_unpackhi_pd(v, v);                  // y y
+        __m128d r = _mm_add_pd(_mm_add_pd(_mm_mul_pd(xx, cx2), _mm_mul_pd(yy, cy2)), d2);
+        _mm_storeu_pd(o2 + 2*i, r);
+    }
+#endif
+    for (; i < count; ++i) {
+        const double x = in[2*i];
+        const double y = in[2*i+1];
+        out[i] = QPointF(t.m11()*x + t.m21()*y + t.dx(), t.m12()*x + t.m22()*y + t.dy());
+    }
+}
+
+const QPointF* transformToScratch(const QTransform& t, const QVector<double>& vertices, int* count)
+{
+    static QThreadStorage<QVector<QPointF> > scratch;
+
+    int n = vertices.size() / 2;
+    QVector<QPointF>& buf = scratch.localData();
+    /* Only grows: a tile worker keeps its buffer for the next features */
+    if (buf.size() < n)
+        buf.resize(n);
+    transformVertices(t, vertices.constData(), n, buf.data());
+
+    *count = n;
+    return buf.constData();
+}
@@ -0,0 +1,27 @@
+//
+// C++ Interface: VertexTransform
+//
+// Description: Affine transform of packed projected vertices into per-thread
+//              scratch buffers, used to draw ways without building and
+//              mapping a QPainterPath for every feature.
+//
+//
+// Copyright: See COPYING file that comes with this distribution
+//
+//
+#ifndef VERTEXTRANSFORM_H
+#define VERTEXTRANSFORM_H
+
+#include <QPointF>
+#include <QTransform>
+#include <QVector>
+
+/* Maps count (x, y) pairs packed in "in" through t into "out". Uses SSE2 or
+ * AVX when available and t is affine. */
+void transformVertices(const QTransform& t, const double* in, int count, QPointF* out);
+
+/* Transforms the packed vertices into a buffer owned by the calling thread.
+ * The result stays valid until the next call from the same thread. */
+const QPointF* transformToScratch(const QTransform& t, const QVector<double>& vertices, int* count);
+
+#endif // VERTEXTRANSFORM_H
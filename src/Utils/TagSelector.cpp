@@ -1,6 +1,7 @@
 #include "TagSelector.h"
 
 #include "IFeature.h"
+#include "Global.h"
 
 void skipWhite(const QString& Expression, int& idx)
 {
@@ -331,18 +332,232 @@ TagSelector* parseTagSelector(const QString& Expression, int& idx)
 TagSelector* TagSelector::parse(const QString& Expression)
 {
     int idx = 0;
-    return parseTagSelector(Expression,idx);
+    TagSelector* Root = parseTagSelector(Expression,idx);
+    return Root ? new TagSelectorCompiled(Root) : 0;
 }
 
 TagSelector* TagSelector::parse(const QString& Expression, int& idx)
 {
-    return parseTagSelector(Expression,idx);
+    TagSelector* Root = parseTagSelector(Expression,idx);
+    return Root ? new TagSelectorCompiled(Root) : 0;
 }
 
 TagSelector::~TagSelector()
 {
 }
 
+bool TagSelector::requiredTags(QList<QPair<QString, QString> >& /* Tags */) const
+{
+    return false;
+}
+
+void TagSelector::compile(TagSelectorProgram& P) const
+{
+    P.emitTree(this);
+}
+
+static const QString emptyString("__EMPTY__");
+
+/* TAGSELECTORPROGRAM */
+
+int TagSelectorProgram::emit(Opcode Op, quint16 Arg, quint32 Key, quint32 Value)
+{
+    Instr I;
+    I.Op = Op;
+    I.Arg = Arg;
+    I.Key = Key;
+    I.Value = Value;
+    Code.append(I);
+    return Code.size()-1;
+}
+
+void TagSelectorProgram::emitTree(const TagSelector* Leaf)
+{
+    Leaves.append(Leaf);
+    emit(Op_Tree, Leaves.size()-1);
+}
+
+void TagSelectorProgram::patch(int At, int Target)
+{
+    Code[At].Arg = Target;
+}
+
+int TagSelectorProgram::addGlob(const QString& Pattern)
+{
+    Globs.append(Pattern.toCaseFolded());
+    return Globs.size()-1;
+}
+
+int TagSelectorProgram::addSet(const ValueSet& Set)
+{
+    Sets.append(Set);
+    return Sets.size()-1;
+}
+
+bool TagSelectorProgram::isSimpleGlob(const QString& Pattern)
+{
+    return !Pattern.contains('[') && !Pattern.contains(']') && !Pattern.contains('\\');
+}
+
+/* Greedy wildcard matching, backtracking only to the last '*': linear in
+ * practice, where QRegExp builds and runs an automaton for every call. */
+bool TagSelectorProgram::globMatch(const QString& Folded, const QString& Pattern)
+{
+    const QChar* s = Folded.constData();
+    const QChar* p = Pattern.constData();
+    const int n = Folded.size();
+    const int m = Pattern.size();
+    int i = 0, j = 0, star = -1, mark = 0;
+    while (i < n) {
+        if (j < m && (p[j] == QLatin1Char('?') || p[j] == s[i])) {
+            ++i;
+            ++j;
+        } else if (j < m && p[j] == QLatin1Char('*')) {
+            star = j++;
+            mark = i;
+        } else if (star >= 0) {
+            j = star + 1;
+            i = ++mark;
+        } else
+            return false;
+    }
+    while (j < m && p[j] == QLatin1Char('*'))
+        ++j;
+    return j == m;
+}
+
+static int findTagId(const IFeature* F, quint32 Key)
+{
+    for (int i=0; i<F->tagSize(); ++i)
+        if (F->tagKeyId(i) == Key)
+            return i;
+    return -1;
+}
+
+TagSelectorMatchResult TagSelectorProgram::run(const IFeature* F, qreal PixelPerM) const
+{
+    TagSelectorMatchResult r = TagSelect_NoMatch;
+    const Instr* I = Code.constData();
+    const int n = Code.size();
+    for (int pc=0; pc<n; ++pc) {
+        switch (I[pc].Op) {
+        case Op_True:
+            r = TagSelect_Match;
+            break;
+        case Op_False:
+            r = TagSelect_NoMatch;
+            break;
+        case Op_Equals:
+        case Op_NotEquals: {
+            int t = findTagId(F, I[pc].Key);
+            if (t < 0)
+                r = TagSelect_NoMatch;
+            else if ((g_getTagValueFold(F->tagValueId(t)) == I[pc].Value) == (I[pc].Op == Op_Equals))
+                r = TagSelect_Match;
+            else
+                r = TagSelect_NoMatch;
+            break;
+        }
+        case Op_Glob:
+        case Op_NotGlob: {
+            int t = findTagId(F, I[pc].Key);
+            if (t < 0)
+                r = TagSelect_NoMatch;
+            else if (globMatch(g_getTagFold(g_getTagValueFold(F->tagValueId(t))), Globs.at(I[pc].Arg)) == (I[pc].Op == Op_Glob))
+                r = TagSelect_Match;
+            else
+                r = TagSelect_NoMatch;
+            break;
+        }
+        case Op_OneOf: {
+            const ValueSet& Set = Sets.at(I[pc].Arg);
+            int t = findTagId(F, I[pc].Key);
+            r = TagSelect_NoMatch;
+            if (t < 0) {
+                if (Set.MatchesMissing)
+                    r = TagSelect_Match;
+                break;
+            }
+            quint32 v = F->tagValueId(t);
+            quint32 fold = g_getTagValueFold(v);
+            for (int i=0; i<Set.Folds.size(); ++i)
+                if (Set.Folds.at(i) == fold && g_getTagValue(v) == Set.Values.at(i)) {
+                    r = TagSelect_Match;
+                    break;
+                }
+            for (int i=0; r == TagSelect_NoMatch && i<Set.Globs.size(); ++i)
+                if (globMatch(g_getTagFold(fold), Set.Globs.at(i)))
+                    r = TagSelect_Match;
+            break;
+        }
+        case Op_Tree:
+            r = Leaves.at(I[pc].Arg)->matches(F, PixelPerM);
+            break;
+        case Op_JumpIfMatch:
+            if (r == TagSelect_Match)
+                pc = I[pc].Arg - 1;
+            break;
+        case Op_JumpIfNoMatch:
+            if (r == TagSelect_NoMatch)
+                pc = I[pc].Arg - 1;
+            break;
+        case Op_Not:
+            r = (r == TagSelect_Match) ? TagSelect_NoMatch : TagSelect_Match;
+            break;
+        case Op_ToMatch:
+            if (r == TagSelect_DefaultMatch)
+                r = TagSelect_Match;
+            break;
+        case Op_ToBool:
+            if (r == TagSelect_DefaultMatch)
+                r = TagSelect_NoMatch;
+            break;
+        case Op_ToDefault:
+            r = (r == TagSelect_Match) ? TagSelect_DefaultMatch : TagSelect_NoMatch;
+            break;
+        }
+    }
+    return r;
+}
+
+/* TAGSELECTORCOMPILED */
+
+TagSelectorCompiled::TagSelectorCompiled(TagSelector* aRoot)
+    : Root(aRoot)
+{
+    Root->compile(Program);
+}
+
+TagSelectorCompiled::~TagSelectorCompiled()
+{
+    delete Root;
+}
+
+TagSelector* TagSelectorCompiled::copy() const
+{
+    return new TagSelectorCompiled(Root->copy());
+}
+
+TagSelectorMatchResult TagSelectorCompiled::matches(const IFeature* F, qreal PixelPerM) const
+{
+    return Program.run(F, PixelPerM);
+}
+
+QString TagSelectorCompiled::asExpression(bool Precedence) const
+{
+    return Root->asExpression(Precedence);
+}
+
+bool TagSelectorCompiled::requiredTags(QList<QPair<QString, QString> >& Tags) const
+{
+    return Root->requiredTags(Tags);
+}
+
+void TagSelectorCompiled::compile(TagSelectorProgram& P) const
+{
+    Root->compile(P);
+}
+
 
 /* TAGSELECTOROPERATOR */
 
@@ -416,8 +631,6 @@ TagSelector* TagSelectorOperator::copy() const
     return new TagSelectorOperator(Key,Oper,Value);
 }
 
-static const QString emptyString("__EMPTY__");
-
 TagSelectorMatchResult TagSelectorOperator::evaluateVal(const QString& val) const
 {
     if (val == emptyString && specialValue != TagSelectValue_Empty)
@@ -776,6 +989,38 @@ QString TagSelectorOperator::asExpression(bool) const
     return "[" + Key + "]" + Oper + Value;
 }
 
+void TagSelectorOperator::compile(TagSelectorProgram& P) const
+{
+    if (specialKey != TagSelectKey_None || specialValue != TagSelectValue_None || Key == "*")
+        return P.emitTree(this);
+
+    /* Same precedence as evaluateVal */
+    if (UseSimpleRegExp) {
+        if (!TagSelectorProgram::isSimpleGlob(Value))
+            return P.emitTree(this);
+        P.emit(theOp == EQ ? TagSelectorProgram::Op_Glob : TagSelectorProgram::Op_NotGlob,
+               P.addGlob(Value), g_addTagKey(Key));
+    } else if (UseFullRegExp || boolVal || okval || (theOp != EQ && theOp != NE)) {
+        P.emitTree(this);
+    } else {
+        P.emit(theOp == EQ ? TagSelectorProgram::Op_Equals : TagSelectorProgram::Op_NotEquals,
+               0, g_addTagKey(Key), g_foldTagValue(Value));
+    }
+}
+
+bool TagSelectorOperator::requiredTags(QList<QPair<QString, QString> >& Tags) const
+{
+    /* A missing tag never matches, except against _NULL_ */
+    if (specialKey != TagSelectKey_None || specialValue != TagSelectValue_None || Key == "*")
+        return false;
+    /* Only plain text equality pins the value; numbers compare as numbers */
+    if (theOp == EQ && !UseSimpleRegExp && !UseFullRegExp && !boolVal && !okval)
+        Tags << qMakePair(Key, Value.toLower());
+    else
+        Tags << qMakePair(Key, QString());
+    return true;
+}
+
 /* TAGSELECTORISONEOF */
 
 TagSelectorIsOneOf::TagSelectorIsOneOf(const QString& key, const QStringList& values)
@@ -872,6 +1117,41 @@ QString TagSelectorIsOneOf::asExpression(bool) const
     return "[" + Key + "] isoneof (" + Values.join(" , ") + ")";
 }
 
+void TagSelectorIsOneOf::compile(TagSelectorProgram& P) const
+{
+    if (specialKey != TagSelectKey_None || specialValue != TagSelectValue_None)
+        return P.emitTree(this);
+
+    TagSelectorProgram::ValueSet Set;
+    foreach (QString Value, exactMatchv) {
+        Set.Folds.append(g_foldTagValue(Value));
+        Set.Values.append(Value);
+    }
+    for (int i=0; i<Values.size(); ++i) {
+        if (!Values[i].contains(QRegExp("[][*?]")))
+            continue;
+        if (!TagSelectorProgram::isSimpleGlob(Values[i]))
+            return P.emitTree(this);
+        Set.Globs.append(Values[i].toCaseFolded());
+    }
+    /* A missing tag is matched as the value __EMPTY__ */
+    Set.MatchesMissing = false;
+    for (int i=0; i<Set.Globs.size(); ++i)
+        if (TagSelectorProgram::globMatch(emptyString.toCaseFolded(), Set.Globs[i]))
+            Set.MatchesMissing = true;
+    P.emit(TagSelectorProgram::Op_OneOf, P.addSet(Set), g_addTagKey(Key));
+}
+
+bool TagSelectorIsOneOf::requiredTags(QList<QPair<QString, QString> >& Tags) const
+{
+    /* Wildcards may match the placeholder of a missing tag */
+    if (specialKey != TagSelectKey_None || specialValue != TagSelectValue_None || !rxv.isEmpty())
+        return false;
+    foreach (QString Value, exactMatchv)
+        Tags << qMakePair(Key, Value.toLower());
+    return true;
+}
+
 /* TAGSELECTORTYPEIS */
 
 TagSelectorTypeIs::TagSelectorTypeIs(const QString& type)
@@ -977,6 +1257,29 @@ QString TagSelectorOr::asExpression(bool Precedence) const
     return R;
 }
 
+void TagSelectorOr::compile(TagSelectorProgram& P) const
+{
+    QList<int> Jumps;
+    for (int i=0; i<Terms.size(); ++i) {
+        Terms[i]->compile(P);
+        if (i < Terms.size()-1)
+            Jumps << P.emit(TagSelectorProgram::Op_JumpIfMatch);
+    }
+    int End = P.emit(TagSelectorProgram::Op_ToBool);
+    foreach (int j, Jumps)
+        P.patch(j, End);
+}
+
+bool TagSelectorOr::requiredTags(QList<QPair<QString, QString> >& Tags) const
+{
+    QList<QPair<QString, QString> > All;
+    for (int i=0; i<Terms.size(); ++i)
+        if (!Terms[i]->requiredTags(All))
+            return false;
+    Tags += All;
+    return true;
+}
+
 
 /* TAGSELECTORAND */
 
@@ -1018,6 +1321,46 @@ QString TagSelectorAnd::asExpression(bool /* Precedence */) const
     return R;
 }
 
+void TagSelectorAnd::compile(TagSelectorProgram& P) const
+{
+    if (Terms.isEmpty())
+        P.emit(TagSelectorProgram::Op_True);
+    QList<int> Jumps;
+    for (int i=0; i<Terms.size(); ++i) {
+        Terms[i]->compile(P);
+        if (i < Terms.size()-1)
+            Jumps << P.emit(TagSelectorProgram::Op_JumpIfNoMatch);
+    }
+    int End = P.emit(TagSelectorProgram::Op_ToMatch);
+    foreach (int j, Jumps)
+        P.patch(j, End);
+}
+
+bool TagSelectorAnd::requiredTags(QList<QPair<QString, QString> >& Tags) const
+{
+    /* Any term will do; prefer one with values, which selects fewer features */
+    QList<QPair<QString, QString> > Best;
+    bool found = false;
+    for (int i=0; i<Terms.size(); ++i) {
+        QList<QPair<QString, QString> > Term;
+        if (!Terms[i]->requiredTags(Term))
+            continue;
+        bool hasValues = true;
+        for (int j=0; j<Term.size(); ++j)
+            if (Term[j].second.isEmpty())
+                hasValues = false;
+        if (!found || hasValues) {
+            Best = Term;
+            found = true;
+        }
+        if (hasValues)
+            break;
+    }
+    if (found)
+        Tags += Best;
+    return found;
+}
+
 /* TAGSELECTORNOT */
 
 TagSelectorNot::TagSelectorNot(TagSelector* term)
@@ -1051,6 +1394,16 @@ QString TagSelectorNot::asExpression(bool /* Precedence */) const
     return "not(" + Term->asExpression(true) + ")";
 }
 
+void TagSelectorNot::compile(TagSelectorProgram& P) const
+{
+    if (!Term) {
+        P.emit(TagSelectorProgram::Op_False);
+        return;
+    }
+    Term->compile(P);
+    P.emit(TagSelectorProgram::Op_Not);
+}
+
 /* TAGSELECTORPARENT */
 
 TagSelectorParent::TagSelectorParent(TagSelector* term)
@@ -1113,6 +1466,11 @@ QString TagSelectorFalse::asExpression(bool /* Precedence */) const
     return " false ";
 }
 
+void TagSelectorFalse::compile(TagSelectorProgram& P) const
+{
+    P.emit(TagSelectorProgram::Op_False);
+}
+
 /* TAGSELECTORTRUE */
 
 TagSelectorTrue::TagSelectorTrue()
@@ -1134,6 +1492,11 @@ QString TagSelectorTrue::asExpression(bool /* Precedence */) const
     return " true ";
 }
 
+void TagSelectorTrue::compile(TagSelectorProgram& P) const
+{
+    P.emit(TagSelectorProgram::Op_True);
+}
+
 /* TAGSELECTORDEFAULT */
 
 TagSelectorDefault::TagSelectorDefault(TagSelector* term)
@@ -1165,3 +1528,14 @@ QString TagSelectorDefault::asExpression(bool /* Precedence */) const
     return " [Default] " + Term->asExpression(true);
 }
 
+bool TagSelectorDefault::requiredTags(QList<QPair<QString, QString> >& Tags) const
+{
+    return Term->requiredTags(Tags);
+}
+
+void TagSelectorDefault::compile(TagSelectorProgram& P) const
+{
+    Term->compile(P);
+    P.emit(TagSelectorProgram::Op_ToDefault);
+}
+
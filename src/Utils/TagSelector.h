@@ -6,7 +6,9 @@ class IFeature;
 #include <QtCore/QString>
 #include <QRegExp>
 #include <QList>
+#include <QPair>
 #include <QStringList>
+#include <QVector>
 
 #include <QDateTime>
 
@@ -33,6 +35,70 @@ enum TagSelectorSpecialValue {
     TagSelectValue_Empty
 };
 
+class TagSelector;
+
+/* Compiled form of a selector: a flat list of instructions over the interned
+ * tag key ids and case folded value ids (see Global.h), run without walking
+ * the tree. Terms that are rare in styles and filters (special keys, full
+ * regular expressions, numeric comparisons, types, parents) are left to the
+ * matches() of their tree node. */
+class TagSelectorProgram
+{
+    public:
+        enum Opcode {
+            Op_True,
+            Op_False,
+            Op_Equals,          /* tag Key has a value folding to Value */
+            Op_NotEquals,       /* tag Key has a value not folding to Value */
+            Op_Glob,            /* tag Key has a value matching Globs[Arg] */
+            Op_NotGlob,         /* tag Key has a value not matching Globs[Arg] */
+            Op_OneOf,           /* tag Key has one of the values of Sets[Arg] */
+            Op_Tree,            /* result of Leaves[Arg]->matches() */
+            Op_JumpIfMatch,     /* jumps to Arg */
+            Op_JumpIfNoMatch,
+            Op_Not,
+            Op_ToMatch,         /* end of 'and': default matches count as matches */
+            Op_ToBool,          /* end of 'or': default matches do not */
+            Op_ToDefault
+        };
+
+        struct Instr
+        {
+            quint16 Op;
+            quint16 Arg;
+            quint32 Key;
+            quint32 Value;
+        };
+
+        struct ValueSet
+        {
+            QVector<quint32> Folds;
+            QStringList Values;     /* compared case sensitively, as isoneof does */
+            QStringList Globs;      /* case folded */
+            bool MatchesMissing;
+        };
+
+        int emit(Opcode Op, quint16 Arg = 0, quint32 Key = 0, quint32 Value = 0);
+        void emitTree(const TagSelector* Leaf);
+        void patch(int At, int Target);
+        int size() const { return Code.size(); }
+
+        int addGlob(const QString& Pattern);
+        int addSet(const ValueSet& Set);
+
+        TagSelectorMatchResult run(const IFeature* F, qreal PixelPerM) const;
+
+        /* True if Pattern only uses the * and ? wildcards */
+        static bool isSimpleGlob(const QString& Pattern);
+        static bool globMatch(const QString& Folded, const QString& Pattern);
+
+    private:
+        QVector<Instr> Code;
+        QStringList Globs;
+        QVector<ValueSet> Sets;
+        QVector<const TagSelector*> Leaves;
+};
+
 class TagSelector
 {
     public:
@@ -41,7 +107,14 @@ class TagSelector
         virtual TagSelector* copy() const = 0;
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const = 0;
         virtual QString asExpression(bool Precedence) const = 0;
-
+        /* Appends the tags of which a feature needs at least one to match
+         * (or default match); an empty value stands for any value, values are
+         * lower case. Returns false if no tag is needed. */
+        virtual bool requiredTags(QList<QPair<QString, QString> >& Tags) const;
+        /* Appends the instructions evaluating this selector to P */
+        virtual void compile(TagSelectorProgram& P) const;
+
+        /* The returned selectors are compiled (see TagSelectorCompiled) */
         static TagSelector* parse(const QString& Expression);
         static TagSelector* parse(const QString& Expression, int& idx);
 };
@@ -62,6 +135,8 @@ class TagSelectorOperator : public TagSelector
         virtual TagSelector* copy() const;
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const;
         virtual QString asExpression(bool Precedence) const;
+        virtual bool requiredTags(QList<QPair<QString, QString> >& Tags) const;
+        virtual void compile(TagSelectorProgram& P) const;
 
     private:
         TagSelectorMatchResult evaluateVal(const QString& val) const;
@@ -88,6 +163,8 @@ class TagSelectorIsOneOf : public TagSelector
         virtual TagSelector* copy() const;
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const;
         virtual QString asExpression(bool Precedence) const;
+        virtual bool requiredTags(QList<QPair<QString, QString> >& Tags) const;
+        virtual void compile(TagSelectorProgram& P) const;
 
     private:
         QList<QRegExp> rxv;
@@ -133,6 +210,8 @@ class TagSelectorOr : public TagSelector
         virtual TagSelector* copy() const;
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const;
         virtual QString asExpression(bool Precedence) const;
+        virtual bool requiredTags(QList<QPair<QString, QString> >& Tags) const;
+        virtual void compile(TagSelectorProgram& P) const;
 
     private:
         QList<TagSelector*> Terms;
@@ -147,6 +226,8 @@ class TagSelectorAnd : public TagSelector
         virtual TagSelector* copy() const;
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const;
         virtual QString asExpression(bool Precedence) const;
+        virtual bool requiredTags(QList<QPair<QString, QString> >& Tags) const;
+        virtual void compile(TagSelectorProgram& P) const;
 
     private:
         QList<TagSelector*> Terms;
@@ -161,6 +242,7 @@ class TagSelectorNot : public TagSelector
         virtual TagSelector* copy() const;
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const;
         virtual QString asExpression(bool Precedence) const;
+        virtual void compile(TagSelectorProgram& P) const;
 
     private:
         TagSelector* Term;
@@ -188,6 +270,7 @@ class TagSelectorFalse : public TagSelector
         virtual TagSelector* copy() const;
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const;
         virtual QString asExpression(bool Precedence) const;
+        virtual void compile(TagSelectorProgram& P) const;
 };
 
 class TagSelectorTrue : public TagSelector
@@ -198,6 +281,7 @@ class TagSelectorTrue : public TagSelector
         virtual TagSelector* copy() const;
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const;
         virtual QString asExpression(bool Precedence) const;
+        virtual void compile(TagSelectorProgram& P) const;
 };
 
 class TagSelectorDefault : public TagSelector
@@ -209,10 +293,29 @@ class TagSelectorDefault : public TagSelector
         virtual TagSelector* copy() const;
         virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const;
         virtual QString asExpression(bool Precedence) const;
+        virtual bool requiredTags(QList<QPair<QString, QString> >& Tags) const;
+        virtual void compile(TagSelectorProgram& P) const;
 
     private:
         TagSelector* Term;
 };
 
+/* The root of a parsed selector with its compiled program, used by matches() */
+class TagSelectorCompiled : public TagSelector
+{
+    public:
+        TagSelectorCompiled(TagSelector* aRoot);
+        virtual ~TagSelectorCompiled();
+
+        virtual TagSelector* copy() const;
+        virtual TagSelectorMatchResult matches(const IFeature* F, qreal PixelPerM) const;
+        virtual QString asExpression(bool Precedence) const;
+        virtual bool requiredTags(QList<QPair<QString, QString> >& Tags) const;
+        virtual void compile(TagSelectorProgram& P) const;
+
+    private:
+        TagSelector* Root;
+        TagSelectorProgram Program;
+};
 
 #endif
@@ -16,12 +16,14 @@
 #endif
 
 #include "MainWindow.h"
+#include "PropertiesDock.h"
 #include "MerkaartorPreferences.h"
 #include "LayerWidget.h"
 
 #include "TagSelector.h"
 #include "IPaintStyle.h"
 #include "FeaturePainter.h"
+#include "PainterIndex.h"
 
 #include "LayerIterator.h"
 #include "IMapAdapter.h"
@@ -37,9 +39,31 @@
 #include <QMenu>
 #include <QSet>
 #include <QReadWriteLock>
+#include <QFuture>
+#include <QFutureWatcher>
+#include <QThreadPool>
+#include <QXmlStreamWriter>
+#include <QtConcurrentMap>
+#include <QtConcurrentRun>
 
 /* MAPDOCUMENT */
 
+/* A feature and its painters in the table being applied */
+struct PainterUpdate
+{
+    Feature* F;
+    const PainterTable* Table;
+    int Revision;
+    QList<const FeaturePainter*> Painters;
+};
+
+/* Runs on the thread pool, while the features keep the current painters */
+static void evaluatePainters(PainterUpdate& U)
+{
+    U.Revision = U.F->painterRevision();
+    U.F->findPainters(U.Table, U.Painters);
+}
+
 class MapDocumentPrivate
 {
 public:
@@ -52,11 +76,14 @@ public:
         , lastDownloadLayer(0)
         , tagFilter(0), FilterRevision(0)
         , layerNum(0)
+        , thePainters(new PainterTable), theNextPainters(0), PaintersDelayDeletes(false)
         , theFeaturePaintersLock( QReadWriteLock::Recursive )
     {
     };
     ~MapDocumentPrivate()
     {
+        delete thePainters;
+        delete theNextPainters;
         History->cleanup();
         delete History;
         for (int i=0; i<Layers.size(); ++i) {
@@ -80,7 +107,13 @@ public:
     int layerNum;
     mutable QString Id;
 
-    QList<FeaturePainter> theFeaturePainters;
+    PainterTable* thePainters;
+    /* The table being applied in the background, and the painters found for
+     * each feature; swapped in by applyNextPainters() */
+    PainterTable* theNextPainters;
+    QVector<PainterUpdate> PaintersUpdate;
+    QFutureWatcher<void> PaintersWatcher;
+    bool PaintersDelayDeletes;
     QReadWriteLock theFeaturePaintersLock;
 };
 
@@ -90,9 +123,7 @@ Document::Document()
     setFilterType(M_PREFS->getCurrentFilter());
     p->title = tr("untitled");
 
-    for (int i=0; i<M_STYLE->painterSize(); ++i) {
-        p->theFeaturePainters.append(FeaturePainter(*M_STYLE->getPainter(i)));
-    }
+    initPainters();
 }
 
 Document::Document(LayerDock* aDock)
@@ -102,19 +133,22 @@ Document::Document(LayerDock* aDock)
     setFilterType(M_PREFS->getCurrentFilter());
     p->title = tr("untitled");
 
-    for (int i=0; i<M_STYLE->painterSize(); ++i) {
-        p->theFeaturePainters.append(FeaturePainter(*M_STYLE->getPainter(i)));
-    }
+    initPainters();
 }
 
-Document::Document(const Document&, LayerDock*)
-: p(0)
+Document::Document(const Document&, LayerDock* aDock)
+    : p(new MapDocumentPrivate)
 {
+    p->theDock = aDock;
+    setFilterType(M_PREFS->getCurrentFilter());
     p->title = tr("untitled");
+
+    initPainters();
 }
 
 Document::~Document()
 {
+    cancelPainters();
     delete p;
 }
 
@@ -125,24 +159,107 @@ const QString& Document::id() const
     return p->Id;
 }
 
-void Document::setPainters(QList<Painter> aPainters)
+void Document::initPainters()
 {
-    lockPaintersForWrite();
-    p->theFeaturePainters.clear();
-    for (int i=0; i<aPainters.size(); ++i) {
-        FeaturePainter fp(aPainters[i]);
-        p->theFeaturePainters.append(fp);
+    p->thePainters->build(M_STYLE->getPainters(), M_STYLE->getStyleSheet());
+    connect(&p->PaintersWatcher, SIGNAL(progressValueChanged(int)), SLOT(on_paintersProgress(int)));
+    connect(&p->PaintersWatcher, SIGNAL(finished()), SLOT(on_paintersEvaluated()));
+}
+
+void Document::setPainters(QList<Painter> aPainters, QSharedPointer<MapCSSStyleSheet> aSheet)
+{
+    cancelPainters();
+
+    p->theNextPainters = new PainterTable;
+    p->theNextPainters->build(aPainters, aSheet);
+    for (FeatureIterator it(this); !it.isEnd(); ++it) {
+        PainterUpdate U;
+        U.F = it.get();
+        U.Table = p->theNextPainters;
+        U.Revision = -1;
+        p->PaintersUpdate.append(U);
     }
-    for (FeatureIterator it(this); !it.isEnd(); ++it)
-    {
-        it.get()->invalidatePainter();
+    if (p->PaintersUpdate.isEmpty()) {
+        applyNextPainters();
+        return;
+    }
+
+    /* The features must outlive the job; they are only read by it */
+    g_backend.delayDeletes();
+    p->PaintersDelayDeletes = true;
+    p->PaintersWatcher.setFuture(QtConcurrent::map(p->PaintersUpdate, evaluatePainters));
+}
+
+void Document::cancelPainters()
+{
+    if (p->PaintersWatcher.isRunning()) {
+        p->PaintersWatcher.cancel();
+        p->PaintersWatcher.waitForFinished();
+    }
+    if (p->PaintersDelayDeletes) {
+        p->PaintersDelayDeletes = false;
+        g_backend.resumeDeletes();
+    }
+    p->PaintersUpdate.clear();
+    delete p->theNextPainters;
+    p->theNextPainters = 0;
+}
+
+void Document::waitForPainters()
+{
+    p->PaintersWatcher.waitForFinished();
+    if (p->theNextPainters)
+        applyNextPainters();
+}
+
+bool Document::isApplyingPainters() const
+{
+    return p->theNextPainters != 0;
+}
+
+void Document::on_paintersProgress(int value)
+{
+    emit paintersProgress(value, p->PaintersWatcher.progressMaximum());
+}
+
+void Document::on_paintersEvaluated()
+{
+    if (p->theNextPainters && !p->PaintersWatcher.isCanceled())
+        applyNextPainters();
+}
+
+void Document::applyNextPainters()
+{
+    /* Waits for the renderers, which hold the painters for read */
+    lockPaintersForWrite();
+    for (int i=0; i<p->PaintersUpdate.size(); ++i) {
+        const PainterUpdate& U = p->PaintersUpdate.at(i);
+        /* Features edited meanwhile are matched again when next drawn */
+        if (U.Revision == U.F->painterRevision())
+            U.F->setPainters(U.Table, U.Painters);
     }
+    /* Features not updated see the generation change and match again */
+    delete p->thePainters;
+    p->thePainters = p->theNextPainters;
+    p->theNextPainters = 0;
     unlockPainters();
+
+    p->PaintersUpdate.clear();
+    if (p->PaintersDelayDeletes) {
+        p->PaintersDelayDeletes = false;
+        g_backend.resumeDeletes();
+    }
+    emit paintersChanged();
+}
+
+const PainterTable* Document::getPainterTable() const
+{
+    return p->thePainters;
 }
 
 int Document::getPaintersSize()
 {
-    return p->theFeaturePainters.size();
+    return p->thePainters->Painters.size();
 }
 
 void Document::unlockPainters() {
@@ -159,7 +276,7 @@ void Document::lockPaintersForWrite() {
 
 const Painter* Document::getPainter(int i)
 {
-    return &p->theFeaturePainters[i];
+    return &p->thePainters->Painters[i];
 }
 
 void Document::addDefaultLayers()
@@ -313,8 +430,10 @@ LayerDock* Document::getLayerDock(void)
 
 void Document::clear()
 {
+    cancelPainters();
     delete p;
     p = new MapDocumentPrivate;
+    initPainters();
     addDefaultLayers();
 }
 
@@ -409,6 +528,9 @@ FilterLayer* Document::addFilterLayer(FilterLayer *aLayer)
 
 void Document::remove(Layer* aLayer)
 {
+    /* The layer may be deleted next, while the painters job reads it */
+    if (isApplyingPainters())
+        waitForPainters();
     QList<Layer*>::iterator i = qFind(p->Layers.begin(),p->Layers.end(), aLayer);
     if (i != p->Layers.end()) {
         p->Layers.erase(i);
@@ -579,6 +701,37 @@ UploadedLayer* Document::getUploadedLayer() const
     return p->uploadedLayer;
 }
 
+/* Features serialized by each task of exportOSM */
+#define EXPORT_CHUNK_SIZE 2000
+
+/* A writer formatted as the whole export. The parts are written inside an
+ * <osm> element, for their indentation, which takeOsmContent leaves out. */
+static void beginOsmPart(QXmlStreamWriter& stream)
+{
+    stream.setAutoFormatting(true);
+    stream.setAutoFormattingIndent(2);
+    stream.writeStartElement("osm");
+}
+
+static QByteArray takeOsmContent(const QByteArray& out)
+{
+    int start = out.indexOf('>');
+    return start < 0 ? QByteArray() : out.mid(start + 1);
+}
+
+/* Runs on the thread pool. Selected is the selection, taken on the GUI thread. */
+static QByteArray serializeChunk(const QVector<Feature*>* Features, const QSet<Feature*>* Selected, int From, int To)
+{
+    QByteArray out;
+    {
+        QXmlStreamWriter stream(&out);
+        beginOsmPart(stream);
+        for (int i=From; i<To; ++i)
+            Features->at(i)->toXML(stream, NULL, false, QString(), Selected);
+    }
+    return takeOsmContent(out);
+}
+
 void Document::exportOSM(QWidget* main, QIODevice* device, QList<Feature*> aFeatures)
 {
     if (aFeatures.isEmpty())
@@ -605,54 +758,118 @@ void Document::exportOSM(QWidget* main, QIODevice* device, QList<Feature*> aFeat
     if (dlg)
         dlg->show();
 
-    QXmlStreamWriter stream(device);
-    stream.setAutoFormatting(true);
-    stream.setAutoFormattingIndent(2);
-    stream.writeStartDocument();
+    /* Nodes, ways, then relations, as readers expect them. The bounding
+     * boxes are brought up to date here, so that the serializing threads
+     * only read the features. */
+    QVector<Feature*> ordered;
+    ordered.reserve(aFeatures.size());
+    QVector<Feature*> Ways, Relations, Others;
+    CoordBox aCoordBox = aFeatures[0]->boundingBox(true);
+    foreach (Feature* F, aFeatures) {
+        aCoordBox.merge(F->boundingBox(true));
+        if (CAST_NODE(F))
+            ordered << F;
+        else if (CAST_WAY(F))
+            Ways << F;
+        else if (CAST_RELATION(F))
+            Relations << F;
+        else
+            Others << F;
+    }
+    ordered << Ways << Relations << Others;
 
-    stream.writeStartElement("osm");
-    stream.writeAttribute("version", "0.6");
-    stream.writeAttribute("generator", QString("%1 %2").arg(qApp->applicationName()).arg(STRINGIFY(VERSION)));
+    QSet<Feature*> selected;
+#ifndef _MOBILE
+    if (g_Merk_MainWindow)
+        foreach (Feature* F, g_Merk_MainWindow->properties()->selection())
+            selected.insert(F);
+#endif
 
-    CoordBox aCoordBox = aFeatures[0]->boundingBox(true);
-    aFeatures[0]->toXML(stream, dlg);
-    for (int i=1; i < aFeatures.size(); i++) {
-        aCoordBox.merge(aFeatures[i]->boundingBox(true));
-        aFeatures[i]->toXML(stream, dlg);
+    QByteArray header;
+    {
+        QXmlStreamWriter stream(&header);
+        stream.setAutoFormatting(true);
+        stream.setAutoFormattingIndent(2);
+        stream.writeStartDocument();
+        stream.writeStartElement("osm");
+        stream.writeAttribute("version", "0.6");
+        stream.writeAttribute("generator", QString("%1 %2").arg(qApp->applicationName()).arg(STRINGIFY(VERSION)));
+        /* Closes the start tag: the chunks follow it */
+        stream.writeCharacters("");
     }
 
-    stream.writeStartElement("bound");
-    QString S = QString().number(aCoordBox.bottom(),'f',6) + ",";
-    S += QString().number(aCoordBox.left(),'f',6) + ",";
-    S += QString().number(aCoordBox.top(),'f',6) + ",";
-    S += QString().number(aCoordBox.right(),'f',6);
-    stream.writeAttribute("box", S);
-    stream.writeAttribute("origin", QString("http://www.openstreetmap.org/api/%1").arg(M_PREFS->apiVersion()));
-    stream.writeEndElement();
+    QByteArray footer;
+    {
+        QXmlStreamWriter stream(&footer);
+        beginOsmPart(stream);
+        stream.writeStartElement("bound");
+        QString S = QString().number(aCoordBox.bottom(),'f',6) + ",";
+        S += QString().number(aCoordBox.left(),'f',6) + ",";
+        S += QString().number(aCoordBox.top(),'f',6) + ",";
+        S += QString().number(aCoordBox.right(),'f',6);
+        stream.writeAttribute("box", S);
+        stream.writeAttribute("origin", QString("http://www.openstreetmap.org/api/%1").arg(M_PREFS->apiVersion()));
+        stream.writeEndElement();
+
+        stream.writeEndElement();
+        stream.writeEndDocument();
+    }
+    footer = takeOsmContent(footer);
+
+    /* The chunks are serialized on the thread pool and written in order, a
+     * few more than the workers being queued */
+    const int total = (ordered.size() + EXPORT_CHUNK_SIZE - 1) / EXPORT_CHUNK_SIZE;
+    const int inFlight = QThreadPool::globalInstance()->maxThreadCount() * 2;
+    QList<QFuture<QByteArray> > pending;
+    int next = 0;
+    bool ok = device->write(header) != -1;
+    for (int done=0; ok && done<total; ++done) {
+        while (next < total && pending.size() < inFlight) {
+            int from = next * EXPORT_CHUNK_SIZE;
+            pending << QtConcurrent::run(serializeChunk, (const QVector<Feature*>*)&ordered, (const QSet<Feature*>*)&selected, from, qMin(from + EXPORT_CHUNK_SIZE, ordered.size()));
+            ++next;
+        }
+        ok = device->write(pending.takeFirst().result()) != -1;
 
-    stream.writeEndElement();
-    stream.writeEndDocument();
+        if (Bar)
+            Bar->setValue(qMin((done + 1) * EXPORT_CHUNK_SIZE, ordered.size()));
+        qApp->processEvents(QEventLoop::ExcludeUserInputEvents);
+    }
+    foreach (QFuture<QByteArray> f, pending)
+        f.waitForFinished();
+    if (ok)
+        ok = device->write(footer) != -1;
+    if (!ok)
+        qWarning() << "OSM export:" << device->errorString();
+}
+
+static inline void appendOnce(QList<Feature*>& List, QSet<Feature*>& Seen, Feature* F)
+{
+    if (Seen.contains(F))
+        return;
+    Seen.insert(F);
+    List.append(F);
 }
 
 QList<Feature*> Document::exportCoreOSM(QList<Feature*> aFeatures, bool forCopyPaste, QProgressDialog * progress)
 {
     QList<Feature*> exportedFeatures;
+    /* What is in exportedFeatures, for the lookups */
+    QSet<Feature*> seen;
+    seen.reserve(aFeatures.size());
     QList<Feature*>::Iterator i;
 
     for (i = aFeatures.begin(); i != aFeatures.end(); ++i) {
         if (/*Node* n = */dynamic_cast<Node*>(*i)) {
-            if (!exportedFeatures.contains(*i))
-                exportedFeatures.append(*i);
+            appendOnce(exportedFeatures, seen, *i);
         } else {
             if (Way* G = dynamic_cast<Way*>(*i)) {
                 for (int j=0; j < G->size(); j++) {
-                    if (Node* P = dynamic_cast<Node*>(G->get(j))) {
-                        if (!exportedFeatures.contains(P))
-                            exportedFeatures.append(P);
-                    }
-                    if (!exportedFeatures.contains(G))
-                        exportedFeatures.append(G);
+                    if (Node* P = dynamic_cast<Node*>(G->get(j)))
+                        appendOnce(exportedFeatures, seen, P);
                 }
+                if (G->size())
+                    appendOnce(exportedFeatures, seen, G);
             } else {
                 //FIXME Not working for relation (not made of point?)
                 if (Relation* G = dynamic_cast<Relation*>(*i)) {
@@ -660,23 +877,18 @@ QList<Feature*> Document::exportCoreOSM(QList<Feature*> aFeatures, bool forCopyP
                         for (int j=0; j < G->size(); j++) {
                             if (Way* R = CAST_WAY(G->get(j))) {
                                 for (int k=0; k < R->size(); k++) {
-                                    if (Node* P = dynamic_cast<Node*>(R->get(k))) {
-                                        if (!exportedFeatures.contains(P))
-                                            exportedFeatures.append(P);
-                                    }
+                                    if (Node* P = dynamic_cast<Node*>(R->get(k)))
+                                        appendOnce(exportedFeatures, seen, P);
                                 }
-                                if (!exportedFeatures.contains(R))
-                                    exportedFeatures.append(R);
+                                appendOnce(exportedFeatures, seen, R);
                             } else
                             if (Node* P = CAST_NODE(G->get(j))) {
-                                if (!exportedFeatures.contains(P))
-                                    exportedFeatures.append(P);
+                                appendOnce(exportedFeatures, seen, P);
                             }
 
                         }
                     }
-                    if (!exportedFeatures.contains(G))
-                        exportedFeatures.append(G);
+                    appendOnce(exportedFeatures, seen, G);
                 }
             }
         }
@@ -705,12 +917,13 @@ bool Document::importNMEA(const QString& filename, TrackLayer* NewLayer)
         return false;
 }
 
-bool Document::importOSC(const QString& filename, DrawingLayer* NewLayer)
+bool Document::importOSC(const QString& filename, DrawingLayer* NewLayer, ImportFilter* aFilter)
 {
 #ifndef FRISIUS_BUILD
     ImportExportOSC imp(this);
     if (!imp.loadFile(filename))
         return false;
+    imp.setFilter(aFilter);
     imp.import(NewLayer);
 
     if (NewLayer->size())
@@ -762,11 +975,12 @@ bool Document::importCSV(const QString& filename, DrawingLayer* NewLayer)
 }
 
 #ifdef USE_PROTOBUF
-bool Document::importPBF(const QString& filename, DrawingLayer* NewLayer)
+bool Document::importPBF(const QString& filename, DrawingLayer* NewLayer, ImportFilter* aFilter)
 {
     ImportExportPBF imp(this);
     if (!imp.loadFile(filename))
         return false;
+    imp.setFilter(aFilter);
     imp.import(NewLayer);
 
     if (NewLayer->size())
@@ -26,6 +26,9 @@ class DirtyLayer;
 class UploadedLayer;
 class DeletedLayer;
 class FeaturePainter;
+class ImportFilter;
+class MapCSSStyleSheet;
+struct PainterTable;
 
 class Document : public QObject, public IDocument
 {
@@ -91,12 +94,12 @@ public:
     bool importNMEA(const QString& filename, TrackLayer* NewLayer);
     bool importKML(const QString& filename, TrackLayer* NewLayer);
     bool importCSV(const QString& filename, DrawingLayer* NewLayer);
-    bool importOSC(const QString& filename, DrawingLayer* NewLayer);
+    bool importOSC(const QString& filename, DrawingLayer* NewLayer, ImportFilter* aFilter = 0);
 #ifndef _MOBILE
     bool importGDAL(const QString& filename, DrawingLayer* NewLayer);
 #endif
 #ifdef USE_PROTOBUF
-    bool importPBF(const QString& filename, DrawingLayer* NewLayer);
+    bool importPBF(const QString& filename, DrawingLayer* NewLayer, ImportFilter* aFilter = 0);
 #endif
 
     QDateTime getLastDownloadLayerTime() const;
@@ -120,12 +123,20 @@ public:
 
     QString toPropertiesHtml();
 
-    virtual void setPainters(QList<Painter> aPainters);
+    /* Matches the features against aPainters, or styles them with aSheet, on
+     * the thread pool; the current painters are used until all are matched
+     * (see paintersChanged) */
+    virtual void setPainters(QList<Painter> aPainters,
+                             QSharedPointer<MapCSSStyleSheet> aSheet = QSharedPointer<MapCSSStyleSheet>());
+    /* Blocks until the painters given to setPainters are in use */
+    void waitForPainters();
+    bool isApplyingPainters() const;
     virtual int getPaintersSize();
     void lockPainters();
     void lockPaintersForWrite();
     void unlockPainters();
     virtual const Painter* getPainter(int i);
+    const PainterTable* getPainterTable() const;
 
     QStringList getCurrentSourceTags();
 
@@ -134,18 +145,26 @@ public:
 
     QList<Feature*> mergeDocument(Document *otherDoc, Layer* layer, CommandList* theList=NULL);
 private:
+    void initPainters();
+    void cancelPainters();
+    void applyNextPainters();
+
     MapDocumentPrivate* p;
 
 protected slots:
     void on_imageRequested(ImageMapLayer* anImageLayer);
     void on_imageReceived(ImageMapLayer* anImageLayer);
     void on_loadingFinished(ImageMapLayer* anImageLayer);
+    void on_paintersProgress(int value);
+    void on_paintersEvaluated();
 
 signals:
     void imageRequested(ImageMapLayer*);
     void imageReceived(ImageMapLayer*);
     void loadingFinished(ImageMapLayer*);
     void historyChanged();
+    void paintersProgress(int value, int maximum);
+    void paintersChanged();
 
 };
 
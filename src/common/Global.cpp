@@ -14,6 +14,8 @@
 #include "MainWindow.h"
 #include "SlippyMapWidget.h"
 
+#include <QReadWriteLock>
+
 #ifdef PORTABLE_BUILD
 bool g_Merk_Portable = true;
 #else
@@ -30,45 +32,166 @@ bool g_Merk_SelfClip = true;
 #else
 bool g_Merk_SelfClip = false;
 #endif
+bool g_Merk_Headless = false;
 
 MainWindow* g_Merk_MainWindow = NULL;
 MemoryBackend g_backend;
 SlippyMapCache* SlippyMapWidget::theSlippyCache = 0;
 
-QStringList tagKeys;
+/* Append-only storage of the interned tags: an entry never moves nor
+ * changes once added, so the getters read it without any lock. An id only
+ * reaches a reader after the append that created it. */
+template<class T>
+class TagTable
+{
+public:
+    enum { ChunkBits = 12, ChunkSize = 1 << ChunkBits, MaxChunks = 1 << 14 };
+
+    TagTable() : count(0)
+    {
+        for (int i=0; i<MaxChunks; ++i)
+            chunks[i] = 0;
+    }
+    ~TagTable()
+    {
+        for (int i=0; i<MaxChunks; ++i)
+            delete [] chunks[i];
+    }
+
+    const T& at(quint32 i) const
+    {
+        return chunks[i >> ChunkBits][i & (ChunkSize-1)];
+    }
+
+    /* Called with tagLock held */
+    quint32 size() const { return count; }
+
+    /* Called with tagLock held for writing */
+    quint32 append(const T& v)
+    {
+        if (!(count & (ChunkSize-1))) {
+            Q_ASSERT((count >> ChunkBits) < MaxChunks);
+            chunks[count >> ChunkBits] = new T[ChunkSize];
+        }
+        chunks[count >> ChunkBits][count & (ChunkSize-1)] = v;
+        return count++;
+    }
+
+private:
+    T* chunks[MaxChunks];
+    quint32 count;
+};
+
+/* The importers add tags while the render and style threads read them:
+ * tagLock guards the hashes and the tag list, not the tables. */
+static QReadWriteLock tagLock;
+TagTable<QString> tagKeys;
 QHash<QString, quint32> tagKeysHash;
-QStringList tagValues;
+TagTable<QString> tagValues;
 QHash<QString, quint32> tagValuesHash;
 QHash< quint32, QList<quint32> > tagList;
+/* Case folded values, and the fold of each entry of tagValues, so that case
+ * insensitive comparisons of values are comparisons of ids */
+TagTable<QString> tagFolds;
+QHash<QString, quint32> tagFoldsHash;
+TagTable<quint32> tagValueFolds;
 QStringList userList;
 QString noUser;
 
-QPair<quint32, quint32> g_addToTagList(QString k, QString v)
+/* Called with tagLock held for writing */
+static quint32 foldTagValue(const QString& v)
 {
-    qint32 ik, iv;
+    QString f = v.toCaseFolded();
+    QHash<QString, quint32>::const_iterator it = tagFoldsHash.constFind(f);
+    if (it != tagFoldsHash.constEnd())
+        return it.value();
+    quint32 id = tagFolds.append(f);
+    tagFoldsHash[f] = id;
+    return id;
+}
 
-    if (!tagKeysHash.contains(k)) {
-        tagKeys.append(k);
-        ik = tagKeys.size()-1;
-        tagKeysHash[k] = ik;
-    } else
-        ik = tagKeysHash.value(k);
+/* Called with tagLock held for writing */
+static quint32 addTagKey(const QString& k)
+{
+    QHash<QString, quint32>::const_iterator it = tagKeysHash.constFind(k);
+    if (it != tagKeysHash.constEnd())
+        return it.value();
+    quint32 id = tagKeys.append(k);
+    tagKeysHash[k] = id;
+    return id;
+}
 
-    if (!tagValuesHash.contains(v)) {
-        tagValues.append(v);
-        iv = tagValues.size()-1;
-        tagValuesHash[v] = iv;
-    } else
-        iv = tagValuesHash.value(v);
+/* Called with tagLock held for writing */
+static quint32 addTagValue(const QString& v)
+{
+    QHash<QString, quint32>::const_iterator it = tagValuesHash.constFind(v);
+    if (it != tagValuesHash.constEnd())
+        return it.value();
+    tagValueFolds.append(foldTagValue(v));
+    quint32 id = tagValues.append(v);
+    tagValuesHash[v] = id;
+    return id;
+}
+
+/* Looks s up in Hash without blocking the other readers */
+static bool findTag(const QHash<QString, quint32>& Hash, const QString& s, quint32& id)
+{
+    QReadLocker lock(&tagLock);
+    QHash<QString, quint32>::const_iterator it = Hash.constFind(s);
+    if (it == Hash.constEnd())
+        return false;
+    id = it.value();
+    return true;
+}
+
+quint32 g_addTagKey(const QString& k)
+{
+    /* Most keys are known already */
+    quint32 id;
+    if (findTag(tagKeysHash, k, id))
+        return id;
 
-    if (!k.isEmpty() && !v.isEmpty())
-        tagList[ik].append(iv);
+    QWriteLocker lock(&tagLock);
+    return addTagKey(k);
+}
+
+quint32 g_foldTagValue(const QString& v)
+{
+    quint32 id;
+    if (findTag(tagFoldsHash, v.toCaseFolded(), id))
+        return id;
+
+    QWriteLocker lock(&tagLock);
+    return foldTagValue(v);
+}
+
+quint32 g_addTagValue(const QString& v)
+{
+    quint32 id;
+    if (findTag(tagValuesHash, v, id))
+        return id;
 
-    return qMakePair((quint32)ik, (quint32)iv);
+    QWriteLocker lock(&tagLock);
+    return addTagValue(v);
+}
+
+QPair<quint32, quint32> g_addToTagList(quint32 k, quint32 v)
+{
+    QWriteLocker lock(&tagLock);
+    if (!tagKeys.at(k).isEmpty() && !tagValues.at(v).isEmpty())
+        tagList[k].append(v);
+
+    return qMakePair(k, v);
+}
+
+QPair<quint32, quint32> g_addToTagList(QString k, QString v)
+{
+    return g_addToTagList(g_addTagKey(k), g_addTagValue(v));
 }
 
 void g_removeFromTagList(quint32 k, quint32 v)
 {
+    QWriteLocker lock(&tagLock);
     tagList[k].removeOne(v);
     if (tagList[k].isEmpty())
         tagList.remove(k);
@@ -76,26 +199,35 @@ void g_removeFromTagList(quint32 k, quint32 v)
 
 QStringList g_getTagKeys()
 {
-    return tagKeys;
+    QReadLocker lock(&tagLock);
+    QStringList res;
+    for (quint32 i=0; i<tagKeys.size(); ++i)
+        res << tagKeys.at(i);
+    return res;
 }
 
 QStringList g_getTagValues()
 {
-    return tagValues;
+    QReadLocker lock(&tagLock);
+    QStringList res;
+    for (quint32 i=0; i<tagValues.size(); ++i)
+        res << tagValues.at(i);
+    return res;
 }
 
 QStringList g_getTagValueList(QString k)
 {
+    QReadLocker lock(&tagLock);
     QSet<quint32> retList;
     if (k == "*") {
         foreach (QList<quint32> list, tagList)
             retList.unite(list.toSet());
     } else
-        retList = tagList[tagKeys.indexOf(k)].toSet();
+        retList = tagList.value(tagKeysHash.value(k, 0xffffffff)).toSet();
 
     QStringList res;
     foreach (quint32 i, retList)
-        res << g_getTagValue(i);
+        res << tagValues.at(i);
 
     return res;
 }
@@ -107,22 +239,34 @@ const QString& g_getTagKey(int idx)
 
 quint32 g_getTagKeyIndex(const QString& s)
 {
-    return tagKeys.indexOf(s);
+    QReadLocker lock(&tagLock);
+    return tagKeysHash.value(s, 0xffffffff);
 }
 
 QStringList g_getTagKeyList()
 {
-    return tagKeys.toSet().toList();
+    return g_getTagKeys();
 }
 
-QString g_getTagValue(int idx)
+const QString& g_getTagValue(int idx)
 {
     return tagValues.at(idx);
 }
 
 quint32 g_getTagValueIndex(const QString& s)
 {
-    return tagValues.indexOf(s);
+    QReadLocker lock(&tagLock);
+    return tagValuesHash.value(s, 0xffffffff);
+}
+
+quint32 g_getTagValueFold(quint32 idx)
+{
+    return tagValueFolds.at(idx);
+}
+
+const QString& g_getTagFold(quint32 fold)
+{
+    return tagFolds.at(fold);
 }
 
 quint32 g_setUser(const QString& u)
@@ -35,19 +35,27 @@ extern bool g_Merk_Ignore_Preferences;
 extern bool g_Merk_Reset_Preferences;
 extern bool g_Merk_IgnoreStartupTemplate;
 extern bool g_Merk_SelfClip;
+extern bool g_Merk_Headless;
 
 extern MainWindow* g_Merk_MainWindow;
 
 extern QPair<quint32, quint32> g_addToTagList(QString k, QString v);
+/* Same with the ids of g_addTagKey and g_addTagValue */
+extern QPair<quint32, quint32> g_addToTagList(quint32 k, quint32 v);
 extern void g_removeFromTagList(quint32 k, quint32 v);
 extern QStringList g_getTagKeys();
 extern QStringList g_getTagValues();
 extern const QString& g_getTagKey(int idx);
 extern quint32 g_getTagKeyIndex(const QString& s);
 extern QStringList g_getTagKeyList();
-extern QString g_getTagValue(int idx);
+extern const QString& g_getTagValue(int idx);
 extern quint32 g_getTagValueIndex(const QString& s);
 extern QStringList g_getTagValueList(QString k) ;
+extern quint32 g_addTagKey(const QString& k);
+extern quint32 g_addTagValue(const QString& v);
+extern quint32 g_foldTagValue(const QString& v);
+extern quint32 g_getTagValueFold(quint32 idx);
+extern const QString& g_getTagFold(quint32 fold);
 
 extern quint32 g_setUser(const QString& u);
 extern const QString& g_getUser(quint32 idx);
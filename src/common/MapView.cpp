@@ -19,6 +19,7 @@
 #include "qgpsdevice.h"
 
 #include "OsmRenderLayer.h"
+#include "RenderStatistics.h"
 
 #ifdef USE_WEBKIT
     #include "browserimagemanager.h"
@@ -50,8 +51,7 @@ public:
     qreal NodeWidth;
     int ZoomLevel;
     CoordBox Viewport;
-    QList<CoordBox> invalidRects;
-    QPoint theVectorPanDelta;
+    bool WireframeDirty;
     qreal theVectorRotation;
     QList<Node*> theVirtualNodes;
     RendererOptions ROptions;
@@ -66,9 +66,10 @@ public:
     QLabel *TL, *TR, *BL, *BR;
 
     OsmRenderLayer* osmLayer;
+    WireframeRenderLayer* wireLayer;
 
     MapViewPrivate()
-      : PixelPerM(0.0), Viewport(WORLD_COORDBOX), theVectorRotation(0.0)
+      : PixelPerM(0.0), Viewport(WORLD_COORDBOX), WireframeDirty(true), theVectorRotation(0.0)
       , BackgroundOnlyPanZoom(false)
       , theDocument(0)
       , theInteraction(0)
@@ -79,7 +80,6 @@ public:
 
 MapView::MapView(QWidget* parent) :
     QWidget(parent), Main(dynamic_cast<MainWindow*>(parent)), StaticBackground(0)
-  , StaticWireframe(0), StaticTouchup(0)
   , SelectionLocked(false),lockIcon(0)
   , p(new MapViewPrivate)
 {
@@ -137,13 +137,19 @@ MapView::MapView(QWidget* parent) :
 
     p->osmLayer = new OsmRenderLayer(this);
     connect(p->osmLayer, SIGNAL(renderingDone()), SLOT(renderingDone()));
+    connect(p->osmLayer, SIGNAL(renderingProgress()), SLOT(update()));
+
+    p->wireLayer = new WireframeRenderLayer(this);
+    connect(p->wireLayer, SIGNAL(renderingDone()), SLOT(renderingDone()));
+    connect(p->wireLayer, SIGNAL(renderingProgress()), SLOT(update()));
 }
 
 MapView::~MapView()
 {
+    p->osmLayer->cancel();
+    p->wireLayer->cancel();
+
     delete StaticBackground;
-    delete StaticWireframe;
-    delete StaticTouchup;
     delete p;
 }
 
@@ -154,8 +160,10 @@ MainWindow *MapView::main()
 
 void MapView::setDocument(Document* aDoc)
 {
+    p->wireLayer->cancel();
     p->theDocument = aDoc;
     p->osmLayer->setDocument(aDoc);
+    p->wireLayer->setDocument(aDoc);
 
     setViewport(viewport(), rect());
 }
@@ -176,10 +184,7 @@ void MapView::invalidate(bool updateWireframe, bool updateOsmMap, bool updateBgM
         }
     }
     if (updateWireframe) {
-        p->invalidRects.clear();
-        p->invalidRects.push_back(p->Viewport);
-
-        p->theVectorPanDelta = QPoint(0, 0);
+        p->WireframeDirty = true;
         SAFE_DELETE(StaticBackground)
     }
     if (p->theDocument && updateBgMap) {
@@ -215,29 +220,20 @@ void MapView::invalidate(bool updateWireframe, bool updateOsmMap, bool updateBgM
     update();
 }
 
+void MapView::recompositeLayers()
+{
+    if (!M_PREFS->getWireframeView() && p->theDocument)
+        p->osmLayer->recomposite();
+    invalidate(true, false, true);
+}
+
 void MapView::panScreen(QPoint delta)
 {
     Coord cDelta = fromView(delta) - fromView(QPoint(0, 0));
     if (p->BackgroundOnlyPanZoom) {
         p->BackgroundOnlyVpTransform.translate(-cDelta.x(), -cDelta.y());
     } else {
-        p->theVectorPanDelta += delta;
-
-        CoordBox r1, r2;
-        if (delta.x()) {
-            if (delta.x() < 0)
-                r1 = CoordBox(p->Viewport.bottomRight(), Coord(p->Viewport.topRight().x() - cDelta.x(), p->Viewport.topRight().y())); // OK
-            else
-                r1 = CoordBox(Coord(p->Viewport.bottomLeft().x() - cDelta.x(), p->Viewport.bottomLeft().y()), p->Viewport.topLeft()); // OK
-            p->invalidRects.push_back(r1);
-        }
-        if (delta.y()) {
-            if (delta.y() < 0)
-                r2 = CoordBox(Coord(p->Viewport.bottomLeft().x(), p->Viewport.bottomLeft().y() - cDelta.y()), p->Viewport.bottomRight()); // OK
-            else
-                r2 = CoordBox(p->Viewport.topLeft(), Coord( p->Viewport.bottomRight().x(), p->Viewport.topRight().y() - cDelta.y())); //NOK
-            p->invalidRects.push_back(r2);
-        }
+        p->wireLayer->cancel();
 
         p->theTransform.translate((qreal)(delta.x())/p->theTransform.m11(), (qreal)(delta.y())/p->theTransform.m22());
         p->theInvertedTransform = p->theTransform.inverted();
@@ -245,6 +241,8 @@ void MapView::panScreen(QPoint delta)
         if (!M_PREFS->getWireframeView() && p->theDocument) {
             p->osmLayer->pan(delta);
         }
+        if (!p->WireframeDirty && p->theDocument)
+            p->wireLayer->pan(delta);
     }
 
     for (LayerIterator<ImageMapLayer*> ImgIt(p->theDocument); !ImgIt.isEnd(); ++ImgIt)
@@ -256,6 +254,7 @@ void MapView::rotateScreen(QPoint /* center */, qreal angle)
 {
     p->theVectorRotation += angle;
 
+    p->wireLayer->cancel();
     transformCalc(p->theTransform, p->theProjection, p->theVectorRotation, p->Viewport, rect());
     p->theInvertedTransform = p->theTransform.inverted();
     viewportRecalc(rect());
@@ -281,7 +280,7 @@ void MapView::paintEvent(QPaintEvent * anEvent)
 
     updateStaticBackground();
 
-    P.drawPixmap(p->theVectorPanDelta, *StaticBackground);
+    P.drawPixmap(0, 0, *StaticBackground);
     P.save();
     QTransform AlignTransform;
     for (LayerIterator<ImageMapLayer*> ImgIt(p->theDocument); !ImgIt.isEnd(); ++ImgIt) {
@@ -292,20 +291,25 @@ void MapView::paintEvent(QPaintEvent * anEvent)
     }
     P.restore();
 
-    if (!p->invalidRects.isEmpty()) {
-        updateWireframe();
+    /* While the styled tiles render, the previous ones or the wireframe stand in */
+    bool showWireframe = M_PREFS->getWireframeView() || (!p->osmLayer->isRenderingDone() && !p->osmLayer->hasPlaceholder()) || M_PREFS->getEditRendering() == 1;
+    if (showWireframe && !p->wireLayer->isWireframeShown())
+        p->WireframeDirty = true;
+    if (p->WireframeDirty) {
+        updateWireframe(showWireframe);
     }
-    if (M_PREFS->getWireframeView() || !p->osmLayer->isRenderingDone() || M_PREFS->getEditRendering() == 1)
-        P.drawPixmap(p->theVectorPanDelta, *StaticWireframe);
+    if (showWireframe)
+        p->wireLayer->drawImage(&P);
     if (!M_PREFS->getWireframeView())
         if (!(TEST_RFLAGS(RendererOptions::Interacting) && M_PREFS->getEditRendering() == 1))
             drawFeatures(P);
-    P.drawPixmap(p->theVectorPanDelta, *StaticTouchup);
+    p->wireLayer->drawTouchup(&P);
 
 
     drawLatLonGrid(P);
     drawDownloadAreas(P);
     drawScale(P);
+    drawRenderStatistics(P);
 
     if (p->theInteraction) {
         P.setRenderHint(QPainter::Antialiasing);
@@ -443,6 +447,30 @@ void floodFill(QImage& theImage, const QPoint& P, const QRgb& targetColor, const
     }
 }
 
+void MapView::drawRenderStatistics(QPainter & P)
+{
+    if (!TEST_RFLAGS(RendererOptions::RenderStatisticsVisible))
+        return;
+
+    if (M_PREFS->getWireframeView())
+        p->wireLayer->drawStatistics(&P);
+    else
+        p->osmLayer->drawStatistics(&P);
+
+    QStringList lines = M_RENDERSTATS->summary();
+    if (lines.isEmpty())
+        return;
+
+    P.save();
+    P.setFont(QFont(P.font().family(), 8));
+    QString text = lines.join("\n");
+    QRect R = P.boundingRect(rect().adjusted(10, 10, -10, -40), Qt::AlignLeft | Qt::AlignBottom, text);
+    P.fillRect(R.adjusted(-4, -4, 4, 4), QColor(255, 255, 255, 208));
+    P.setPen(Qt::black);
+    P.drawText(R, Qt::AlignLeft | Qt::AlignBottom, text);
+    P.restore();
+}
+
 void MapView::drawLatLonGrid(QPainter & P)
 {
     if (!TEST_RFLAGS(RendererOptions::LatLonGridVisible))
@@ -540,9 +568,10 @@ void MapView::drawLatLonGrid(QPainter & P)
     P.restore();
 }
 
-void MapView::drawFeaturesSync(QPainter & P) {
-    while (!p->osmLayer->isRenderingDone());
+bool MapView::drawFeaturesSync(QPainter & P, int msecs, const RenderProgressCallback& progress) {
+    bool done = p->osmLayer->waitForRendering(msecs, progress);
     p->osmLayer->drawImage(&P);
+    return done;
 }
 
 void MapView::drawFeatures(QPainter & P)
@@ -601,94 +630,12 @@ void MapView::updateStaticBackground()
     }
 }
 
-void MapView::updateWireframe()
+void MapView::updateWireframe(bool showWireframe)
 {
-    QMap<RenderPriority, QSet <Feature*> > theFeatures;
-    QMap<RenderPriority, QSet<Feature*> >::const_iterator itm;
-    QSet<Feature*>::const_iterator it;
-
-    QPainter P;
-
-    for (int i=0; i<p->theDocument->layerSize(); ++i)
-        g_backend.getFeatureSet(p->theDocument->getLayer(i), theFeatures, p->invalidRects, p->theProjection);
-
-    if (!p->theVectorPanDelta.isNull()) {
-        QRegion exposed;
-        StaticWireframe->scroll(p->theVectorPanDelta.x(), p->theVectorPanDelta.y(), StaticWireframe->rect(), &exposed);
-        P.begin(StaticWireframe);
-        P.setClipping(true);
-        P.setClipRegion(exposed);
-        P.setCompositionMode(QPainter::CompositionMode_Source);
-        P.fillRect(StaticWireframe->rect(), Qt::transparent);
-    } else {
-        StaticWireframe->fill(Qt::transparent);
-        P.begin(StaticWireframe);
-        P.setClipping(true);
-        P.setClipRegion(rect());
-    }
-
-    if (M_PREFS->getWireframeView() || !p->osmLayer->isRenderingDone() || M_PREFS->getEditRendering() == 1) {
-        if (M_PREFS->getWireframeView() && M_PREFS->getUseAntiAlias())
-            P.setRenderHint(QPainter::Antialiasing);
-        else if (M_PREFS->getEditRendering() == 1)
-            P.setRenderHint(QPainter::Antialiasing);
-        for (itm = theFeatures.constBegin() ;itm != theFeatures.constEnd(); ++itm)
-        {
-            for (it = itm.value().constBegin() ;it != itm.value().constEnd(); ++it)
-            {
-                qreal alpha = (*it)->getAlpha();
-                P.setOpacity(alpha);
-
-                (*it)->drawSimple(P, this);
-            }
-        }
-    }
-    P.end();
-
-    if (!p->theVectorPanDelta.isNull()) {
-        QRegion exposed;
-        StaticTouchup->scroll(p->theVectorPanDelta.x(), p->theVectorPanDelta.y(), StaticTouchup->rect(), &exposed);
-        P.begin(StaticTouchup);
-        P.setClipping(true);
-        P.setClipRegion(exposed);
-        P.setCompositionMode(QPainter::CompositionMode_Source);
-        P.fillRect(StaticTouchup->rect(), Qt::transparent);
-    } else {
-        StaticTouchup->fill(Qt::transparent);
-        P.begin(StaticTouchup);
-        P.setClipping(true);
-        P.setClipRegion(rect());
-    }
-
-    P.setRenderHint(QPainter::Antialiasing);
-
-    for (itm = theFeatures.constBegin() ;itm != theFeatures.constEnd(); ++itm)
-    {
-        for (it = itm.value().constBegin() ;it != itm.value().constEnd(); ++it)
-        {
-            qreal alpha = (*it)->getAlpha();
-            P.setOpacity(alpha);
-
-            (*it)->drawTouchup(P, this);
-        }
-    }
-    P.end();
-
-    p->invalidRects.clear();
-    p->theVectorPanDelta = QPoint(0, 0);
-
-
-//    QPainter P;
-
-//    StaticBuffer->fill(Qt::transparent);
-//    P.begin(StaticBuffer);
-//    P.setCompositionMode(QPainter::CompositionMode_Source);
-//    P.setClipping(true);
-//    P.setClipRegion(rect());
-////    if (M_PREFS->getUseAntiAlias())
-////        P.setRenderHint(QPainter::Antialiasing);
-//    drawFeatures(P);
-//    P.end();
+    /* Rendered on the worker pool; tiles show up as they are done */
+    p->wireLayer->setWireframeShown(showWireframe);
+    p->wireLayer->forceRedraw(p->theProjection, p->theTransform, rect(), p->PixelPerM, p->ROptions);
+    p->WireframeDirty = false;
 }
 
 void MapView::mousePressEvent(QMouseEvent* anEvent)
@@ -773,22 +720,11 @@ void MapView::on_imageReceived(ImageMapLayer* aLayer)
 
 void MapView::resizeEvent(QResizeEvent * ev)
 {
+    p->wireLayer->cancel();
     viewportRecalc(QRect(QPoint(0,0), ev->size()));
 
     QWidget::resizeEvent(ev);
 
-    if (!StaticWireframe || (StaticWireframe->size() != size()))
-    {
-        delete StaticWireframe;
-        StaticWireframe = new QPixmap(size());
-        StaticWireframe->fill(Qt::transparent);
-    }
-    if (!StaticTouchup || (StaticTouchup->size() != size()))
-    {
-        delete StaticTouchup;
-        StaticTouchup = new QPixmap(size());
-    }
-
     invalidate(true, true, true);
 }
 
@@ -830,6 +766,8 @@ bool MapView::toXML(QXmlStreamWriter& stream)
 
 void MapView::fromXML(QXmlStreamReader& stream)
 {
+    p->wireLayer->cancel();
+
     CoordBox cb;
     stream.readNext();
     while(!stream.atEnd() && !stream.isEndElement()) {
@@ -995,6 +933,7 @@ void MapView::setViewport(const CoordBox & TargetMap,
         targetVp = CoordBox (TargetMap.center()-COORD_ENLARGE*10, TargetMap.center()+COORD_ENLARGE*10);
     else
         targetVp = TargetMap;
+    p->wireLayer->cancel();
     transformCalc(p->theTransform, p->theProjection, p->theVectorRotation, targetVp, Screen);
     p->theInvertedTransform = p->theTransform.inverted();
     viewportRecalc(Screen);
@@ -1060,6 +999,7 @@ void MapView::zoom(qreal d, const QPoint & Around,
     qreal DeltaLat = (Around.y() - pBefore.y() * ScaleLat);
     qreal DeltaLon = (Around.x() - pBefore.x() * ScaleLon);
 
+    p->wireLayer->cancel();
 //    p->theTransform.setMatrix(ScaleLon*cos(p->theVectorRotation), 0, 0, 0, ScaleLat*cos(p->theVectorRotation), 0, DeltaLon, DeltaLat, 1);
     p->theTransform.reset();
     p->theTransform.scale(ScaleLon, ScaleLat);
@@ -1113,6 +1053,7 @@ void MapView::setCenter(Coord & Center, const QRect & /*Screen*/)
 
 void MapView::setInteracting(bool val)
 {
+    p->wireLayer->cancel();
     if (val)
         p->ROptions.options |= RendererOptions::Interacting;
     else
@@ -1137,9 +1078,15 @@ RendererOptions MapView::renderOptions()
 
 void MapView::setRenderOptions(const RendererOptions &opt)
 {
+    p->wireLayer->cancel();
     p->ROptions = opt;
 }
 
+void MapView::setRenderingPriority(int aPriority)
+{
+    p->osmLayer->setRenderingPriority(aPriority);
+}
+
 void MapView::stopRendering() {
     p->osmLayer->stopRendering();
 }
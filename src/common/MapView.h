@@ -36,14 +36,20 @@ public:
     void setInteraction(Interaction* anInteraction);
 
     void drawFeatures(QPainter & painter);
-    void drawFeaturesSync(QPainter & P);
+    /* Waits (at most msecs if >= 0) for the rendering to finish, then draws.
+     * Returns false if the deadline was hit and the drawing is incomplete. */
+    bool drawFeaturesSync(QPainter & P, int msecs = -1, const RenderProgressCallback& progress = RenderProgressCallback());
     void drawLatLonGrid(QPainter & painter);
     void drawDownloadAreas(QPainter & painter);
     void drawScale(QPainter & painter);
+    void drawRenderStatistics(QPainter & painter);
 
     void panScreen(QPoint delta) ;
     void rotateScreen(QPoint center, qreal angle);
     void invalidate(bool updateWireframe, bool updateOsmMap, bool updateBgMap);
+    /* After a change of the visibility, order, alpha or read-only state of
+     * layers: composites the rendered layers again instead of redrawing */
+    void recompositeLayers();
 
     virtual void paintEvent(QPaintEvent* anEvent);
     virtual void mousePressEvent(QMouseEvent * event);
@@ -87,6 +93,7 @@ public:
     RendererOptions renderOptions();
     void setRenderOptions(const RendererOptions& opt);
 
+    void setRenderingPriority(int aPriority);
     void stopRendering();
     void resumeRendering();
 
@@ -99,12 +106,10 @@ public:
 private:
     void drawGPS(QPainter & painter);
     void updateStaticBackground();
-    void updateWireframe();
+    void updateWireframe(bool showWireframe);
 
     MainWindow* Main;
     QPixmap* StaticBackground;
-    QPixmap* StaticWireframe;
-    QPixmap* StaticTouchup;
     bool StaticMapUpToDate;
     bool SelectionLocked;
     QLabel* lockIcon;